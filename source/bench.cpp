@@ -0,0 +1,566 @@
+// DGen/SDL frame throughput benchmark.
+// Runs the same ROM and demo through every compiled-in CPU core combination
+// using the headless interface and reports the results as JSON.
+
+#include "platform.h"
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#define IS_MAIN_CPP
+#include "system.h"
+#include "md.h"
+#include "pd.h"
+#include "rc.h"
+#include "rc-vars.h"
+#include "headless/headless.h"
+
+// Required by the core, normally defined in main.cpp.
+FILE *debug_log = NULL;
+int demo_finished = 0;
+int slot = 0;
+
+// M68K cores, as dgen_emu_m68k values (see emu_m68k_names[]).
+static const int bench_m68k[] = {
+#ifdef WITH_STAR
+	1,
+#endif
+#ifdef WITH_MUSA
+	2,
+#endif
+#ifdef WITH_CYCLONE
+	3,
+#endif
+	0
+};
+
+// Z80 cores, as dgen_emu_z80 values (see emu_z80_names[]).
+static const int bench_z80[] = {
+#ifdef WITH_MZ80
+	1,
+#endif
+#ifdef WITH_CZ80
+	2,
+#endif
+#ifdef WITH_DRZ80
+	3,
+#endif
+#ifdef WITH_GXZ80
+	4,
+#endif
+	0
+};
+
+// Results for a single core combination.
+struct bench_result {
+	int m68k;
+	int z80;
+	unsigned long frames;
+	unsigned long usecs;
+	unsigned long long samples;
+	size_t state_size; // md::save_state() output size
+	double save_usecs; // Average md::save_state() duration
+	double load_usecs; // Average md::load_state() duration
+	unsigned long runahead_usecs; // Same frames with bench.runahead
+#ifdef WITH_PROFILE
+	uint64_t ticks; // Total prof_now() ticks elapsed
+	uint64_t section[md::PROF_TOTAL]; // Ticks spent in each section
+	uint64_t frontend; // Ticks spent in pd_graphics_update() and such
+#endif
+};
+
+// Benchmark settings.
+static struct {
+	const char *rom;
+	const char *demo;
+	unsigned long frames;
+	unsigned long warmup;
+	int m68k; // -1 for all
+	int z80; // -1 for all
+	bool forced_pal; // -N or -P given, don't guess from the ROM
+	unsigned int runahead; // Run-ahead frames to measure, 0 for none
+} bench = {
+	NULL, NULL, 600, 60, -1, -1, false, 0
+};
+
+// Number of states saved and loaded to measure their cost.
+#define BENCH_STATE_LOOPS 1000
+
+// Show help and exit with code 2
+static void help()
+{
+	printf(
+	"DGen/SDL v" VER "\n"
+	"Usage: dgen_bench [options] [romname]\n\n"
+	"Runs romname (or the built-in test ROM) with each compiled-in CPU\n"
+	"core combination and writes results to stdout in JSON format.\n"
+	"The cost of saving and loading states in memory is measured after\n"
+	"the last frame.\n\n"
+	"Where options are:\n"
+	"    -v              Print version number and exit.\n"
+	"    -r RCFILE       Read in the file RCFILE after parsing\n"
+	"                    $HOME/.dgen/dgenrc.\n"
+	"    -f FRAMES       Number of frames to measure (default 600).\n"
+	"    -w FRAMES       Number of frames to run before measuring\n"
+	"                    (default 60).\n"
+	"    -D DEMONAME     Replay a previously recorded demo (dgen -d).\n"
+	"                    It is restarted for each core combination.\n"
+	"    -a FRAMES       Emulate as many frames again with FRAMES frames\n"
+	"                    of run-ahead (int_runahead) and report the cost\n"
+	"                    of each extra frame.\n"
+	"    -m CORE         Only benchmark this M68K core (%s",
+	emu_m68k_names[0]);
+	for (size_t i = 0; (bench_m68k[i] != 0); ++i)
+		printf(", %s", emu_m68k_names[bench_m68k[i]]);
+	printf(
+	").\n"
+	"    -z CORE         Only benchmark this Z80 core (%s",
+	emu_z80_names[0]);
+	for (size_t i = 0; (bench_z80[i] != 0); ++i)
+		printf(", %s", emu_z80_names[bench_z80[i]]);
+	printf(
+	").\n"
+	"    -R (J|X|U|E| )  Force emulator region.\n"
+	"    -N              Use NTSC mode (60Hz).\n"
+	"    -P              Use PAL mode (50Hz).\n"
+#ifndef WITH_PROFILE
+	"\nThis build has no profiling support (configure --enable-profile),\n"
+	"only frame rates are reported.\n"
+#endif
+	);
+	exit(2);
+}
+
+/**
+ * Look up a core by name.
+ * @param names NULL-terminated array of core names.
+ * @param cores Zero-terminated array of compiled-in cores.
+ * @param name Name to look for.
+ * @return Core number, or -1 if it doesn't exist or isn't compiled in.
+ */
+static int bench_core(const char *names[], const int *cores, const char *name)
+{
+	int i;
+
+	for (i = 0; (names[i] != NULL); ++i) {
+		if (strcasecmp(names[i], name))
+			continue;
+		if (i == 0)
+			return 0;
+		for (; (*cores != 0); ++cores)
+			if (*cores == i)
+				return i;
+		break;
+	}
+	return -1;
+}
+
+// Print a JSON string.
+static void json_string(const char *s)
+{
+	if (s == NULL) {
+		fputs("null", stdout);
+		return;
+	}
+	putchar('"');
+	for (; (*s != '\0'); ++s) {
+		if ((*s == '"') || (*s == '\\'))
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", (unsigned char)*s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+/**
+ * Measure the cost of saving and loading states in memory, at the point
+ * the emulation has reached.
+ * @param megad Emulated console.
+ * @param[out] res Results.
+ * @return 0 on success, -1 on error.
+ */
+static int bench_state(md *megad, struct bench_result *res)
+{
+	size_t size = megad->save_state(NULL, 0);
+	uint8_t *buf = (uint8_t *)malloc(size);
+	unsigned long start;
+	unsigned int i;
+
+	if (buf == NULL) {
+		fprintf(stderr, "bench: out of memory.\n");
+		return -1;
+	}
+	start = pd_usecs();
+	for (i = 0; (i != BENCH_STATE_LOOPS); ++i)
+		megad->save_state(buf, size);
+	res->save_usecs = ((double)(pd_usecs() - start) / BENCH_STATE_LOOPS);
+	start = pd_usecs();
+	for (i = 0; (i != BENCH_STATE_LOOPS); ++i)
+		megad->load_state(buf, size);
+	res->load_usecs = ((double)(pd_usecs() - start) / BENCH_STATE_LOOPS);
+	res->state_size = size;
+	free(buf);
+	return 0;
+}
+
+/**
+ * Emulate as many frames as the measured ones again, running bench.runahead
+ * frames ahead each time.
+ * @param megad Emulated console.
+ * @param[out] res Results.
+ */
+static void bench_runahead(md *megad, struct bench_result *res)
+{
+	unsigned long start;
+	unsigned long i;
+
+	start = pd_usecs();
+	for (i = 0; (i != bench.frames); ++i) {
+		if (bench.demo != NULL)
+			headless_demo_next(*megad);
+		megad->one_frame_runahead(&mdscr, mdpal, &sndi,
+					  bench.runahead);
+		pd_graphics_update(false);
+		pd_sound_write();
+	}
+	res->runahead_usecs = (pd_usecs() - start);
+	if (res->runahead_usecs == 0)
+		res->runahead_usecs = 1;
+}
+
+/**
+ * Emulate a number of frames with a given core combination.
+ * @param[out] res Results, res->m68k and res->z80 select the cores.
+ * @return 0 on success, -1 on error.
+ */
+static int bench_run(struct bench_result *res)
+{
+	md *megad;
+	unsigned long i;
+	unsigned long start = 0;
+#ifdef WITH_PROFILE
+	uint64_t ticks = 0;
+#endif
+
+	dgen_emu_m68k = res->m68k;
+	dgen_emu_z80 = res->z80;
+	megad = new md(dgen_pal != 0, dgen_region);
+	if (!megad->okay()) {
+		fprintf(stderr, "bench: Mega Drive initialization failed.\n");
+		delete megad;
+		return -1;
+	}
+	if ((bench.rom != NULL) && (megad->load(bench.rom))) {
+		fprintf(stderr, "bench: unable to load \"%s\".\n", bench.rom);
+		delete megad;
+		return -1;
+	}
+	megad->pad[0] = MD_PAD_UNTOUCHED;
+	megad->pad[1] = MD_PAD_UNTOUCHED;
+	megad->reset();
+	// Automatic region settings from ROM header.
+	if ((!dgen_region) && (!bench.forced_pal)) {
+		uint8_t c = megad->region_guess();
+		int hz;
+		int pal;
+
+		md::region_info(c, &pal, &hz, 0, 0, 0);
+		if ((hz != dgen_hz) || (pal != dgen_pal)) {
+			long rate = dgen_soundrate;
+			unsigned int samples = 0;
+
+			dgen_hz = hz;
+			dgen_pal = pal;
+			pd_graphics_reinit(1, dgen_pal, dgen_hz);
+			pd_sound_init(rate, samples);
+		}
+		megad->region = c;
+		megad->pal = pal;
+		megad->init_pal();
+		megad->init_sound();
+	}
+	if ((bench.demo != NULL) && (headless_demo_open(bench.demo, *megad))) {
+		delete megad;
+		return -1;
+	}
+	for (i = 0; (i < (bench.warmup + bench.frames)); ++i) {
+		if (i == bench.warmup) {
+			start = pd_usecs();
+			res->samples = headless_sound_written();
+#ifdef WITH_PROFILE
+			megad->prof_reset();
+			megad->prof_enabled = true;
+			ticks = md::prof_now();
+			res->frontend = 0;
+#endif
+		}
+		if (bench.demo != NULL)
+			headless_demo_next(*megad);
+		megad->one_frame(&mdscr, mdpal, &sndi);
+#ifdef WITH_PROFILE
+		if (megad->prof_enabled) {
+			uint64_t now = md::prof_now();
+
+			pd_graphics_update(false);
+			pd_sound_write();
+			res->frontend += (md::prof_now() - now);
+			continue;
+		}
+#endif
+		pd_graphics_update(false);
+		pd_sound_write();
+	}
+	res->usecs = (pd_usecs() - start);
+	if (res->usecs == 0)
+		res->usecs = 1;
+	res->frames = bench.frames;
+	res->samples = (headless_sound_written() - res->samples);
+#ifdef WITH_PROFILE
+	megad->prof_switch(md::PROF_OTHER);
+	megad->prof_enabled = false;
+	res->ticks = (md::prof_now() - ticks);
+	memcpy(res->section, megad->prof_ticks, sizeof(res->section));
+	// The frontend was charged to PROF_OTHER as well.
+	if (res->section[md::PROF_OTHER] >= res->frontend)
+		res->section[md::PROF_OTHER] -= res->frontend;
+#endif
+	if (bench.runahead)
+		bench_runahead(megad, res);
+	headless_demo_close();
+	if (bench_state(megad, res)) {
+		delete megad;
+		return -1;
+	}
+	delete megad;
+	return 0;
+}
+
+/**
+ * Print the results of a run as a JSON object.
+ * @param res Results.
+ */
+static void bench_print(const struct bench_result *res)
+{
+	printf("\t\t{\n"
+	       "\t\t\t\"m68k\": \"%s\",\n"
+	       "\t\t\t\"z80\": \"%s\",\n"
+	       "\t\t\t\"frames\": %lu,\n"
+	       "\t\t\t\"seconds\": %.6f,\n"
+	       "\t\t\t\"fps\": %.2f,\n"
+	       "\t\t\t\"samples\": %llu,\n"
+	       "\t\t\t\"state_bytes\": %lu,\n"
+	       "\t\t\t\"state_save_usecs\": %.3f,\n"
+	       "\t\t\t\"state_load_usecs\": %.3f",
+	       emu_m68k_names[res->m68k], emu_z80_names[res->z80],
+	       res->frames, (res->usecs / 1000000.0),
+	       ((double)res->frames * 1000000.0 / res->usecs),
+	       res->samples, (unsigned long)res->state_size,
+	       res->save_usecs, res->load_usecs);
+	if (bench.runahead)
+		printf(",\n"
+		       "\t\t\t\"runahead_frames\": %u,\n"
+		       "\t\t\t\"runahead_fps\": %.2f,\n"
+		       "\t\t\t\"runahead_usecs_per_extra_frame\": %.3f",
+		       bench.runahead,
+		       ((double)res->frames * 1000000.0 /
+			res->runahead_usecs),
+		       (((double)res->runahead_usecs - res->usecs) /
+			res->frames / bench.runahead));
+#ifdef WITH_PROFILE
+	{
+		static const char *names[md::PROF_TOTAL] = {
+			"other", "m68k", "z80", "vdp", "sound"
+		};
+		// Convert ticks to microseconds using the measured duration.
+		double scale = ((res->ticks == 0) ? 0.0 :
+				((double)res->usecs / res->ticks));
+		unsigned int i;
+
+		printf(",\n\t\t\t\"usecs_per_frame\": {\n");
+		for (i = 0; (i != md::PROF_TOTAL); ++i)
+			printf("\t\t\t\t\"%s\": %.3f,\n", names[i],
+			       (res->section[i] * scale / res->frames));
+		printf("\t\t\t\t\"frontend\": %.3f\n"
+		       "\t\t\t}",
+		       (res->frontend * scale / res->frames));
+	}
+#endif
+	printf("\n\t\t}");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	FILE *file;
+	long rate;
+	unsigned int samples = 0;
+	size_t i;
+	size_t j;
+	bool first = true;
+	int ret = 0;
+
+	// Parse the RC file, never write anything back.
+	dgen_autoconf = 0;
+	if ((file = dgen_fopen_rc(DGEN_READ)) != NULL) {
+		parse_rc(file, DGEN_RC);
+		fclose(file);
+		file = NULL;
+	}
+	while ((c = getopt(argc, argv, "hvr:f:w:D:a:m:z:R:NP")) != EOF) {
+		switch (c) {
+		case 'v':
+			printf("DGen/SDL version " VER "\n");
+			return 0;
+		case 'r':
+			if ((file = dgen_fopen(NULL, optarg,
+					       (DGEN_READ | DGEN_CURRENT))) ==
+			    NULL) {
+				fprintf(stderr, "rc: %s: %s\n", optarg,
+					strerror(errno));
+				break;
+			}
+			parse_rc(file, optarg);
+			fclose(file);
+			file = NULL;
+			break;
+		case 'f':
+			bench.frames = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			bench.warmup = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			bench.demo = optarg;
+			break;
+		case 'a':
+			bench.runahead = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			if ((bench.m68k = bench_core(emu_m68k_names,
+						     bench_m68k, optarg)) < 0) {
+				fprintf(stderr, "bench: M68K core `%s' not"
+					" available.\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'z':
+			if ((bench.z80 = bench_core(emu_z80_names,
+						    bench_z80, optarg)) < 0) {
+				fprintf(stderr, "bench: Z80 core `%s' not"
+					" available.\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'R':
+			if ((strlen(optarg) != 1) ||
+			    (strchr("jxue ", (optarg[0] | 0x20)) == NULL)) {
+				fprintf(stderr, "bench: invalid region `%s'.\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			dgen_region = (optarg[0] & ~(0x20));
+			if (dgen_region) {
+				int hz;
+				int pal;
+
+				md::region_info(dgen_region, &pal, &hz,
+						0, 0, 0);
+				dgen_hz = hz;
+				dgen_pal = pal;
+			}
+			bench.forced_pal = false;
+			break;
+		case 'N':
+			dgen_hz = NTSC_HZ;
+			dgen_pal = 0;
+			bench.forced_pal = true;
+			break;
+		case 'P':
+			dgen_hz = PAL_HZ;
+			dgen_pal = 1;
+			bench.forced_pal = true;
+			break;
+		default:
+			help();
+		}
+	}
+	if (optind < argc)
+		bench.rom = argv[optind];
+	if (bench.frames == 0)
+		help();
+	if (!pd_graphics_init(1, dgen_pal, dgen_hz)) {
+		fprintf(stderr, "bench: couldn't initialize graphics.\n");
+		return 1;
+	}
+	rate = dgen_soundrate;
+	if (!pd_sound_init(rate, samples)) {
+		fprintf(stderr, "bench: couldn't initialize sound.\n");
+		return 1;
+	}
+	printf("{\n"
+	       "\t\"version\": \"" VER "\",\n"
+	       "\t\"rom\": ");
+	json_string(bench.rom);
+	printf(",\n\t\"demo\": ");
+	json_string(bench.demo);
+	printf(",\n"
+	       "\t\"frames\": %lu,\n"
+	       "\t\"warmup\": %lu,\n"
+	       "\t\"depth\": %d,\n"
+	       "\t\"soundrate\": %ld,\n"
+#ifdef WITH_NUKEDOPN2
+	       "\t\"ym2612\": \"%s\",\n"
+#endif
+#ifdef WITH_PROFILE
+	       "\t\"profile\": true,\n"
+#else
+	       "\t\"profile\": false,\n"
+#endif
+	       "\t\"runs\": [\n",
+	       bench.frames, bench.warmup, mdscr.bpp, rate
+#ifdef WITH_NUKEDOPN2
+	       , ((dgen_ym_chipimpl == YM_CHIPIMPL_NUKEDOPN2) ?
+		  "nukedopn2" : "mame")
+#endif
+	       );
+	for (i = 0; (i == 0) || (bench_m68k[(i - 1)] != 0); ++i) {
+		int m68k = ((i == 0) ? 0 : bench_m68k[(i - 1)]);
+
+		// Only benchmark the "none" core if explicitly requested.
+		if ((bench.m68k != m68k) &&
+		    ((bench.m68k >= 0) || (m68k == 0)))
+			continue;
+		for (j = 0; (j == 0) || (bench_z80[(j - 1)] != 0); ++j) {
+			struct bench_result res;
+			int z80 = ((j == 0) ? 0 : bench_z80[(j - 1)]);
+
+			if ((bench.z80 != z80) &&
+			    ((bench.z80 >= 0) || (z80 == 0)))
+				continue;
+			memset(&res, 0, sizeof(res));
+			res.m68k = m68k;
+			res.z80 = z80;
+			fprintf(stderr, "bench: running %s/%s...\n",
+				emu_m68k_names[m68k], emu_z80_names[z80]);
+			if (bench_run(&res)) {
+				ret = 1;
+				continue;
+			}
+			if (!first)
+				printf(",\n");
+			first = false;
+			bench_print(&res);
+			fflush(stdout);
+		}
+	}
+	printf("\n\t]\n}\n");
+	pd_sound_deinit();
+	return ret;
+}
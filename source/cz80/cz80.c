@@ -43,13 +43,13 @@ void FASTCALL Cz80_RetI_Dummy(void *ctx);
 // core main functions
 ///////////////////////
 
-void Cz80_Init(cz80_struc *cpu)
+// flags tables initialisation, tables are shared by all CPUs
+static void Cz80_Init_Tables(void)
 {
+    static int done = 0;
     unsigned int i, j, p;
 
-    memset(cpu, 0, sizeof(cz80_struc));
-    
-    // flags tables initialisation
+    if (done) return;
     for (i = 0; i < 256; i++)
     {
         SZXY[i] = i & (CZ80_SF | CZ80_YF | CZ80_XF);
@@ -70,6 +70,13 @@ void Cz80_Init(cz80_struc *cpu)
         if (i == 0x7F) SZXYHV_dec[i] |= CZ80_VF;
         if ((i & 0x0F) == 0x0F) SZXYHV_dec[i] |= CZ80_HF;
     }
+    done = 1;
+}
+
+void Cz80_Init(cz80_struc *cpu)
+{
+    memset(cpu, 0, sizeof(cz80_struc));
+    Cz80_Init_Tables();
 
     Cz80_Set_Fetch(cpu, 0x0000, 0xFFFF, NULL);
 
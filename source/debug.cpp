@@ -1610,7 +1610,7 @@ int md::debug_cmd_reg(int n_args, char **args)
 		debug_show_z80_regs();
 		break;
 	case DBG_CONTEXT_YM2612:
-		debug_show_ym2612_regs();
+		debug_show_ym2612_regs(ym2612[0]);
 		break;
 	default:
 		printf("register dump not implemented on %s core\n",
@@ -40,6 +40,6 @@ struct dgen_wp {
 	unsigned char	*bytes;
 };
 
-extern "C" void		debug_show_ym2612_regs(void); // fm.c
+extern "C" void		debug_show_ym2612_regs(void *chip); // fm.c
 
 #endif
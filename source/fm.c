@@ -103,6 +103,7 @@
 #include "platform.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdarg.h>
 #include <math.h>
@@ -694,29 +695,22 @@ typedef struct
 	UINT32	lfo_inc;
 
 	UINT32	lfo_freq[8];	/* LFO FREQ table */
-} FM_OPN;
-
-
-
-/* current chip state */
-static void		*cur_chip = 0;	/* pointer of current chip struct */
-static FM_ST	*State;			/* basic status */
-static FM_CH	*cch[8];		/* pointer of FM channels */
 
+	/* runtime state, kept here so that chips don't share anything */
+	INT32	m2,c1,c2;		/* Phase Modulation input for operators 2,3,4 */
+	INT32	mem;			/* one sample delay memory */
+	INT32	out_fm[8];		/* outputs of working channels */
+	UINT32	LFO_AM;			/* runtime LFO calculations helper */
+	INT32	LFO_PM;			/* runtime LFO calculations helper */
+} FM_OPN;
 
-static INT32	m2,c1,c2;		/* Phase Modulation input for operators 2,3,4 */
-static INT32	mem;			/* one sample delay memory */
 
-static INT32	out_fm[8];		/* outputs of working channels */
 
 #if (BUILD_YM2608||BUILD_YM2610||BUILD_YM2610B)
 static INT32	out_adpcm[4];	/* channel output NONE,LEFT,RIGHT or CENTER for YM2608/YM2610 ADPCM */
 static INT32	out_delta[4];	/* channel output NONE,LEFT,RIGHT or CENTER for YM2608/YM2610 DELTAT*/
 #endif
 
-static UINT32	LFO_AM;			/* runtime LFO calculations helper */
-static INT32	LFO_PM;			/* runtime LFO calculations helper */
-
 /* log output level */
 #define LOG_ERR  3      /* ERROR       */
 #define LOG_WAR  2      /* WARNING     */
@@ -942,9 +936,9 @@ INLINE void FM_KEYOFF(FM_CH *CH , int s )
 }
 
 /* set algorithm connection */
-static void setup_connection( FM_CH *CH, int ch )
+static void setup_connection( FM_OPN *OPN, FM_CH *CH, int ch )
 {
-	INT32 *carrier = &out_fm[ch];
+	INT32 *carrier = &OPN->out_fm[ch];
 
 	INT32 **om1 = &CH->connect1;
 	INT32 **om2 = &CH->connect3;
@@ -955,43 +949,43 @@ static void setup_connection( FM_CH *CH, int ch )
 	switch( CH->ALGO ){
 	case 0:
 		/* M1---C1---MEM---M2---C2---OUT */
-		*om1 = &c1;
-		*oc1 = &mem;
-		*om2 = &c2;
-		*memc= &m2;
+		*om1 = &OPN->c1;
+		*oc1 = &OPN->mem;
+		*om2 = &OPN->c2;
+		*memc= &OPN->m2;
 		break;
 	case 1:
 		/* M1------+-MEM---M2---C2---OUT */
 		/*      C1-+                     */
-		*om1 = &mem;
-		*oc1 = &mem;
-		*om2 = &c2;
-		*memc= &m2;
+		*om1 = &OPN->mem;
+		*oc1 = &OPN->mem;
+		*om2 = &OPN->c2;
+		*memc= &OPN->m2;
 		break;
 	case 2:
 		/* M1-----------------+-C2---OUT */
 		/*      C1---MEM---M2-+          */
-		*om1 = &c2;
-		*oc1 = &mem;
-		*om2 = &c2;
-		*memc= &m2;
+		*om1 = &OPN->c2;
+		*oc1 = &OPN->mem;
+		*om2 = &OPN->c2;
+		*memc= &OPN->m2;
 		break;
 	case 3:
 		/* M1---C1---MEM------+-C2---OUT */
 		/*                 M2-+          */
-		*om1 = &c1;
-		*oc1 = &mem;
-		*om2 = &c2;
-		*memc= &c2;
+		*om1 = &OPN->c1;
+		*oc1 = &OPN->mem;
+		*om2 = &OPN->c2;
+		*memc= &OPN->c2;
 		break;
 	case 4:
 		/* M1---C1-+-OUT */
 		/* M2---C2-+     */
 		/* MEM: not used */
-		*om1 = &c1;
+		*om1 = &OPN->c1;
 		*oc1 = carrier;
-		*om2 = &c2;
-		*memc= &mem;	/* store it anywhere where it will not be used */
+		*om2 = &OPN->c2;
+		*memc= &OPN->mem;	/* store it anywhere where it will not be used */
 		break;
 	case 5:
 		/*    +----C1----+     */
@@ -1000,17 +994,17 @@ static void setup_connection( FM_CH *CH, int ch )
 		*om1 = 0;	/* special mark */
 		*oc1 = carrier;
 		*om2 = carrier;
-		*memc= &m2;
+		*memc= &OPN->m2;
 		break;
 	case 6:
 		/* M1---C1-+     */
 		/*      M2-+-OUT */
 		/*      C2-+     */
 		/* MEM: not used */
-		*om1 = &c1;
+		*om1 = &OPN->c1;
 		*oc1 = carrier;
 		*om2 = carrier;
-		*memc= &mem;	/* store it anywhere where it will not be used */
+		*memc= &OPN->mem;	/* store it anywhere where it will not be used */
 		break;
 	case 7:
 		/* M1-+     */
@@ -1021,7 +1015,7 @@ static void setup_connection( FM_CH *CH, int ch )
 		*om1 = carrier;
 		*oc1 = carrier;
 		*om2 = carrier;
-		*memc= &mem;	/* store it anywhere where it will not be used */
+		*memc= &OPN->mem;	/* store it anywhere where it will not be used */
 		break;
 	}
 
@@ -1173,9 +1167,9 @@ INLINE void advance_lfo(FM_OPN *OPN)
 			/* triangle */
 			/* AM: 0 to 126 step +2, 126 to 0 step -2 */
 			if (pos<64)
-				LFO_AM = (pos&63) * 2;
+				OPN->LFO_AM = (pos&63) * 2;
 			else
-				LFO_AM = 126 - ((pos&63) * 2);
+				OPN->LFO_AM = 126 - ((pos&63) * 2);
 		}
 
 		/* PM works with 4 times slower clock */
@@ -1183,14 +1177,14 @@ INLINE void advance_lfo(FM_OPN *OPN)
 		/* update PM when LFO output changes */
 		/*if (prev_pos != pos)*/ /* can't use global lfo_pm for this optimization, must be chip->lfo_pm instead*/
 		{
-			LFO_PM = pos;
+			OPN->LFO_PM = pos;
 		}
 
 	}
 	else
 	{
-		LFO_AM = 0;
-		LFO_PM = 0;
+		OPN->LFO_AM = 0;
+		OPN->LFO_PM = 0;
 	}
 }
 
@@ -1399,7 +1393,7 @@ INLINE void advance_eg_channel(FM_OPN *OPN, FM_SLOT *SLOT)
 INLINE void update_phase_lfo_slot(FM_OPN *OPN, FM_SLOT *SLOT, INT32 pms, UINT32 block_fnum)
 {
 	UINT32 fnum_lfo  = ((block_fnum & 0x7f0) >> 4) * 32 * 8;
-	INT32  lfo_fn_table_index_offset = lfo_pm_table[ fnum_lfo + pms + LFO_PM ];
+	INT32  lfo_fn_table_index_offset = lfo_pm_table[ fnum_lfo + pms + OPN->LFO_PM ];
 
 	if (lfo_fn_table_index_offset)    /* LFO phase modulation active */
 	{
@@ -1435,7 +1429,7 @@ INLINE void update_phase_lfo_channel(FM_OPN *OPN, FM_CH *CH)
 	UINT32 block_fnum = CH->block_fnum;
 
 	UINT32 fnum_lfo  = ((block_fnum & 0x7f0) >> 4) * 32 * 8;
-	INT32  lfo_fn_table_index_offset = lfo_pm_table[ fnum_lfo + CH->pms + LFO_PM ];
+	INT32  lfo_fn_table_index_offset = lfo_pm_table[ fnum_lfo + CH->pms + OPN->LFO_PM ];
 
 	if (lfo_fn_table_index_offset)    /* LFO phase modulation active */
 	{
@@ -1481,14 +1475,38 @@ INLINE void update_phase_lfo_channel(FM_OPN *OPN, FM_CH *CH)
 	}
 }
 
+/* update phase counters of all operators */
+INLINE void chan_update_phase(FM_OPN *OPN, FM_CH *CH, int chnum)
+{
+	if(CH->pms)
+	{
+		/* add support for 3 slot mode */
+		if ((OPN->ST.mode & 0xC0) && (chnum == 2))
+		{
+		        update_phase_lfo_slot(OPN, &CH->SLOT[SLOT1], CH->pms, OPN->SL3.block_fnum[1]);
+		        update_phase_lfo_slot(OPN, &CH->SLOT[SLOT2], CH->pms, OPN->SL3.block_fnum[2]);
+		        update_phase_lfo_slot(OPN, &CH->SLOT[SLOT3], CH->pms, OPN->SL3.block_fnum[0]);
+		        update_phase_lfo_slot(OPN, &CH->SLOT[SLOT4], CH->pms, CH->block_fnum);
+		}
+		else update_phase_lfo_channel(OPN, CH);
+	}
+	else	/* no LFO phase modulation */
+	{
+		CH->SLOT[SLOT1].phase += CH->SLOT[SLOT1].Incr;
+		CH->SLOT[SLOT2].phase += CH->SLOT[SLOT2].Incr;
+		CH->SLOT[SLOT3].phase += CH->SLOT[SLOT3].Incr;
+		CH->SLOT[SLOT4].phase += CH->SLOT[SLOT4].Incr;
+	}
+}
+
 INLINE void chan_calc(FM_OPN *OPN, FM_CH *CH, int chnum)
 {
 	unsigned int eg_out;
 
-	UINT32 AM = LFO_AM >> CH->ams;
+	UINT32 AM = OPN->LFO_AM >> CH->ams;
 
 
-	m2 = c1 = c2 = mem = 0;
+	OPN->m2 = OPN->c1 = OPN->c2 = OPN->mem = 0;
 
 	*CH->mem_connect = CH->mem_value;	/* restore delayed sample (MEM) value to m2 or c2 */
 
@@ -1499,7 +1517,7 @@ INLINE void chan_calc(FM_OPN *OPN, FM_CH *CH, int chnum)
 
 		if( !CH->connect1 ){
 			/* algorithm 5  */
-			mem = c1 = c2 = CH->op1_out[0];
+			OPN->mem = OPN->c1 = OPN->c2 = CH->op1_out[0];
 		}
 		else
 		{
@@ -1519,40 +1537,59 @@ INLINE void chan_calc(FM_OPN *OPN, FM_CH *CH, int chnum)
 
 	eg_out = volume_calc(&CH->SLOT[SLOT3]);
 	if( eg_out < ENV_QUIET )		/* SLOT 3 */
-		*CH->connect3 += op_calc(CH->SLOT[SLOT3].phase, eg_out, m2);
+		*CH->connect3 += op_calc(CH->SLOT[SLOT3].phase, eg_out, OPN->m2);
 
 	eg_out = volume_calc(&CH->SLOT[SLOT2]);
 	if( eg_out < ENV_QUIET )		/* SLOT 2 */
-		*CH->connect2 += op_calc(CH->SLOT[SLOT2].phase, eg_out, c1);
+		*CH->connect2 += op_calc(CH->SLOT[SLOT2].phase, eg_out, OPN->c1);
 
 	eg_out = volume_calc(&CH->SLOT[SLOT4]);
 	if( eg_out < ENV_QUIET )		/* SLOT 4 */
-		*CH->connect4 += op_calc(CH->SLOT[SLOT4].phase, eg_out, c2);
+		*CH->connect4 += op_calc(CH->SLOT[SLOT4].phase, eg_out, OPN->c2);
 
 
 	/* store current MEM */
-	CH->mem_value = mem;
+	CH->mem_value = OPN->mem;
 
 	/* update phase counters AFTER output calculations */
-	if(CH->pms)
-	{
-		/* add support for 3 slot mode */
-		if ((OPN->ST.mode & 0xC0) && (chnum == 2))
-		{
-		        update_phase_lfo_slot(OPN, &CH->SLOT[SLOT1], CH->pms, OPN->SL3.block_fnum[1]);
-		        update_phase_lfo_slot(OPN, &CH->SLOT[SLOT2], CH->pms, OPN->SL3.block_fnum[2]);
-		        update_phase_lfo_slot(OPN, &CH->SLOT[SLOT3], CH->pms, OPN->SL3.block_fnum[0]);
-		        update_phase_lfo_slot(OPN, &CH->SLOT[SLOT4], CH->pms, CH->block_fnum);
-		}
-		else update_phase_lfo_channel(OPN, CH);
-	}
-	else	/* no LFO phase modulation */
-	{
-		CH->SLOT[SLOT1].phase += CH->SLOT[SLOT1].Incr;
-		CH->SLOT[SLOT2].phase += CH->SLOT[SLOT2].Incr;
-		CH->SLOT[SLOT3].phase += CH->SLOT[SLOT3].Incr;
-		CH->SLOT[SLOT4].phase += CH->SLOT[SLOT4].Incr;
-	}
+	chan_update_phase(OPN, CH, chnum);
+}
+
+/* a channel is silent when all its operators are off and nothing is left
+   in its feedback and MEM delays, chan_calc() would only advance phases */
+INLINE int chan_silent(FM_CH *CH)
+{
+	return ((CH->SLOT[SLOT1].state == EG_OFF) &&
+		(CH->SLOT[SLOT2].state == EG_OFF) &&
+		(CH->SLOT[SLOT3].state == EG_OFF) &&
+		(CH->SLOT[SLOT4].state == EG_OFF) &&
+		(CH->SLOT[SLOT1].vol_out >= ENV_QUIET) &&
+		(CH->SLOT[SLOT2].vol_out >= ENV_QUIET) &&
+		(CH->SLOT[SLOT3].vol_out >= ENV_QUIET) &&
+		(CH->SLOT[SLOT4].vol_out >= ENV_QUIET) &&
+		((CH->op1_out[0] | CH->op1_out[1] | CH->mem_value) == 0));
+}
+
+/* bit mask of silent channels */
+INLINE unsigned int chan_silent_mask(FM_CH **cch)
+{
+	unsigned int mask = 0;
+	int c;
+
+	for (c = 0; (c != 6); ++c)
+		if (chan_silent(cch[c]))
+			mask |= (1 << c);
+	return mask;
+}
+
+/* chan_calc() for channels that may be silent */
+INLINE void chan_calc_fast(FM_OPN *OPN, FM_CH *CH, int chnum,
+			   unsigned int silent)
+{
+	if (silent & (1 << chnum))
+		chan_update_phase(OPN, CH, chnum);
+	else
+		chan_calc(OPN, CH, chnum);
 }
 
 /* update phase increment and envelope generator */
@@ -1675,12 +1712,18 @@ static void reset_channels( FM_ST *ST , FM_CH *CH , int num )
 }
 
 /* initialize generic tables */
+/* tables are shared by all chips and only computed once */
+static int tables_ready;
+
 static int init_tables(void)
 {
 	signed int i,x;
 	signed int n;
 	double o,m;
 
+	if (tables_ready)
+		return 1;
+
 	for (x=0; x<TL_RES_LEN; x++)
 	{
 		m = (1<<16) / pow(2, (x+1) * (ENV_STEP/4.0) / 8.0);
@@ -1787,6 +1830,7 @@ static int init_tables(void)
 	sample[0]=fopen("sampsum.pcm","wb");
 #endif
 
+	tables_ready = 1;
 	return 1;
 
 }
@@ -2163,7 +2207,7 @@ static void OPNWriteReg(FM_OPN *OPN, int r, int v)
 				int feedback = (v>>3)&7;
 				CH->ALGO = v&7;
 				CH->FB   = feedback ? feedback+6 : 0;
-				setup_connection( CH, c );
+				setup_connection( OPN, CH, c );
 			}
 			break;
 		case 1:		/* 0xb4-0xb6 : L , R , AMS , PMS (YM2612/YM2610B/YM2610/YM2608) */
@@ -2261,11 +2305,6 @@ typedef struct
 	INT32		dacout;
 } YM2612;
 
-static int YM2612NumChips;	/* total chip */
-static YM2612 *FM2612=NULL;	/* array of YM2612's */
-
-static int dacen;
-
 #ifdef YM2612_LOWPASS
 extern int rc_get_ym_lowpass_cutoff();
 static INT16 lowpass_filter(INT32 *pMem, const int lowpass_cutoff, INT16 sample)
@@ -2278,30 +2317,31 @@ static INT16 lowpass_filter(INT32 *pMem, const int lowpass_cutoff, INT16 sample)
 #endif
 
 /* Generate samples for one of the YM2612s */
-void YM2612UpdateOne(int num, INT16 *buffer, unsigned int length,
-		     unsigned int volume, int loud)
+/* Generate "length" stereo samples mixed into "buffer", or with the mono
+   samples from "mix" instead when not NULL. */
+void YM2612UpdateOne(void *chip, INT16 *buffer, unsigned int length,
+		     unsigned int volume, int loud, const INT32 *mix)
 {
-	YM2612 *F2612 = &(FM2612[num]);
-	FM_OPN *OPN   = &(FM2612[num].OPN);
+	YM2612 *F2612 = (YM2612 *)chip;
+	FM_OPN *OPN   = &F2612->OPN;
+	FM_ST *State  = &OPN->ST;
+	FM_CH *cch[6];
 	unsigned int i;
 	INT32 dacout  = F2612->dacout;
+	int dacen     = F2612->dacen;
+	unsigned int silent;
+	/* output gain (16.16), "loud" makes it 1.5 times louder */
+	const int32_t gain = ((((loud ? 3 : 2) * volume) << 16) / 200);
 #ifdef YM2612_LOWPASS
 	const lowpass_cutoff = rc_get_ym_lowpass_cutoff();
 #endif
 
-	if( (void *)F2612 != cur_chip ){
-		cur_chip = (void *)F2612;
-		State = &OPN->ST;
-		cch[0]   = &F2612->CH[0];
-		cch[1]   = &F2612->CH[1];
-		cch[2]   = &F2612->CH[2];
-		cch[3]   = &F2612->CH[3];
-		cch[4]   = &F2612->CH[4];
-		cch[5]   = &F2612->CH[5];
-		/* DAC mode */
-		dacen = F2612->dacen;
-
-	}
+	cch[0]   = &F2612->CH[0];
+	cch[1]   = &F2612->CH[1];
+	cch[2]   = &F2612->CH[2];
+	cch[3]   = &F2612->CH[3];
+	cch[4]   = &F2612->CH[4];
+	cch[5]   = &F2612->CH[5];
 
 	/* refresh PG and EG */
 	refresh_fc_eg_chan( OPN, cch[0] );
@@ -2321,6 +2361,10 @@ void YM2612UpdateOne(int num, INT16 *buffer, unsigned int length,
 	refresh_fc_eg_chan( OPN, cch[4] );
 	refresh_fc_eg_chan( OPN, cch[5] );
 
+	/* operators only leave EG_OFF on key on, channels that are silent now
+	   remain so until the end of this buffer */
+	silent = chan_silent_mask(cch);
+
 	/* buffering */
 	for(i=0; i < length ; i++)
 	{
@@ -2328,23 +2372,23 @@ void YM2612UpdateOne(int num, INT16 *buffer, unsigned int length,
 		advance_lfo(OPN);
 
 		/* clear outputs */
-		out_fm[0] = 0;
-		out_fm[1] = 0;
-		out_fm[2] = 0;
-		out_fm[3] = 0;
-		out_fm[4] = 0;
-		out_fm[5] = 0;
+		OPN->out_fm[0] = 0;
+		OPN->out_fm[1] = 0;
+		OPN->out_fm[2] = 0;
+		OPN->out_fm[3] = 0;
+		OPN->out_fm[4] = 0;
+		OPN->out_fm[5] = 0;
 		
 		/* calculate FM */
-		chan_calc(OPN, cch[0], 0 );
-		chan_calc(OPN, cch[1], 1 );
-		chan_calc(OPN, cch[2], 2 );
-		chan_calc(OPN, cch[3], 3 );
-		chan_calc(OPN, cch[4], 4 );
+		chan_calc_fast(OPN, cch[0], 0, silent);
+		chan_calc_fast(OPN, cch[1], 1, silent);
+		chan_calc_fast(OPN, cch[2], 2, silent);
+		chan_calc_fast(OPN, cch[3], 3, silent);
+		chan_calc_fast(OPN, cch[4], 4, silent);
 		if( dacen )
 			*cch[5]->connect4 += dacout;
 		else
-			chan_calc(OPN, cch[5], 5 );
+			chan_calc_fast(OPN, cch[5], 5, silent);
 
 		/* advance envelope generator */
 		OPN->eg_timer += OPN->eg_timer_add;
@@ -2359,23 +2403,24 @@ void YM2612UpdateOne(int num, INT16 *buffer, unsigned int length,
 			advance_eg_channel(OPN, &cch[3]->SLOT[SLOT1]);
 			advance_eg_channel(OPN, &cch[4]->SLOT[SLOT1]);
 			advance_eg_channel(OPN, &cch[5]->SLOT[SLOT1]);
+			silent = chan_silent_mask(cch);
 		}
 
 		{
 			int32_t lt, rt;
 
-			lt  = ((out_fm[0]>>0) & OPN->pan[0]);
-			rt  = ((out_fm[0]>>0) & OPN->pan[1]);
-			lt += ((out_fm[1]>>0) & OPN->pan[2]);
-			rt += ((out_fm[1]>>0) & OPN->pan[3]);
-			lt += ((out_fm[2]>>0) & OPN->pan[4]);
-			rt += ((out_fm[2]>>0) & OPN->pan[5]);
-			lt += ((out_fm[3]>>0) & OPN->pan[6]);
-			rt += ((out_fm[3]>>0) & OPN->pan[7]);
-			lt += ((out_fm[4]>>0) & OPN->pan[8]);
-			rt += ((out_fm[4]>>0) & OPN->pan[9]);
-			lt += ((out_fm[5]>>0) & OPN->pan[10]);
-			rt += ((out_fm[5]>>0) & OPN->pan[11]);
+			lt  = ((OPN->out_fm[0]>>0) & OPN->pan[0]);
+			rt  = ((OPN->out_fm[0]>>0) & OPN->pan[1]);
+			lt += ((OPN->out_fm[1]>>0) & OPN->pan[2]);
+			rt += ((OPN->out_fm[1]>>0) & OPN->pan[3]);
+			lt += ((OPN->out_fm[2]>>0) & OPN->pan[4]);
+			rt += ((OPN->out_fm[2]>>0) & OPN->pan[5]);
+			lt += ((OPN->out_fm[3]>>0) & OPN->pan[6]);
+			rt += ((OPN->out_fm[3]>>0) & OPN->pan[7]);
+			lt += ((OPN->out_fm[4]>>0) & OPN->pan[8]);
+			rt += ((OPN->out_fm[4]>>0) & OPN->pan[9]);
+			lt += ((OPN->out_fm[5]>>0) & OPN->pan[10]);
+			rt += ((OPN->out_fm[5]>>0) & OPN->pan[11]);
 			
 			lt >>= FINAL_SH;
 			rt >>= FINAL_SH;
@@ -2389,14 +2434,17 @@ void YM2612UpdateOne(int num, INT16 *buffer, unsigned int length,
 				SAVE_ALL_CHANNELS
 			#endif
 
-			/* Mix with buffer. */
-			lt += *buffer;
-			/* Make it louder. */
-			if (loud)
-				lt = ((lt * 3) >> 1);
-			/* Lower volume? */
-			if (volume != 100)
-				lt = ((lt * (int)volume) / 100);
+			/* Mix with buffer, apply gain. */
+			if (mix != NULL) {
+				lt += *mix;
+				rt += *(mix++);
+			}
+			else {
+				lt += buffer[0];
+				rt += buffer[1];
+			}
+			if (gain != 0x10000)
+				lt = (int32_t)(((int64_t)lt * gain) >> 16);
 			/* Hard clipping for signed 16-bit output. */
 			lt = ((abs(lt + 32767) - abs(lt - 32767)) >> 1);
 #ifdef YM2612_LOWPASS
@@ -2404,11 +2452,8 @@ void YM2612UpdateOne(int num, INT16 *buffer, unsigned int length,
 #endif
 			*(buffer++) = lt;
 
-			rt += *buffer;
-			if (loud)
-				rt = ((rt * 3) >> 1);
-			if (volume != 100)
-				rt = ((rt * (int)volume) / 100);
+			if (gain != 0x10000)
+				rt = (int32_t)(((int64_t)rt * gain) >> 16);
 			rt = ((abs(rt + 32767) - abs(rt - 32767)) >> 1);
 #ifdef YM2612_LOWPASS
 			rt = (lowpass_cutoff) ? lowpass_filter(&F2612->memR, lowpass_cutoff, rt) : rt;
@@ -2423,123 +2468,54 @@ void YM2612UpdateOne(int num, INT16 *buffer, unsigned int length,
 
 }
 
-#ifdef _STATE_H
-static void YM2612_postload(void)
-{
-	int num , r;
-
-	for(num=0;num<YM2612NumChips;num++)
-	{
-		/* DAC data & port */
-		FM2612[num].dacout = ((int)FM2612[num].REGS[0x2a] - 0x80) << 6;	/* level unknown */
-		FM2612[num].dacen  = FM2612[num].REGS[0x2d] & 0x80;
-		/* OPN registers */
-		/* DT / MULTI , TL , KS / AR , AMON / DR , SR , SL / RR , SSG-EG */
-		for(r=0x30;r<0x9e;r++)
-			if((r&3) != 3)
-			{
-				OPNWriteReg(&FM2612[num].OPN,r,FM2612[num].REGS[r]);
-				OPNWriteReg(&FM2612[num].OPN,r|0x100,FM2612[num].REGS[r|0x100]);
-			}
-		/* FB / CONNECT , L / R / AMS / PMS */
-		for(r=0xb0;r<0xb6;r++)
-			if((r&3) != 3)
-			{
-				OPNWriteReg(&FM2612[num].OPN,r,FM2612[num].REGS[r]);
-				OPNWriteReg(&FM2612[num].OPN,r|0x100,FM2612[num].REGS[r|0x100]);
-			}
-		/* channels */
-		/*FM_channel_postload(FM2612[num].CH,6);*/
-	}
-	cur_chip = NULL;
-}
 
-static void YM2612_save_state(void)
+/* initialize one YM2612 emulator, returns its state or NULL */
+void *YM2612Init(int index, int clock, int rate,
+                 FM_TIMERHANDLER TimerHandler,FM_IRQHANDLER IRQHandler)
 {
-	int num;
-	const char statename[] = "YM2612";
-
-	for(num=0;num<YM2612NumChips;num++)
-	{
-		state_save_register_UINT8 (statename, num, "regs"   , FM2612[num].REGS   , 512);
-		FMsave_state_st(statename,num,&FM2612[num].OPN.ST);
-		FMsave_state_channel(statename,num,FM2612[num].CH,6);
-		/* 3slots */
-		state_save_register_UINT32 (statename, num, "slot3fc" , FM2612[num].OPN.SL3.fc ,   3);
-		state_save_register_UINT8  (statename, num, "slot3fh" , &FM2612[num].OPN.SL3.fn_h, 1);
-		state_save_register_UINT8  (statename, num, "slot3kc" , FM2612[num].OPN.SL3.kcode, 3);
-		/* address register1 */
-		state_save_register_UINT8 (statename, num, "addr_A1" , &FM2612[num].addr_A1, 1);
-	}
-	state_save_register_func_postload(YM2612_postload);
-}
-#endif /* _STATE_H */
-
-/* initialize YM2612 emulator(s) */
-int YM2612Init(int num, int clock, int rate, int mjazz,
-               FM_TIMERHANDLER TimerHandler,FM_IRQHANDLER IRQHandler)
-{
-	int i;
-
-	if (FM2612) return (-1);	/* duplicate init. */
-	cur_chip = NULL;	/* hiro-shi!! */
-
-	YM2612NumChips = num;
+	YM2612 *F2612;
 
 	/* allocate extend state space */
-	if( (FM2612 = (YM2612 *)malloc(sizeof(YM2612) * YM2612NumChips))==NULL)
-		return (-1);
+	if( (F2612 = (YM2612 *)malloc(sizeof(YM2612)))==NULL)
+		return NULL;
 	/* clear */
-	memset(FM2612,0,sizeof(YM2612) * YM2612NumChips);
+	memset(F2612,0,sizeof(YM2612));
 	/* allocate total level table (128kb space) */
 	if( !init_tables() )
 	{
-		if (FM2612) {
-			free( FM2612 );
-			FM2612 = NULL;
-		}
-		return (-1);
-	}
-
-	for ( i = 0 ; i < YM2612NumChips; i++ ) {
-		FM2612[i].OPN.ST.index = i;
-		FM2612[i].OPN.type = TYPE_YM2612;
-		FM2612[i].OPN.P_CH = FM2612[i].CH;
-		FM2612[i].OPN.ST.clock = clock;
-		FM2612[i].OPN.ST.rate = rate;
-		if (mjazz)
-			FM2612[i].OPN.ST.rate <<= i;
-		/* FM2612[i].OPN.ST.irq = 0; */
-		/* FM2612[i].OPN.ST.status = 0; */
-		/* Extend handler */
-		FM2612[i].OPN.ST.Timer_Handler = TimerHandler;
-		FM2612[i].OPN.ST.IRQ_Handler   = IRQHandler;
-		YM2612ResetChip(i);
-	}
-#ifdef _STATE_H
-	YM2612_save_state();
-#endif
-	return 0;
+		free( F2612 );
+		return NULL;
+	}
+
+	F2612->OPN.ST.index = index;
+	F2612->OPN.type = TYPE_YM2612;
+	F2612->OPN.P_CH = F2612->CH;
+	F2612->OPN.ST.clock = clock;
+	F2612->OPN.ST.rate = rate;
+	/* F2612->OPN.ST.irq = 0; */
+	/* F2612->OPN.ST.status = 0; */
+	/* Extend handler */
+	F2612->OPN.ST.Timer_Handler = TimerHandler;
+	F2612->OPN.ST.IRQ_Handler   = IRQHandler;
+	YM2612ResetChip(F2612);
+	return F2612;
 }
 
 /* shut down emulator */
-void YM2612Shutdown()
+void YM2612Shutdown(void *chip)
 {
-	if (!FM2612) return;
+	if (!chip) return;
 
 	FMCloseTable();
-	if (FM2612) {
-		free(FM2612);
-		FM2612 = NULL;
-	}
+	free(chip);
 }
 
 /* reset one of chip */
-void YM2612ResetChip(int num)
+void YM2612ResetChip(void *chip)
 {
 	int i;
-	YM2612 *F2612 = &(FM2612[num]);
-	FM_OPN *OPN   = &(FM2612[num].OPN);
+	YM2612 *F2612 = (YM2612 *)chip;
+	FM_OPN *OPN   = &F2612->OPN;
 
 	OPNSetPres( OPN, 6*24, 6*24, 0);
 	/* status clear */
@@ -2569,12 +2545,12 @@ void YM2612ResetChip(int num)
 }
 
 /* YM2612 write */
-/* n = number  */
+/* chip = state */
 /* a = address */
 /* v = value   */
-int YM2612Write(int n, int a, UINT8 v)
+int YM2612Write(void *chip, int a, UINT8 v)
 {
-	YM2612 *F2612 = &(FM2612[n]);
+	YM2612 *F2612 = (YM2612 *)chip;
 	int addr;
 
 	v &= 0xff;	/* adjust to 8 bit bus */
@@ -2599,22 +2575,21 @@ int YM2612Write(int n, int a, UINT8 v)
 			switch( addr )
 			{
 			case 0x2a:	/* DAC data (YM2612) */
-				YM2612UpdateReq(n);
+				YM2612UpdateReq(chip);
 				F2612->dacout = ((int)v - 0x80) << 6;	/* level unknown */
 				break;
 			case 0x2b:	/* DAC Sel  (YM2612) */
 				/* b7 = dac enable */
 				F2612->dacen = v & 0x80;
-				cur_chip = NULL;
 				break;
 			default:	/* OPN section */
-				YM2612UpdateReq(n);
+				YM2612UpdateReq(chip);
 				/* write register */
 				OPNWriteMode(&(F2612->OPN),addr,v);
 			}
 			break;
 		default:	/* 0x30-0xff OPN section */
-			YM2612UpdateReq(n);
+			YM2612UpdateReq(chip);
 			/* write register */
 			OPNWriteReg(&(F2612->OPN),addr,v);
 		}
@@ -2633,16 +2608,16 @@ int YM2612Write(int n, int a, UINT8 v)
 /*#ifdef _STATE_H*/
 		F2612->REGS[addr | 0x100] = v;
 /*#endif*/
-		YM2612UpdateReq(n);
+		YM2612UpdateReq(chip);
 		OPNWriteReg(&(F2612->OPN),addr | 0x100,v);
 		break;
 	}
 	return F2612->OPN.ST.irq;
 }
 
-UINT8 YM2612Read(int n,int a)
+UINT8 YM2612Read(void *chip,int a)
 {
-	YM2612 *F2612 = &(FM2612[n]);
+	YM2612 *F2612 = (YM2612 *)chip;
 
 	switch( a&3){
 	case 0:	/* status 0 */
@@ -2650,15 +2625,15 @@ UINT8 YM2612Read(int n,int a)
 	case 1:
 	case 2:
 	case 3:
-		LOG(LOG_WAR,("YM2612 #%d:A=%d read unmapped area\n",n,a));
+		LOG(LOG_WAR,("YM2612 #%d:A=%d read unmapped area\n",F2612->OPN.ST.index,a));
 		return FM_STATUS_FLAG(&F2612->OPN.ST);
 	}
 	return 0;
 }
 
-int YM2612TimerOver(int n,int c)
+int YM2612TimerOver(void *chip,int c)
 {
-	YM2612 *F2612 = &(FM2612[n]);
+	YM2612 *F2612 = (YM2612 *)chip;
 
 	if( c )
 	{	/* Timer B */
@@ -2666,7 +2641,7 @@ int YM2612TimerOver(int n,int c)
 	}
 	else
 	{	/* Timer A */
-		YM2612UpdateReq(n);
+		YM2612UpdateReq(chip);
 		/* timer update */
 		TimerAOver( &(F2612->OPN.ST) );
 		/* CSM mode key,TL controll */
@@ -2679,17 +2654,17 @@ int YM2612TimerOver(int n,int c)
 }
 
 /* Implemented by zamaz for dgen */
-void YM2612_dump(int num, uint8_t buf[512])
+void YM2612_dump(void *chip, uint8_t buf[512])
 {
-	YM2612 *F2612 = &(FM2612[num]);
+	YM2612 *F2612 = (YM2612 *)chip;
 
 	memcpy(buf, F2612->REGS, 512);
 }
 
 /* Implemented by zamaz for dgen */
-void YM2612_restore(int num, uint8_t buf[512])
+void YM2612_restore(void *chip, uint8_t buf[512])
 {
-	YM2612 *F2612 = &(FM2612[num]);
+	YM2612 *F2612 = (YM2612 *)chip;
 	unsigned int r;
 
 	memcpy(F2612->REGS, buf, 512);
@@ -2710,6 +2685,70 @@ void YM2612_restore(int num, uint8_t buf[512])
 	}
 }
 
+/* Size of the buffers used by YM2612_state_save()/YM2612_state_load(). */
+unsigned int YM2612_state_size(void)
+{
+	return (sizeof(uintptr_t) + sizeof(YM2612));
+}
+
+/* Save the complete chip state, not only registers. The state is a copy of
+   the chip structure preceded by its address, which is used to relocate
+   internal pointers when loading it into another chip. */
+void YM2612_state_save(void *chip, uint8_t *buf)
+{
+	uintptr_t base = (uintptr_t)chip;
+
+	memcpy(buf, &base, sizeof(base));
+	memcpy(&buf[sizeof(base)], chip, sizeof(YM2612));
+}
+
+static INT32 *ym2612_rebase(INT32 *ptr, uintptr_t delta)
+{
+	if (ptr == NULL)
+		return NULL;
+	return (INT32 *)((uintptr_t)ptr + delta);
+}
+
+/* Load a state saved by YM2612_state_save(). Both chips must run at the
+   same clock and rate, -1 is returned otherwise and the chip is left
+   untouched. */
+int YM2612_state_load(void *chip, const uint8_t *buf)
+{
+	YM2612 *F2612 = (YM2612 *)chip;
+	const uint8_t *from = &buf[sizeof(uintptr_t)];
+	FM_TIMERHANDLER timer_handler = F2612->OPN.ST.Timer_Handler;
+	FM_IRQHANDLER irq_handler = F2612->OPN.ST.IRQ_Handler;
+	UINT8 index = F2612->OPN.ST.index;
+	uintptr_t base;
+	uintptr_t delta;
+	int c, s;
+
+	if ((memcmp(&from[offsetof(YM2612, OPN.ST.clock)],
+		    &F2612->OPN.ST.clock, sizeof(F2612->OPN.ST.clock))) ||
+	    (memcmp(&from[offsetof(YM2612, OPN.ST.rate)],
+		    &F2612->OPN.ST.rate, sizeof(F2612->OPN.ST.rate))))
+		return -1;
+	memcpy(&base, buf, sizeof(base));
+	memcpy(F2612, from, sizeof(*F2612));
+	delta = ((uintptr_t)F2612 - base);
+	F2612->OPN.ST.index = index;
+	F2612->OPN.ST.Timer_Handler = timer_handler;
+	F2612->OPN.ST.IRQ_Handler = irq_handler;
+	F2612->OPN.P_CH = F2612->CH;
+	for (c = 0; (c != 6); ++c) {
+		FM_CH *CH = &F2612->CH[c];
+
+		for (s = 0; (s != 4); ++s)
+			CH->SLOT[s].DT = ym2612_rebase(CH->SLOT[s].DT, delta);
+		CH->connect1 = ym2612_rebase(CH->connect1, delta);
+		CH->connect2 = ym2612_rebase(CH->connect2, delta);
+		CH->connect3 = ym2612_rebase(CH->connect3, delta);
+		CH->connect4 = ym2612_rebase(CH->connect4, delta);
+		CH->mem_connect = ym2612_rebase(CH->mem_connect, delta);
+	}
+	return 0;
+}
+
 // ---------------------------------------------------------------------------
 // Everything below this line is for the debugger.
 // It can't be in debug.c because it needs the private structs defined here
@@ -2929,11 +2968,11 @@ void debug_show_ym2612_chan_regs(uint8_t regs[512], uint8_t ch)
 }
 
 #define DEBUG_MAX_CHAN				6
-void debug_show_ym2612_regs()
+void debug_show_ym2612_regs(void *chip)
 {
 	uint8_t			regs[512], chan;
 
-	YM2612_dump(0, regs);
+	YM2612_dump(chip, regs);
 
 	printf("ym2612:\n");
 	debug_show_ym2612_global_regs(regs);
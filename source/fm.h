@@ -209,19 +209,25 @@ int YM2610TimerOver(int n, int c );
 #endif /* BUILD_YM2610 */
 
 #if BUILD_YM2612
-int YM2612Init(int num, int baseclock, int rate, int mjazz,
+/* Each chip has its own state, returned by YM2612Init(). Chips don't share
+   anything but read-only tables computed by the first YM2612Init() call,
+   which therefore must not run concurrently with another one. */
+void *YM2612Init(int index, int baseclock, int rate,
                FM_TIMERHANDLER TimerHandler,FM_IRQHANDLER IRQHandler);
-void YM2612Shutdown(void);
-void YM2612ResetChip(int num);
-void YM2612UpdateOne(int num, INT16 *buffer, unsigned int length,
-		     unsigned int volume, int loud);
-
-int YM2612Write(int n, int a,unsigned char v);
-unsigned char YM2612Read(int n,int a);
-int YM2612TimerOver(int n, int c );
-
-void YM2612_dump(int num, uint8_t buf[512]);
-void YM2612_restore(int num, uint8_t buf[512]);
+void YM2612Shutdown(void *chip);
+void YM2612ResetChip(void *chip);
+void YM2612UpdateOne(void *chip, INT16 *buffer, unsigned int length,
+		     unsigned int volume, int loud, const INT32 *mix);
+
+int YM2612Write(void *chip, int a,unsigned char v);
+unsigned char YM2612Read(void *chip,int a);
+int YM2612TimerOver(void *chip, int c );
+
+void YM2612_dump(void *chip, uint8_t buf[512]);
+void YM2612_restore(void *chip, uint8_t buf[512]);
+unsigned int YM2612_state_size(void);
+void YM2612_state_save(void *chip, uint8_t *buf);
+int YM2612_state_load(void *chip, const uint8_t *buf);
 #endif /* BUILD_YM2612 */
 
 #if 0 //BUILD_YM2151
@@ -0,0 +1,581 @@
+/**
+ * Headless ("null") interface.
+ *
+ * Renders into an in-memory bitmap, keeps generated sound in a memory
+ * buffer and takes input from a demo file (-D) instead of a keyboard.
+ * Nothing is displayed, played or throttled, so frames run as fast as the
+ * host allows.
+ */
+
+#ifdef __MINGW32__
+#undef __STRICT_ANSI__
+#endif
+
+#include "platform.h"
+
+#ifndef _MSC_VER
+#include <sys/time.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <assert.h>
+#include <limits.h>
+
+#include "md.h"
+#include "rc.h"
+#include "rc-vars.h"
+#include "pd.h"
+#include "system.h"
+#include "movie.h"
+#include "shot.h"
+#include "headless.h"
+
+// Define externed variables
+struct bmap mdscr;
+unsigned char *mdpal = NULL;
+struct sndinfo sndi;
+const char *pd_options = "F:q";
+
+/// Headless emulation is never frozen.
+bool pd_freeze = false;
+
+/// Nor rewinding.
+bool pd_rewind = false;
+
+unsigned long headless_frames = 0;
+
+static struct {
+	unsigned int width; ///< 320
+	unsigned int height; ///< 224 or 240
+	unsigned int hz; ///< frame rate
+	unsigned long start; ///< pd_usecs() value at init
+	unsigned long limit; ///< stop after this many frames, 0 if unlimited
+	unsigned int quiet:1; ///< suppress messages
+	uint8_t palette[256]; ///< palette for 8bpp mode (mdpal)
+} video = {
+	320, 224, 60, 0, 0, 0, { 0 }
+};
+
+/// Sound capture buffer, overwritten from the start when full.
+static struct {
+	unsigned int rate; ///< samples rate
+	unsigned int size; ///< buffer size in samples
+	unsigned int wp; ///< write position in samples
+	unsigned int fill; ///< number of valid samples
+	int16_t *buf; ///< interleaved stereo storage
+} sound;
+
+/// Total samples written, survives pd_sound_deinit().
+static unsigned long long sound_written;
+
+/// Demo input for headless_demo_*().
+static movie demo;
+
+// Externed from main.cpp, so we can quit once the demo is over.
+extern int demo_finished;
+
+#ifdef _MSC_VER
+static double pd_milliseconds()
+{
+	double r = 0.0;
+
+	static LARGE_INTEGER initialCount = { 0 };
+	static LARGE_INTEGER perfCountFreq = { 0 };
+
+	if (!initialCount.QuadPart)
+	{
+		QueryPerformanceFrequency(&perfCountFreq);
+		QueryPerformanceCounter(&initialCount);
+	}
+
+	LARGE_INTEGER perfCount;
+	if (QueryPerformanceCounter(&perfCount))
+	{
+		r = ((double)perfCount.QuadPart - initialCount.QuadPart) / ((double)perfCountFreq.QuadPart / 1000.0);
+	}
+	else
+	{
+		r = (double)GetTickCount();
+	}
+
+	return r;
+}
+#endif
+
+/**
+ * Elapsed time in microseconds.
+ * @return Microseconds.
+ */
+unsigned long pd_usecs(void)
+{
+#ifdef _MSC_VER
+	return (unsigned long)(pd_milliseconds() * 1000.0);
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long)((tv.tv_sec * 1000000) + tv.tv_usec);
+#endif
+}
+
+/**
+ * Open a demo file for input and load its start state.
+ * @param name Demo file name, looked up like "dgen -D".
+ * @param megad Context, with the demo's ROM loaded.
+ * @return 0 on success, -1 on error.
+ */
+int headless_demo_open(const char *name, md &megad)
+{
+	FILE *file;
+
+	headless_demo_close();
+	file = dgen_fopen("demos", name, (DGEN_READ | DGEN_CURRENT));
+	if ((file == NULL) || (demo.play(file, megad))) {
+		fprintf(stderr, "headless: can't play demo file %s\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+void headless_demo_close()
+{
+	demo.close();
+}
+
+/**
+ * Number of frames left in the demo.
+ * @return Frames, ULONG_MAX if unknown, 0 if no demo is open.
+ */
+unsigned long headless_demo_length()
+{
+	if (!demo.playing())
+		return 0;
+	return demo.remaining();
+}
+
+/**
+ * Feed the next demo frame to the pads.
+ * @param megad Context.
+ * @return 0 on success, -1 if there is nothing left to read.
+ */
+int headless_demo_next(md &megad)
+{
+	if (demo.frame(megad)) {
+		headless_demo_close();
+		return -1;
+	}
+	return 0;
+}
+
+void headless_frame_limit(unsigned long frames)
+{
+	video.limit = frames;
+}
+
+const int16_t *headless_sound_buffer(unsigned int *size)
+{
+	*size = sound.size;
+	return sound.buf;
+}
+
+unsigned long long headless_sound_written()
+{
+	return sound_written;
+}
+
+uint8_t *pd_screen_filter_ptr(struct bmap &scr, uint32_t &width, uint32_t &height)
+{
+	width = video.width;
+	height = video.height;
+	return ((uint8_t *)scr.data + (scr.pitch * 8) + 16);
+}
+
+#ifdef WITH_SEGAVR
+void pd_set_swap_interval(int32_t)
+{
+}
+#endif
+
+#ifdef WITH_OPENVR
+bool pd_screen_is_opengl()
+{
+	return false;
+}
+#endif
+
+/// Screenshots are converted and written in the background.
+static shot_writer shots;
+
+/**
+ * Print the outcome of finished screenshots.
+ */
+static void screenshots_report()
+{
+	std::string name;
+	bool ok;
+
+	while (shots.done(name, ok)) {
+		if (ok)
+			pd_message("Screenshot written to %s.", name.c_str());
+		else
+			pd_message("Error while generating screenshot %s.",
+				   name.c_str());
+	}
+}
+
+/**
+ * Take a screenshot.
+ * Always raw (mdscr contents), there is no other screen to capture.
+ */
+void pd_do_screenshot(md& megad, const char *pNameSuffix)
+{
+	static unsigned int n = 0;
+	enum shot_writer::format fmt = (dgen_png_screenshots ?
+					shot_writer::SHOT_PNG :
+					shot_writer::SHOT_TGA);
+	FILE *fp;
+	char name[(sizeof(megad.romname) + 32)];
+
+	switch (mdscr.bpp) {
+	case 15:
+	case 16:
+	case 24:
+	case 32:
+		break;
+	default:
+		pd_message("Screenshots unsupported in %d bpp.", mdscr.bpp);
+		return;
+	}
+	snprintf(name, sizeof(name), "%s-%s%06u.%s",
+		 ((megad.romname[0] == '\0') ? "unknown" : megad.romname),
+		 pNameSuffix, n, shot_writer::extension(fmt));
+	// Written later by the worker thread, never reuse a name.
+	n = ((n + 1) % 1000000);
+	if ((fp = dgen_fopen("screenshots", name, DGEN_WRITE)) == NULL) {
+		pd_message("Can't open %s.", name);
+		return;
+	}
+	if (shots.write(fp, name, fmt,
+			((uint8_t *)mdscr.data + (mdscr.pitch * 8) + 16),
+			mdscr.pitch, video.width, video.height, mdscr.bpp))
+		pd_message("Error while generating screenshot %s.", name);
+}
+
+/**
+ * Headless flags help.
+ */
+void pd_help()
+{
+  printf(
+  "    -F FRAMES       Quit after FRAMES frames (0: never, default).\n"
+  "    -q              Do not print messages.\n"
+  );
+}
+
+/**
+ * Override rc variables that make no sense without a display.
+ */
+static void headless_rc()
+{
+	// Never throttle or skip frames.
+	dgen_frameskip = 0;
+	dgen_nice = 0;
+	dgen_joystick = 0;
+	// Don't let the above leak into the user's configuration.
+	dgen_autoconf = 0;
+}
+
+/**
+ * Handle rc variables
+ */
+void pd_rc()
+{
+	headless_rc();
+}
+
+/**
+ * Handle the switches.
+ * @param c Switch's value.
+ * @param optarg Switch's argument.
+ */
+void pd_option(char c, const char *optarg)
+{
+	switch (c) {
+	case 'F':
+		video.limit = strtoul(optarg, NULL, 0);
+		break;
+	case 'q':
+		video.quiet = 1;
+		break;
+	}
+}
+
+/**
+ * Set up the in-memory screen.
+ * @return 0 on success.
+ */
+static int screen_init()
+{
+	unsigned int bpp = dgen_depth;
+	unsigned int Bpp;
+
+	switch (bpp) {
+	case 8:
+	case 15:
+	case 16:
+	case 24:
+	case 32:
+		break;
+	default:
+		bpp = 32;
+		break;
+	}
+	Bpp = ((bpp + 1) / 8);
+	if ((mdscr.data == NULL) ||
+	    ((unsigned int)mdscr.bpp != bpp) ||
+	    ((unsigned int)mdscr.w != (video.width + 16)) ||
+	    ((unsigned int)mdscr.h != (video.height + 16))) {
+		mdscr.w = (video.width + 16);
+		mdscr.h = (video.height + 16);
+		mdscr.pitch = (mdscr.w * Bpp);
+		mdscr.bpp = bpp;
+		free(mdscr.data);
+		mdscr.data = (uint8_t *)calloc(mdscr.h, mdscr.pitch);
+		if (mdscr.data == NULL) {
+			memset(&mdscr, 0, sizeof(mdscr));
+			return -1;
+		}
+	}
+	if (bpp == 8) {
+		memset(video.palette, 0x00, sizeof(video.palette));
+		mdpal = video.palette;
+	}
+	else
+		mdpal = NULL;
+	return 0;
+}
+
+/**
+ * Initialize the in-memory screen.
+ * @param want_pal Nonzero for PAL mode.
+ * @param hz Requested frame rate (between 0 and 1000).
+ * @return Nonzero if successful.
+ */
+int pd_graphics_init(int, int want_pal, int hz)
+{
+	if ((hz <= 0) || (hz > 1000)) {
+		fprintf(stderr, "headless: invalid frame rate (%d)\n", hz);
+		return 0;
+	}
+	headless_rc();
+	video.hz = hz;
+	video.height = (want_pal ? 240 : 224);
+	if (screen_init()) {
+		fprintf(stderr, "headless: can't allocate screen.\n");
+		return 0;
+	}
+	fprintf(stderr, "video: %ux%u, %d bpp (headless), %uHz\n",
+		video.width, video.height, mdscr.bpp, video.hz);
+	headless_frames = 0;
+	video.start = pd_usecs();
+	return 1;
+}
+
+int pd_graphics_reinit(int want_sound, int want_pal, int hz)
+{
+	unsigned long frames = headless_frames;
+	unsigned long start = video.start;
+
+	if (!pd_graphics_init(want_sound, want_pal, hz))
+		return 0;
+	headless_frames = frames;
+	video.start = start;
+	return 1;
+}
+
+void pd_graphics_palette_update()
+{
+}
+
+void pd_graphics_update(bool)
+{
+}
+
+/**
+ * Initialize the sound capture buffer.
+ * @param freq Sound samples rate.
+ * @param[in,out] samples Minimum buffer size in samples.
+ * @return Nonzero on success.
+ */
+int pd_sound_init(long &freq, unsigned int &samples)
+{
+	pd_sound_deinit();
+	if (freq <= 0)
+		return 0;
+	sound.rate = freq;
+	sndi.len = (freq / video.hz);
+	samples += sndi.len;
+	sound.size = samples;
+	sndi.lr = (int16_t *)calloc(2, (sndi.len * sizeof(sndi.lr[0])));
+	sound.buf = (int16_t *)calloc(sound.size, (2 * sizeof(sound.buf[0])));
+	if ((sndi.lr == NULL) || (sound.buf == NULL)) {
+		fprintf(stderr, "headless: couldn't allocate sound buffers.\n");
+		pd_sound_deinit();
+		return 0;
+	}
+	fprintf(stderr, "sound: %uHz (headless), buffer: %u samples\n",
+		sound.rate, sound.size);
+	return 1;
+}
+
+void pd_sound_deinit()
+{
+	free(sound.buf);
+	memset(&sound, 0, sizeof(sound));
+	free((void *)sndi.lr);
+	sndi.lr = NULL;
+	sndi.len = 0;
+}
+
+/**
+ * Return samples read/write indices in the buffer.
+ */
+unsigned int pd_sound_rp()
+{
+	if (!sound.size)
+		return 0;
+	return (((sound.wp + sound.size) - sound.fill) % sound.size);
+}
+
+unsigned int pd_sound_wp()
+{
+	return sound.wp;
+}
+
+/**
+ * Nothing is ever played back, captured samples don't count.
+ */
+unsigned int pd_sound_fill()
+{
+	return 0;
+}
+
+/**
+ * Append contents of sndi to the capture buffer.
+ */
+void pd_sound_write()
+{
+	unsigned int len = sndi.len;
+	const int16_t *src = sndi.lr;
+
+	if ((!sound.size) || (src == NULL))
+		return;
+	sound_written += len;
+	while (len) {
+		unsigned int n = (sound.size - sound.wp);
+
+		if (n > len)
+			n = len;
+		memcpy(&sound.buf[(sound.wp * 2)], src,
+		       (n * 2 * sizeof(sound.buf[0])));
+		src += (n * 2);
+		len -= n;
+		sound.wp = ((sound.wp + n) % sound.size);
+		sound.fill += n;
+	}
+	if (sound.fill > sound.size)
+		sound.fill = sound.size;
+}
+
+/**
+ * Headless emulation never stops intentionally.
+ */
+int pd_stopped()
+{
+	return 0;
+}
+
+/**
+ * Check whether it's time to quit.
+ * Input comes from the demo played by main.cpp (-D), quit when it ends.
+ * @return 1 to keep going, 0 to quit.
+ */
+int pd_handle_events(md &)
+{
+	screenshots_report();
+	++headless_frames;
+	if ((video.limit) && (headless_frames >= video.limit))
+		return 0;
+	return (demo_finished == 0);
+}
+
+void pd_message(const char *fmt, ...)
+{
+	va_list vl;
+
+	if (video.quiet)
+		return;
+	va_start(vl, fmt);
+	vfprintf(stderr, fmt, vl);
+	va_end(vl);
+	fputc('\n', stderr);
+}
+
+void pd_clear_message()
+{
+}
+
+void pd_show_carthead(md& megad)
+{
+	struct {
+		const char *p;
+		const char *s;
+		size_t len;
+	} data[] = {
+#define CE(i, s) { i, s, sizeof(s) }
+		CE("System", megad.cart_head.system_name),
+		CE("Copyright", megad.cart_head.copyright),
+		CE("Domestic name", megad.cart_head.domestic_name),
+		CE("Overseas name", megad.cart_head.overseas_name),
+		CE("Product number", megad.cart_head.product_no),
+		CE("Memo", megad.cart_head.memo),
+		CE("Countries", megad.cart_head.countries)
+	};
+	size_t i;
+
+	for (i = 0; (i < elemof(data)); ++i) {
+		size_t j;
+
+		fprintf(stderr, "%s: ", data[i].p);
+		for (j = 0; (j < data[i].len); ++j)
+			fputc((isprint(data[i].s[j]) ? data[i].s[j] : ' '),
+			      stderr);
+		fputc('\n', stderr);
+	}
+}
+
+/* Clean up this awful mess :) */
+void pd_quit()
+{
+	unsigned long usecs = (pd_usecs() - video.start);
+
+	shots.wait();
+	screenshots_report();
+	if (usecs == 0)
+		usecs = 1;
+	fprintf(stderr,
+		"headless: %lu frames in %lu.%06lu seconds (%.2f FPS),"
+		" %llu audio samples\n",
+		headless_frames, (usecs / 1000000), (usecs % 1000000),
+		((double)headless_frames * 1000000.0 / usecs),
+		sound_written);
+	headless_demo_close();
+	pd_sound_deinit();
+	free(mdscr.data);
+	mdscr.data = NULL;
+	mdpal = NULL;
+}
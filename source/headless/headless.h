@@ -0,0 +1,37 @@
+#ifndef __HEADLESS_H__
+#define __HEADLESS_H__
+
+// Headless platform interface extensions.
+// These are only available when linking against headless/libpdheadless.a,
+// for tools that drive md::one_frame() directly (benchmarks, regressions).
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "md.h"
+
+/// Frames processed so far by pd_handle_events().
+extern unsigned long headless_frames;
+
+// Replay input from a demo file (same format as "dgen -d", see movie.h).
+// Loads its start state into megad, which must have the same ROM loaded.
+// Returns 0 on success, -1 if the file cannot be opened or played.
+int headless_demo_open(const char *name, md &megad);
+void headless_demo_close();
+// Number of frames left, ULONG_MAX if unknown, 0 without a demo.
+unsigned long headless_demo_length();
+// Load the next demo frame into megad.
+// Returns 0 on success, -1 when the demo is over (or no demo is open).
+int headless_demo_next(md &megad);
+
+// Stop pd_handle_events() after this many frames (0 means no limit).
+void headless_frame_limit(unsigned long frames);
+
+// Return the captured audio buffer (interleaved stereo, 16-bit signed) and
+// its size in samples (not bytes). Data wraps around at *size; the oldest
+// sample is at pd_sound_rp().
+const int16_t *headless_sound_buffer(unsigned int *size);
+// Total number of samples passed to pd_sound_write() since init.
+unsigned long long headless_sound_written();
+
+#endif // __HEADLESS_H__
@@ -29,6 +29,8 @@
 #include "pd-defs.h"
 #include "rc.h"
 #include "rc-vars.h"
+#include "rewind.h"
+#include "movie.h"
 
 #ifdef _MSC_VER
 #include "vcproj/DGenSDL/DGenSDL/resource.h"
@@ -44,9 +46,6 @@ extern "C" HINSTANCE SDL_Instance;
 static long dgen_mingw_detach = 1;
 #endif
 
-// Defined in ras.cpp, and set to true if the Genesis palette's changed.
-extern int pal_dirty;
-
 FILE *debug_log = NULL;
 
 // Do a demo frame, if active
@@ -56,6 +55,10 @@ enum demo_status {
 	DEMO_PLAY
 };
 
+// Set once demo playback reaches its end.
+// It is externed from your implementation, which may want to quit then.
+int demo_finished = 0;
+
 #ifdef _MSC_VER
 void usleep(LONGLONG uSec)
 {
@@ -70,32 +73,51 @@ void usleep(LONGLONG uSec)
 }
 #endif
 
-static inline void do_demo(md& megad, FILE* demo, enum demo_status* status)
+static inline void do_demo(md& megad, movie& demo)
 {
-	uint32_t pad[2];
+	bool playing = demo.playing();
 
-	switch (*status) {
-	case DEMO_OFF:
-		break;
-	case DEMO_RECORD:
-		pad[0] = h2be32(megad.pad[0]);
-		pad[1] = h2be32(megad.pad[1]);
-		fwrite(&pad, sizeof(pad), 1, demo);
-		break;
-	case DEMO_PLAY:
-		if (fread(&pad, sizeof(pad), 1, demo) == 1) {
-			megad.pad[0] = be2h32(pad[0]);
-			megad.pad[1] = be2h32(pad[1]);
-		}
-		else {
-			if (feof(demo))
-				pd_message("Demo finished.");
-			else
-				pd_message("Demo finished (read error).");
-			*status = DEMO_OFF;
+	if ((!demo.active()) || (demo.frame(megad) == 0))
+		return;
+	if (playing) {
+		if (demo.close() == 0)
+			pd_message("Demo finished.");
+		else
+			pd_message("Demo finished (read error).");
+		demo_finished = 1;
+	}
+	else {
+		demo.close();
+		pd_message("Demo recording stopped (write error).");
+	}
+}
+
+// Emulate a frame, or step back through the rewind history while the rewind
+// control is held. Not while a demo is being played or recorded.
+// Run ahead only for frames that are displayed.
+static void do_frame(md& megad, movie& demo,
+		     struct bmap* scr, unsigned char* pal, struct sndinfo* snd)
+{
+	if ((pd_rewind) && (megad.rewind != NULL) && (!demo.active())) {
+		// One snapshot per displayed frame, skipped frames are dropped
+		// so the rewind speed doesn't depend on the host.
+		if (scr != NULL) {
+			megad.rewind->step(megad);
+			// Without sound, it must not end up in WAV dumps.
+			megad.one_frame(scr, pal, NULL);
 		}
-		break;
+		// Play silence while going backwards.
+		if (snd != NULL)
+			memset(snd->lr, 0,
+			       (snd->len * 2 * sizeof(snd->lr[0])));
+		return;
 	}
+	do_demo(megad, demo);
+	megad.one_frame_runahead(scr, pal, snd,
+				 (((scr != NULL) && (dgen_runahead > 0)) ?
+				  dgen_runahead : 0));
+	if (megad.rewind != NULL)
+		megad.rewind->frame(megad);
 }
 
 // Temporary garbage can string :)
@@ -124,6 +146,11 @@ static void help()
   "    -H HZ           Use a custom frame rate.\n"
   "    -d DEMONAME     Record a demo of the game you are playing.\n"
   "    -D DEMONAME     Play back a previously recorded demo.\n"
+  "    -w WAVNAME      Write sound output to a WAV file.\n"
+#ifdef WITH_NUKEDOPN2
+  "    -W WAVNAME      Write Nuked OPN2 output at its native rate to a WAV\n"
+  "                    file.\n"
+#endif
   "    -s SLOT         Load the saved state from the given slot at startup.\n"
 #ifdef __MINGW32__
   "    -m              Do not detach from console.\n"
@@ -184,9 +211,13 @@ void md_load(md& megad)
 		pd_message(temp);
 		return;
 	}
-	megad.import_gst(load);
+	if (megad.import_gst(load) < 0)
+		snprintf(temp, sizeof(temp),
+			 "Couldn't load state from slot %d!", slot);
+	else
+		snprintf(temp, sizeof(temp), "Loaded state from slot %d.",
+			 slot);
 	fclose(load);
-	snprintf(temp, sizeof(temp), "Loaded state from slot %d.", slot);
 	pd_message(temp);
 }
 
@@ -265,9 +296,12 @@ int main(int argc, char *argv[])
   int c = 0, stop = 0, usec = 0, start_slot = -1;
   unsigned long frames, frames_old, fps;
   char *patches = NULL, *rom = NULL;
+  const char *wav = NULL, *wav_ym3438 = NULL;
   unsigned long oldclk, newclk, startclk, fpsclk;
   FILE *file = NULL;
   enum demo_status demo_status = DEMO_OFF;
+  FILE *demo_file = NULL;
+  movie demo;
   unsigned int samples;
   class md *megad;
   bool first = true;
@@ -303,7 +337,11 @@ int main(int argc, char *argv[])
 #ifdef __MINGW32__
 	   "m"
 #endif
-	   "s:hvr:n:p:R:NPH:d:D:",
+	   "s:hvr:n:p:R:NPH:d:D:w:"
+#ifdef WITH_NUKEDOPN2
+	   "W:"
+#endif
+	   ,
 	   pd_options);
 #ifdef _MSC_VER
   int optind = 0;
@@ -405,12 +443,12 @@ int main(int argc, char *argv[])
 #endif
 	case 'd':
 	  // Record demo
-	  if(file)
+	  if(demo_file)
 	    {
 	      fprintf(stderr,"main: Can't record and play at the same time!\n");
 	      break;
 	    }
-	  if(!(file = dgen_fopen("demos", optarg, DGEN_WRITE)))
+	  if(!(demo_file = dgen_fopen("demos", optarg, DGEN_WRITE)))
 	    {
 	      fprintf(stderr, "main: Can't record demo file %s!\n", optarg);
 	      break;
@@ -419,18 +457,30 @@ int main(int argc, char *argv[])
 	  break;
 	case 'D':
 	  // Play demo
-	  if(file)
+	  if(demo_file)
 	    {
 	      fprintf(stderr,"main: Can't record and play at the same time!\n");
 	      break;
 	    }
-	  if(!(file = dgen_fopen("demos", optarg, (DGEN_READ | DGEN_CURRENT))))
+	  if(!(demo_file = dgen_fopen("demos", optarg,
+				      (DGEN_READ | DGEN_CURRENT))))
 	    {
 	      fprintf(stderr, "main: Can't play demo file %s!\n", optarg);
 	      break;
 	    }
 	  demo_status = DEMO_PLAY;
+	  demo_finished = 0;
 	  break;
+	case 'w':
+	  // Capture sound
+	  wav = optarg;
+	  break;
+#ifdef WITH_NUKEDOPN2
+	case 'W':
+	  // Capture native rate YM2612 output
+	  wav_ym3438 = optarg;
+	  break;
+#endif
 	case '?': // Bad option!
 	case 'h': // A cry for help :)
 	  help();
@@ -575,6 +625,27 @@ next_rom:
 		}
 	}
 
+	// Start sound capture once the region is known.
+	if ((wav) || (wav_ym3438)) {
+		if (!dgen_sound)
+			fprintf(stderr, "main: Sound is disabled, WAV files"
+				" will be empty.\n");
+		if (megad->wav_dump_start(wav, wav_ym3438))
+			fprintf(stderr, "main: Can't write WAV file: %s\n",
+				strerror(errno));
+		// Keep capturing when loading the next ROM.
+		wav = NULL;
+		wav_ym3438 = NULL;
+	}
+
+	// Rewind history starts with each ROM.
+	if ((dgen_rewind_size > 0) &&
+	    (megad->rewind_start(((size_t)dgen_rewind_size << 20),
+				 ((dgen_rewind_interval > 0) ?
+				  dgen_rewind_interval : 1))))
+		fprintf(stderr, "main: Can't allocate %ldMiB for rewinding.\n",
+			(long)dgen_rewind_size);
+
 	// Load up save RAM
 	ram_load(*megad);
 	// If -s option was given, load the requested slot
@@ -588,6 +659,21 @@ next_rom:
 		md_load(*megad);
 	}
 
+	// Demos start from the current state, which they embed.
+	if (demo_status == DEMO_RECORD) {
+		if (demo.record(demo_file, *megad))
+			pd_message("Can't record demo.");
+	}
+	else if (demo_status == DEMO_PLAY) {
+		if (demo.play(demo_file, *megad)) {
+			pd_message("Can't play demo.");
+			demo_finished = 1;
+		}
+	}
+	// Only for the first ROM.
+	demo_status = DEMO_OFF;
+	demo_file = NULL;
+
 	// Start the timing refs
 	startclk = pd_usecs();
 	oldclk = startclk;
@@ -627,6 +713,22 @@ next_rom:
 			frames_old = frames;
 		}
 
+		if ((dgen_sound) && (dgen_sound_master) && (sndi.lr != NULL)) {
+			if (pd_freeze)
+				goto frozen;
+			// Sound is the master clock, emulate a frame as soon
+			// as there is room for it in the sound buffer.
+			oldclk = newclk;
+			if ((pd_sound_fill() + sndi.len) <= samples)
+				goto do_not_skip;
+#ifdef __BEOS__
+			snooze(1);
+#else
+			usleep(1000);
+#endif
+			goto events;
+		}
+
 		if (dgen_frameskip == 0
 #if WITH_SEGAVR
 			|| !megad->segavr_allow_frameskip()
@@ -677,14 +779,15 @@ next_rom:
 
 			// Draw frames.
 			while (frames_todo > 1) {
-				do_demo(*megad, file, &demo_status);
 				if (dgen_sound) {
 					// Skip this frame, keep sound going.
-					megad->one_frame(NULL, NULL, &sndi);
+					do_frame(*megad, demo,
+						 NULL, NULL, &sndi);
 					pd_sound_write();
 				}
 				else
-					megad->one_frame(NULL, NULL, NULL);
+					do_frame(*megad, demo,
+						 NULL, NULL, NULL);
 				--frames_todo;
 				stop |= (pd_handle_events(*megad) ^ 1);
 			}
@@ -693,17 +796,18 @@ next_rom:
 #ifdef WITH_OPENVR
 			megad->openvr_get_poses();
 #endif
-			do_demo(*megad, file, &demo_status);
 			if (dgen_sound) {
-				megad->one_frame(&mdscr, mdpal, &sndi);
+				do_frame(*megad, demo,
+					 &mdscr, mdpal, &sndi);
 				pd_sound_write();
 			}
 			else
-				megad->one_frame(&mdscr, mdpal, NULL);
+				do_frame(*megad, demo,
+					 &mdscr, mdpal, NULL);
 		frozen:
-			if ((mdpal) && (pal_dirty)) {
+			if ((mdpal) && (megad->vdp.pal_dirty)) {
 				pd_graphics_palette_update();
-				pal_dirty = 0;
+				megad->vdp.pal_dirty = 0;
 			}
 
 #ifdef WITH_OPENVR
@@ -735,6 +839,7 @@ next_rom:
 			++frames;
 		}
 
+	events:
 		stop |= (pd_handle_events(*megad) ^ 1);
 #ifdef WITH_SEGAVR
 		megad->segavr_apply_hmd_movement();
@@ -770,10 +875,7 @@ next_rom:
 		md_save(*megad);
 	}
 	megad->unplug();
-	if (file) {
-		fclose(file);
-		file = NULL;
-	}
+	demo.close();
 	if ((++optind) < argc) {
 		rom = argv[optind];
 		stop = 0;
@@ -781,6 +883,8 @@ next_rom:
 	}
 clean_up:
 	// Cleanup
+	if (demo_file)
+		fclose(demo_file);
 	delete megad;
 	pd_sound_deinit();
 	pd_quit();
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <mutex>
 #ifdef HAVE_MEMCPY_H
 #include "memcpy.h"
 #endif
@@ -15,6 +16,7 @@
 #include "rc-vars.h"
 #include "debug.h"
 #include "decode.h"
+#include "rewind.h"
 
 extern FILE *debug_log;
 
@@ -316,6 +318,7 @@ int md::reset()
 	openvr_init();
 #endif
   if (debug_log) fprintf (debug_log,"reset()\n");
+  ++resets;
 
     aoo3_toggle=aoo5_toggle=aoo3_six=aoo5_six
     =aoo3_six_timeout=aoo5_six_timeout
@@ -556,21 +559,22 @@ void md::z80_reset()
  */
 bool md::init_sound()
 {
-	if (lock == false)
-		return false;
+	unsigned int i;
+
 #ifdef WITH_NUKEDOPN2
 	if (dgen_ym_chipimpl == YM_CHIPIMPL_NUKEDOPN2)
 	{
 		OPN2_SetChipType(ym3438_mode_ym2612);
-		OPN2_Reset(&opn2);
-		ym3438_sample[0] = ym3438_sample[1] = ym3438_sample_prev[0] = ym3438_sample_prev[1] = ym3438_cycles = ym3438_frame_ptr = ym3438_frame_cycles = 0;
-		memset(ym3438_frame_buffer, 0, sizeof(ym3438_frame_buffer));
+		ym3438_reset();
 	}
 	else
 	{
 #endif
 		if (ok_ym2612) {
-			YM2612Shutdown();
+			for (i = 0; (i != elemof(ym2612)); ++i) {
+				YM2612Shutdown(ym2612[i]);
+				ym2612[i] = NULL;
+			}
 			ok_ym2612 = false;
 		}
 #ifdef WITH_NUKEDOPN2
@@ -585,24 +589,28 @@ bool md::init_sound()
 #ifdef WITH_NUKEDOPN2
 	if (dgen_ym_chipimpl == YM_CHIPIMPL_NUKEDOPN2)
 	{
-		OPN2_Reset(&opn2);
-		ym3438_sample[0] = ym3438_sample[1] = ym3438_sample_prev[0] = ym3438_sample_prev[1] = ym3438_cycles = ym3438_frame_ptr = ym3438_frame_cycles = 0;
-		memset(ym3438_frame_buffer, 0, sizeof(ym3438_frame_buffer));
+		ym3438_reset();
 	}
 	else
 	{
 #endif
-		// Initialize two additional chips when MJazz is enabled.
-		if (YM2612Init((dgen_mjazz ? 3 : 1),
-				   (((pal) ? PAL_MCLK : NTSC_MCLK) / 7),
-				   dgen_soundrate, dgen_mjazz, NULL, NULL))
-			return false;
-		ok_ym2612 = true;
+		// Initialize two additional chips when MJazz is enabled, each
+		// one running at twice the rate of the previous one.
+		for (i = 0; (i != (dgen_mjazz ? 3u : 1u)); ++i) {
+			ym2612[i] = YM2612Init(i,
+					       (((pal) ?
+						 PAL_MCLK : NTSC_MCLK) / 7),
+					       (dgen_soundrate << i),
+					       NULL, NULL);
+			if (ym2612[i] == NULL)
+				return false;
+			ok_ym2612 = true;
+		}
 #ifdef WITH_NUKEDOPN2
 	}
 #endif
 
-	if (SN76496_init(0,
+	if (SN76496_init(&sn76496,
 			 (((pal) ? PAL_MCLK : NTSC_MCLK) / 15),
 			 dgen_soundrate, 16))
 		return false;
@@ -610,6 +618,27 @@ bool md::init_sound()
 	return true;
 }
 
+/**
+ * Reinitialise sound, keeping the current state of sound chip registers.
+ * @return True when successful.
+ */
+bool md::reinit_sound()
+{
+	uint8_t ym2612_buf[512];
+	uint8_t sn76496_buf[16];
+	bool fm = ok_ym2612;
+
+	if (fm)
+		YM2612_dump(ym2612[0], ym2612_buf);
+	SN76496_dump(&sn76496, sn76496_buf);
+	if (init_sound() == false)
+		return false;
+	SN76496_restore(&sn76496, sn76496_buf);
+	if ((fm) && (ok_ym2612))
+		YM2612_restore(ym2612[0], ym2612_buf);
+	return true;
+}
+
 /**
  * Switch to PAL or NTSC.
  * This method's name is a bit misleading.  This switches to PAL or not
@@ -647,8 +676,6 @@ void md::init_pal()
 	}
 }
 
-bool md::lock = false;
-
 #ifdef WITH_OPENVR
 SOVRInterface *md::spCurrentOVRI = NULL;
 #endif
@@ -685,11 +712,18 @@ md::md(bool pal, char region):
 #endif
 	pal(pal), ok_ym2612(false), ok_sn76496(false),
 	vdp(*this), region(region), plugged(false), romCopy(NULL)
+#ifdef WITH_NUKEDOPN2
+	, ym3438_worker(NULL)
+#endif
+	, dac_resampler(1)
 {
-	// Only one MD object is allowed to exist at once.
-	if (lock)
-		return;
-	lock = true;
+	// CPU and sound cores compute tables shared by all instances the
+	// first time they are initialized, create MD objects one at a time.
+	static std::mutex init_lock;
+	std::lock_guard<std::mutex> guard(init_lock);
+
+	memset(ym2612, 0, sizeof(ym2612));
+	memset(&sn76496, 0, sizeof(sn76496));
 
 	// PAL or NTSC.
 	init_pal();
@@ -713,6 +747,17 @@ md::md(bool pal, char region):
 	vgm_dump_dac_samples = 0;
 	vgm_dump = false;
 #endif
+	wav_dump = NULL;
+	wav_dump_ym3438 = NULL;
+	rewind = NULL;
+	runahead_state = NULL;
+	runahead_size = 0;
+	resets = 0;
+
+#ifdef WITH_PROFILE
+	prof_enabled = false;
+	prof_reset();
+#endif
 
 #ifdef WITH_PICO
 	pico_enabled = false;
@@ -796,6 +841,7 @@ md::md(bool pal, char region):
   z80ram[0x10006] = 0x00;
   z80ram[0x10007] = 0x00;
 
+	m68k_page_map();
 #ifdef WITH_MUSA
 	md_set_musa(1);
 	musa_memory_map();
@@ -928,13 +974,11 @@ md::md(bool pal, char region):
 	return;
 cleanup:
 #ifdef WITH_NUKEDOPN2
-	OPN2_Reset(&opn2);
-	ym3438_sample[0] = ym3438_sample[1] = ym3438_sample_prev[0] = ym3438_sample_prev[1] = ym3438_cycles = ym3438_frame_ptr = ym3438_frame_cycles = 0;
-	memset(ym3438_frame_buffer, 0, sizeof(ym3438_frame_buffer));
+	ym3438_reset();
 #endif
 
-	if (ok_ym2612)
-		YM2612Shutdown();
+	for (unsigned int i = 0; (i != elemof(ym2612)); ++i)
+		YM2612Shutdown(ym2612[i]);
 	if (ok_sn76496)
 		(void)0;
 #ifdef WITH_MUSA
@@ -949,14 +993,19 @@ cleanup:
 #endif
 	free(mem);
 	memset(this, 0, sizeof(*this));
-	lock = false;
 }
 
 md::~md()
 {
+#ifdef WITH_NUKEDOPN2
+	ym3438_thread_stop();
+#endif
 #ifdef WITH_VGMDUMP
 	vgm_dump_stop();
 #endif
+	wav_dump_stop();
+	rewind_stop();
+	free(runahead_state);
 
 	assert(rom != NULL);
 	if (rom != no_rom)
@@ -988,18 +1037,15 @@ md::~md()
 #endif
 
 #ifdef WITH_NUKEDOPN2
-	OPN2_Reset(&opn2);
-	ym3438_sample[0] = ym3438_sample[1] = ym3438_sample_prev[0] = ym3438_sample_prev[1] = ym3438_cycles = ym3438_frame_ptr = ym3438_frame_cycles = 0;
-	memset(ym3438_frame_buffer, 0, sizeof(ym3438_frame_buffer));
+	ym3438_reset();
 #endif
 
-	if (ok_ym2612)
-		YM2612Shutdown();
+	for (unsigned int i = 0; (i != elemof(ym2612)); ++i)
+		YM2612Shutdown(ym2612[i]);
 	if (ok_sn76496)
 		(void)0;
 	ok=0;
 	memset(this, 0, sizeof(*this));
-	lock = false;
 }
 
 #ifdef ROM_BYTESWAP
@@ -1031,6 +1077,9 @@ int md::plug_in(unsigned char *cart,int len)
     free(romCopy);
     romCopy = NULL;
   }
+  // History of the previous cartridge is useless
+  if (rewind != NULL)
+    rewind->clear();
   // Plug in the cartridge specified by the uchar *
   // NB - The megadrive will free() it if unplug() is called, or it exits
   // So it must be a single piece of malloced data
@@ -1076,6 +1125,7 @@ int md::plug_in(unsigned char *cart,int len)
       save_start = save_len = 0;
       saveram = NULL;
     }
+	m68k_page_map();
 #ifdef WITH_MUSA
 	md_set_musa(1);
 	musa_memory_map();
@@ -1155,6 +1205,7 @@ int md::unplug()
   free(saveram);
   saveram = NULL;
   save_start = save_len = 0;
+	m68k_page_map();
 #ifdef WITH_MUSA
 	md_set_musa(1);
 	musa_memory_map();
@@ -1436,6 +1487,15 @@ void md::fix_rom_checksum()
   if (romlen>=0x190) { rom[ROM_ADDR(0x18e)]=cs>>8; rom[ROM_ADDR(0x18f)]=cs&255; }
 }
 
+/**
+ * Calculate the ROM checksum, regardless of the one stored in its header.
+ * @return Checksum.
+ */
+unsigned short md::rom_checksum()
+{
+  return calculate_checksum(rom,romlen);
+}
+
 /**
  * This is the default ROM, used when nothing is loaded.
  */
@@ -66,6 +66,7 @@ extern "C" {
 
 #include "sn76496.h"
 #include "system.h"
+#include "resample.h"
 
 #include <cmath>
 
@@ -188,23 +189,28 @@ private:
   int dma_len();
   int dma_addr();
   unsigned char dma_mem_read(int addr);
+  int dma_vram_copy(int addr, int len);
   int putword(unsigned short d);
   int putbyte(unsigned char d);
   // Used by draw_scanline to render the different display components
-  void draw_tile1(int which, int line, unsigned char *where);
-  void draw_tile1_solid(int which, int line, unsigned char *where);
-  void draw_tile2(int which, int line, unsigned char *where);
-  void draw_tile2_solid(int which, int line, unsigned char *where);
-  void draw_tile3(int which, int line, unsigned char *where);
-  void draw_tile3_solid(int which, int line, unsigned char *where);
-  void draw_tile4(int which, int line, unsigned char *where);
-  void draw_tile4_solid(int which, int line, unsigned char *where);
+  void draw_tile(int which, int line, uint16_t *where);
+  void draw_tile_solid(int which, int line, uint16_t *where);
+  void draw_line(uint8_t *out);
+  inline const uint8_t *get_tile_line(int which, int line, unsigned &tile);
+  void tile_cache_update();
+  // Tile lines decoded to one palette index per byte, for each 4 bytes of
+  // VRAM, as is ([0]) and x flipped ([1]).
+  uint8_t tile_cache[(0x10000 / 4)][2][8];
+  uint8_t tile_scratch[8];
   void draw_window(int line, int front);
   void draw_sprites(int line, bool front);
   void draw_plane_back0(int line);
   void draw_plane_back1(int line);
   void draw_plane_front0(int line);
   void draw_plane_front1(int line);
+#ifdef WITH_DEBUG_VDP
+  void draw_sprites_boxing(int line);
+#endif
   struct sprite_info {
     uint8_t* sprite; // sprite location
     uint32_t* tile; // array of tiles (th * tw)
@@ -219,18 +225,60 @@ private:
     unsigned int xflip:1; // X-flipped
     unsigned int yflip:1; // Y-flipped
   };
+  struct sprite_mask_area {
+    int x0, y0; // top left corner in sprite_mask (inclusive)
+    int x1, y1; // bottom right corner in sprite_mask (exclusive)
+  };
+  struct sprite_mask_entry {
+    struct sprite_info info; // decoded entry, coordinates in sprite_mask
+    struct sprite_mask_area area; // region possibly touched by this sprite
+    uint8_t sat[8]; // copy of the SAT entry (link field cleared)
+    uint8_t mode; // reg[12] bits used to decode it
+    bool used; // whether this sprite is part of the overlap mask
+  };
+  enum sprite_mask_op {
+    SPRITE_MASK_DRAW, // merge sprite into sprite_mask/sprite_mask_top
+    SPRITE_MASK_TEST // check for dots from higher index sprites
+  };
   inline void get_sprite_info(struct sprite_info&, int);
-  inline void sprite_mask_add(uint8_t*, int, struct sprite_info&, int);
+  inline bool sprite_mask_add(struct sprite_info&, int, enum sprite_mask_op);
+  bool sprite_mask_ref_add(uint8_t (*)[512], struct sprite_info&, int);
+  bool sprite_mask_stale(struct sprite_info&);
   // Working variables for the above
   unsigned char sprite_order[0x101], *sprite_base;
+  // Lowest index of a sprite with a dot at each location (0xff for none).
   uint8_t sprite_mask[512][512];
+  // Highest index + 1 of a sprite with a dot at each location (0 for none).
+  uint8_t sprite_mask_top[512][512];
+  // State of each sprite slot when sprite_mask was last updated.
+  struct sprite_mask_entry sprite_mask_cache[80];
+  // VRAM changes (dirt[0x00-0x1f]) not yet seen by sprite_mask_generate().
+  uint8_t sprite_mask_dirt[0x20];
+  bool sprite_mask_collision;
   int sprite_count;
+  // Decoded sprite_order entries, up to the frame limit (sprite_list_end).
+  struct sprite_info sprite_list[80];
+  int sprite_list_end;
+  // Indices in sprite_list of sprites found on each line.
+  uint8_t sprite_lines[256][80];
+  uint8_t sprite_lines_count[256];
+  // reg[12] bits used by sprite_lines_generate(), -1 when out of date.
+  int sprite_lines_mode;
   int masking_sprite_index_cache;
   int dots_cache;
   unsigned int Bpp;
   unsigned int Bpp_times8;
   struct bmap *bmap;
-  unsigned char *dest;
+  // Scanline being composited, one entry per dot (see ras.cpp), with room
+  // for tiles partially drawn past both edges. dest points to x = 0.
+  uint16_t line_buf[(8 + 320 + 16)];
+  uint16_t *dest;
+  // Shadow operator added to low priority dots, if any.
+  uint16_t line_shadow;
+  // Whether shadow/highlight mode is being rendered on this line.
+  bool line_sh;
+  // Output color for each line_buf entry, built from highpal.
+  uint32_t line_lut[0x80];
   md& belongs;
 public:
   md_vdp(md&);
@@ -246,9 +294,15 @@ public:
   void reset();
 
   uint32_t highpal[64];
+  // This is marked each time the palette is updated. Handy for the 8bpp
+  // implementation, so we don't waste time changing the palette
+  // unnecessarily.
+  int pal_dirty;
   // Draw a scanline
   void sprite_masking_overflow(int line);
   void sprite_mask_generate();
+  int sprite_mask_check(bool& collision);
+  void sprite_lines_generate();
   void draw_scanline(struct bmap *bits, int line);
   void draw_pixel(struct bmap *bits, int x, int y, uint32_t rgb);
   void write_reg(uint8_t addr, uint8_t data);
@@ -382,7 +436,8 @@ public:
 	}
 
 #ifdef WITH_MUSA
-	static class md* md_musa;
+	// Musashi keeps its state per thread, so does its current owner.
+	static thread_local class md* md_musa;
 	unsigned int md_musa_ref;
 	class md* md_musa_prev;
 
@@ -448,11 +503,11 @@ public:
 	unsigned int vblank(); // Return first vblank line
 
 private:
-	static bool lock; // Prevent other MD objects
-
 	unsigned int ok: 1;
 	unsigned int ok_ym2612: 1; // YM2612
 	unsigned int ok_sn76496: 1; // SN76496
+	void *ym2612[3]; // YM2612 state, three chips with MJazz
+	struct SN76496 sn76496; // SN76496 state
 
   unsigned int romlen;
   unsigned char *mem,*rom,*ram,*z80ram;
@@ -467,8 +522,9 @@ public:
   z80_state_t z80_state;
 #ifdef WITH_NUKEDOPN2
   ym3438_t opn2;
+  static const int skOpn2CycleRatio = 42;
   static const int skYm3438CyclesPerSample = 24;
-  static const int skYm3438FrameSampleCount = 1080 * 2 * skYm3438CyclesPerSample;
+  static const int skYm3438FrameSampleCount = 1080 * 2;
   int16_t ym3438_accm[skYm3438CyclesPerSample][2];
   int16_t ym3438_frame_buffer[skYm3438FrameSampleCount];
   int ym3438_frame_ptr;
@@ -476,7 +532,24 @@ public:
   int ym3438_sample[2];
   int ym3438_sample_prev[2];
   int ym3438_cycles;
+  resampler ym3438_resampler; // ym3438_frame_buffer to output rate
   void ym3438_update_buffer(int cycles);
+  void ym3438_clock(int cycles);
+  void ym3438_reset();
+  void ym3438_frame_start();
+  // Worker thread clocking opn2 (bool_ym_thread), NULL when not running.
+  // While it runs, opn2 and the ym3438_* variables above belong to it
+  // unless ym3438_thread_sync() has been called since the last event.
+  struct ym3438_worker *ym3438_worker;
+  void ym3438_thread_start();
+  void ym3438_thread_stop();
+  void ym3438_thread_sync();
+  void ym3438_thread_push(uint8_t type, unsigned int cycles,
+			  uint8_t port = 0, uint8_t value = 0);
+  void ym3438_thread_flush(unsigned int cycles);
+  uint8_t ym3438_thread_read(int port);
+  void ym3438_thread_progress();
+  static void ym3438_thread_main(md *md);
 #endif
   void m68k_state_dump();
   void m68k_state_restore();
@@ -543,6 +616,7 @@ private:
   unsigned char  calculate_coo9();
   int may_want_to_get_pic(struct bmap *bm,unsigned char retpal[256],int mark);
   int may_want_to_get_sound(struct sndinfo *sndi);
+  void skip_sound();
 
 	// Horizontal counter table
 	uint8_t hc_table[512][2];
@@ -565,6 +639,7 @@ private:
 	 // Number of microseconds spent in current frame
 	unsigned int frame_usecs();
 	unsigned int current_cycles();
+	unsigned int current_cycles_min();
 
   int fm_timer_callback();
   int myfm_read(int a);
@@ -575,18 +650,53 @@ private:
   int fm_ticker[4];
   signed short fm_reg[2][0x100]; // All of them (-1 = not def'd yet)
 
-	uint8_t dac_data[0x400];
+	// DAC output changes during the current frame, in order, with their
+	// current_cycles() timestamps. Rendered by may_want_to_get_sound().
+	struct dac_event {
+		unsigned int cycles;
+		int16_t level;
+	} dac_events[0x800];
 	unsigned int dac_len;
+	int16_t dac_level; // output level when the frame started
+	uint8_t dac_data; // last value written to register 0x2a
 	bool dac_enabled;
+	resampler dac_resampler; // rendered DAC to output rate (mono)
+	static const unsigned int dac_grid = 0x400; // rendered steps per frame
 	void dac_init();
 	void dac_submit(uint8_t d);
 	void dac_enable(uint8_t d);
+	void dac_set_level(int16_t level);
+	void dac_render(int16_t *out, unsigned int frame_cycles);
 
   uint8_t m68k_ROM_read(uint32_t a);
   uint8_t m68k_IO_read(uint32_t a);
   uint8_t m68k_VDP_read(uint32_t a);
   void m68k_ROM_write(uint32_t, uint8_t);
   void m68k_IO_write(uint32_t, uint8_t);
+	uint8_t m68k_empty_read(uint32_t a);
+	void m68k_empty_write(uint32_t a, uint8_t d);
+	uint16_t m68k_IO_readword(uint32_t a);
+	void m68k_IO_writeword(uint32_t a, uint16_t d);
+	uint16_t m68k_VDP_readword(uint32_t a);
+	void m68k_VDP_write(uint32_t a, uint8_t d);
+	void m68k_VDP_writeword(uint32_t a, uint16_t d);
+#ifdef WITH_PICO
+	uint8_t m68k_pico_read(uint32_t a);
+#endif
+
+	// M68K memory map, one entry per 64KB page (address >> 16).
+	// Direct pointers are used when not NULL, handlers otherwise.
+	// Missing word handlers are emulated with two byte accesses.
+	struct m68k_page {
+		uint8_t *read; // Page contents for reads
+		uint8_t *write; // Page contents for writes
+		unsigned int swab; // 1 if contents are byte-swapped
+		uint8_t (md::*readbyte)(uint32_t a);
+		uint16_t (md::*readword)(uint32_t a);
+		void (md::*writebyte)(uint32_t a, uint8_t d);
+		void (md::*writeword)(uint32_t a, uint16_t d);
+	} m68k_pages[0x100];
+	void m68k_page_map(); // Rebuild m68k_pages[]
 
 
 public:
@@ -605,6 +715,43 @@ public:
 	void vgm_dump_frame();
 #endif
 
+	// Sound capture to WAV files (see wav.h), fed by
+	// may_want_to_get_sound(). Streams are NULL when not captured.
+	class wav_writer *wav_dump; // final mix at the output rate
+	class wav_writer *wav_dump_ym3438; // Nuked OPN2 at its native rate
+	int wav_dump_start(const char *name, const char *ym3438_name);
+	int wav_dump_stop();
+
+#ifdef WITH_PROFILE
+	// Host time spent in the various parts of one_frame(), in
+	// prof_now() ticks. Only accounted while prof_enabled is true.
+	enum prof_section {
+		PROF_OTHER, // Anything not covered below
+		PROF_M68K, // m68k_run()
+		PROF_Z80, // z80_run(), z80_sync()
+		PROF_VDP, // md_vdp::draw_scanline()
+		PROF_SOUND, // may_want_to_get_sound(), Nuked OPN2 updates
+		PROF_TOTAL
+	};
+	uint64_t prof_ticks[PROF_TOTAL];
+	bool prof_enabled;
+	static uint64_t prof_now();
+	void prof_reset();
+	enum prof_section prof_switch(enum prof_section to);
+private:
+	enum prof_section prof_current;
+	uint64_t prof_since;
+public:
+#define MD_PROF_ENTER(s) \
+	enum md::prof_section prof_prev = \
+		(prof_enabled ? prof_switch(md::s) : md::PROF_OTHER)
+#define MD_PROF_LEAVE() \
+	(prof_enabled ? (void)prof_switch(prof_prev) : (void)0)
+#else
+#define MD_PROF_ENTER(s) (void)0
+#define MD_PROF_LEAVE() (void)0
+#endif
+
   // public struct, full with data from the cartridge header
   struct _carthead_ {
     char system_name[0x10];           // "SEGA GENESIS    ", "SEGA MEGA DRIVE  "
@@ -628,6 +775,13 @@ public:
   char region; // Emulator region.
   uint8_t region_guess();
   int one_frame(struct bmap *bm,unsigned char retpal[256],struct sndinfo *sndi);
+  // Run-ahead, hides the game's own input latency (see mdfr.cpp).
+  int one_frame_runahead(struct bmap *bm, unsigned char retpal[256],
+			 struct sndinfo *sndi, unsigned int frames);
+private:
+  uint8_t *runahead_state; // md::save_state() buffer
+  size_t runahead_size;
+public:
   void pad_update();
   int pad[2];
   uint8_t pad_com[2];
@@ -645,16 +799,20 @@ public:
   ~md();
   void init_pal();
   bool init_sound();
+  bool reinit_sound();
   int plug_in(unsigned char *cart,int len);
   int unplug();
   int load(const char *name);
 
   int reset();
+  // Number of reset() calls so far, to notice them from outside.
+  unsigned int resets;
 
 	uint8_t misc_readbyte(uint32_t a);
 	void misc_writebyte(uint32_t a, uint8_t d);
 	uint16_t misc_readword(uint32_t a);
 	void misc_writeword(uint32_t a, uint16_t d);
+	const uint8_t *misc_readpage(uint32_t a, unsigned int &swab);
 
 	void z80_init();
 	void z80_reset();
@@ -701,6 +859,27 @@ public:
 #endif
   int import_gst(FILE *hand);
   int export_gst(FILE *hand);
+  // In-memory save states (see save.cpp), a GST image followed by
+  // extensions that restore the emulated state exactly.
+  static const size_t gst_size = 0x22478;
+  size_t save_state(uint8_t *buf, size_t cap);
+  // load_state() errors, and warnings when the state was loaded anyway.
+  enum {
+    STATE_ERR_HEADER = -1, // not a GST image
+    STATE_ERR_SYSTEM = -2, // not from a Genesis/Mega Drive
+    STATE_WARN_EMULATOR = 1, // not made by DGen/SDL
+    STATE_WARN_VERSION = 2 // unknown version
+  };
+  int load_state(const uint8_t *buf, size_t len);
+  static const char *load_state_message(int ret);
+  // Rewind history made of save states (see rewind.h), NULL when disabled.
+  class rewind_ring *rewind;
+  int rewind_start(size_t size, unsigned int interval);
+  void rewind_stop();
+private:
+  size_t state_ext_save(uint8_t *ext);
+  void state_ext_load(const uint8_t *buf, size_t len);
+public:
 
   char romname[256];
 
@@ -711,6 +890,9 @@ public:
 
   // Fix ROM checksum
   void fix_rom_checksum();
+  // Calculate it without changing anything
+  unsigned short rom_checksum();
+  unsigned int rom_size() const { return romlen; }
 
   // List of patches currently applied.
   struct patch_elem {
@@ -860,6 +1042,7 @@ public:
   void segavr_cleanup();
   void segavr_register_vblank();
   void segavr_begin_scan();
+  void segavr_end_scan();
   bool segavr_allow_frameskip();
   bool segavr_steal_frame(bmap *pFrame);
   void segavr_set_hmd_movement(const uint32_t axis, const float amount);
@@ -868,6 +1051,7 @@ public:
   bool segavr_catch_io_write(uint32_t a, uint8_t d);
   bool segavr_catch_io_read(uint8_t &valueOut, uint32_t a);
   void segavr_headsmack();
+  bool segavr_headsmack_pending();
   float bgr_to_mono(const uint8_t *pBgr);
   int32_t mHmdThRwMask;
   int32_t mHmdRequestBit;
@@ -877,6 +1061,10 @@ public:
   uint32_t mHmdEncoded;
   int32_t mHmdVblankCounter;
   uint32_t mHmdFlags;
+  // mHmdFlags and mHmdVblankCounter after the last displayed frame, which
+  // one_frame_runahead() doesn't restore along with the rest of the state.
+  uint32_t mHmdShownFlags;
+  int32_t mHmdShownVblankCounter;
   int32_t mStereoShotCount;
   bmap *mpEyeMap;
   float *mpLightnessTable;
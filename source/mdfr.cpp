@@ -17,14 +17,26 @@
 #include "md.h"
 #include "debug.h"
 #include "rc-vars.h"
-#ifdef WITH_NUKEDOPN2
+#include "wav.h"
 #include <algorithm>
+#ifdef WITH_PROFILE
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define PROF_RDTSC
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#define PROF_RDTSC
+#elif defined(_MSC_VER)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 #endif
 
 // Set and unset contexts (Musashi, StarScream, MZ80)
 
 #ifdef WITH_MUSA
-class md* md::md_musa(0);
+thread_local class md* md::md_musa(0);
 
 bool md::md_set_musa(bool set)
 {
@@ -494,7 +506,7 @@ void md::md_set(bool set)
 // Return PC data.
 unsigned int md::m68k_read_pc()
 {
-	static bool rec = false;
+	static thread_local bool rec = false;
 	unsigned int pc;
 
 	// Forbid recursion.
@@ -553,6 +565,51 @@ int md::m68k_odo()
 	return odo.m68k;
 }
 
+#ifdef WITH_PROFILE
+
+// Return a monotonic timestamp for profiling purposes. Its unit is
+// unspecified (TSC ticks when available), only ratios are meaningful.
+uint64_t md::prof_now()
+{
+#if defined(PROF_RDTSC)
+	return __rdtsc();
+#elif defined(_MSC_VER)
+	LARGE_INTEGER count;
+
+	QueryPerformanceCounter(&count);
+	return count.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+#endif
+}
+
+// Clear accumulated profiling data.
+void md::prof_reset()
+{
+	memset(prof_ticks, 0, sizeof(prof_ticks));
+	prof_current = PROF_OTHER;
+	prof_since = prof_now();
+}
+
+// Charge elapsed time to the current section and switch to another one.
+// Returns the previous section so callers can restore it when done, which
+// keeps nested sections (e.g. z80_sync() called from m68k_run()) exclusive.
+enum md::prof_section md::prof_switch(enum prof_section to)
+{
+	uint64_t now = prof_now();
+	enum prof_section prev = prof_current;
+
+	prof_ticks[prev] += (now - prof_since);
+	prof_since = now;
+	prof_current = to;
+	return prev;
+}
+
+#endif // WITH_PROFILE
+
 // Run M68K to odo.m68k_max
 void md::m68k_run()
 {
@@ -566,6 +623,7 @@ void md::m68k_run()
 	if (cycles <= 0)
 		return;
 
+	MD_PROF_ENTER(PROF_M68K);
 	m68k_st_running = 1;
 #ifdef WITH_DEBUGGER
 	if (debug_trap)
@@ -620,6 +678,7 @@ void md::m68k_run()
 cpu_stalled:
 #endif
 	m68k_st_running = 0;
+	MD_PROF_LEAVE();
 }
 
 // Issue BUSREQ
@@ -755,6 +814,7 @@ void md::z80_run()
 
 	if (cycles <= 0)
 		return;
+	MD_PROF_ENTER(PROF_Z80);
 	z80_st_running = 1;
 #ifdef WITH_DEBUGGER
 	if (debug_trap)
@@ -826,6 +886,7 @@ void md::z80_run()
 cpu_stalled:
 #endif
 	z80_st_running = 0;
+	MD_PROF_LEAVE();
 }
 
 // Synchronize Z80 with M68K, don't execute code if fake is nonzero
@@ -843,6 +904,7 @@ void md::z80_sync(int fake)
 	cycles -= odo.z80;
 	if (cycles <= 0)
 		return;
+	MD_PROF_ENTER(PROF_Z80);
 	z80_st_running = 1;
 #ifdef WITH_DEBUGGER
 	if (debug_trap)
@@ -914,6 +976,7 @@ void md::z80_sync(int fake)
 cpu_stalled:
 #endif
 	z80_st_running = 0;
+	MD_PROF_LEAVE();
 }
 
 // Trigger Z80 IRQ
@@ -1006,6 +1069,20 @@ unsigned int md::current_cycles()
 	return m68k_odo() * m68kd;
 }
 
+// Lowest value current_cycles() may return from now on, during this frame.
+unsigned int md::current_cycles_min()
+{
+#ifdef WITH_SEGAVR
+	const int m68kd = (dgen_segavr_m68k_cyclediv) ? dgen_segavr_m68k_cyclediv : 7;
+	const int z80d = (dgen_segavr_z80_cyclediv) ? dgen_segavr_z80_cyclediv : 15;
+#else
+	const int m68kd = 7;
+	const int z80d = 15;
+#endif
+	// Both odometers only go forward until the next frame.
+	return std::min<unsigned int>((z80_odo() * z80d), (m68k_odo() * m68kd));
+}
+
 // Return first line of vblank
 unsigned int md::vblank()
 {
@@ -1058,7 +1135,7 @@ int md::one_frame(struct bmap *bm, unsigned char retpal[256],
 	// Reset odometers
 	memset(&odo, 0, sizeof(odo));
 #ifdef WITH_NUKEDOPN2
-	ym3438_frame_cycles = 0;
+	ym3438_frame_start();
 #endif
 	// Reset FM tickers
 	fm_ticker[1] = 0;
@@ -1195,10 +1272,64 @@ int md::one_frame(struct bmap *bm, unsigned char retpal[256],
 	// Fill the sound buffers
 	if (sndi)
 		may_want_to_get_sound(sndi);
+	else
+		skip_sound();
 	fm_timer_callback();
 	md_set(0);
 #ifdef WITH_VGMDUMP
 	vgm_dump_frame();
+#endif
+#ifdef WITH_SEGAVR
+	if (bm != NULL)
+		segavr_end_scan();
+#endif
+	return 0;
+}
+
+/**
+ * Emulate a frame, then keep going for a number of frames with the same
+ * pad input to display the last one, and restore the state reached after
+ * the first frame. Games usually react to input a few frames late, this
+ * shows that reaction right away at the cost of emulating the extra frames
+ * (without sound) and a save_state()/load_state() pair.
+ * @param bm Same as one_frame().
+ * @param retpal Same as one_frame().
+ * @param sndi Same as one_frame(), only the first frame is heard.
+ * @param frames Number of frames to run ahead, 0 is the same as one_frame().
+ * @return Same as one_frame().
+ */
+int md::one_frame_runahead(struct bmap *bm, unsigned char retpal[256],
+			   struct sndinfo *sndi, unsigned int frames)
+{
+	size_t size;
+	unsigned int i;
+#ifdef WITH_VGMDUMP
+	bool vgm = vgm_dump;
+#endif
+
+	if (frames == 0)
+		return one_frame(bm, retpal, sndi);
+	size = save_state(NULL, 0);
+	if (size > runahead_size) {
+		uint8_t *tmp = (uint8_t *)realloc(runahead_state, size);
+
+		if (tmp == NULL)
+			return one_frame(bm, retpal, sndi);
+		runahead_state = tmp;
+		runahead_size = size;
+	}
+	one_frame(NULL, NULL, sndi);
+	save_state(runahead_state, size);
+	// Nothing emulated from now on really happened.
+#ifdef WITH_VGMDUMP
+	vgm_dump = false;
+#endif
+	for (i = 1; (i != frames); ++i)
+		one_frame(NULL, NULL, NULL);
+	one_frame(bm, retpal, NULL);
+	load_state(runahead_state, size);
+#ifdef WITH_VGMDUMP
+	vgm_dump = vgm;
 #endif
 	return 0;
 }
@@ -1258,8 +1389,6 @@ uint8_t md::calculate_coo9()
 }
 
 #ifdef WITH_NUKEDOPN2
-static const int skOpn2CycleRatio = 42;
-
 void md::ym3438_update_buffer(int cycles)
 {
 	if (cycles <= ym3438_frame_cycles)
@@ -1267,6 +1396,19 @@ void md::ym3438_update_buffer(int cycles)
 		return;
 	}
 
+	MD_PROF_ENTER(PROF_SOUND);
+	ym3438_clock(cycles);
+	MD_PROF_LEAVE();
+}
+
+// Same as ym3438_update_buffer() without profiling, for the worker thread.
+void md::ym3438_clock(int cycles)
+{
+	if (cycles <= ym3438_frame_cycles)
+	{
+		return;
+	}
+
 	int sampleCount = (cycles - ym3438_frame_cycles + skOpn2CycleRatio - 1) / skOpn2CycleRatio;
 	ym3438_frame_cycles += sampleCount * skOpn2CycleRatio;
 
@@ -1283,15 +1425,16 @@ void md::ym3438_update_buffer(int cycles)
 				ym3438_sample[0] += ym3438_accm[accSampleIndex][0];
 				ym3438_sample[1] += ym3438_accm[accSampleIndex][1];
 			}
-		}
 
-		assert(ym3438_frame_ptr < skYm3438FrameSampleCount);
-		if (ym3438_frame_ptr < skYm3438FrameSampleCount)
-		{
-			const int l = std::max<int>(std::min<int>(ym3438_sample[0] * 11, 32767), -32768);
-			const int r = std::max<int>(std::min<int>(ym3438_sample[1] * 11, 32767), -32768);
-			ym3438_frame_buffer[ym3438_frame_ptr++] = l;
-			ym3438_frame_buffer[ym3438_frame_ptr++] = r;
+			// One output sample every skYm3438CyclesPerSample clocks
+			assert(ym3438_frame_ptr < skYm3438FrameSampleCount);
+			if (ym3438_frame_ptr < skYm3438FrameSampleCount)
+			{
+				const int l = std::max<int>(std::min<int>(ym3438_sample[0] * 11, 32767), -32768);
+				const int r = std::max<int>(std::min<int>(ym3438_sample[1] * 11, 32767), -32768);
+				ym3438_frame_buffer[ym3438_frame_ptr++] = l;
+				ym3438_frame_buffer[ym3438_frame_ptr++] = r;
+			}
 		}
 	}
 }
@@ -1305,17 +1448,15 @@ inline int md::may_want_to_get_pic(struct bmap *bm,unsigned char retpal[256],int
 {
   if (bm==NULL) return 0;
 
-  if (ras>=0 && (unsigned int)ras<vblank())
+  if (ras>=0 && (unsigned int)ras<vblank()) {
+    MD_PROF_ENTER(PROF_VDP);
     vdp.draw_scanline(bm, ras);
+    MD_PROF_LEAVE();
+  }
   if(retpal && ras == 100) get_md_palette(retpal, vdp.cram);
   return 0;
 }
 
-static inline float lerp_samples(const float sample0, const float sample1, const float f)
-{
-	return sample0 * f + (1.0f - f) * sample1;
-}
-
 static inline int16_t fm_sample_processing(int32_t &prevSample, int32_t sample)
 {
 	//re-create some of the logic from YM2612UpdateOne
@@ -1334,186 +1475,129 @@ static inline int16_t fm_sample_processing(int32_t &prevSample, int32_t sample)
 	return (int16_t)sample;
 }
 
-template<typename T>
-static void sample_into_buffer(struct sndinfo *sndi, int32_t *pSamplePrev, const T *pSamples, const int sampleCount)
+// Output samples resampled at once, sizes the intermediate buffers.
+static const unsigned int skResampleChunk = 256;
+
+static void sample_into_buffer(struct sndinfo *sndi, const unsigned int done, const unsigned int count, const int32_t *pMix, resampler &rs, int32_t *pSamplePrev, const int16_t *pSamples, const unsigned int sampleCount)
 {
-	//do some crappy linear interpolation. at some point, implement something like http://www.slack.net/~ant/bl-synth/
-	const float step = 1.0f / sndi->len;
-	float currentTime = 0.0f;
-	const int maxSampleIndex = (sampleCount << 1) - 4;
-	for (unsigned int sampleIndex = 0; sampleIndex < sndi->len; ++sampleIndex)
+	//band-limited resampling of one chunk, mixed with the mono PSG and DAC output
+	int32_t resampled[skResampleChunk * 2];
+	const unsigned int i0 = (unsigned int)(((uint64_t)sampleCount * done) / sndi->len);
+	const unsigned int i1 = (unsigned int)(((uint64_t)sampleCount * (done + count)) / sndi->len);
+	rs.process(&pSamples[i0 << 1], (i1 - i0), resampled, count);
+	for (unsigned int sampleIndex = 0; sampleIndex < count; ++sampleIndex)
 	{
-		const float sourceFraction = currentTime * sampleCount;
-		const int i0 = std::min<int>((int)sourceFraction << 1, maxSampleIndex);
-		const T lSample0 = pSamples[i0];
-		const T rSample0 = pSamples[i0 + 1];
-		const float f = sourceFraction - floorf(sourceFraction);
-
-		T lLerpSample, rLerpSample;
-		if (f <= 0.0f || i0 == maxSampleIndex)
-		{
-			lLerpSample = lSample0;
-			rLerpSample = rSample0;
-		}
-		else
-		{
-			const T lSample1 = pSamples[i0 + 2];
-			const T rSample1 = pSamples[i0 + 3];
-			lLerpSample = (T)lerp_samples(lSample0, lSample1, f);
-			rLerpSample = (T)lerp_samples(rSample0, rSample1, f);
-		}
-
-		int16_t &lDst = sndi->lr[(sampleIndex << 1)];
-		int16_t &rDst = sndi->lr[(sampleIndex << 1) + 1];
-		lDst = fm_sample_processing(pSamplePrev[0], (int32_t)lLerpSample + lDst);
-		rDst = fm_sample_processing(pSamplePrev[1], (int32_t)rLerpSample + rDst);
-		currentTime += step;
+		sndi->lr[(done + sampleIndex) << 1] = fm_sample_processing(pSamplePrev[0], resampled[(sampleIndex << 1)] + pMix[sampleIndex]);
+		sndi->lr[((done + sampleIndex) << 1) + 1] = fm_sample_processing(pSamplePrev[1], resampled[(sampleIndex << 1) + 1] + pMix[sampleIndex]);
 	}
 }
 
-//#define _DEBUG_FM_DUMP
-#ifdef _DEBUG_FM_DUMP
-typedef struct waveFileFmt_s
-{
-	uint32_t	id;
-	uint32_t	size;
-	uint16_t	format;
-	uint16_t	channels;
-	uint32_t	sampleRate;
-	uint32_t	byteRate;
-	uint16_t	blockAlign;
-	uint16_t	bps;
-} waveFileFmt_t;
-typedef struct waveFileData_s
-{
-	uint32_t	id;
-	uint32_t	size;
-} waveFileData_t;
-typedef struct waveFile_s
-{
-	uint32_t		id;
-	uint32_t		chunkSize;
-	uint32_t		format;
-	waveFileFmt_t	fmt;
-	waveFileData_t	data;
-} waveFile_t;
-
-int gDebugDumpFrames = 0; //non-static so the compiler doesn't strip it out (meant to be poked from a debugger)
-static FILE *gpDebugDumpFile = NULL;
-static FILE *open_debug_wave(const char *pPath, const int frequency)
+// Complete a frame nobody listens to. Sound chips are brought up to date
+// the same way as may_want_to_get_sound() but their output is dropped.
+void md::skip_sound()
 {
-	FILE *pFile = fopen(pPath, "wb");
-	if (!pFile)
-	{
-		return NULL;
+	MD_PROF_ENTER(PROF_SOUND);
+	if (dac_len) {
+		dac_level = dac_events[(dac_len - 1)].level;
+		dac_len = 0;
+	}
+#ifdef WITH_NUKEDOPN2
+	if (dgen_ym_chipimpl == YM_CHIPIMPL_NUKEDOPN2) {
+		if (ym3438_worker != NULL)
+			ym3438_thread_flush(current_cycles());
+		else
+			ym3438_update_buffer(current_cycles());
+		ym3438_frame_ptr = 0;
 	}
-
-	int dataSize = 0; //will fix up after the file's finished writing
-	waveFile_t w;
-	memset(&w, 0, sizeof(w));
-	w.id = 0x46464952;
-	w.chunkSize = dataSize + sizeof(waveFile_t) - 8;
-	w.format = 0x45564157;
-	w.fmt.id = 0x20746D66;
-	w.fmt.size = 16;
-	w.fmt.format = 1; //linear pcm
-	w.fmt.channels = 2;
-	w.fmt.sampleRate = frequency;
-	w.fmt.bps = 16;
-	w.fmt.byteRate = w.fmt.sampleRate * w.fmt.channels * w.fmt.bps / 8;
-	w.fmt.blockAlign = w.fmt.channels * w.fmt.bps / 8;
-	w.data.id = 0x61746164;
-	w.data.size = dataSize;
-
-	fwrite(&w, sizeof(w), 1, pFile);
-	return pFile;
-}
 #endif
+	MD_PROF_LEAVE();
+}
 
 int md::may_want_to_get_sound(struct sndinfo *sndi)
 {
   extern intptr_t dgen_volume;
-  unsigned int i, len = sndi->len;
-
-  // Get the PSG
-  SN76496Update_16_2(0, sndi->lr, len);
-
-	if (dac_len) {
-		unsigned int ratio = ((sndi->len << 10) / elemof(dac_data));
-
-		// Stretch the DAC to fit the real length.
-		for (i = 0; (i != sndi->len); ++i) {
-			unsigned int index = ((i << 10) / ratio);
-			uint16_t data;
-
-			if (index >= dac_len)
-				data = dac_data[dac_len - 1];
-			else
-				data = dac_data[index];
-			data = ((data - 0x80) << 6);
-			sndi->lr[i << 1] += data;
-			sndi->lr[(i << 1) ^ 1] += data;
-		}
-		// Clear the DAC for next frame.
-		dac_len = 0;
-#ifndef NDEBUG
-		memset(dac_data, 0xff, sizeof(dac_data));
+  unsigned int i, n, len = sndi->len;
+  int16_t dac[dac_grid];
+  bool dac_on = ((dac_len) || (dac_level));
+#ifdef WITH_NUKEDOPN2
+  bool nuked = (dgen_ym_chipimpl == YM_CHIPIMPL_NUKEDOPN2);
 #endif
-	}
+  MD_PROF_ENTER(PROF_SOUND);
+
+	// Place DAC writes where they happened during the frame.
+	if (dac_on)
+		dac_render(dac, current_cycles());
+	else
+		dac_resampler.reset();
 
 #ifdef WITH_NUKEDOPN2
-	if (dgen_ym_chipimpl == YM_CHIPIMPL_NUKEDOPN2)
+	if (nuked)
 	{
-		ym3438_update_buffer(current_cycles());
-		if (ym3438_frame_ptr > 0)
-		{
-#ifdef _DEBUG_FM_DUMP //dump the raw data at native frequency for offline testing and sampling
-			if (gDebugDumpFrames > 0)
-			{
-				if (!gpDebugDumpFile)
-				{
-					const int frequency = ((pal) ? PAL_MCLK : NTSC_MCLK) / skOpn2CycleRatio;
-					gpDebugDumpFile = open_debug_wave("d:\\other\\_fmdump.wav", frequency);
-				}
-
-				if (gpDebugDumpFile)
-				{
-					fwrite(ym3438_frame_buffer, sizeof(int16_t) * ym3438_frame_ptr, 1, gpDebugDumpFile);
+		if (ym3438_worker != NULL)
+			ym3438_thread_flush(current_cycles());
+		else
+			ym3438_update_buffer(current_cycles());
+		// Native rate capture, before resampling.
+		if ((wav_dump_ym3438 != NULL) && (ym3438_frame_ptr > 0))
+			wav_dump_ym3438->write(ym3438_frame_buffer,
+					       (ym3438_frame_ptr >> 1));
+	}
+#endif
+
+	// Mix one chunk at a time. PSG and DAC are mono, they add up at full
+	// precision before the FM stage adds its stereo output, applies the
+	// volume and clips.
+	for (i = 0; (i < len); i += n) {
+		int32_t mix[skResampleChunk];
+		int16_t *lr = &sndi->lr[(i << 1)];
+		unsigned int j;
+
+		n = std::min<unsigned int>((len - i), skResampleChunk);
+		SN76496Update(&sn76496, mix, n);
+		if (dac_on) {
+			int32_t resampled[skResampleChunk];
+			unsigned int i0 = ((elemof(dac) * i) / len);
+			unsigned int i1 = ((elemof(dac) * (i + n)) / len);
+
+			// Resample the DAC to fit the real length.
+			dac_resampler.process(&dac[i0], (i1 - i0), resampled, n);
+			for (j = 0; (j != n); ++j)
+				mix[j] += resampled[j];
+		}
+#ifdef WITH_NUKEDOPN2
+		if (nuked) {
+			if (ym3438_frame_ptr > 0)
+				sample_into_buffer(sndi, i, n, mix,
+						   ym3438_resampler,
+						   ym3438_sample_prev,
+						   ym3438_frame_buffer,
+						   (ym3438_frame_ptr >> 1));
+			else
+				// No FM output, same volume and clipping.
+				for (j = 0; (j != n); ++j) {
+					lr[(j << 1)] = fm_sample_processing
+						(ym3438_sample_prev[0], mix[j]);
+					lr[((j << 1) + 1)] =
+						fm_sample_processing
+						(ym3438_sample_prev[1], mix[j]);
 				}
-				--gDebugDumpFrames;
-			}
-			else if (gpDebugDumpFile)
-			{
-				//fix the sizes up
-				const int finalSize = ftell(gpDebugDumpFile);
-				const int dataSize = finalSize - sizeof(waveFile_t);
-				const int chunkSize = sizeof(waveFile_t) - 8;
-				fseek(gpDebugDumpFile, offsetof(waveFile_t, chunkSize), SEEK_SET);
-				fwrite(&chunkSize, sizeof(int), 1, gpDebugDumpFile);
-				fseek(gpDebugDumpFile, sizeof(waveFile_t) - 4, SEEK_SET);
-				fwrite(&dataSize, sizeof(int), 1, gpDebugDumpFile);
-
-				fclose(gpDebugDumpFile);
-				gpDebugDumpFile = NULL;
-			}
-#endif
-
-			sample_into_buffer(sndi, ym3438_sample_prev, ym3438_frame_buffer, ym3438_frame_ptr >> 1);
-			ym3438_frame_ptr = 0;
+			continue;
 		}
-	}
-	else
-	{
 #endif
-		// Add in the stereo FM buffer
-		YM2612UpdateOne(0, sndi->lr, len, dgen_volume, 1);
+		// Add in the stereo FM output.
+		YM2612UpdateOne(ym2612[0], lr, n, dgen_volume, 1, mix);
 		if (dgen_mjazz) {
-			YM2612UpdateOne(1, sndi->lr, len, dgen_volume, 0);
-			YM2612UpdateOne(2, sndi->lr, len, dgen_volume, 0);
+			YM2612UpdateOne(ym2612[1], lr, n, dgen_volume, 0, NULL);
+			YM2612UpdateOne(ym2612[2], lr, n, dgen_volume, 0, NULL);
 		}
-#ifdef WITH_NUKEDOPN2
 	}
+#ifdef WITH_NUKEDOPN2
+	if (nuked)
+		ym3438_frame_ptr = 0;
 #endif
+	if (wav_dump != NULL)
+		wav_dump->write(sndi->lr, len);
+  MD_PROF_LEAVE();
   return 0;
 }
 
@@ -246,73 +246,182 @@ uint8_t md::m68k_VDP_read(uint32_t a)
 	return 0; /* invalid address */
 }
 
-/**
- * Read a byte from the m68Ks ram.
- * @param a Address to read.
- */
-uint8_t md::misc_readbyte(uint32_t a)
+uint16_t md::m68k_IO_readword(uint32_t a)
 {
-	/* clip to 24-bit */
-	a &= 0x00ffffff;
-	/* 0x000000-0x7fffff: ROM */
-	if (a <= M68K_ROM_END) {
-		return m68k_ROM_read(a);
+	uint16_t ret;
+
+	/* BUSREQ */
+	if ((a & 0xffff00) == 0xa11100)
+		return ((!z80_st_busreq << 8) | (m68k_read_pc() & 0xfeff));
+	/* RESET */
+	if ((a & 0xffff00) == 0xa11200)
+		return m68k_read_pc();
+	ret = (misc_readbyte(a) << 8);
+	ret |= misc_readbyte(a + 1);
+	return ret;
+}
+
+uint16_t md::m68k_VDP_readword(uint32_t a)
+{
+	uint16_t ret;
+
+	a &= 0xe700ff;
+	if (a < 0xc00004) {
+		if (a & 0x01)
+			return 0;
+		vdp.cmd_pending = false;
+		return vdp.readword();
 	}
+	if (a < 0xc00008) {
+		if (a & 0x01)
+			return 0;
+		return (((coo4 & 0xff) << 8) | (coo5 & 0xff));
+	}
+	if (a == 0xc00008) {
+		if (a & 0x01)
+			return 0;
+		return ((calculate_coo8() << 8) |
+			(calculate_coo9() & 0xff));
+	}
+	ret = (m68k_VDP_read(a) << 8);
+	ret |= m68k_VDP_read(a + 1);
+	return ret;
+}
+
+uint8_t md::m68k_empty_read(uint32_t a)
+{
+	/*
+	 * http://cgfm2.emuviews.com/txt/gen-hw.txt
+	 * see section 1 point 3 for what these addresses do.
+	 */
+	(void)a;
+	return 0;
+}
+
 #ifdef WITH_PICO
+uint8_t md::m68k_pico_read(uint32_t a)
+{
 	/* 0x800000-0x80001f: Sega Pico I/O area */
-	if ((pico_enabled) &&
-	    ((a >= 0x800000) && (a <= 0x80001f))) {
-		a &= 0x1f;
-		switch(a) {
-		case 1: // Version register
-			switch (region) {
-			case 'J': // Japan
-				return 0;
-			case 'E': // Europe
-				return 32;
-			case 'U': // USA
-				return 64;
-			}
+	if (a > 0x80001f)
+		return 0;
+	a &= 0x1f;
+	switch(a) {
+	case 1: // Version register
+		switch (region) {
+		case 'J': // Japan
 			return 0;
-		case 3: // Pico pad
-			return pad[0];
-		case 5: // MSB of X coordinate for pen
-			return pico_pen_coords[0] >> 8;
-		case 7: // LSB of X coordinate for pen
-			return pico_pen_coords[0] & 0xff;
-		case 9: // MSB of Y coordinate for pen
-			return pico_pen_coords[1] >> 8;
-		case 0xB: // LSB of Y coordinate for pen
-			return pico_pen_coords[1] & 0xff;
+		case 'E': // Europe
+			return 32;
+		case 'U': // USA
+			return 64;
 		}
+		return 0;
+	case 3: // Pico pad
+		return pad[0];
+	case 5: // MSB of X coordinate for pen
+		return pico_pen_coords[0] >> 8;
+	case 7: // LSB of X coordinate for pen
+		return pico_pen_coords[0] & 0xff;
+	case 9: // MSB of Y coordinate for pen
+		return pico_pen_coords[1] >> 8;
+	case 0xB: // LSB of Y coordinate for pen
+		return pico_pen_coords[1] & 0xff;
 	}
 	/* 0x800020-0xafffff: Sega Pico empty area */
-	if ((pico_enabled) &&
-	    (a <= M68K_IO_END))
-		return 0;
+	return 0;
+}
 #endif
-	/* 0x800000-0x9fffff: empty area */
-	if (a <= M68K_EMPTY1_END) {
-		/*
-		 * http://cgfm2.emuviews.com/txt/gen-hw.txt
-		 * see section 1 point 3 for what these addresses do.
-		 */
-		return 0;
+
+/**
+ * Rebuild the M68K memory map after ROM or save RAM changes.
+ */
+void md::m68k_page_map()
+{
+	static const struct m68k_page empty = {
+		NULL, NULL, 0,
+		&md::m68k_empty_read, NULL,
+		&md::m68k_empty_write, NULL
+	};
+	static const struct m68k_page io = {
+		NULL, NULL, 0,
+		&md::m68k_IO_read, &md::m68k_IO_readword,
+		&md::m68k_IO_write, &md::m68k_IO_writeword
+	};
+	static const struct m68k_page vdp = {
+		NULL, NULL, 0,
+		&md::m68k_VDP_read, &md::m68k_VDP_readword,
+		&md::m68k_VDP_write, &md::m68k_VDP_writeword
+	};
+	unsigned int i;
+
+	/* 0x000000-0x7fffff: ROM */
+	for (i = 0; (i <= (M68K_ROM_END >> 16)); ++i) {
+		struct m68k_page *page = &m68k_pages[i];
+		uint32_t start = (i << 16);
+		uint32_t end = (start + 0x10000);
+
+		*page = empty;
+		page->writebyte = &md::m68k_ROM_write;
+		/* Save RAM may be switched on and off at any time. */
+		if ((save_len) &&
+		    (start < (save_start + save_len)) && (end > save_start))
+			page->readbyte = &md::m68k_ROM_read;
+		else if (end <= romlen) {
+			page->read = &rom[start];
+#ifdef ROM_BYTESWAP
+			page->swab = 1;
+#endif
+		}
+		else if (start < romlen)
+			page->readbyte = &md::m68k_ROM_read;
 	}
+	/* 0x800000-0x9fffff: empty area */
+	for (; (i <= (M68K_EMPTY1_END >> 16)); ++i)
+		m68k_pages[i] = empty;
 	/* 0xa00000-0xafffff: system I/O and control */
-	if (a <= M68K_IO_END) {
-		return m68k_IO_read(a);
-	}
+	for (; (i <= (M68K_IO_END >> 16)); ++i)
+		m68k_pages[i] = io;
 	/* 0xb00000-0xbfffff: empty area */
-	if (a <= M68K_EMPTY2_END)
-		return 0;
+	for (; (i <= (M68K_EMPTY2_END >> 16)); ++i)
+		m68k_pages[i] = empty;
 	/* 0xc00000-0xdfffff: VDP/PSG */
-	if (a <= M68K_VDP_END) {
-		return m68k_VDP_read(a);
-	}
+	for (; (i <= (M68K_VDP_END >> 16)); ++i)
+		m68k_pages[i] = vdp;
 	/* 0xe00000-0xfeffff: invalid addresses, mirror RAM */
 	/* 0xff0000-0xffffff: RAM */
-	return ram[((a ^ 1) & 0xffff)];
+	for (; (i < elemof(m68k_pages)); ++i) {
+		m68k_pages[i] = empty;
+		m68k_pages[i].read = ram;
+		m68k_pages[i].write = ram;
+		m68k_pages[i].swab = 1;
+	}
+#ifdef WITH_PICO
+	if (pico_enabled) {
+		/* 0x800000-0x80001f: Sega Pico I/O area */
+		m68k_pages[(M68K_EMPTY1_START >> 16)].readbyte =
+			&md::m68k_pico_read;
+		/* 0x800020-0xafffff: Sega Pico empty area */
+		for (i = (M68K_IO_START >> 16);
+		     (i <= (M68K_IO_END >> 16));
+		     ++i)
+			m68k_pages[i].readbyte = &md::m68k_empty_read;
+	}
+#endif
+}
+
+/**
+ * Read a byte from the m68Ks ram.
+ * @param a Address to read.
+ */
+uint8_t md::misc_readbyte(uint32_t a)
+{
+	const struct m68k_page &page = m68k_pages[((a >> 16) & 0xff)];
+
+	/* clip to 24-bit */
+	a &= 0x00ffffff;
+	if (page.read != NULL)
+		return page.read[((a & 0xffff) ^ page.swab)];
+	return (this->*page.readbyte)(a);
 }
 
 void md::m68k_ROM_write(uint32_t a, uint8_t d)
@@ -432,46 +541,92 @@ void md::m68k_IO_write(uint32_t a, uint8_t d)
 	}
 }
 
-/**
- * write a byte to the m68Ks ram.
- * @param a Address to write.
- * @param d Date (byte) two write.
- */
-void md::misc_writebyte(uint32_t a, uint8_t d)
+void md::m68k_IO_writeword(uint32_t a, uint16_t d)
 {
-	/* clip to 24-bit */
-	a &= 0x00ffffff;
-	/* 0x000000-0x7fffff: ROM */
-	if (a <= M68K_ROM_END) {
-		m68k_ROM_write(a, d);
+	/* Z80 */
+	if (a < 0xa10000) {
+		if ((!z80_st_busreq) && (a < 0xa04000))
+			return;
+		z80_write((a & 0xffff), (d >> 8));
 		return;
 	}
-	/* 0x800000-0x9fffff: empty area */
-	if (a <= M68K_EMPTY1_END)
+	/* BUSREQ and RESET */
+	if ((a == 0xa11100) ||
+	    (a == 0xa11200)) {
+		m68k_IO_write(a, (d >> 8));
 		return;
-	/* 0xa00000-0xafffff: system I/O and control */
-	if (a <= M68K_IO_END) {
-		m68k_IO_write(a, d);
+	}
+	misc_writebyte(a, (d >> 8));
+	misc_writebyte((a + 1), (d & 0xff));
+}
+
+void md::m68k_VDP_write(uint32_t a, uint8_t d)
+{
+	a &= 0xe700ff;
+	if (a < 0xc00008) {
+		m68k_VDP_writeword(a, (d | (d << 8)));
 		return;
 	}
-	/* 0xb00000-0xbfffff: empty area */
-	if (a <= M68K_EMPTY2_END)
+	/* PSG */
+	if (a == 0xc00011)
+		mysn_write(d);
+}
+
+void md::m68k_VDP_writeword(uint32_t a, uint16_t d)
+{
+	a &= 0xe700ff;
+	if (a < 0xc00004) {
+		if (a & 0x01)
+			return;
+		vdp.writeword(d);
+		vdp.cmd_pending = false;
 		return;
-	/* 0xc00000-0xdfffff: VDP/PSG */
-	if (a < M68K_VDP_END) {
-		a &= 0xe700ff;
-		if (a < 0xc00008) {
-			misc_writeword(a, (d | (d << 8)));
+	}
+	if (a < 0xc00008) {
+		if (a & 0x01)
+			return;
+		/* second half of a command */
+		if (vdp.cmd_pending) {
+			vdp.command(d);
 			return;
 		}
-		/* PSG */
-		if (a == 0xc00011)
-			mysn_write(d);
+		/* register write */
+		if ((d & 0xc000) == 0x8000) {
+			uint8_t addr = ((d >> 8) & 0x1f);
+			vdp.write_reg(addr, d);
+			return;
+		}
+		/* first half of a command */
+		vdp.command(d);
+		vdp.cmd_pending = true;
 		return;
 	}
-	/* 0xe00000-0xfeffff: invalid addresses, mirror RAM */
-	/* 0xff0000-0xffffff: RAM */
-	ram[((a ^ 1) & 0xffff)] = d;
+	m68k_VDP_write(a, (d >> 8));
+	m68k_VDP_write((a + 1), (d & 0xff));
+}
+
+void md::m68k_empty_write(uint32_t a, uint8_t d)
+{
+	(void)a;
+	(void)d;
+}
+
+/**
+ * write a byte to the m68Ks ram.
+ * @param a Address to write.
+ * @param d Date (byte) two write.
+ */
+void md::misc_writebyte(uint32_t a, uint8_t d)
+{
+	const struct m68k_page &page = m68k_pages[((a >> 16) & 0xff)];
+
+	/* clip to 24-bit */
+	a &= 0x00ffffff;
+	if (page.write != NULL) {
+		page.write[((a & 0xffff) ^ page.swab)] = d;
+		return;
+	}
+	(this->*page.writebyte)(a, d);
 }
 
 
@@ -484,42 +639,40 @@ void md::misc_writebyte(uint32_t a, uint8_t d)
  */
 uint16_t md::misc_readword(uint32_t a)
 {
+	const struct m68k_page &page = m68k_pages[((a >> 16) & 0xff)];
 	uint16_t ret;
 
 	a &= 0x00ffffff;
-	/* BUSREQ */
-	if ((a & 0xffff00) == 0xa11100)
-		return ((!z80_st_busreq << 8) | (m68k_read_pc() & 0xfeff));
-	/* RESET */
-	if ((a & 0xffff00) == 0xa11200)
-		return m68k_read_pc();
-	/* VDP */
-	if ((a >= 0xc00000) && (a < 0xe00000)) {
-		a &= 0xe700ff;
-		if (a < 0xc00004) {
-			if (a & 0x01)
-				return 0;
-			vdp.cmd_pending = false;
-			return vdp.readword();
-		}
-		if (a < 0xc00008) {
-			if (a & 0x01)
-				return 0;
-			return (((coo4 & 0xff) << 8) | (coo5 & 0xff));
-		}
-		if (a == 0xc00008) {
-			if (a & 0x01)
-				return 0;
-			return ((calculate_coo8() << 8) |
-				(calculate_coo9() & 0xff));
-		}
+	if ((page.read != NULL) && ((a & 0x01) == 0)) {
+		const uint8_t *p = &page.read[(a & 0xffff)];
+
+		if (page.swab)
+			return ((p[1] << 8) | p[0]);
+		return ((p[0] << 8) | p[1]);
 	}
+	if (page.readword != NULL)
+		return (this->*page.readword)(a);
 	/* else pass onto readbyte */
 	ret = (misc_readbyte(a) << 8);
 	ret |= misc_readbyte(a + 1);
 	return ret;
 }
 
+/**
+ * Get the contents of the 64KB page containing an address, when they can
+ * be read directly (ROM, RAM).
+ * @param a Address in the page.
+ * @param[out] swab Set to 1 if contents are byte-swapped, 0 otherwise.
+ * @return Page contents, NULL if reads must go through misc_readbyte().
+ */
+const uint8_t *md::misc_readpage(uint32_t a, unsigned int &swab)
+{
+	const struct m68k_page &page = m68k_pages[((a >> 16) & 0xff)];
+
+	swab = page.swab;
+	return page.read;
+}
+
 /**
  * Write a word to m68k memory
  * @param a Address to write to.
@@ -527,50 +680,26 @@ uint16_t md::misc_readword(uint32_t a)
  */
 void md::misc_writeword(uint32_t a, uint16_t d)
 {
+	const struct m68k_page &page = m68k_pages[((a >> 16) & 0xff)];
+
 	a &= 0x00ffffff;
-	/* Z80 */
-	if ((a >= 0xa00000) && (a < 0xa10000)) {
-		if ((!z80_st_busreq) && (a < 0xa04000))
-			return;
-		z80_write((a & 0xffff), (d >> 8));
+	if ((page.write != NULL) && ((a & 0x01) == 0)) {
+		uint8_t *p = &page.write[(a & 0xffff)];
+
+		if (page.swab) {
+			p[0] = d;
+			p[1] = (d >> 8);
+		}
+		else {
+			p[0] = (d >> 8);
+			p[1] = d;
+		}
 		return;
 	}
-	/* BUSREQ and RESET */
-	if ((a == 0xa11100) ||
-	    (a == 0xa11200)) {
-		misc_writebyte(a, (d >> 8));
+	if (page.writeword != NULL) {
+		(this->*page.writeword)(a, d);
 		return;
 	}
-	/* VDP */
-	if ((a >= 0xc00000) && (a < 0xe00000)) {
-		a &= 0xe700ff;
-		if (a < 0xc00004) {
-			if (a & 0x01)
-				return;
-			vdp.writeword(d);
-			vdp.cmd_pending = false;
-			return;
-		}
-		if (a < 0xc00008) {
-			if (a & 0x01)
-				return;
-			/* second half of a command */
-			if (vdp.cmd_pending) {
-				vdp.command(d);
-				return;
-			}
-			/* register write */
-			if ((d & 0xc000) == 0x8000) {
-				uint8_t addr = ((d >> 8) & 0x1f);
-				vdp.write_reg(addr, d);
-				return;
-			}
-			/* first half of a command */
-			vdp.command(d);
-			vdp.cmd_pending = true;
-			return;
-		}
-	}
 	/* else pass onto writebyte */
 	misc_writebyte(a, (d >> 8));
 	misc_writebyte((a + 1), (d & 0xff));
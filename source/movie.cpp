@@ -0,0 +1,323 @@
+// Input movies, see movie.h.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include "md.h"
+#include "rc-vars.h"
+#include "system.h"
+#include "movie.h"
+
+#define MOVIE_MAGIC "DGENMOVI"
+// Size of the version 1 header and frame record.
+#define MOVIE_HEADER_SIZE 36
+#define MOVIE_FRAME_SIZE 20
+// Size of legacy frame records.
+#define MOVIE_LEGACY_FRAME_SIZE 8
+// Recorded frames are written to the file in chunks of this size.
+#define MOVIE_BUFFER_SIZE 65536
+// Start states are much smaller than this, larger ones are corrupted.
+#define MOVIE_STATE_MAX (16 << 20)
+
+static inline void put32(uint8_t *buf, uint32_t val)
+{
+	val = h2be32(val);
+	memcpy(buf, &val, sizeof(val));
+}
+
+static inline uint32_t get32(const uint8_t *buf)
+{
+	uint32_t val;
+
+	memcpy(&val, buf, sizeof(val));
+	return be2h32(val);
+}
+
+movie::movie():
+	mode(MOVIE_OFF), file(NULL), error(false), record_size(0), left(0),
+	resets(0)
+{
+	memset(&hdr, 0, sizeof(hdr));
+}
+
+movie::~movie()
+{
+	close();
+}
+
+/**
+ * Append data to the output buffer, flushing it when full.
+ * @param data Data to write.
+ * @param len Size of data.
+ */
+void movie::write(const uint8_t *data, size_t len)
+{
+	buf.insert(buf.end(), data, (data + len));
+	if (buf.size() >= MOVIE_BUFFER_SIZE)
+		flush();
+}
+
+/**
+ * Write the output buffer to the file.
+ * @return 0 on success, -1 on error.
+ */
+int movie::flush()
+{
+	if ((!error) && (!buf.empty()) &&
+	    (fwrite(buf.data(), buf.size(), 1, file) != 1))
+		error = true;
+	buf.clear();
+	return (error ? -1 : 0);
+}
+
+int movie::record(FILE *file, md& megad)
+{
+	uint8_t head[MOVIE_HEADER_SIZE];
+	std::vector<uint8_t> state;
+
+	close();
+	if (file == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	this->file = file;
+	mode = MOVIE_RECORD;
+	state.resize(megad.save_state(NULL, 0));
+	megad.save_state(state.data(), state.size());
+	hdr.version = MOVIE_VERSION;
+	hdr.rom_size = megad.rom_size();
+	hdr.rom_checksum = megad.rom_checksum();
+	hdr.cpu_emu = megad.cpu_emu;
+	hdr.z80_core = megad.z80_core;
+	hdr.ym_chipimpl = dgen_ym_chipimpl;
+	hdr.region = megad.region;
+	hdr.pal = megad.pal;
+	hdr.state_size = state.size();
+	memset(head, 0, sizeof(head));
+	memcpy(&head[0], MOVIE_MAGIC, 8);
+	put32(&head[8], hdr.version);
+	put32(&head[12], MOVIE_HEADER_SIZE);
+	put32(&head[16], MOVIE_FRAME_SIZE);
+	put32(&head[20], hdr.rom_size);
+	head[24] = (hdr.rom_checksum >> 8);
+	head[25] = hdr.rom_checksum;
+	head[26] = hdr.cpu_emu;
+	head[27] = hdr.z80_core;
+	head[28] = hdr.ym_chipimpl;
+	head[29] = hdr.region;
+	head[30] = hdr.pal;
+	put32(&head[32], hdr.state_size);
+	record_size = MOVIE_FRAME_SIZE;
+	resets = megad.resets;
+	write(head, sizeof(head));
+	write(state.data(), state.size());
+	// Fail early if the file isn't writable.
+	if (flush()) {
+		close();
+		return -1;
+	}
+	return 0;
+}
+
+int movie::play(FILE *file, md& megad)
+{
+	uint8_t head[MOVIE_HEADER_SIZE];
+	size_t header_size;
+	size_t n;
+	long pos;
+	long end;
+	int ret;
+
+	close();
+	if (file == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	this->file = file;
+	mode = MOVIE_PLAY;
+	n = fread(head, 1, 8, file);
+	if ((n != 8) || (memcmp(head, MOVIE_MAGIC, 8))) {
+		// Legacy movie, pads only.
+		if (fseek(file, 0, SEEK_SET) != 0) {
+			fprintf(stderr, "movie: unable to rewind legacy movie"
+				" file\n");
+			goto error;
+		}
+		record_size = MOVIE_LEGACY_FRAME_SIZE;
+		goto length;
+	}
+	if (fread(&head[8], (sizeof(head) - 8), 1, file) != 1) {
+		fprintf(stderr, "movie: truncated header\n");
+		goto error;
+	}
+	hdr.version = get32(&head[8]);
+	header_size = get32(&head[12]);
+	record_size = get32(&head[16]);
+	if ((hdr.version == 0) || (hdr.version > MOVIE_VERSION)) {
+		fprintf(stderr, "movie: unsupported version %lu\n",
+			(unsigned long)hdr.version);
+		goto error;
+	}
+	if ((header_size < MOVIE_HEADER_SIZE) ||
+	    (record_size < MOVIE_FRAME_SIZE)) {
+		fprintf(stderr, "movie: corrupted header\n");
+		goto error;
+	}
+	hdr.rom_size = get32(&head[20]);
+	hdr.rom_checksum = ((head[24] << 8) | head[25]);
+	hdr.cpu_emu = head[26];
+	hdr.z80_core = head[27];
+	hdr.ym_chipimpl = head[28];
+	hdr.region = head[29];
+	hdr.pal = head[30];
+	hdr.state_size = get32(&head[32]);
+	// Skip unknown header fields.
+	if ((header_size > sizeof(head)) &&
+	    (fseek(file, header_size, SEEK_SET) != 0)) {
+		fprintf(stderr, "movie: truncated header\n");
+		goto error;
+	}
+	if ((hdr.rom_size != megad.rom_size()) ||
+	    (hdr.rom_checksum != megad.rom_checksum())) {
+		fprintf(stderr,
+			"movie: recorded with another ROM (size %lu, checksum"
+			" %04x)\n",
+			(unsigned long)hdr.rom_size, hdr.rom_checksum);
+		goto error;
+	}
+	// Replaying with other cores is fine as long as they are accurate
+	// enough, which is what benchmarks and regression runs check.
+	if ((hdr.cpu_emu != megad.cpu_emu) ||
+	    (hdr.z80_core != megad.z80_core) ||
+	    (hdr.ym_chipimpl != dgen_ym_chipimpl))
+		fprintf(stderr,
+			"movie: recorded with other cores (CPU %u, Z80 %u,"
+			" YM2612 %u), playback may desync\n",
+			hdr.cpu_emu, hdr.z80_core, hdr.ym_chipimpl);
+	if ((hdr.region != megad.region) || (hdr.pal != megad.pal))
+		fprintf(stderr,
+			"movie: recorded with region %c (%s), playback may"
+			" desync\n",
+			hdr.region, (hdr.pal ? "PAL" : "NTSC"));
+	// Don't trust the state size before allocating it.
+	if ((hdr.state_size > MOVIE_STATE_MAX) ||
+	    (((pos = ftell(file)) != -1) &&
+	     (fseek(file, 0, SEEK_END) == 0) &&
+	     ((end = ftell(file)) != -1) &&
+	     (fseek(file, pos, SEEK_SET) == 0) &&
+	     (hdr.state_size > (unsigned long)(end - pos)))) {
+		fprintf(stderr, "movie: corrupted header\n");
+		goto error;
+	}
+	buf.resize(hdr.state_size);
+	if (fread(buf.data(), buf.size(), 1, file) != 1) {
+		fprintf(stderr, "movie: truncated start state\n");
+		goto error;
+	}
+	if ((ret = megad.load_state(buf.data(), buf.size())) < 0) {
+		fprintf(stderr, "movie: unable to load start state: %s\n",
+			md::load_state_message(ret));
+		goto error;
+	}
+length:
+	// Count frames when possible (not with pipes).
+	left = ULONG_MAX;
+	if (((pos = ftell(file)) != -1) &&
+	    (fseek(file, 0, SEEK_END) == 0) &&
+	    ((end = ftell(file)) != -1) &&
+	    (fseek(file, pos, SEEK_SET) == 0))
+		left = ((end - pos) / record_size);
+	resets = megad.resets;
+	return 0;
+error:
+	close();
+	return -1;
+}
+
+int movie::frame(md& megad)
+{
+	uint8_t rec[MOVIE_FRAME_SIZE];
+	uint32_t flags = 0;
+
+	switch (mode) {
+	case MOVIE_OFF:
+		return -1;
+	case MOVIE_RECORD:
+		if (megad.resets != resets) {
+			flags |= MOVIE_FRAME_RESET;
+			resets = megad.resets;
+		}
+		memset(rec, 0, sizeof(rec));
+		put32(&rec[0], megad.pad[0]);
+		put32(&rec[4], megad.pad[1]);
+#ifdef WITH_SEGAVR
+		flags |= MOVIE_FRAME_HMD;
+		if (megad.segavr_headsmack_pending())
+			flags |= MOVIE_FRAME_HEADSMACK;
+		{
+			uint32_t angle[2];
+
+			memcpy(angle, megad.mHmdAngles, sizeof(angle));
+			put32(&rec[12], angle[0]);
+			put32(&rec[16], angle[1]);
+		}
+#endif
+		put32(&rec[8], flags);
+		write(rec, sizeof(rec));
+		return (error ? -1 : 0);
+	case MOVIE_PLAY:
+		break;
+	}
+	buf.resize(record_size);
+	if ((left == 0) || (fread(buf.data(), record_size, 1, file) != 1)) {
+		if (ferror(file))
+			error = true;
+		mode = MOVIE_OFF;
+		return -1;
+	}
+	if (left != ULONG_MAX)
+		--left;
+	if (record_size >= MOVIE_FRAME_SIZE)
+		flags = get32(&buf[8]);
+	if (flags & MOVIE_FRAME_RESET)
+		megad.reset();
+	megad.pad[0] = get32(&buf[0]);
+	megad.pad[1] = get32(&buf[4]);
+#ifdef WITH_SEGAVR
+	if (flags & MOVIE_FRAME_HMD) {
+		uint32_t angle[2];
+		float angles[2];
+
+		angle[0] = get32(&buf[12]);
+		angle[1] = get32(&buf[16]);
+		memcpy(angles, angle, sizeof(angles));
+		megad.segavr_update_hmd_angles(angles);
+	}
+	if (flags & MOVIE_FRAME_HEADSMACK)
+		megad.segavr_headsmack();
+#endif
+	return 0;
+}
+
+int movie::close()
+{
+	int ret = 0;
+
+	if (file == NULL)
+		return 0;
+	if (mode == MOVIE_RECORD)
+		flush();
+	if (error)
+		ret = -1;
+	if (fclose(file))
+		ret = -1;
+	file = NULL;
+	mode = MOVIE_OFF;
+	error = false;
+	left = 0;
+	buf.clear();
+	memset(&hdr, 0, sizeof(hdr));
+	return ret;
+}
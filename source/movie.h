@@ -0,0 +1,104 @@
+#ifndef __MOVIE_H__
+#define __MOVIE_H__
+
+// Input movies ("dgen -d" / "dgen -D").
+// A movie starts with a header identifying the ROM and the emulation cores
+// it was recorded with, followed by a save state (md::save_state()) of the
+// console at the time recording started, then one record per frame with
+// everything the host fed the console before emulating it.
+//
+// All fields are big-endian:
+//
+//   offset size
+//        0    8 "DGENMOVI"
+//        8    4 version (MOVIE_VERSION)
+//       12    4 header size, the start state follows it
+//       16    4 frame record size
+//       20    4 ROM size
+//       24    2 ROM checksum (computed, not the one from its header)
+//       26    1 md::cpu_emu
+//       27    1 md::z80_core
+//       28    1 dgen_ym_chipimpl
+//       29    1 md::region
+//       30    1 md::pal
+//       31    1 reserved, 0
+//       32    4 start state size
+//
+// Frame record:
+//
+//        0    4 pad[0]
+//        4    4 pad[1]
+//        8    4 flags (MOVIE_FRAME_*)
+//       12    4 mHmdAngles[0] (IEEE 754 single)
+//       16    4 mHmdAngles[1]
+//
+// Readers must skip header and frame record bytes they don't know about.
+// Files that don't start with the magic string come from older versions,
+// they only contain pad[0] and pad[1] for each frame.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+class md;
+
+#define MOVIE_VERSION 1
+
+#define MOVIE_FRAME_RESET 0x01 // md::reset() was called before this frame
+#define MOVIE_FRAME_HEADSMACK 0x02 // md::segavr_headsmack() too
+#define MOVIE_FRAME_HMD 0x04 // HMD angles are valid
+
+class movie {
+public:
+	struct header {
+		uint32_t version;
+		uint32_t rom_size;
+		uint16_t rom_checksum;
+		uint8_t cpu_emu;
+		uint8_t z80_core;
+		uint8_t ym_chipimpl;
+		uint8_t region;
+		uint8_t pal;
+		uint32_t state_size;
+	};
+
+	movie();
+	~movie();
+	// Start recording from the current state of megad. The file is
+	// closed on error or by close().
+	int record(FILE *file, md& megad);
+	// Start playing, after loading the start state into megad. Fails if
+	// the movie was made with another ROM, only warns when cores differ.
+	// The file is closed on error or by close().
+	int play(FILE *file, md& megad);
+	// Call before emulating each frame. Stores the input about to be used
+	// when recording, replaces it when playing.
+	// Returns 0 on success, -1 once playback is over or on error.
+	int frame(md& megad);
+	// Stop, flushing what's left. Returns -1 if anything failed.
+	int close();
+	bool active() const { return (mode != MOVIE_OFF); }
+	bool recording() const { return (mode == MOVIE_RECORD); }
+	bool playing() const { return (mode == MOVIE_PLAY); }
+	// Frames left to play.
+	unsigned long remaining() const { return left; }
+	// Header of the movie being played or recorded. Legacy files
+	// have a zeroed header.
+	const struct header& info() const { return hdr; }
+
+private:
+	enum { MOVIE_OFF, MOVIE_RECORD, MOVIE_PLAY } mode;
+	FILE *file;
+	bool error;
+	struct header hdr;
+	size_t record_size; // bytes per frame in file
+	unsigned long left;
+	unsigned int resets; // last seen md::resets
+	std::vector<uint8_t> buf; // output buffer, or input record
+
+	void write(const uint8_t *data, size_t len);
+	int flush();
+};
+
+#endif // __MOVIE_H__
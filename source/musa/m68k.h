@@ -355,6 +355,12 @@ void m68k_pulse_halt(void);
 /* Get the size of the cpu context in bytes */
 unsigned int m68k_context_size(void);
 
+/* Get the size of the leading part of a cpu context that holds the CPU
+ * state (registers, flags, interrupt and prefetch state) and no pointers,
+ * which can be copied between contexts set up for the same CPU type.
+ */
+unsigned int m68k_context_state_size(void);
+
 /* Get a cpu context */
 unsigned int m68k_get_context(void* dst);
 
@@ -181,6 +181,16 @@
 #define M68K_LOG_FILEHANDLE         some_file_handle
 
 
+/* Storage class of the CPU state. Making it thread local allows several
+ * emulated CPUs to run in parallel threads, each one with its own context.
+ */
+#if defined(_MSC_VER)
+#define M68K_THREAD_LOCAL           __declspec(thread)
+#else
+#define M68K_THREAD_LOCAL           __thread
+#endif
+
+
 /* ----------------------------- COMPATIBILITY ---------------------------- */
 
 /* The following options set optimizations that violate the current ANSI
@@ -32,6 +32,7 @@ static const char* copyright_notice =
 /* ================================ INCLUDES ============================== */
 /* ======================================================================== */
 
+#include <stddef.h>
 #include "platform.h"
 
 extern void m68040_fpu_op0(void);
@@ -45,10 +46,10 @@ extern void m68040_fpu_op1(void);
 /* ================================= DATA ================================= */
 /* ======================================================================== */
 
-int  m68ki_initial_cycles;
-int  m68ki_remaining_cycles = 0;                     /* Number of clocks remaining */
-uint m68ki_tracing = 0;
-uint m68ki_address_space;
+M68K_THREAD_LOCAL int  m68ki_initial_cycles;
+M68K_THREAD_LOCAL int  m68ki_remaining_cycles = 0;   /* Number of clocks remaining */
+M68K_THREAD_LOCAL uint m68ki_tracing = 0;
+M68K_THREAD_LOCAL uint m68ki_address_space;
 
 #ifdef M68K_LOG_ENABLE
 const char* m68ki_cpu_names[] =
@@ -74,15 +75,15 @@ const char* m68ki_cpu_names[] =
 #endif /* M68K_LOG_ENABLE */
 
 /* The CPU core */
-m68ki_cpu_core m68ki_cpu;
+M68K_THREAD_LOCAL m68ki_cpu_core m68ki_cpu;
 
 #if M68K_EMULATE_ADDRESS_ERROR
-jmp_buf m68ki_aerr_trap;
+M68K_THREAD_LOCAL jmp_buf m68ki_aerr_trap;
 #endif /* M68K_EMULATE_ADDRESS_ERROR */
 
-uint    m68ki_aerr_address;
-uint    m68ki_aerr_write_mode;
-uint    m68ki_aerr_fc;
+M68K_THREAD_LOCAL uint m68ki_aerr_address;
+M68K_THREAD_LOCAL uint m68ki_aerr_write_mode;
+M68K_THREAD_LOCAL uint m68ki_aerr_fc;
 
 /* Used by shift & rotate instructions */
 uint8 m68ki_shift_8_table[65] =
@@ -512,7 +513,7 @@ static int default_instr_hook_callback(void)
 
 #if M68K_EMULATE_ADDRESS_ERROR
 	#include <setjmp.h>
-	jmp_buf m68ki_aerr_trap;
+	M68K_THREAD_LOCAL jmp_buf m68ki_aerr_trap;
 #endif /* M68K_EMULATE_ADDRESS_ERROR */
 
 
@@ -680,10 +681,44 @@ void m68k_set_instr_hook_callback(int  (*callback)(void))
 	CALLBACK_INSTR_HOOK = callback ? callback : default_instr_hook_callback;
 }
 
+#if M68K_REGISTER_MEMORY
+/* Marks pages that must be looked up in the whole m68ki_cpu.mem array. */
+m68k_mem_t m68ki_mem_partial;
+#endif
+
 void m68k_register_memory(m68k_mem_t memory[], unsigned int len)
 {
+#if M68K_REGISTER_MEMORY
+	unsigned int page;
+#endif
+
 	m68ki_cpu.mem = (void *)memory;
 	m68ki_cpu.mem_len = len;
+#if M68K_REGISTER_MEMORY
+	/* Precompute which region covers each page, the first one wins. */
+	for (page = 0; (page != M68KI_MEM_PAGES); ++page) {
+		uint start = (page << M68KI_MEM_PAGE_SHIFT);
+		uint end = (start + (1 << M68KI_MEM_PAGE_SHIFT));
+		unsigned int i;
+
+		m68ki_cpu.mem_page[page] = NULL;
+		if (memory == NULL)
+			continue;
+		for (i = 0; (i != len); ++i) {
+			m68k_mem_t *mem = &memory[i];
+
+			if ((start >= (mem->addr + mem->size)) ||
+			    (end <= mem->addr))
+				continue;
+			if ((start >= mem->addr) &&
+			    (end <= (mem->addr + mem->size)))
+				m68ki_cpu.mem_page[page] = mem;
+			else
+				m68ki_cpu.mem_page[page] = &m68ki_mem_partial;
+			break;
+		}
+	}
+#endif
 }
 
 #include <stdio.h>
@@ -969,6 +1004,11 @@ unsigned int m68k_context_size()
 	return sizeof(m68ki_cpu_core);
 }
 
+unsigned int m68k_context_state_size()
+{
+	return offsetof(m68ki_cpu_core, cyc_instruction);
+}
+
 unsigned int m68k_get_context(void* dst)
 {
 	if(dst) *(m68ki_cpu_core*)dst = m68ki_cpu;
@@ -27,6 +27,7 @@
 #define M68KCPU__HEADER
 
 #include <stdint.h>
+#include <string.h>
 #include "m68k.h"
 #include <limits.h>
 
@@ -504,7 +505,7 @@ typedef uint32 uint64;
 /* Address error */
 #if M68K_EMULATE_ADDRESS_ERROR
 	#include <setjmp.h>
-	extern jmp_buf m68ki_aerr_trap;
+	extern M68K_THREAD_LOCAL jmp_buf m68ki_aerr_trap;
 
 	#define m68ki_set_address_error_trap() \
 		if(setjmp(m68ki_aerr_trap) != 0) \
@@ -797,6 +798,10 @@ typedef union
 	double f;
 } fp_reg;
 
+/* Page size used to look up registered memory regions */
+#define M68KI_MEM_PAGE_SHIFT 16
+#define M68KI_MEM_PAGES (0x1000000 >> M68KI_MEM_PAGE_SHIFT)
+
 typedef struct
 {
 	uint cpu_type;     /* CPU Type: 68000, 68008, 68010, 68EC020, or 68020 */
@@ -850,6 +855,9 @@ typedef struct
 	/* Memory regions if defined */
 	m68k_mem_t (*mem)[];
 	unsigned int mem_len;
+	/* Region covering each 64KB page of the 24-bit address space, NULL
+	 * if none, &m68ki_mem_partial if partially covered (scan mem). */
+	m68k_mem_t *mem_page[M68KI_MEM_PAGES];
 
 	/* Callbacks to host */
 	int  (*int_ack_callback)(int int_line);           /* Interrupt Acknowledge */
@@ -865,19 +873,22 @@ typedef struct
 } m68ki_cpu_core;
 
 
-extern m68ki_cpu_core m68ki_cpu;
-extern sint           m68ki_remaining_cycles;
-extern uint           m68ki_tracing;
+extern M68K_THREAD_LOCAL m68ki_cpu_core m68ki_cpu;
+#if M68K_REGISTER_MEMORY
+extern m68k_mem_t m68ki_mem_partial;
+#endif
+extern M68K_THREAD_LOCAL sint m68ki_remaining_cycles;
+extern M68K_THREAD_LOCAL uint m68ki_tracing;
 extern uint8          m68ki_shift_8_table[];
 extern uint16         m68ki_shift_16_table[];
 extern uint           m68ki_shift_32_table[];
 extern uint8          m68ki_exception_cycle_table[][256];
-extern uint           m68ki_address_space;
+extern M68K_THREAD_LOCAL uint m68ki_address_space;
 extern uint8          m68ki_ea_idx_cycle_table[];
 
-extern uint           m68ki_aerr_address;
-extern uint           m68ki_aerr_write_mode;
-extern uint           m68ki_aerr_fc;
+extern M68K_THREAD_LOCAL uint m68ki_aerr_address;
+extern M68K_THREAD_LOCAL uint m68ki_aerr_write_mode;
+extern M68K_THREAD_LOCAL uint m68ki_aerr_fc;
 
 /* Read data immediately after the program counter */
 INLINE uint m68ki_read_imm_16(void);
@@ -1006,69 +1017,58 @@ char* m68ki_disassemble_quick(unsigned int pc, unsigned int cpu_type);
 /* ======================================================================== */
 
 
-/* ---------------------------- Read Immediate ---------------------------- */
+/* ------------------------- Direct memory access ------------------------- */
 
-/* Handles all immediate reads, does address error check, function code setting,
- * and prefetching if they are enabled in m68kconf.h
+#if M68K_REGISTER_MEMORY
+
+/* Read a 16-bit value from registered memory in a single load, swab
+ * means it is stored in host (little-endian) order instead of big-endian.
+ * Same result as assembling m[swab] and m[swab ^ 1].
  */
-INLINE uint m68ki_read_imm_16(void)
+INLINE uint m68ki_mem_16(const uint8 *m, uint swab)
 {
-	m68ki_set_fc(FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
-	m68ki_check_address_error(REG_PC, MODE_READ, FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
-#if M68K_EMULATE_PREFETCH
-	if(MASK_OUT_BELOW_2(REG_PC) != CPU_PREF_ADDR)
-	{
-		CPU_PREF_ADDR = MASK_OUT_BELOW_2(REG_PC);
-		CPU_PREF_DATA = m68k_read_immediate_32(ADDRESS_68K(CPU_PREF_ADDR));
-	}
-	REG_PC += 2;
-	return MASK_OUT_ABOVE_16(CPU_PREF_DATA >> ((2-((REG_PC-2)&2))<<3));
+	uint16 v;
+
+	memcpy(&v, m, sizeof(v));
+#ifdef WORDS_BIGENDIAN
+	if (swab)
 #else
-	REG_PC += 2;
-	return m68k_read_immediate_16(ADDRESS_68K(REG_PC-2));
-#endif /* M68K_EMULATE_PREFETCH */
+	if (!swab)
+#endif
+		v = ((v >> 8) | (v << 8));
+	return v;
 }
-INLINE uint m68ki_read_imm_32(void)
-{
-#if M68K_EMULATE_PREFETCH
-	uint temp_val;
 
-	m68ki_set_fc(FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
-	m68ki_check_address_error(REG_PC, MODE_READ, FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
-	if(MASK_OUT_BELOW_2(REG_PC) != CPU_PREF_ADDR)
-	{
-		CPU_PREF_ADDR = MASK_OUT_BELOW_2(REG_PC);
-		CPU_PREF_DATA = m68k_read_immediate_32(ADDRESS_68K(CPU_PREF_ADDR));
-	}
-	temp_val = CPU_PREF_DATA;
-	REG_PC += 2;
-	if(MASK_OUT_BELOW_2(REG_PC) != CPU_PREF_ADDR)
-	{
-		CPU_PREF_ADDR = MASK_OUT_BELOW_2(REG_PC);
-		CPU_PREF_DATA = m68k_read_immediate_32(ADDRESS_68K(CPU_PREF_ADDR));
-		temp_val = MASK_OUT_ABOVE_32((temp_val << 16) | (CPU_PREF_DATA >> 16));
-	}
-	REG_PC += 2;
+/* 32-bit version of the above, each 16-bit half is swapped separately. */
+INLINE uint m68ki_mem_32(const uint8 *m, uint swab)
+{
+	uint32 v;
 
-	return temp_val;
+	memcpy(&v, m, sizeof(v));
+#ifdef WORDS_BIGENDIAN
+	if (swab)
+		v = (((v & 0xff00ff00) >> 8) | ((v & 0x00ff00ff) << 8));
 #else
-	m68ki_set_fc(FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
-	m68ki_check_address_error(REG_PC, MODE_READ, FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
-	REG_PC += 4;
-	return m68k_read_immediate_32(ADDRESS_68K(REG_PC-4));
-#endif /* M68K_EMULATE_PREFETCH */
+	if (swab)
+		v = ((v >> 16) | (v << 16));
+	else
+		v = (((v >> 24) & 0x000000ff) | ((v >> 8) & 0x0000ff00) |
+		     ((v << 8) & 0x00ff0000) | ((v << 24) & 0xff000000));
+#endif
+	return v;
 }
 
-
-
-/* ------------------------- Top level read/write ------------------------- */
-
-#if M68K_REGISTER_MEMORY
-
 INLINE m68k_mem_t *m68ki_locate_memory(uint address)
 {
 	unsigned int i;
 
+	if (address < (M68KI_MEM_PAGES << M68KI_MEM_PAGE_SHIFT)) {
+		m68k_mem_t *mem =
+			m68ki_cpu.mem_page[(address >> M68KI_MEM_PAGE_SHIFT)];
+
+		if (mem != &m68ki_mem_partial)
+			return mem;
+	}
 	if (m68ki_cpu.mem == NULL)
 		return NULL;
 	for (i = 0; (i != m68ki_cpu.mem_len); ++i) {
@@ -1096,13 +1096,11 @@ INLINE m68k_mem_t *m68ki_locate_memory(uint address)
 	do {								\
 		m68k_mem_t *mem = m68ki_locate_memory(a);		\
 									\
-		if (mem != NULL) {					\
-			uint8 *m = &((uint8 *)mem->mem)			\
-				[(((a) - mem->addr) & mem->mask)];	\
-									\
-			return ((m[mem->swab] << 8) |			\
-				m[(mem->swab ^ 1)]);			\
-		}							\
+		if (mem != NULL)					\
+			return m68ki_mem_16(&((uint8 *)mem->mem)	\
+					    [(((a) - mem->addr) &	\
+					      mem->mask)],		\
+					    mem->swab);			\
 	}								\
 	while (0)
 
@@ -1110,15 +1108,36 @@ INLINE m68k_mem_t *m68ki_locate_memory(uint address)
 	do {								\
 		m68k_mem_t *mem = m68ki_locate_memory(a);		\
 									\
-		if (mem != NULL) {					\
-			uint8 *m = &((uint8 *)mem->mem)			\
-				[(((a) - mem->addr) & mem->mask)];	\
+		if (mem != NULL)					\
+			return m68ki_mem_32(&((uint8 *)mem->mem)	\
+					    [(((a) - mem->addr) &	\
+					      mem->mask)],		\
+					    mem->swab);			\
+	}								\
+	while (0)
+
+/* Same as above for instruction fetches, which also require mem->x. */
+#define m68ki_fetch_memory_16_direct(a)					\
+	do {								\
+		m68k_mem_t *mem = m68ki_locate_memory(a);		\
 									\
-			return ((m[mem->swab] << 24) |			\
-				(m[(mem->swab ^ 1)] << 16) |		\
-				(m[(mem->swab + 2)] << 8) |		\
-				m[((mem->swab + 2) ^ 1)]);		\
-		}							\
+		if ((mem != NULL) && (mem->x))				\
+			return m68ki_mem_16(&((uint8 *)mem->mem)	\
+					    [(((a) - mem->addr) &	\
+					      mem->mask)],		\
+					    mem->swab);			\
+	}								\
+	while (0)
+
+#define m68ki_fetch_memory_32_direct(a)					\
+	do {								\
+		m68k_mem_t *mem = m68ki_locate_memory(a);		\
+									\
+		if ((mem != NULL) && (mem->x))				\
+			return m68ki_mem_32(&((uint8 *)mem->mem)	\
+					    [(((a) - mem->addr) &	\
+					      mem->mask)],		\
+					    mem->swab);			\
 	}								\
 	while (0)
 
@@ -1172,6 +1191,8 @@ INLINE m68k_mem_t *m68ki_locate_memory(uint address)
 #define m68ki_read_memory_8_direct(a) (void)0
 #define m68ki_read_memory_16_direct(a) (void)0
 #define m68ki_read_memory_32_direct(a) (void)0
+#define m68ki_fetch_memory_16_direct(a) (void)0
+#define m68ki_fetch_memory_32_direct(a) (void)0
 
 #define m68ki_write_memory_8_direct(a, v) (void)0
 #define m68ki_write_memory_16_direct(a, v) (void)0
@@ -1179,6 +1200,66 @@ INLINE m68k_mem_t *m68ki_locate_memory(uint address)
 
 #endif /* M68K_REGISTER_MEMORY */
 
+
+/* ---------------------------- Read Immediate ---------------------------- */
+
+/* Handles all immediate reads, does address error check, function code setting,
+ * and prefetching if they are enabled in m68kconf.h
+ */
+INLINE uint m68ki_read_imm_16(void)
+{
+	m68ki_set_fc(FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
+	m68ki_check_address_error(REG_PC, MODE_READ, FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
+#if M68K_EMULATE_PREFETCH
+	if(MASK_OUT_BELOW_2(REG_PC) != CPU_PREF_ADDR)
+	{
+		CPU_PREF_ADDR = MASK_OUT_BELOW_2(REG_PC);
+		CPU_PREF_DATA = m68k_read_immediate_32(ADDRESS_68K(CPU_PREF_ADDR));
+	}
+	REG_PC += 2;
+	return MASK_OUT_ABOVE_16(CPU_PREF_DATA >> ((2-((REG_PC-2)&2))<<3));
+#else
+	REG_PC += 2;
+	m68ki_fetch_memory_16_direct(ADDRESS_68K(REG_PC-2));
+	return m68k_read_immediate_16(ADDRESS_68K(REG_PC-2));
+#endif /* M68K_EMULATE_PREFETCH */
+}
+INLINE uint m68ki_read_imm_32(void)
+{
+#if M68K_EMULATE_PREFETCH
+	uint temp_val;
+
+	m68ki_set_fc(FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
+	m68ki_check_address_error(REG_PC, MODE_READ, FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
+	if(MASK_OUT_BELOW_2(REG_PC) != CPU_PREF_ADDR)
+	{
+		CPU_PREF_ADDR = MASK_OUT_BELOW_2(REG_PC);
+		CPU_PREF_DATA = m68k_read_immediate_32(ADDRESS_68K(CPU_PREF_ADDR));
+	}
+	temp_val = CPU_PREF_DATA;
+	REG_PC += 2;
+	if(MASK_OUT_BELOW_2(REG_PC) != CPU_PREF_ADDR)
+	{
+		CPU_PREF_ADDR = MASK_OUT_BELOW_2(REG_PC);
+		CPU_PREF_DATA = m68k_read_immediate_32(ADDRESS_68K(CPU_PREF_ADDR));
+		temp_val = MASK_OUT_ABOVE_32((temp_val << 16) | (CPU_PREF_DATA >> 16));
+	}
+	REG_PC += 2;
+
+	return temp_val;
+#else
+	m68ki_set_fc(FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
+	m68ki_check_address_error(REG_PC, MODE_READ, FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
+	REG_PC += 4;
+	m68ki_fetch_memory_32_direct(ADDRESS_68K(REG_PC-4));
+	return m68k_read_immediate_32(ADDRESS_68K(REG_PC-4));
+#endif /* M68K_EMULATE_PREFETCH */
+}
+
+
+
+/* ------------------------- Top level read/write ------------------------- */
+
 /* Handles all memory accesses (except for immediate reads if they are
  * configured to use separate functions in m68kconf.h).
  * All memory accesses must go through these top level functions.
@@ -6,6 +6,21 @@
 #include <errno.h>
 #include "md.h"
 #include "rc-vars.h"
+#include "wav.h"
+#ifdef WITH_NUKEDOPN2
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Events sent to the YM3438 worker thread, in emulation order.
+enum ym3438_event_type {
+	YM3438_EV_WRITE, // clock the chip up to cycles, then write to port
+	YM3438_EV_CLOCK, // clock the chip up to cycles
+	YM3438_EV_FRAME, // new frame, cycles start over from zero
+	YM3438_EV_QUIT // terminate the thread
+};
+#endif
 
 // REMEMBER NOT TO USE ANY STATIC variables, because they
 // will exist thoughout ALL megadrives!
@@ -67,16 +82,21 @@ end:
 #ifdef WITH_NUKEDOPN2
 		if (dgen_ym_chipimpl == YM_CHIPIMPL_NUKEDOPN2)
 		{
-			ym3438_update_buffer(current_cycles());
-			OPN2_Write(&opn2, a, v);
+			if (ym3438_worker != NULL)
+				ym3438_thread_push(YM3438_EV_WRITE,
+						   current_cycles(), a, v);
+			else {
+				ym3438_update_buffer(current_cycles());
+				OPN2_Write(&opn2, a, v);
+			}
 		}
 		else
 		{
 #endif
-			YM2612Write(0, a, v);
+			YM2612Write(ym2612[0], a, v);
 			if (dgen_mjazz) {
-				YM2612Write(1, a, v);
-				YM2612Write(2, a, v);
+				YM2612Write(ym2612[1], a, v);
+				YM2612Write(ym2612[2], a, v);
 			}
 #ifdef WITH_NUKEDOPN2
 		}
@@ -91,13 +111,15 @@ int md::myfm_read(int a)
 #ifdef WITH_NUKEDOPN2
 	if (dgen_ym_chipimpl == YM_CHIPIMPL_NUKEDOPN2)
 	{
+		if (ym3438_worker != NULL)
+			return (fm_tover | (ym3438_thread_read(a) & ~0x03));
 		ym3438_update_buffer(current_cycles());
 		return fm_tover | (OPN2_Read(&opn2, (a & 3)) & ~0x03);
 	}
 	else
 	{
 #endif
-		return (fm_tover | (YM2612Read(0, (a & 3)) & ~0x03));
+		return (fm_tover | (YM2612Read(ym2612[0], (a & 3)) & ~0x03));
 #ifdef WITH_NUKEDOPN2
 	}
 #endif
@@ -108,7 +130,7 @@ int md::mysn_write(int d)
 #ifdef WITH_VGMDUMP
 	vgm_dump_sn76496(d);
 #endif
-	SN76496Write(0, d);
+	SN76496Write(&sn76496, d);
 	return 0;
 }
 
@@ -139,6 +161,10 @@ int md::fm_timer_callback()
 			fm_ticker[2] -= bmax;
 		}
 	}
+#ifdef WITH_NUKEDOPN2
+	if (ym3438_worker != NULL)
+		ym3438_thread_progress();
+#endif
 
 	return 0;
 }
@@ -152,23 +178,25 @@ void md::fm_reset()
 #ifdef WITH_NUKEDOPN2
 	if (dgen_ym_chipimpl == YM_CHIPIMPL_NUKEDOPN2)
 	{
+		ym3438_thread_sync();
 		OPN2_Reset(&opn2);
 		ym3438_sample[0] = ym3438_sample[1] = ym3438_cycles = ym3438_frame_ptr = ym3438_frame_cycles = 0;
 		memset(ym3438_frame_buffer, 0, sizeof(ym3438_frame_buffer));
+		ym3438_resampler.reset();
 	}
 	else
 	{
 #endif
-		YM2612ResetChip(0);
+		YM2612ResetChip(ym2612[0]);
 		if (dgen_mjazz) {
-			YM2612ResetChip(1);
-			YM2612ResetChip(2);
+			YM2612ResetChip(ym2612[1]);
+			YM2612ResetChip(ym2612[2]);
 		}
 #ifdef WITH_NUKEDOPN2
 	}
 #endif
 
-	SN76496_init(0,
+	SN76496_init(&sn76496,
 		     (((pal) ? PAL_MCLK : NTSC_MCLK) / 15),
 		     dgen_soundrate, 16);
 }
@@ -176,47 +204,71 @@ void md::fm_reset()
 void md::dac_init()
 {
 	dac_enabled = true;
+	dac_data = 0x80;
+	dac_level = 0;
 	dac_len = 0;
-#ifndef NDEBUG
-	memset(dac_data, 0xff, sizeof(dac_data));
-#endif
+	dac_resampler.reset();
 }
 
-static const struct {
-	unsigned int samples;
-	unsigned int usecs;
-} per_frame[2] = {
-	{ (44100 / 60), (1000000 / 60) },
-	{ (44100 / 50), (1000000 / 50) },
-};
+// Record a DAC output level change at the current time.
+void md::dac_set_level(int16_t level)
+{
+	if (dac_len == elemof(dac_events)) {
+		// Out of room, the last change now holds this level instead.
+		dac_events[(dac_len - 1)].level = level;
+		return;
+	}
+	dac_events[dac_len].cycles = current_cycles();
+	dac_events[dac_len].level = level;
+	++dac_len;
+}
 
 void md::dac_submit(uint8_t d)
 {
-	unsigned int usecs;
-	unsigned int index;
-	unsigned int i;
+	dac_data = d;
+	if (dac_enabled)
+		dac_set_level((d - 0x80) << 6);
+}
 
-	if (!dac_enabled)
-		return;
-	if (dac_len == elemof(dac_data))
-		return;
-	usecs = frame_usecs();
-	index = ((usecs << 10) /
-		 ((per_frame[pal].usecs << 10) /
-		  elemof(dac_data)));
-	if (index >= elemof(dac_data))
+void md::dac_enable(uint8_t d)
+{
+	bool enabled = ((d & 0x80) >> 7);
+
+	if (enabled == dac_enabled)
 		return;
-	dac_data[index] = d;
-	if (dac_len)
-		d = dac_data[dac_len - 1];
-	for (i = dac_len; (i < index); ++i)
-		dac_data[i] = d;
-	dac_len = (index + 1);
+	dac_enabled = enabled;
+	dac_set_level(enabled ? ((dac_data - 0x80) << 6) : 0);
 }
 
-void md::dac_enable(uint8_t d)
+/**
+ * Render the DAC output of the current frame as dac_grid steps of equal
+ * duration, then start a new frame.
+ * @param[out] out Rendered output, dac_grid samples.
+ * @param frame_cycles Frame length, in current_cycles() units.
+ */
+void md::dac_render(int16_t *out, unsigned int frame_cycles)
 {
-	dac_enabled = ((d & 0x80) >> 7);
+	int16_t level = dac_level;
+	unsigned int pos = 0;
+	unsigned int i;
+
+	if (frame_cycles == 0)
+		frame_cycles = 1;
+	for (i = 0; (i != dac_len); ++i) {
+		uint64_t end = (((uint64_t)dac_events[i].cycles * dac_grid) /
+				frame_cycles);
+
+		if (end > dac_grid)
+			end = dac_grid;
+		// Keep the previous level until this change.
+		while (pos < end)
+			out[pos++] = level;
+		level = dac_events[i].level;
+	}
+	while (pos != dac_grid)
+		out[pos++] = level;
+	dac_level = level;
+	dac_len = 0;
 }
 
 #ifdef WITH_VGMDUMP
@@ -322,7 +374,10 @@ int md::vgm_dump_start(const char *name)
 	if (fwrite(buf, sizeof(buf), 1, vgm_dump_file) != 1)
 		goto error;
 	// Dump YM2612 registers directly.
-	YM2612_dump(0, ym2612_buf);
+	if (ok_ym2612)
+		YM2612_dump(ym2612[0], ym2612_buf);
+	else
+		memset(ym2612_buf, 0, sizeof(ym2612_buf));
 	// Timers.
 	{
 		uint8_t buf[] = {
@@ -402,3 +457,415 @@ void md::vgm_dump_stop()
 }
 
 #endif // WITH_VGMDUMP
+
+/**
+ * Open a WAV file for capture.
+ * @param name File name, relative to the "wav" directory by default.
+ * @param rate Sample rate.
+ * @return Stereo writer, NULL on error (errno is set).
+ */
+static wav_writer *wav_dump_open(const char *name, unsigned int rate)
+{
+	FILE *file = dgen_fopen("wav", name, DGEN_WRITE);
+	wav_writer *wav;
+	int e;
+
+	if (file == NULL)
+		return NULL;
+	wav = new wav_writer();
+	if (wav->open(file, rate, 2) == 0)
+		return wav;
+	e = errno;
+	delete wav;
+	fclose(file);
+	errno = e;
+	return NULL;
+}
+
+/**
+ * Start capturing sound to WAV files.
+ * @param name File for the final mix, NULL for none.
+ * @param ym3438_name File for the native rate Nuked OPN2 output, NULL for
+ * none. It only receives data while Nuked OPN2 is the YM2612 core.
+ * @return 0 on success, -1 on error (errno is set).
+ */
+int md::wav_dump_start(const char *name, const char *ym3438_name)
+{
+	wav_dump_stop();
+	if ((name != NULL) &&
+	    ((wav_dump = wav_dump_open(name, dgen_soundrate)) == NULL))
+		return -1;
+	if (ym3438_name == NULL)
+		return 0;
+#ifdef WITH_NUKEDOPN2
+	wav_dump_ym3438 = wav_dump_open(ym3438_name,
+					(((pal) ? PAL_MCLK : NTSC_MCLK) /
+					 (skOpn2CycleRatio *
+					  skYm3438CyclesPerSample)));
+	if (wav_dump_ym3438 != NULL)
+		return 0;
+#else
+	errno = ENOSYS;
+#endif
+	{
+		int e = errno;
+
+		wav_dump_stop();
+		errno = e;
+	}
+	return -1;
+}
+
+/**
+ * Stop capturing sound, flush and close WAV files.
+ * @return 0 on success, -1 if some data couldn't be written.
+ */
+int md::wav_dump_stop()
+{
+	int ret = 0;
+
+	if ((wav_dump != NULL) && (wav_dump->close()))
+		ret = -1;
+	if ((wav_dump_ym3438 != NULL) && (wav_dump_ym3438->close()))
+		ret = -1;
+	delete wav_dump;
+	wav_dump = NULL;
+	delete wav_dump_ym3438;
+	wav_dump_ym3438 = NULL;
+	return ret;
+}
+
+#ifdef WITH_NUKEDOPN2
+
+struct ym3438_event {
+	unsigned int cycles;
+	uint8_t type;
+	uint8_t port;
+	uint8_t value;
+};
+
+// Wake the worker up about every 16 scanlines (in master clock cycles).
+#define YM3438_WAKE_CYCLES (16 * 3420)
+
+struct ym3438_worker {
+	// Single producer (emulation), single consumer (worker) queue.
+	struct ym3438_event queue[4096]; // power of two
+	std::atomic<unsigned int> head; // next event to write
+	std::atomic<unsigned int> tail; // next event to read
+	// Set while the worker waits on wake for new events.
+	std::atomic<bool> sleeping;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::thread thread;
+	// Emulation thread side.
+	unsigned int progress; // last cycles value sent with YM3438_EV_CLOCK
+	unsigned int woken; // cycles value when the worker was last woken up
+	// Copy of the busy flag logic (OPN2_DoIO()) and status register of
+	// opn2, updated by ym3438_thread_push() to answer reads without
+	// waiting for the worker.
+	struct {
+		int cycles; // same as ym3438_frame_cycles
+		Bit8u write_d;
+		Bit8u write_busy;
+		Bit8u write_busy_cnt;
+		Bit8u busy;
+		Bit8u status;
+		Bit32u status_time;
+		Bit32u status_reset; // status_time value set by reads
+		bool readmode; // status may be read from any port
+		bool test; // test mode may be enabled, read opn2 itself
+		bool stale; // opn2 may have been modified directly, reload
+	} chip;
+};
+
+// Wake the worker up if it's waiting for events.
+static void ym3438_wake(struct ym3438_worker *w)
+{
+	if (w->sleeping.load()) {
+		std::lock_guard<std::mutex> lock(w->lock);
+
+		w->wake.notify_one();
+	}
+}
+
+// Clock the status copy up to "cycles", like md::ym3438_clock().
+static void ym3438_status_clock(struct ym3438_worker *w, int cycles)
+{
+	int clocks;
+
+	if (cycles <= w->chip.cycles)
+		return;
+	clocks = ((cycles - w->chip.cycles + md::skOpn2CycleRatio - 1) /
+		  md::skOpn2CycleRatio);
+	w->chip.cycles += (clocks * md::skOpn2CycleRatio);
+	if (w->chip.status_time > (Bit32u)clocks)
+		w->chip.status_time -= clocks;
+	else
+		w->chip.status_time = 0;
+	// Nothing changes once the busy counter has settled.
+	while ((clocks--) &&
+	       (w->chip.write_d | w->chip.write_busy | w->chip.busy)) {
+		Bit8u write_d_en = ((w->chip.write_d & 0x03) == 0x01);
+
+		w->chip.write_d <<= 1;
+		w->chip.busy = w->chip.write_busy;
+		w->chip.write_busy_cnt += w->chip.write_busy;
+		w->chip.write_busy = ((w->chip.write_busy &&
+				       !(w->chip.write_busy_cnt >> 5)) ||
+				      write_d_en);
+		w->chip.write_busy_cnt &= 0x1f;
+	}
+}
+
+void md::ym3438_thread_main(md *md)
+{
+	struct ym3438_worker *w = md->ym3438_worker;
+	unsigned int tail = w->tail.load(std::memory_order_relaxed);
+
+	while (1) {
+		unsigned int head = w->head.load(std::memory_order_acquire);
+
+		if (tail == head) {
+			std::unique_lock<std::mutex> lock(w->lock);
+
+			w->sleeping.store(true);
+			while (w->head.load() == tail)
+				w->wake.wait(lock);
+			w->sleeping.store(false);
+			continue;
+		}
+		do {
+			const struct ym3438_event &ev =
+				w->queue[(tail % elemof(w->queue))];
+
+			switch (ev.type) {
+			case YM3438_EV_WRITE:
+				md->ym3438_clock(ev.cycles);
+				OPN2_Write(&md->opn2, ev.port, ev.value);
+				break;
+			case YM3438_EV_CLOCK:
+				md->ym3438_clock(ev.cycles);
+				break;
+			case YM3438_EV_FRAME:
+				md->ym3438_frame_cycles = 0;
+				break;
+			case YM3438_EV_QUIT:
+				w->tail.store((tail + 1), std::memory_order_release);
+				return;
+			}
+			++tail;
+		}
+		while (tail != head);
+		w->tail.store(tail, std::memory_order_release);
+	}
+}
+
+/**
+ * Start the YM3438 worker thread. From now on, opn2 is updated through
+ * ym3438_thread_push().
+ */
+void md::ym3438_thread_start()
+{
+	struct ym3438_worker *w;
+	ym3438_t probe;
+
+	if (ym3438_worker != NULL)
+		return;
+	w = new struct ym3438_worker;
+	w->head.store(0);
+	w->tail.store(0);
+	w->sleeping.store(false);
+	w->progress = 0;
+	w->woken = 0;
+	memset(&w->chip, 0, sizeof(w->chip));
+	w->chip.stale = true;
+	// The chip type is private to ym3438.c, find out how reads behave
+	// with a copy of opn2.
+	probe = opn2;
+	probe.mode_test_21[6] = 0;
+	probe.status_time = 0;
+	OPN2_Read(&probe, 1);
+	w->chip.readmode = (probe.status_time != 0);
+	probe.status_time = 0;
+	OPN2_Read(&probe, 0);
+	w->chip.status_reset = probe.status_time;
+	ym3438_worker = w;
+	w->thread = std::thread(ym3438_thread_main, this);
+}
+
+/**
+ * Stop the YM3438 worker thread once it has processed pending events.
+ */
+void md::ym3438_thread_stop()
+{
+	struct ym3438_worker *w = ym3438_worker;
+
+	if (w == NULL)
+		return;
+	ym3438_thread_push(YM3438_EV_QUIT, 0);
+	ym3438_wake(w);
+	w->thread.join();
+	ym3438_worker = NULL;
+	delete w;
+}
+
+/**
+ * Wait until the YM3438 worker thread has processed all events. opn2 and
+ * related variables can then be used directly until the next event.
+ */
+void md::ym3438_thread_sync()
+{
+	struct ym3438_worker *w = ym3438_worker;
+	unsigned int head;
+
+	if (w == NULL)
+		return;
+	head = w->head.load(std::memory_order_relaxed);
+	ym3438_wake(w);
+	while (w->tail.load(std::memory_order_acquire) != head)
+		std::this_thread::yield();
+	w->chip.stale = true;
+}
+
+/**
+ * Clock opn2 up to "cycles" through the YM3438 worker thread and wait
+ * until it's done, to use the samples it generated.
+ */
+void md::ym3438_thread_flush(unsigned int cycles)
+{
+	ym3438_thread_push(YM3438_EV_CLOCK, cycles);
+	ym3438_thread_sync();
+}
+
+/**
+ * Send an event to the YM3438 worker thread, waiting for room if the
+ * queue is full.
+ */
+void md::ym3438_thread_push(uint8_t type, unsigned int cycles,
+			    uint8_t port, uint8_t value)
+{
+	struct ym3438_worker *w = ym3438_worker;
+	unsigned int head = w->head.load(std::memory_order_relaxed);
+	struct ym3438_event &ev = w->queue[(head % elemof(w->queue))];
+
+	// The worker is idle since the last sync, so it's safe to read opn2.
+	if (w->chip.stale) {
+		w->chip.cycles = ym3438_frame_cycles;
+		w->chip.write_d = opn2.write_d;
+		w->chip.write_busy = opn2.write_busy;
+		w->chip.write_busy_cnt = opn2.write_busy_cnt;
+		w->chip.busy = opn2.busy;
+		w->chip.status = opn2.status;
+		w->chip.status_time = opn2.status_time;
+		w->chip.test = (opn2.mode_test_21[6] ||
+				(fm_reg[0][0x21] & 0x40));
+		w->chip.stale = false;
+	}
+	switch (type) {
+	case YM3438_EV_WRITE:
+		ym3438_status_clock(w, cycles);
+		// Same as OPN2_Write().
+		if (port & 1)
+			w->chip.write_d |= 1;
+		// Test mode may change mid-frame, don't wait for a sync.
+		if (((port & 3) == 1) && (fm_sel[0] == 0x21))
+			w->chip.test = ((value & 0x40) != 0);
+		break;
+	case YM3438_EV_CLOCK:
+		ym3438_status_clock(w, cycles);
+		break;
+	case YM3438_EV_FRAME:
+		w->chip.cycles = 0;
+		w->progress = 0;
+		w->woken = 0;
+		break;
+	}
+	while ((head - w->tail.load(std::memory_order_acquire)) ==
+	       elemof(w->queue)) {
+		ym3438_wake(w);
+		std::this_thread::yield();
+	}
+	ev.cycles = cycles;
+	ev.type = type;
+	ev.port = port;
+	ev.value = value;
+	w->head.store((head + 1));
+}
+
+/**
+ * Read the YM3438 status register without waiting for the worker thread,
+ * unless the chip is in test mode.
+ */
+uint8_t md::ym3438_thread_read(int port)
+{
+	struct ym3438_worker *w = ym3438_worker;
+	unsigned int cycles = current_cycles();
+
+	port &= 3;
+	// Bring the status copy up to date.
+	ym3438_thread_push(YM3438_EV_CLOCK, cycles);
+	if (w->chip.test) {
+		// Test data comes from the whole chip.
+		ym3438_thread_sync();
+		return OPN2_Read(&opn2, port);
+	}
+	// Same as OPN2_Read() out of test mode. Timer flags (bits 0 and 1)
+	// aren't tracked, myfm_read() replaces them.
+	if ((port == 0) || (w->chip.readmode)) {
+		w->chip.status = (w->chip.busy << 7);
+		w->chip.status_time = w->chip.status_reset;
+	}
+	if (w->chip.status_time)
+		return w->chip.status;
+	return 0;
+}
+
+/**
+ * Let the YM3438 worker thread clock opn2 as far as possible, called
+ * once per scanline.
+ */
+void md::ym3438_thread_progress()
+{
+	struct ym3438_worker *w = ym3438_worker;
+	// Later events can't have a lower cycles value.
+	unsigned int cycles = current_cycles_min();
+
+	if (cycles <= w->progress)
+		return;
+	w->progress = cycles;
+	ym3438_thread_push(YM3438_EV_CLOCK, cycles);
+	if ((cycles - w->woken) >= YM3438_WAKE_CYCLES) {
+		w->woken = cycles;
+		ym3438_wake(w);
+	}
+}
+
+/**
+ * Prepare opn2 for a new frame, starting or stopping the worker thread
+ * according to bool_ym_thread.
+ */
+void md::ym3438_frame_start()
+{
+	if ((dgen_ym_chipimpl == YM_CHIPIMPL_NUKEDOPN2) && (dgen_ym_thread)) {
+		if (ym3438_worker == NULL)
+			ym3438_thread_start();
+		ym3438_thread_push(YM3438_EV_FRAME, 0);
+		return;
+	}
+	ym3438_thread_stop();
+	ym3438_frame_cycles = 0;
+}
+
+/**
+ * Reset opn2 and the state used to generate samples from it.
+ */
+void md::ym3438_reset()
+{
+	ym3438_thread_sync();
+	OPN2_Reset(&opn2);
+	ym3438_sample[0] = ym3438_sample[1] = ym3438_sample_prev[0] = ym3438_sample_prev[1] = ym3438_cycles = ym3438_frame_ptr = ym3438_frame_cycles = 0;
+	memset(ym3438_frame_buffer, 0, sizeof(ym3438_frame_buffer));
+	ym3438_resampler.reset();
+}
+
+#endif // WITH_NUKEDOPN2
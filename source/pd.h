@@ -16,7 +16,7 @@ unsigned long pd_usecs(void);
 uint8_t *pd_screen_filter_ptr(struct bmap &scr, uint32_t &width, uint32_t &height);
 
 //rww - exposed to auto-generate a series of stereo shots
-void pd_do_screenshot(md& megad, const char *pNameSuffix, const bool autoIncrementShotNumber);
+void pd_do_screenshot(md& megad, const char *pNameSuffix);
 
 // This is the struct bmap setup by your implementation.
 // It should be 336x240 (or 336x256 in PAL mode), in 8, 12, 15, 16, 24 or 32
@@ -57,6 +57,8 @@ void pd_sound_deinit();
 // This should return samples read/write indices in the buffer.
 unsigned int pd_sound_rp();
 unsigned int pd_sound_wp();
+// Number of samples buffered and waiting to be played.
+unsigned int pd_sound_fill();
 // And this function is called to commit the sound buffers to be played.
 void pd_sound_write();
 
@@ -83,6 +85,9 @@ int pd_stopped();
 // If true, stop emulation (display last frame repeatedly).
 extern bool pd_freeze;
 
+// If true, step back through md::rewind instead of emulating forward.
+extern bool pd_rewind;
+
 // These are called to display and clear game messages.
 void pd_message(const char *fmt, ...);
 void pd_clear_message();
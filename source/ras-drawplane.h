@@ -24,7 +24,8 @@
 	int x, scan = 0, w, xstart;
 	static int sizes[4] = { 32, 64, 64, 128 };
 	unsigned which;
-	unsigned char *where, *hscroll_rec_ptr, *tiles, *tile_line = NULL;
+	uint16_t *where;
+	unsigned char *hscroll_rec_ptr, *tiles, *tile_line = NULL;
 	int xoff, yoff, xoff_mask;
 	int hscroll_amount, yscroll_amount = 0;
 	uint8_t two_cell_vscroll = 0;
@@ -111,7 +112,7 @@
 	hscroll_amount = get_word(hscroll_rec_ptr);
 	xoff_mask = xsize - 1;
 	xoff = ((-(hscroll_amount>>3) - 1)<<1) & xoff_mask;
-	where = dest + (xstart + (hscroll_amount & 7)) * (int) Bpp;
+	where = dest + (xstart + (hscroll_amount & 7));
 
 	/*
 	 * If this is not column vscroll mode, we look up the
@@ -185,7 +186,7 @@
 #if PLANE == 0
 	skip:
 #endif
-		where += Bpp_times8;
+		where += 8;
 		xoff = ((xoff + 2) & xoff_mask);
 	}
 }
@@ -16,36 +16,26 @@
 #include "pd.h"
 #include "rc-vars.h"
 
-// This is marked each time the palette is updated. Handy for the 8bpp
-// implementation, so we don't waste time changing the palette unnecessarily.
-int pal_dirty;
-
-// Macros, to route draw_tile and draw_tile_solid to the right handler
-#define draw_tile(which, line, where) \
-	switch(Bpp)\
-	  {\
-	  case 1:\
-	    draw_tile1((which),(line),(where)); break;\
-	  case 2:\
-	    draw_tile2((which),(line),(where)); break;\
-	  case 3:\
-	    draw_tile3((which),(line),(where)); break;\
-	  case 4:\
-	    draw_tile4((which),(line),(where)); break;\
-	  }
+// SSE2/AVX2 versions of the 32bpp conversion are selected at runtime on x86.
+#if (defined(__i386__) || defined(__x86_64__) || \
+     defined(_M_IX86) || defined(_M_X64)) && \
+    (defined(__GNUC__) || defined(_MSC_VER))
+#define RAS_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define RAS_TARGET(t)
+#else
+#define RAS_TARGET(t) __attribute__((target(t)))
+#endif
+#endif
 
-#define draw_tile_solid(which, line, where) \
-	switch(Bpp)\
-	  {\
-	  case 1:\
-	    draw_tile1_solid((which),(line),(where)); break;\
-	  case 2:\
-	    draw_tile2_solid((which),(line),(where)); break;\
-	  case 3:\
-	    draw_tile3_solid((which),(line),(where)); break;\
-	  case 4:\
-	    draw_tile4_solid((which),(line),(where)); break;\
-	  }
+// SSE2 is always there on x86-64, tiles are composited with it directly.
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define RAS_SSE2
+#include <emmintrin.h>
+#endif
 
 // Silly utility function, get a big-endian word
 #ifdef WORDS_BIGENDIAN
@@ -56,442 +46,169 @@ static inline int get_word(unsigned char *where)
   { return (where[0] << 8) | where[1]; }
 #endif
 
-// Tile pixel masks
-#ifdef WORDS_BIGENDIAN
-#  define PIXEL0 (0xf0000000)
-#  define PIXEL1 (0x0f000000)
-#  define PIXEL2 (0x00f00000)
-#  define PIXEL3 (0x000f0000)
-#  define PIXEL4 (0x0000f000)
-#  define PIXEL5 (0x00000f00)
-#  define PIXEL6 (0x000000f0)
-#  define PIXEL7 (0x0000000f)
-#  define SHIFT0 (28)
-#  define SHIFT1 (24)
-#  define SHIFT2 (20)
-#  define SHIFT3 (16)
-#  define SHIFT4 (12)
-#  define SHIFT5 ( 8)
-#  define SHIFT6 ( 4)
-#  define SHIFT7 ( 0)
-#else // WORDS_BIGENDIAN
-#  define PIXEL0 (0x000000f0)
-#  define PIXEL1 (0x0000000f)
-#  define PIXEL2 (0x0000f000)
-#  define PIXEL3 (0x00000f00)
-#  define PIXEL4 (0x00f00000)
-#  define PIXEL5 (0x000f0000)
-#  define PIXEL6 (0xf0000000)
-#  define PIXEL7 (0x0f000000)
-#  define SHIFT0 ( 4)
-#  define SHIFT1 ( 0)
-#  define SHIFT2 (12)
-#  define SHIFT3 ( 8)
-#  define SHIFT4 (20)
-#  define SHIFT5 (16)
-#  define SHIFT6 (28)
-#  define SHIFT7 (24)
-#endif // WORDS_BIGENDIAN
-
-#ifdef WITH_X86_TILES
-extern "C" {
-
-void asm_tiles_init(unsigned char *vram,
-		    unsigned char *reg,
-		    unsigned *highpal);
-
-void drawtile1(int which, int line, unsigned char *where);
-void drawtile1_solid(int which, int line, unsigned char *where);
-void drawtile2(int which, int line, unsigned char *where);
-void drawtile2_solid(int which, int line, unsigned char *where);
-void drawtile3(int which, int line, unsigned char *where);
-void drawtile3_solid(int which, int line, unsigned char *where);
-void drawtile4(int which, int line, unsigned char *where);
-void drawtile4_solid(int which, int line, unsigned char *where);
-}
-
-// Pass off these calls to assembler counterparts
-inline void md_vdp::draw_tile1_solid(int which, int line, unsigned char *where)
-  { drawtile1_solid(which, line, where); }
-
-inline void md_vdp::draw_tile1(int which, int line, unsigned char *where)
-  { drawtile1(which, line, where); }
-
-inline void md_vdp::draw_tile2_solid(int which, int line, unsigned char *where)
-  { drawtile2_solid(which, line, where); }
+// Expand a line of 8 4-bit pixels to one palette index per byte
+static inline void tile_decode(uint8_t *dst, const uint8_t *src, bool xflip)
+{
+	unsigned int i;
 
-inline void md_vdp::draw_tile2(int which, int line, unsigned char *where)
-  { drawtile2(which, line, where); }
+	if (xflip)
+		for (i = 0; (i != 4); ++i) {
+			dst[(7 - (i << 1))] = (src[i] >> 4);
+			dst[(6 - (i << 1))] = (src[i] & 0x0f);
+		}
+	else
+		for (i = 0; (i != 4); ++i) {
+			dst[(i << 1)] = (src[i] >> 4);
+			dst[((i << 1) + 1)] = (src[i] & 0x0f);
+		}
+}
 
-inline void md_vdp::draw_tile3_solid(int which, int line, unsigned char *where)
-  { drawtile3_solid(which, line, where); }
+// Line buffer entries (md_vdp::line_buf). Tiles are composited there as
+// CRAM indices, then converted once to the output format by draw_line().
+#define LINE_INDEX 0x3f // CRAM index (palette << 4 | dot)
+#define LINE_BACKGROUND 0x40 // color 0 of a solid tile, use reg[7] instead
+#define LINE_OPS_SHIFT 8 // up to 4 shadow/highlight operators, 2 bits each
+#define LINE_SHADOW 1
+#define LINE_HIGHLIGHT 2
 
-inline void md_vdp::draw_tile3(int which, int line, unsigned char *where)
-  { drawtile3(which, line, where); }
+#ifdef RAS_SSE2
 
-inline void md_vdp::draw_tile4_solid(int which, int line, unsigned char *where)
-  { drawtile4_solid(which, line, where); }
+// Write 8 entries, color zero becomes the background color.
+static inline void line_store(uint16_t *where, const uint8_t *dots,
+			      uint16_t pal, uint32_t)
+{
+	__m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)dots),
+				      _mm_setzero_si128());
+	__m128i zero = _mm_cmpeq_epi16(d, _mm_setzero_si128());
+
+	d = _mm_or_si128(d, _mm_set1_epi16(pal));
+	d = _mm_or_si128(d, _mm_and_si128(zero,
+					  _mm_set1_epi16(LINE_BACKGROUND)));
+	_mm_storeu_si128((__m128i *)where, d);
+}
 
-inline void md_vdp::draw_tile4(int which, int line, unsigned char *where)
-  { drawtile4(which, line, where); }
+// Write 8 entries, leaving color zero transparent.
+static inline void line_merge(uint16_t *where, const uint8_t *dots,
+			      uint16_t pal, uint32_t)
+{
+	__m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)dots),
+				      _mm_setzero_si128());
+	__m128i zero = _mm_cmpeq_epi16(d, _mm_setzero_si128());
+
+	d = _mm_or_si128(d, _mm_set1_epi16(pal));
+	d = _mm_or_si128(_mm_andnot_si128(zero, d),
+			 _mm_and_si128(zero,
+				       _mm_loadu_si128((const __m128i *)
+						       where)));
+	_mm_storeu_si128((__m128i *)where, d);
+}
 
-#else // WITH_X86_TILES
+#else // RAS_SSE2
 
 static bool has_zero_nibbles(uint32_t u32)
 {
 	return ((u32 - 0x11111111) & ~u32 & 0x88888888);
 }
 
-// Blit tile solidly, for 1 byte-per-pixel
-inline void md_vdp::draw_tile1_solid(int which, int line, unsigned char *where)
+static inline void line_store(uint16_t *where, const uint8_t *dots,
+			      uint16_t pal, uint32_t)
 {
-  unsigned tile, pal;
-
-  pal = (which >> 9 & 0x30); // Determine which 16-color palette
-
-  if(which & 0x1000) // y flipped
-    line ^= 7; // take from the bottom, instead of the top
+	unsigned int i;
 
-  if(reg[12] & 2) // interlace
-    tile = *(unsigned*)(vram + ((which&0x7ff) << 6) + (line << 3));
-  else
-    tile = *(unsigned*)(vram + ((which&0x7ff) << 5) + (line << 2));
-
-  // Blit the tile!
-  if(which & 0x800) // x flipped
-    {
-      *(where  ) = ((tile & PIXEL7)>>SHIFT7) | pal;
-      *(where+1) = ((tile & PIXEL6)>>SHIFT6) | pal;
-      *(where+2) = ((tile & PIXEL5)>>SHIFT5) | pal;
-      *(where+3) = ((tile & PIXEL4)>>SHIFT4) | pal;
-      *(where+4) = ((tile & PIXEL3)>>SHIFT3) | pal;
-      *(where+5) = ((tile & PIXEL2)>>SHIFT2) | pal;
-      *(where+6) = ((tile & PIXEL1)>>SHIFT1) | pal;
-      *(where+7) = ((tile & PIXEL0)>>SHIFT0) | pal;
-    } else {
-      *(where  ) = ((tile & PIXEL0)>>SHIFT0) | pal;
-      *(where+1) = ((tile & PIXEL1)>>SHIFT1) | pal;
-      *(where+2) = ((tile & PIXEL2)>>SHIFT2) | pal;
-      *(where+3) = ((tile & PIXEL3)>>SHIFT3) | pal;
-      *(where+4) = ((tile & PIXEL4)>>SHIFT4) | pal;
-      *(where+5) = ((tile & PIXEL5)>>SHIFT5) | pal;
-      *(where+6) = ((tile & PIXEL6)>>SHIFT6) | pal;
-      *(where+7) = ((tile & PIXEL7)>>SHIFT7) | pal;
-    }
+	for (i = 0; (i != 8); ++i)
+		where[i] = (pal | (dots[i] ? dots[i] : LINE_BACKGROUND));
 }
 
-// Blit tile, leaving color zero transparent, for 1 byte per pixel
-inline void md_vdp::draw_tile1(int which, int line, unsigned char *where)
+static inline void line_merge(uint16_t *where, const uint8_t *dots,
+			      uint16_t pal, uint32_t tile)
 {
-  unsigned tile, pal;
-
-  pal = (which >> 9 & 0x30); // Determine which 16-color palette
-
-  if(which & 0x1000) // y flipped
-    line ^= 7; // take from the bottom, instead of the top
-
-  if(reg[12] & 2) // interlace
-    tile = *(unsigned*)(vram + ((which&0x7ff) << 6) + (line << 3));
-  else
-    tile = *(unsigned*)(vram + ((which&0x7ff) << 5) + (line << 2));
-  // If the tile is all 0's, why waste the time?
-  if(!tile) return;
-
-  // If the tile doesn't have any transparent pixels, draw it solidly.
-  if (!has_zero_nibbles(tile)) {
-    if (which & 0x800) {
-      // x flipped
-      *(where  ) = ((tile & PIXEL7)>>SHIFT7) | pal;
-      *(where+1) = ((tile & PIXEL6)>>SHIFT6) | pal;
-      *(where+2) = ((tile & PIXEL5)>>SHIFT5) | pal;
-      *(where+3) = ((tile & PIXEL4)>>SHIFT4) | pal;
-      *(where+4) = ((tile & PIXEL3)>>SHIFT3) | pal;
-      *(where+5) = ((tile & PIXEL2)>>SHIFT2) | pal;
-      *(where+6) = ((tile & PIXEL1)>>SHIFT1) | pal;
-      *(where+7) = ((tile & PIXEL0)>>SHIFT0) | pal;
-    }
-    else {
-      *(where  ) = ((tile & PIXEL0)>>SHIFT0) | pal;
-      *(where+1) = ((tile & PIXEL1)>>SHIFT1) | pal;
-      *(where+2) = ((tile & PIXEL2)>>SHIFT2) | pal;
-      *(where+3) = ((tile & PIXEL3)>>SHIFT3) | pal;
-      *(where+4) = ((tile & PIXEL4)>>SHIFT4) | pal;
-      *(where+5) = ((tile & PIXEL5)>>SHIFT5) | pal;
-      *(where+6) = ((tile & PIXEL6)>>SHIFT6) | pal;
-      *(where+7) = ((tile & PIXEL7)>>SHIFT7) | pal;
-    }
-    return;
-  }
+	unsigned int i;
 
-  // Blit the tile!
-  if(which & 0x800) // x flipped
-    {
-      if(tile & PIXEL7) *(where  ) = ((tile & PIXEL7)>>SHIFT7) | pal;
-      if(tile & PIXEL6) *(where+1) = ((tile & PIXEL6)>>SHIFT6) | pal;
-      if(tile & PIXEL5) *(where+2) = ((tile & PIXEL5)>>SHIFT5) | pal;
-      if(tile & PIXEL4) *(where+3) = ((tile & PIXEL4)>>SHIFT4) | pal;
-      if(tile & PIXEL3) *(where+4) = ((tile & PIXEL3)>>SHIFT3) | pal;
-      if(tile & PIXEL2) *(where+5) = ((tile & PIXEL2)>>SHIFT2) | pal;
-      if(tile & PIXEL1) *(where+6) = ((tile & PIXEL1)>>SHIFT1) | pal;
-      if(tile & PIXEL0) *(where+7) = ((tile & PIXEL0)>>SHIFT0) | pal;
-    } else {
-      if(tile & PIXEL0) *(where  ) = ((tile & PIXEL0)>>SHIFT0) | pal;
-      if(tile & PIXEL1) *(where+1) = ((tile & PIXEL1)>>SHIFT1) | pal;
-      if(tile & PIXEL2) *(where+2) = ((tile & PIXEL2)>>SHIFT2) | pal;
-      if(tile & PIXEL3) *(where+3) = ((tile & PIXEL3)>>SHIFT3) | pal;
-      if(tile & PIXEL4) *(where+4) = ((tile & PIXEL4)>>SHIFT4) | pal;
-      if(tile & PIXEL5) *(where+5) = ((tile & PIXEL5)>>SHIFT5) | pal;
-      if(tile & PIXEL6) *(where+6) = ((tile & PIXEL6)>>SHIFT6) | pal;
-      if(tile & PIXEL7) *(where+7) = ((tile & PIXEL7)>>SHIFT7) | pal;
-    }
+	// If the tile doesn't have any transparent pixels, draw it solidly.
+	if (!has_zero_nibbles(tile)) {
+		for (i = 0; (i != 8); ++i)
+			where[i] = (pal | dots[i]);
+		return;
+	}
+	for (i = 0; (i != 8); ++i)
+		if (dots[i])
+			where[i] = (pal | dots[i]);
 }
 
-// Blit tile solidly, for 2 byte-per-pixel
-inline void md_vdp::draw_tile2_solid(int which, int line, unsigned char *where)
-{
-  unsigned tile, temp, *pal;
-  unsigned short *wwhere = (unsigned short*)where;
-
-  pal = highpal + (which >> 9 & 0x30); // Determine which 16-color palette
-  temp = *pal; *pal = highpal[reg[7]&0x3f]; // Get background color
-
-  if(which & 0x1000) // y flipped
-    line ^= 7; // take from the bottom, instead of the top
+#endif // RAS_SSE2
 
-  if(reg[12] & 2) // interlace
-    tile = *(unsigned*)(vram + ((which&0x7ff) << 6) + (line << 3));
-  else
-    tile = *(unsigned*)(vram + ((which&0x7ff) << 5) + (line << 2));
+// Append a shadow/highlight operator to a line buffer entry. Operators are
+// applied in order during conversion, extra ones are ignored.
+static inline void line_op(uint16_t &dot, unsigned int op)
+{
+	unsigned int shift;
 
-  // Blit the tile!
-  if(which & 0x800) // x flipped
-    {
-      *(wwhere  ) = pal[((tile & PIXEL7)>>SHIFT7)];
-      *(wwhere+1) = pal[((tile & PIXEL6)>>SHIFT6)];
-      *(wwhere+2) = pal[((tile & PIXEL5)>>SHIFT5)];
-      *(wwhere+3) = pal[((tile & PIXEL4)>>SHIFT4)];
-      *(wwhere+4) = pal[((tile & PIXEL3)>>SHIFT3)];
-      *(wwhere+5) = pal[((tile & PIXEL2)>>SHIFT2)];
-      *(wwhere+6) = pal[((tile & PIXEL1)>>SHIFT1)];
-      *(wwhere+7) = pal[((tile & PIXEL0)>>SHIFT0)];
-    } else {
-      *(wwhere  ) = pal[((tile & PIXEL0)>>SHIFT0)];
-      *(wwhere+1) = pal[((tile & PIXEL1)>>SHIFT1)];
-      *(wwhere+2) = pal[((tile & PIXEL2)>>SHIFT2)];
-      *(wwhere+3) = pal[((tile & PIXEL3)>>SHIFT3)];
-      *(wwhere+4) = pal[((tile & PIXEL4)>>SHIFT4)];
-      *(wwhere+5) = pal[((tile & PIXEL5)>>SHIFT5)];
-      *(wwhere+6) = pal[((tile & PIXEL6)>>SHIFT6)];
-      *(wwhere+7) = pal[((tile & PIXEL7)>>SHIFT7)];
-    }
-  // Restore the original color
-  *pal = temp;
+	for (shift = LINE_OPS_SHIFT; (shift != 16); shift += 2)
+		if (((dot >> shift) & 3) == 0) {
+			dot |= (op << shift);
+			return;
+		}
 }
 
-// Blit tile, leaving color zero transparent, for 2 byte per pixel
-inline void md_vdp::draw_tile2(int which, int line, unsigned char *where)
+// Get a tile line already decoded to palette indices, x flipped if needed.
+// The raw tile line is returned through "tile" for blank checking.
+inline const uint8_t *md_vdp::get_tile_line(int which, int line,
+					     unsigned &tile)
 {
-  unsigned tile, *pal;
-  unsigned short *wwhere = (unsigned short*)where;
-
-  pal = highpal + (which >> 9 & 0x30); // Determine which 16-color palette
+  unsigned addr;
 
   if(which & 0x1000) // y flipped
     line ^= 7; // take from the bottom, instead of the top
 
   if(reg[12] & 2) // interlace
-    tile = *(unsigned*)(vram + ((which&0x7ff) << 6) + (line << 3));
+    addr = ((which&0x7ff) << 6) + (line << 3);
   else
-    tile = *(unsigned*)(vram + ((which&0x7ff) << 5) + (line << 2));
-  // If the tile is all 0's, why waste the time?
-  if(!tile) return;
-
-  // If the tile doesn't have any transparent pixels, draw it solidly.
-  if (!has_zero_nibbles(tile)) {
-    if (which & 0x800) {
-      // x flipped
-      *(wwhere  ) = pal[((tile & PIXEL7)>>SHIFT7)];
-      *(wwhere+1) = pal[((tile & PIXEL6)>>SHIFT6)];
-      *(wwhere+2) = pal[((tile & PIXEL5)>>SHIFT5)];
-      *(wwhere+3) = pal[((tile & PIXEL4)>>SHIFT4)];
-      *(wwhere+4) = pal[((tile & PIXEL3)>>SHIFT3)];
-      *(wwhere+5) = pal[((tile & PIXEL2)>>SHIFT2)];
-      *(wwhere+6) = pal[((tile & PIXEL1)>>SHIFT1)];
-      *(wwhere+7) = pal[((tile & PIXEL0)>>SHIFT0)];
-    }
-    else {
-      *(wwhere  ) = pal[((tile & PIXEL0)>>SHIFT0)];
-      *(wwhere+1) = pal[((tile & PIXEL1)>>SHIFT1)];
-      *(wwhere+2) = pal[((tile & PIXEL2)>>SHIFT2)];
-      *(wwhere+3) = pal[((tile & PIXEL3)>>SHIFT3)];
-      *(wwhere+4) = pal[((tile & PIXEL4)>>SHIFT4)];
-      *(wwhere+5) = pal[((tile & PIXEL5)>>SHIFT5)];
-      *(wwhere+6) = pal[((tile & PIXEL6)>>SHIFT6)];
-      *(wwhere+7) = pal[((tile & PIXEL7)>>SHIFT7)];
-    }
-    return;
-  }
-
-  // Blit the tile!
-  if(which & 0x800) // x flipped
-    {
-      if(tile & PIXEL7) *(wwhere  ) = pal[((tile & PIXEL7)>>SHIFT7)];
-      if(tile & PIXEL6) *(wwhere+1) = pal[((tile & PIXEL6)>>SHIFT6)];
-      if(tile & PIXEL5) *(wwhere+2) = pal[((tile & PIXEL5)>>SHIFT5)];
-      if(tile & PIXEL4) *(wwhere+3) = pal[((tile & PIXEL4)>>SHIFT4)];
-      if(tile & PIXEL3) *(wwhere+4) = pal[((tile & PIXEL3)>>SHIFT3)];
-      if(tile & PIXEL2) *(wwhere+5) = pal[((tile & PIXEL2)>>SHIFT2)];
-      if(tile & PIXEL1) *(wwhere+6) = pal[((tile & PIXEL1)>>SHIFT1)];
-      if(tile & PIXEL0) *(wwhere+7) = pal[((tile & PIXEL0)>>SHIFT0)];
-    } else {
-      if(tile & PIXEL0) *(wwhere  ) = pal[((tile & PIXEL0)>>SHIFT0)];
-      if(tile & PIXEL1) *(wwhere+1) = pal[((tile & PIXEL1)>>SHIFT1)];
-      if(tile & PIXEL2) *(wwhere+2) = pal[((tile & PIXEL2)>>SHIFT2)];
-      if(tile & PIXEL3) *(wwhere+3) = pal[((tile & PIXEL3)>>SHIFT3)];
-      if(tile & PIXEL4) *(wwhere+4) = pal[((tile & PIXEL4)>>SHIFT4)];
-      if(tile & PIXEL5) *(wwhere+5) = pal[((tile & PIXEL5)>>SHIFT5)];
-      if(tile & PIXEL6) *(wwhere+6) = pal[((tile & PIXEL6)>>SHIFT6)];
-      if(tile & PIXEL7) *(wwhere+7) = pal[((tile & PIXEL7)>>SHIFT7)];
-    }
+    addr = ((which&0x7ff) << 5) + (line << 2);
+  tile = *(unsigned*)(vram + addr);
+  if (addr < 0x10000)
+    return tile_cache[(addr >> 2)][((which >> 11) & 1)];
+  // Interlaced tiles may point past VRAM, decode them directly.
+  tile_decode(tile_scratch, (vram + addr), (which & 0x800));
+  return tile_scratch;
 }
 
-inline void md_vdp::draw_tile3_solid(int which, int line, unsigned char *where)
+// Blit tile solidly
+inline void md_vdp::draw_tile_solid(int which, int line, uint16_t *where)
 {
-  unsigned tile, temp, *pal;
-  uint24_t *wwhere = (uint24_t *)where;
-
-  pal = highpal + (which >> 9 & 0x30); // Determine which 16-color palette
-  temp = *pal; *pal = highpal[reg[7]&0x3f]; // Get background color
-
-  if(which & 0x1000) // y flipped
-    line ^= 7; // take from the bottom, instead of the top
-
-  if(reg[12] & 2) // interlace
-    tile = *(unsigned*)(vram + ((which&0x7ff) << 6) + (line << 3));
-  else
-    tile = *(unsigned*)(vram + ((which&0x7ff) << 5) + (line << 2));
+  unsigned tile;
+  const uint8_t *dots = get_tile_line(which, line, tile);
 
-  // Blit the tile!
-  if(which & 0x800) // x flipped
-    {
-      u24cpy(&wwhere[0], (uint24_t *)&pal[((tile & PIXEL7) >> SHIFT7)]);
-      u24cpy(&wwhere[1], (uint24_t *)&pal[((tile & PIXEL6) >> SHIFT6)]);
-      u24cpy(&wwhere[2], (uint24_t *)&pal[((tile & PIXEL5) >> SHIFT5)]);
-      u24cpy(&wwhere[3], (uint24_t *)&pal[((tile & PIXEL4) >> SHIFT4)]);
-      u24cpy(&wwhere[4], (uint24_t *)&pal[((tile & PIXEL3) >> SHIFT3)]);
-      u24cpy(&wwhere[5], (uint24_t *)&pal[((tile & PIXEL2) >> SHIFT2)]);
-      u24cpy(&wwhere[6], (uint24_t *)&pal[((tile & PIXEL1) >> SHIFT1)]);
-      u24cpy(&wwhere[7], (uint24_t *)&pal[((tile & PIXEL0) >> SHIFT0)]);
-    } else {
-      u24cpy(&wwhere[0], (uint24_t *)&pal[((tile & PIXEL0) >> SHIFT0)]);
-      u24cpy(&wwhere[1], (uint24_t *)&pal[((tile & PIXEL1) >> SHIFT1)]);
-      u24cpy(&wwhere[2], (uint24_t *)&pal[((tile & PIXEL2) >> SHIFT2)]);
-      u24cpy(&wwhere[3], (uint24_t *)&pal[((tile & PIXEL3) >> SHIFT3)]);
-      u24cpy(&wwhere[4], (uint24_t *)&pal[((tile & PIXEL4) >> SHIFT4)]);
-      u24cpy(&wwhere[5], (uint24_t *)&pal[((tile & PIXEL5) >> SHIFT5)]);
-      u24cpy(&wwhere[6], (uint24_t *)&pal[((tile & PIXEL6) >> SHIFT6)]);
-      u24cpy(&wwhere[7], (uint24_t *)&pal[((tile & PIXEL7) >> SHIFT7)]);
-    }
-  // Restore the original color
-  *pal = temp;
+  // Blit the tile! Color zero shows the background color.
+  line_store(where, dots, ((which >> 9 & 0x30) | line_shadow), tile);
 }
 
-inline void md_vdp::draw_tile3(int which, int line, unsigned char *where)
+// Blit tile, leaving color zero transparent
+inline void md_vdp::draw_tile(int which, int line, uint16_t *where)
 {
-  unsigned tile, *pal;
-  uint24_t *wwhere = (uint24_t *)where;
-
-  pal = highpal + (which >> 9 & 0x30); // Determine which 16-color palette
-
-  if(which & 0x1000) // y flipped
-    line ^= 7; // take from the bottom, instead of the top
+  unsigned tile, i;
+  const uint8_t *dots = get_tile_line(which, line, tile);
+  const int palOffset = (which >> 9 & 0x30);
+  uint16_t pal;
 
-  if(reg[12] & 2) // interlace
-    tile = *(unsigned*)(vram + ((which&0x7ff) << 6) + (line << 3));
-  else
-    tile = *(unsigned*)(vram + ((which&0x7ff) << 5) + (line << 2));
-  // If it's empty, why waste the time?
+  // If the tile is all 0's, why waste the time?
   if(!tile) return;
 
-  // If the tile doesn't have any transparent pixels, draw it solidly.
-  if (!has_zero_nibbles(tile)) {
-    if (which & 0x800) {
-      // x flipped
-      u24cpy(&wwhere[0], (uint24_t *)&pal[((tile & PIXEL7) >> SHIFT7)]);
-      u24cpy(&wwhere[1], (uint24_t *)&pal[((tile & PIXEL6) >> SHIFT6)]);
-      u24cpy(&wwhere[2], (uint24_t *)&pal[((tile & PIXEL5) >> SHIFT5)]);
-      u24cpy(&wwhere[3], (uint24_t *)&pal[((tile & PIXEL4) >> SHIFT4)]);
-      u24cpy(&wwhere[4], (uint24_t *)&pal[((tile & PIXEL3) >> SHIFT3)]);
-      u24cpy(&wwhere[5], (uint24_t *)&pal[((tile & PIXEL2) >> SHIFT2)]);
-      u24cpy(&wwhere[6], (uint24_t *)&pal[((tile & PIXEL1) >> SHIFT1)]);
-      u24cpy(&wwhere[7], (uint24_t *)&pal[((tile & PIXEL0) >> SHIFT0)]);
-    }
-    else {
-      u24cpy(&wwhere[0], (uint24_t *)&pal[((tile & PIXEL0) >> SHIFT0)]);
-      u24cpy(&wwhere[1], (uint24_t *)&pal[((tile & PIXEL1) >> SHIFT1)]);
-      u24cpy(&wwhere[2], (uint24_t *)&pal[((tile & PIXEL2) >> SHIFT2)]);
-      u24cpy(&wwhere[3], (uint24_t *)&pal[((tile & PIXEL3) >> SHIFT3)]);
-      u24cpy(&wwhere[4], (uint24_t *)&pal[((tile & PIXEL4) >> SHIFT4)]);
-      u24cpy(&wwhere[5], (uint24_t *)&pal[((tile & PIXEL5) >> SHIFT5)]);
-      u24cpy(&wwhere[6], (uint24_t *)&pal[((tile & PIXEL6) >> SHIFT6)]);
-      u24cpy(&wwhere[7], (uint24_t *)&pal[((tile & PIXEL7) >> SHIFT7)]);
-    }
-    return;
-  }
+  pal = (palOffset | line_shadow); // Determine which 16-color palette
 
-  // Blit the tile!
-  if(which & 0x800) // x flipped
+  //shove in some half-assed shadow & highlight support in here.
+  //this is not quite right, but it's a temp bandage as i'm eventually gonna replace this whole vdp implementation.
+  if ((line_sh) && (palOffset == 48) && (drawing_layer == 3))
     {
-      if (tile & PIXEL7)
-		u24cpy(&wwhere[0],
-		       (uint24_t *)&pal[((tile & PIXEL7) >> SHIFT7)]);
-      if(tile & PIXEL6)
-		u24cpy(&wwhere[1],
-		       (uint24_t *)&pal[((tile & PIXEL6) >> SHIFT6)]);
-      if(tile & PIXEL5)
-		u24cpy(&wwhere[2],
-		       (uint24_t *)&pal[((tile & PIXEL5) >> SHIFT5)]);
-      if(tile & PIXEL4)
-		u24cpy(&wwhere[3],
-		       (uint24_t *)&pal[((tile & PIXEL4) >> SHIFT4)]);
-      if(tile & PIXEL3)
-		u24cpy(&wwhere[4],
-		       (uint24_t *)&pal[((tile & PIXEL3) >> SHIFT3)]);
-      if(tile & PIXEL2)
-		u24cpy(&wwhere[5],
-		       (uint24_t *)&pal[((tile & PIXEL2) >> SHIFT2)]);
-      if(tile & PIXEL1)
-		u24cpy(&wwhere[6],
-		       (uint24_t *)&pal[((tile & PIXEL1) >> SHIFT1)]);
-      if(tile & PIXEL0)
-		u24cpy(&wwhere[7],
-		       (uint24_t *)&pal[((tile & PIXEL0) >> SHIFT0)]);
-    } else {
-      if(tile & PIXEL0)
-		u24cpy(&wwhere[0],
-		       (uint24_t *)&pal[((tile & PIXEL0) >> SHIFT0)]);
-      if(tile & PIXEL1)
-		u24cpy(&wwhere[1],
-		       (uint24_t *)&pal[((tile & PIXEL1) >> SHIFT1)]);
-      if(tile & PIXEL2)
-		u24cpy(&wwhere[2],
-		       (uint24_t *)&pal[((tile & PIXEL2) >> SHIFT2)]);
-      if(tile & PIXEL3)
-		u24cpy(&wwhere[3],
-		       (uint24_t *)&pal[((tile & PIXEL3) >> SHIFT3)]);
-      if(tile & PIXEL4)
-		u24cpy(&wwhere[4],
-		       (uint24_t *)&pal[((tile & PIXEL4) >> SHIFT4)]);
-      if(tile & PIXEL5)
-		u24cpy(&wwhere[5],
-		       (uint24_t *)&pal[((tile & PIXEL5) >> SHIFT5)]);
-      if(tile & PIXEL6)
-		u24cpy(&wwhere[6],
-		       (uint24_t *)&pal[((tile & PIXEL6) >> SHIFT6)]);
-      if(tile & PIXEL7)
-		u24cpy(&wwhere[7],
-		       (uint24_t *)&pal[((tile & PIXEL7) >> SHIFT7)]);
+      for (i = 0; (i != 8); ++i)
+	if (dots[i] == 15)
+	  line_op(where[i], LINE_SHADOW);
+	else if (dots[i] == 14)
+	  line_op(where[i], LINE_HIGHLIGHT);
+	else if (dots[i])
+	  where[i] = (pal | dots[i]);
+      return;
     }
+  line_merge(where, dots, pal, tile);
 }
 
 static inline uint8_t color_darken(const uint8_t color)
@@ -521,224 +238,225 @@ static inline uint32_t rgba_lighten(const uint32_t color)
 	return r | (g << 8) | (b << 16) | (color & 0xFF000000);
 }
 
-// Blit tile solidly, for 4 byte-per-pixel
-inline void md_vdp::draw_tile4_solid(int which, int line, unsigned char *where)
+// Apply the shadow/highlight operators of a line buffer entry.
+static inline uint32_t rgba_ops(uint32_t color, unsigned int ops)
 {
-  unsigned tile, temp, *pal;
-  unsigned *wwhere = (unsigned*)where;
-
-  const int palOffset = (which >> 9 & 0x30);
-  pal = highpal + palOffset; // Determine which 16-color palette
-  temp = *pal; *pal = highpal[reg[7]&0x3f]; // Get background color
-
-  if(which & 0x1000) // y flipped
-    line ^= 7; // take from the bottom, instead of the top
+	for (; (ops != 0); ops >>= 2)
+		if ((ops & 3) == LINE_SHADOW)
+			color = rgba_darken(color);
+		else
+			color = rgba_lighten(color);
+	return color;
+}
 
-  if(reg[12] & 2) // interlace
-    tile = *(unsigned*)(vram + ((which&0x7ff) << 6) + (line << 3));
-  else
-    tile = *(unsigned*)(vram + ((which&0x7ff) << 5) + (line << 2));
-
-  const int i7 = ((tile & PIXEL7) >> SHIFT7);
-  const int i6 = ((tile & PIXEL6) >> SHIFT6);
-  const int i5 = ((tile & PIXEL5) >> SHIFT5);
-  const int i4 = ((tile & PIXEL4) >> SHIFT4);
-  const int i3 = ((tile & PIXEL3) >> SHIFT3);
-  const int i2 = ((tile & PIXEL2) >> SHIFT2);
-  const int i1 = ((tile & PIXEL1) >> SHIFT1);
-  const int i0 = ((tile & PIXEL0) >> SHIFT0);
-  uint32_t p7 = pal[i7];
-  uint32_t p6 = pal[i6];
-  uint32_t p5 = pal[i5];
-  uint32_t p4 = pal[i4];
-  uint32_t p3 = pal[i3];
-  uint32_t p2 = pal[i2];
-  uint32_t p1 = pal[i1];
-  uint32_t p0 = pal[i0];
-
-  if ((reg[12] & 8) && !drawing_high)
-  {
-	  p0 = rgba_darken(p0);
-	  p1 = rgba_darken(p1);
-	  p2 = rgba_darken(p2);
-	  p3 = rgba_darken(p3);
-	  p4 = rgba_darken(p4);
-	  p5 = rgba_darken(p5);
-	  p6 = rgba_darken(p6);
-	  p7 = rgba_darken(p7);
-  }
+// Convert line buffer entries to 32bpp, applying operators.
+static void line_convert32_c(uint32_t *out, const uint16_t *in,
+			     const uint32_t *lut)
+{
+  unsigned int i;
 
-  // Blit the tile!
-  if(which & 0x800) // x flipped
+  for (i = 0; (i != 320); ++i)
     {
-      *(wwhere  ) = p7;
-      *(wwhere+1) = p6;
-      *(wwhere+2) = p5;
-      *(wwhere+3) = p4;
-      *(wwhere+4) = p3;
-      *(wwhere+5) = p2;
-      *(wwhere+6) = p1;
-      *(wwhere+7) = p0;
-    } else {
-      *(wwhere  ) = p0;
-      *(wwhere+1) = p1;
-      *(wwhere+2) = p2;
-      *(wwhere+3) = p3;
-      *(wwhere+4) = p4;
-      *(wwhere+5) = p5;
-      *(wwhere+6) = p6;
-      *(wwhere+7) = p7;
+      uint32_t color = lut[(in[i] & 0x7f)];
+
+      if (in[i] >> LINE_OPS_SHIFT)
+	color = rgba_ops(color, (in[i] >> LINE_OPS_SHIFT));
+      out[i] = color;
     }
-  // Restore the original color
-  *pal = temp;
 }
 
-static inline void shadow_highlight_mix4(uint32_t &dst, const int palIndex, const uint32_t color)
+#ifdef RAS_SIMD
+
+// Same as rgba_darken() and rgba_lighten(), 4 pixels at a time.
+RAS_TARGET("sse2")
+static inline __m128i sse2_darken(__m128i c)
 {
-	//terrible approach, will be busted with overlaps, doesn't grab through to the correct plane in certain cases
-	if (palIndex == 15)
-	{
-		dst = rgba_darken(dst);
-	}
-	else if (palIndex == 14)
-	{
-		dst = rgba_lighten(dst);
-	}
-	else
-	{
-		dst = color;
-	}
+  __m128i a = _mm_and_si128(_mm_srli_epi32(c, 2), _mm_set1_epi32(0x003f3f3f));
+  __m128i b = _mm_and_si128(_mm_srli_epi32(c, 1), _mm_set1_epi32(0x007f7f7f));
+
+  return _mm_or_si128(_mm_add_epi8(a, b),
+		      _mm_and_si128(c, _mm_set1_epi32(0xff000000)));
 }
 
-// Blit tile, leaving color zero transparent, for 4 byte per pixel
-inline void md_vdp::draw_tile4(int which, int line, unsigned char *where)
+RAS_TARGET("sse2")
+static inline __m128i sse2_lighten(__m128i c)
 {
-  unsigned tile, *pal;
-  unsigned *wwhere = (unsigned*)where;
+  return _mm_adds_epu8(c, _mm_and_si128(_mm_srli_epi32(c, 1),
+					_mm_set1_epi32(0x007f7f7f)));
+}
 
-  const int palOffset = (which >> 9 & 0x30);
-  pal = highpal + palOffset; // Determine which 16-color palette
+// Take a where mask is set, b otherwise.
+RAS_TARGET("sse2")
+static inline __m128i sse2_select(__m128i mask, __m128i a, __m128i b)
+{
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
 
-  if(which & 0x1000) // y flipped
-    line ^= 7; // take from the bottom, instead of the top
+RAS_TARGET("sse2")
+static void line_convert32_sse2(uint32_t *out, const uint16_t *in,
+				const uint32_t *lut)
+{
+  const __m128i zero = _mm_setzero_si128();
+  unsigned int i;
 
-  if(reg[12] & 2) // interlace
-    tile = *(unsigned*)(vram + ((which&0x7ff) << 6) + (line << 3));
-  else
-    tile = *(unsigned*)(vram + ((which&0x7ff) << 5) + (line << 2));
-  // If the tile is all 0's, why waste the time?
-  if(!tile) return;
+  for (i = 0; (i != 320); i += 4)
+    {
+      __m128i color = _mm_set_epi32(lut[(in[(i + 3)] & 0x7f)],
+				    lut[(in[(i + 2)] & 0x7f)],
+				    lut[(in[(i + 1)] & 0x7f)],
+				    lut[(in[i] & 0x7f)]);
+      __m128i ops = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)
+						       &in[i]), zero);
+
+      // One operator from each entry at a time.
+      for (ops = _mm_srli_epi32(ops, LINE_OPS_SHIFT);
+	   (_mm_movemask_epi8(_mm_cmpeq_epi32(ops, zero)) != 0xffff);
+	   ops = _mm_srli_epi32(ops, 2))
+	{
+	  __m128i op = _mm_and_si128(ops, _mm_set1_epi32(3));
+
+	  color = sse2_select(_mm_cmpeq_epi32(op, _mm_set1_epi32(LINE_SHADOW)),
+			      sse2_darken(color), color);
+	  color = sse2_select(_mm_cmpeq_epi32(op,
+					      _mm_set1_epi32(LINE_HIGHLIGHT)),
+			      sse2_lighten(color), color);
+	}
+      _mm_storeu_si128((__m128i *)&out[i], color);
+    }
+}
 
-  const int i7 = ((tile & PIXEL7) >> SHIFT7);
-  const int i6 = ((tile & PIXEL6) >> SHIFT6);
-  const int i5 = ((tile & PIXEL5) >> SHIFT5);
-  const int i4 = ((tile & PIXEL4) >> SHIFT4);
-  const int i3 = ((tile & PIXEL3) >> SHIFT3);
-  const int i2 = ((tile & PIXEL2) >> SHIFT2);
-  const int i1 = ((tile & PIXEL1) >> SHIFT1);
-  const int i0 = ((tile & PIXEL0) >> SHIFT0);
-  uint32_t p7 = pal[i7];
-  uint32_t p6 = pal[i6];
-  uint32_t p5 = pal[i5];
-  uint32_t p4 = pal[i4];
-  uint32_t p3 = pal[i3];
-  uint32_t p2 = pal[i2];
-  uint32_t p1 = pal[i1];
-  uint32_t p0 = pal[i0];
+RAS_TARGET("avx2")
+static inline __m256i avx2_darken(__m256i c)
+{
+  __m256i a = _mm256_and_si256(_mm256_srli_epi32(c, 2),
+			       _mm256_set1_epi32(0x003f3f3f));
+  __m256i b = _mm256_and_si256(_mm256_srli_epi32(c, 1),
+			       _mm256_set1_epi32(0x007f7f7f));
 
-  //shove in some half-assed shadow & highlight support in here.
-  //this is not quite right, but it's a temp bandage as i'm eventually gonna replace this whole vdp implementation.
-  //also, it's not implemented on the other tile drawing paths because i'm lazy. (another thing that could be handled nicely with some templating instead of rampant duplication)
-  if (reg[12] & 8)
-  {
-	  if (!drawing_high)
-	  {
-		  p0 = rgba_darken(p0);
-		  p1 = rgba_darken(p1);
-		  p2 = rgba_darken(p2);
-		  p3 = rgba_darken(p3);
-		  p4 = rgba_darken(p4);
-		  p5 = rgba_darken(p5);
-		  p6 = rgba_darken(p6);
-		  p7 = rgba_darken(p7);
-	  }
+  return _mm256_or_si256(_mm256_add_epi8(a, b),
+			 _mm256_and_si256(c, _mm256_set1_epi32(0xff000000)));
+}
 
-	  if (palOffset == 48 && drawing_layer == 3)
-	  {
-		  if (which & 0x800) // x flipped
-		  {
-			  if (tile & PIXEL7) shadow_highlight_mix4(*(wwhere), i7, p7);
-			  if (tile & PIXEL6) shadow_highlight_mix4(*(wwhere + 1), i6, p6);
-			  if (tile & PIXEL5) shadow_highlight_mix4(*(wwhere + 2), i5, p5);
-			  if (tile & PIXEL4) shadow_highlight_mix4(*(wwhere + 3), i4, p4);
-			  if (tile & PIXEL3) shadow_highlight_mix4(*(wwhere + 4), i3, p3);
-			  if (tile & PIXEL2) shadow_highlight_mix4(*(wwhere + 5), i2, p2);
-			  if (tile & PIXEL1) shadow_highlight_mix4(*(wwhere + 6), i1, p1);
-			  if (tile & PIXEL0) shadow_highlight_mix4(*(wwhere + 7), i0, p0);
-		  }
-		  else {
-			  if (tile & PIXEL0) shadow_highlight_mix4(*(wwhere), i0, p0);
-			  if (tile & PIXEL1) shadow_highlight_mix4(*(wwhere + 1), i1, p1);
-			  if (tile & PIXEL2) shadow_highlight_mix4(*(wwhere + 2), i2, p2);
-			  if (tile & PIXEL3) shadow_highlight_mix4(*(wwhere + 3), i3, p3);
-			  if (tile & PIXEL4) shadow_highlight_mix4(*(wwhere + 4), i4, p4);
-			  if (tile & PIXEL5) shadow_highlight_mix4(*(wwhere + 5), i5, p5);
-			  if (tile & PIXEL6) shadow_highlight_mix4(*(wwhere + 6), i6, p6);
-			  if (tile & PIXEL7) shadow_highlight_mix4(*(wwhere + 7), i7, p7);
-		  }
-		  return;
-	  }
-  }
+RAS_TARGET("avx2")
+static inline __m256i avx2_lighten(__m256i c)
+{
+  return _mm256_adds_epu8(c, _mm256_and_si256(_mm256_srli_epi32(c, 1),
+					      _mm256_set1_epi32(0x007f7f7f)));
+}
+
+RAS_TARGET("avx2")
+static void line_convert32_avx2(uint32_t *out, const uint16_t *in,
+				const uint32_t *lut)
+{
+  unsigned int i;
 
-  // If the tile doesn't have any transparent pixels, draw it solidly.
-  if (!has_zero_nibbles(tile)) {
-    if (which & 0x800) {
-      // x flipped
-      *(wwhere  ) = p7;
-      *(wwhere+1) = p6;
-      *(wwhere+2) = p5;
-      *(wwhere+3) = p4;
-      *(wwhere+4) = p3;
-      *(wwhere+5) = p2;
-      *(wwhere+6) = p1;
-      *(wwhere+7) = p0;
+  for (i = 0; (i != 320); i += 8)
+    {
+      __m256i dots = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)
+							   &in[i]));
+      __m256i color = _mm256_i32gather_epi32((const int *)lut,
+					     _mm256_and_si256(dots,
+							      _mm256_set1_epi32(0x7f)),
+					     4);
+      __m256i ops;
+
+      // One operator from each entry at a time.
+      for (ops = _mm256_srli_epi32(dots, LINE_OPS_SHIFT);
+	   (!_mm256_testz_si256(ops, ops));
+	   ops = _mm256_srli_epi32(ops, 2))
+	{
+	  __m256i op = _mm256_and_si256(ops, _mm256_set1_epi32(3));
+
+	  color = _mm256_blendv_epi8(color, avx2_darken(color),
+				     _mm256_cmpeq_epi32(op,
+							_mm256_set1_epi32(LINE_SHADOW)));
+	  color = _mm256_blendv_epi8(color, avx2_lighten(color),
+				     _mm256_cmpeq_epi32(op,
+							_mm256_set1_epi32(LINE_HIGHLIGHT)));
+	}
+      _mm256_storeu_si256((__m256i *)&out[i], color);
     }
-    else {
-      *(wwhere  ) = p0;
-      *(wwhere+1) = p1;
-      *(wwhere+2) = p2;
-      *(wwhere+3) = p3;
-      *(wwhere+4) = p4;
-      *(wwhere+5) = p5;
-      *(wwhere+6) = p6;
-      *(wwhere+7) = p7;
+}
+
+// Pick the best implementation supported by the CPU.
+static void (*line_convert32_select())(uint32_t *, const uint16_t *,
+				       const uint32_t *)
+{
+#ifdef _MSC_VER
+  int info[4];
+  int max;
+  bool sse2;
+  bool avx2 = false;
+
+  __cpuid(info, 0);
+  max = info[0];
+  if (max < 1)
+    return line_convert32_c;
+  __cpuid(info, 1);
+  sse2 = ((info[3] >> 26) & 1);
+  // AVX and OSXSAVE, then YMM state enabled by the OS.
+  if ((max >= 7) &&
+      ((info[2] & 0x18000000) == 0x18000000) &&
+      ((_xgetbv(0) & 6) == 6))
+    {
+      __cpuidex(info, 7, 0);
+      avx2 = ((info[1] >> 5) & 1);
     }
-    return;
-  }
+#else
+  bool sse2;
+  bool avx2;
 
-  // Blit the tile!
-  if(which & 0x800) // x flipped
+  __builtin_cpu_init();
+  sse2 = __builtin_cpu_supports("sse2");
+  avx2 = __builtin_cpu_supports("avx2");
+#endif
+  if (avx2)
+    return line_convert32_avx2;
+  if (sse2)
+    return line_convert32_sse2;
+  return line_convert32_c;
+}
+
+static void (*const line_convert32)(uint32_t *, const uint16_t *,
+				    const uint32_t *) = line_convert32_select();
+
+#else // RAS_SIMD
+
+#define line_convert32 line_convert32_c
+
+#endif // RAS_SIMD
+
+// Convert line_buf to the output format, 320 dots wide.
+void md_vdp::draw_line(uint8_t *out)
+{
+  const uint32_t bg = highpal[reg[7]&0x3f]; // Get background color
+  uint32_t *lut = line_lut;
+  unsigned int i;
+
+  lut[(LINE_BACKGROUND | 0x00)] = bg;
+  lut[(LINE_BACKGROUND | 0x10)] = bg;
+  lut[(LINE_BACKGROUND | 0x20)] = bg;
+  lut[(LINE_BACKGROUND | 0x30)] = bg;
+  // Only 32bpp implements shadow/highlight operators.
+  switch (Bpp)
     {
-      if(tile & PIXEL7) *(wwhere  ) = p7;
-      if(tile & PIXEL6) *(wwhere+1) = p6;
-      if(tile & PIXEL5) *(wwhere+2) = p5;
-      if(tile & PIXEL4) *(wwhere+3) = p4;
-      if(tile & PIXEL3) *(wwhere+4) = p3;
-      if(tile & PIXEL2) *(wwhere+5) = p2;
-      if(tile & PIXEL1) *(wwhere+6) = p1;
-      if(tile & PIXEL0) *(wwhere+7) = p0;
-    } else {
-      if(tile & PIXEL0) *(wwhere  ) = p0;
-      if(tile & PIXEL1) *(wwhere+1) = p1;
-      if(tile & PIXEL2) *(wwhere+2) = p2;
-      if(tile & PIXEL3) *(wwhere+3) = p3;
-      if(tile & PIXEL4) *(wwhere+4) = p4;
-      if(tile & PIXEL5) *(wwhere+5) = p5;
-      if(tile & PIXEL6) *(wwhere+6) = p6;
-      if(tile & PIXEL7) *(wwhere+7) = p7;
+    case 1:
+      for (i = 0; (i != 320); ++i)
+	out[i] = lut[(dest[i] & 0x7f)];
+      break;
+    case 2:
+      for (i = 0; (i != 320); ++i)
+	((uint16_t *)out)[i] = lut[(dest[i] & 0x7f)];
+      break;
+    case 3:
+      for (i = 0; (i != 320); ++i)
+	u24cpy(&((uint24_t *)out)[i], (uint24_t *)&lut[(dest[i] & 0x7f)]);
+      break;
+    case 4:
+      line_convert32((uint32_t *)out, dest, lut);
+      break;
     }
 }
-#endif // WITH_X86_TILES
 
 // Draw the window (front or back)
 void md_vdp::draw_window(int line, int front)
@@ -747,7 +465,7 @@ void md_vdp::draw_window(int line, int front)
   int x, y, w, start;
   int pl, add;
   int total_window;
-  unsigned char *where;
+  uint16_t *where;
   int which;
   // Set everything up
   y = line >> 3;
@@ -768,7 +486,7 @@ void md_vdp::draw_window(int line, int front)
       start = 24;
     }
   add = -2;
-  where = dest + (start * (int)Bpp);
+  where = dest + start;
 	for (x = -1; (x < w); ++x) {
 		if (!total_window) {
 			if (reg[17] & 0x80) {
@@ -786,7 +504,7 @@ void md_vdp::draw_window(int line, int front)
 			draw_tile(which, (line & 7), where);
 	skip:
 		add += 2;
-		where += Bpp_times8;
+		where += 8;
 	}
 }
 
@@ -834,13 +552,49 @@ inline void md_vdp::get_sprite_info(struct sprite_info& info, int index)
 	info.h = (info.th << 3);
 }
 
+/*
+ * Decode sprites in display order up to the frame limit (80 in H40 and 64
+ * in H32) and sort them by the lines they appear on, so that
+ * sprite_masking_overflow() and draw_sprites() only have to go through
+ * those found on the current line.
+ */
+void md_vdp::sprite_lines_generate()
+{
+	int frame_limit = ((reg[12] & 1) ? 80 : 64);
+	int i;
+
+	memset(sprite_lines_count, 0, sizeof(sprite_lines_count));
+	sprite_list_end = sprite_count;
+	for (i = 0; (i < sprite_count); ++i) {
+		sprite_info& info = sprite_list[i];
+		int line;
+		int end;
+
+		if (sprite_order[i] >= frame_limit) {
+			sprite_list_end = i;
+			break;
+		}
+		get_sprite_info(info, sprite_order[i]);
+		line = info.y;
+		end = (info.y + info.h);
+		if (line < 0)
+			line = 0;
+		if (end > 256)
+			end = 256;
+		for (; (line < end); ++line)
+			sprite_lines[line][(sprite_lines_count[line]++)] = i;
+	}
+	sprite_lines_mode = (reg[12] & 3);
+}
+
 void md_vdp::sprite_masking_overflow(int line)
 {
 	int masking_sprite_index;
 	bool masking_effective;
-	int frame_limit;
 	int line_limit;
 	int dots;
+	unsigned int count;
+	unsigned int n;
 	int i;
 
 	/*
@@ -863,40 +617,23 @@ void md_vdp::sprite_masking_overflow(int line)
 	masking_effective = (sprite_overflow_line == (line - 1));
 	// Set sprites and dots limits for the current line.
 	if (reg[12] & 1) {
-		frame_limit = 80;
 		line_limit = 20;
 		dots = 320;
 	}
 	else {
-		frame_limit = 64;
 		line_limit = 16;
 		dots = 256;
 	}
-	for (i = 0; i < sprite_count; i++) {
-		int x, y, w, h;
-		int idx;
-		uint8_t *sprite;
-
-		// First, make sure the frame limit hasn't been reached.
-		idx = sprite_order[i];
-		if (idx >= frame_limit) {
-			if (masking_sprite_index == -1)
-				masking_sprite_index = (i - 1);
-			break;
-		}
+	// Only go through sprites found on the current line.
+	assert((line >= 0) && (line < 256));
+	count = sprite_lines_count[line];
+	for (n = 0; (n != count); ++n) {
+		int x, w;
+
+		i = sprite_lines[line][n];
 		// Get current sprite coordinates and dimensions.
-		sprite = (sprite_base + (idx << 3));
-		x = get_word(sprite + 6) & 0x1ff;
-		y = get_word(sprite);
-		if (reg[12] & 2)
-			y = ((y & 0x3fe) >> 1);
-		else
-			y &= 0x1ff;
-		h = (((sprite[2] & 0x03) << 3) + 8);
-		w = (((sprite[2] << 1) & 0x18) + 8);
-		// If this sprite isn't found on the current line, skip it.
-		if (!(((line + 0x80) >= y) && ((line + 0x80) < (y + h))))
-			continue;
+		x = get_word(sprite_list[i].sprite + 6) & 0x1ff;
+		w = sprite_list[i].w;
 		// Substract sprite from the dots limit and decrease the
 		// sprites limit.
 		dots -= w;
@@ -942,6 +679,11 @@ void md_vdp::sprite_masking_overflow(int line)
 		    (masking_sprite_index == -1))
 			masking_sprite_index = i;
 	}
+	// Stop at the frame limit if we get that far.
+	if ((n == count) &&
+	    (sprite_list_end != sprite_count) &&
+	    (masking_sprite_index == -1))
+		masking_sprite_index = (sprite_list_end - 1);
 	// If no masking sprite index was found, display them all.
 	if (masking_sprite_index == -1)
 		masking_sprite_index = (sprite_count - 1);
@@ -949,8 +691,20 @@ void md_vdp::sprite_masking_overflow(int line)
 	dots_cache = dots;
 }
 
-inline void md_vdp::sprite_mask_add(uint8_t* dest, int pitch,
-				    struct sprite_info& info, int value)
+/*
+ * Walk the dots of a sprite in the overlap mask. Coordinates in info are
+ * relative to sprite_mask.
+ *
+ * SPRITE_MASK_DRAW merges the sprite in sprite_mask (lowest index) and
+ * sprite_mask_top (highest index + 1). Both are order independent, so any
+ * subset of sprites can be redrawn over an area without clearing it first.
+ *
+ * SPRITE_MASK_TEST returns true when a non-transparent dot from a sprite
+ * with a higher index than value lies under this one, which is what the
+ * sprite collision bit is based on.
+ */
+inline bool md_vdp::sprite_mask_add(struct sprite_info& info, int value,
+				    enum sprite_mask_op op)
 {
 	uint32_t *tile = info.tile;
 	int len = (info.tw * info.h);
@@ -958,6 +712,248 @@ inline void md_vdp::sprite_mask_add(uint8_t* dest, int pitch,
 	int line = 0;
 	int wrap = 0;
 	int unit = 1;
+	int pitch = sizeof(sprite_mask[0]);
+	int pos = ((pitch * info.y) + info.x);
+
+	if (info.yflip) {
+		pos += (pitch * (info.h - 1));
+		pitch = -pitch;
+	}
+	if (info.xflip) {
+		pos += (info.w - 1);
+		unit = -unit;
+	}
+	while (len) {
+		uint_fast32_t dots = be2h32(*tile);
+		unsigned int tmp;
+
+		for (tmp = 0; (tmp != 8); ++tmp) {
+			bool dot;
+
+			assert(pos >= 0);
+			assert(pos < (int)sizeof(sprite_mask));
+#ifdef WORDS_BIGENDIAN
+			dot = (dots & 0x0000000f);
+			dots >>= 4;
+#else
+			dot = (dots & 0xf0000000);
+			dots <<= 4;
+#endif
+			switch (op) {
+			case SPRITE_MASK_DRAW:
+				if (!dot)
+					break;
+				if (value < sprite_mask[0][pos])
+					sprite_mask[0][pos] = value;
+				if (value >= sprite_mask_top[0][pos])
+					sprite_mask_top[0][pos] = (value + 1);
+				break;
+			case SPRITE_MASK_TEST:
+				if (sprite_mask_top[0][pos] > (value + 1))
+					return true;
+				break;
+			}
+			pos += unit;
+		}
+		++tile;
+		// Wrap around like tile numbers do in draw_tile().
+		if (tile == (uint32_t *)(vram + 0x10000))
+			tile = (uint32_t *)vram;
+		++line;
+		if (line == lines) {
+			/* Next tile. */
+			line = 0;
+			++wrap;
+			if (wrap == info.th) {
+				/* Next tiles column. */
+				pos -= (pitch * (info.h - 1));
+				wrap = 0;
+			}
+			else {
+				/* Next tiles row. */
+				pos += (pitch - (8 * unit));
+			}
+		}
+		else {
+			/* Next line of dots. */
+			pos -= (8 * unit);
+			pos += pitch;
+		}
+		--len;
+	}
+	return false;
+}
+
+/*
+ * Check whether the pattern data used by a sprite changed since the
+ * previous sprite_mask_generate() call.
+ */
+bool md_vdp::sprite_mask_stale(struct sprite_info& info)
+{
+	unsigned int start = ((uint8_t *)info.tile - vram);
+	unsigned int end = (start + (info.tw * info.h * 4));
+	unsigned int i;
+
+	// Interlaced sprites may point past VRAM, always redraw them.
+	if (start >= 0x10000)
+		return true;
+	for (i = (start >> 8); (i <= ((end - 1) >> 8)); ++i)
+		if (sprite_mask_dirt[((i & 0xff) >> 3)] & (1 << (i & 7)))
+			return true;
+	return false;
+}
+
+/*
+ * Update the overlap mask used for sprites with the high priority bit set
+ * and the sprite collision bit. Only sprites whose SAT entry, position in
+ * the list or pattern data changed since the previous call are redrawn,
+ * along with those sharing the same area.
+ */
+void md_vdp::sprite_mask_generate()
+{
+	struct sprite_mask_area area[(80 * 2)];
+	unsigned int areas = 0;
+	unsigned int i;
+	unsigned int j;
+	int y;
+
+	for (i = 0; (i != 80); ++i) {
+		struct sprite_mask_entry entry;
+		struct sprite_mask_entry& cache = sprite_mask_cache[i];
+		sprite_info& info = entry.info;
+
+		entry.used = false;
+		if ((int)i < sprite_count) {
+			get_sprite_info(info, sprite_order[i]);
+			// We only care about sprites with the low priority
+			// bit unset, and don't bother with hidden sprites.
+			entry.used = ((!info.prio) &&
+				      (info.x < 320) && ((info.x + info.w) >= 0) &&
+				      (info.y < 256) && ((info.y + info.h) >= 0));
+		}
+		if ((!entry.used) && (!cache.used))
+			continue;
+		if (entry.used) {
+			memcpy(entry.sat, info.sprite, sizeof(entry.sat));
+			entry.sat[3] = 0;
+			entry.mode = (reg[12] & 3);
+			info.x += 0x80;
+			info.y += 0x80;
+			entry.area.x0 = info.x;
+			entry.area.x1 = (info.x + info.w);
+			entry.area.y0 = info.y;
+			entry.area.y1 = (info.y + info.h);
+			// Interlaced sprites are drawn over a taller area.
+			if (info.inter) {
+				entry.area.y0 -= (info.h * 2);
+				entry.area.y1 += (info.h * 2);
+			}
+			if ((cache.used) &&
+			    (entry.mode == cache.mode) &&
+			    (!memcmp(entry.sat, cache.sat, sizeof(entry.sat))) &&
+			    (!sprite_mask_stale(info)))
+				continue;
+		}
+		if (cache.used)
+			area[(areas++)] = cache.area;
+		if (entry.used)
+			area[(areas++)] = entry.area;
+		cache = entry;
+	}
+	// VRAM changes have been taken into account.
+	memset(sprite_mask_dirt, 0, sizeof(sprite_mask_dirt));
+	if (areas) {
+		// Clear changed areas.
+		for (i = 0; (i != areas); ++i) {
+			struct sprite_mask_area& a = area[i];
+
+			if (a.x0 < 0)
+				a.x0 = 0;
+			if (a.x1 > 512)
+				a.x1 = 512;
+			if (a.y0 < 0)
+				a.y0 = 0;
+			if (a.y1 > 512)
+				a.y1 = 512;
+			if ((a.x0 >= a.x1) || (a.y0 >= a.y1))
+				continue;
+			for (y = a.y0; (y != a.y1); ++y) {
+				memset(&sprite_mask[y][a.x0], 0xff,
+				       (a.x1 - a.x0));
+				memset(&sprite_mask_top[y][a.x0], 0,
+				       (a.x1 - a.x0));
+			}
+		}
+		// Redraw sprites found there.
+		for (i = 0; (i != 80); ++i) {
+			struct sprite_mask_entry& e = sprite_mask_cache[i];
+
+			if (!e.used)
+				continue;
+			for (j = 0; (j != areas); ++j)
+				if ((e.area.x0 < area[j].x1) &&
+				    (e.area.x1 > area[j].x0) &&
+				    (e.area.y0 < area[j].y1) &&
+				    (e.area.y1 > area[j].y0))
+					break;
+			if (j != areas)
+				sprite_mask_add(e.info, i, SPRITE_MASK_DRAW);
+		}
+		// Look for collisions between overlapping sprites.
+		sprite_mask_collision = false;
+		for (i = 0; ((i != 80) && (!sprite_mask_collision)); ++i) {
+			struct sprite_mask_entry& e = sprite_mask_cache[i];
+
+			if (!e.used)
+				continue;
+			for (j = (i + 1); (j != 80); ++j) {
+				struct sprite_mask_entry& f = sprite_mask_cache[j];
+
+				if ((f.used) &&
+				    (e.area.x0 < f.area.x1) &&
+				    (e.area.x1 > f.area.x0) &&
+				    (e.area.y0 < f.area.y1) &&
+				    (e.area.y1 > f.area.y0))
+					break;
+			}
+			if ((j != 80) &&
+			    (sprite_mask_add(e.info, i, SPRITE_MASK_TEST)))
+				sprite_mask_collision = true;
+		}
+	}
+	if (sprite_mask_collision)
+		belongs.coo5 |= 0x20;
+#ifndef NDEBUG
+	{
+		bool collision;
+		int ret = sprite_mask_check(collision);
+
+		assert((ret > 0) ||
+		       ((ret == 0) && (collision == sprite_mask_collision)));
+	}
+#endif
+}
+
+/*
+ * Draw a sprite in a 512x512 overlap mask the way sprite_mask_generate()
+ * used to, before it was made incremental. Sprites must be drawn from the
+ * highest index to the lowest, over a mask initially filled with 0xff.
+ * Returns true when the sprite covers a dot from a previous one.
+ * This is kept as is to check the incremental version against it, don't
+ * share code between them.
+ */
+bool md_vdp::sprite_mask_ref_add(uint8_t (*mask)[512],
+				 struct sprite_info& info, int value)
+{
+	uint8_t *dest = mask[0];
+	uint32_t *tile = info.tile;
+	int pitch = sizeof(mask[0]);
+	int len = (info.tw * info.h);
+	int lines = (8 << info.inter);
+	int line = 0;
+	int wrap = 0;
+	int unit = 1;
+	bool hit = false;
 
 	dest += info.x;
 	dest += (pitch * info.y);
@@ -974,17 +970,16 @@ inline void md_vdp::sprite_mask_add(uint8_t* dest, int pitch,
 		unsigned int tmp;
 
 		for (tmp = 0; (tmp != 8); ++tmp) {
-			assert(dest >= (uint8_t *)sprite_mask);
-			assert(dest < ((uint8_t *)sprite_mask +
-				       sizeof(sprite_mask)));
+			assert(dest >= mask[0]);
+			assert(dest < (mask[0] + (512 * 512)));
 			/*
 			 * If a non-transparent sprite dot has already been
 			 * drawn here, trigger the collision bit (d5).
-			 * FIXME: doing this here is hackish and doesn't take
-			 * sprites with the high priority bit into account.
+			 * FIXME: this doesn't take sprites with the high
+			 * priority bit into account.
 			 */
 			if (*dest != 0xff)
-				belongs.coo5 |= 0x20;
+				hit = true;
 #ifdef WORDS_BIGENDIAN
 			if (dots & 0x0000000f)
 				*dest = value;
@@ -1019,31 +1014,50 @@ inline void md_vdp::sprite_mask_add(uint8_t* dest, int pitch,
 		}
 		--len;
 	}
+	return hit;
 }
 
-void md_vdp::sprite_mask_generate()
+/*
+ * Rebuild the overlap mask from scratch with sprite_mask_ref_add() and
+ * compare it with sprite_mask, as updated by the last
+ * sprite_mask_generate() call. collision is set to whether the sprite
+ * collision bit must be set.
+ * Returns 0 when both masks match, -1 when they differ, 1 when they can't
+ * be compared because a sprite uses pattern data past the end of VRAM,
+ * which the original algorithm doesn't wrap around.
+ */
+int md_vdp::sprite_mask_check(bool& collision)
 {
+	uint8_t (*ref)[512] = new uint8_t[512][512];
+	int ret = 0;
 	int i;
 
-	memset(sprite_mask, 0xff, sizeof(sprite_mask));
+	collision = false;
+	memset(ref, 0xff, (sizeof(ref[0]) * 512));
 	for (i = (sprite_count - 1); (i >= 0); --i) {
 		sprite_info info;
 
 		get_sprite_info(info, sprite_order[i]);
-		// We only care about sprites with the low priority bit unset.
 		if (info.prio)
 			continue;
-		// Don't bother with hidden sprites.
 		if ((info.x >= 320) || ((info.x + info.w) < 0))
 			continue;
 		if ((info.y >= 256) || ((info.y + info.h) < 0))
 			continue;
+		if ((((uint8_t *)info.tile - vram) +
+		     (info.tw * info.h * 4)) > 0x10000) {
+			ret = 1;
+			break;
+		}
 		info.x += 0x80;
 		info.y += 0x80;
-		// Draw overlap mask for this sprite in a 512x512 virtual area.
-		sprite_mask_add((uint8_t *)sprite_mask, sizeof(sprite_mask[0]),
-				info, i);
+		if (sprite_mask_ref_add(ref, info, i))
+			collision = true;
 	}
+	if ((ret == 0) && (memcmp(ref, sprite_mask, sizeof(sprite_mask))))
+		ret = -1;
+	delete[] ref;
+	return ret;
 }
 
 void md_vdp::draw_sprites(int line, bool front)
@@ -1051,31 +1065,22 @@ void md_vdp::draw_sprites(int line, bool front)
   unsigned int which;
   int tx, ty, x, y, xend, ysize, yoff, i, masking_sprite_index;
   int dots;
-  unsigned char *where;
-#ifdef WITH_DEBUG_VDP
-  static int ant[2];
-  static unsigned long ant_last[2];
-  unsigned long ant_cur;
+  unsigned int n;
+  uint16_t *where;
 
-  if ((dgen_vdp_sprites_boxing) && (line == 0)) {
-    ant_cur = pd_usecs();
-    if ((ant_cur - ant_last[front]) > 100000) {
-      ant_last[front] = ant_cur;
-      ant[front] ^= 1;
-    }
-  }
-#endif
   masking_sprite_index = masking_sprite_index_cache;
   dots = dots_cache;
   // If dots_cache is less than zero, draw the first sprite partially.
   if (dots > 0)
     dots = 0;
   // Sprites have to be in reverse order :P
-  for (i = masking_sprite_index; i >= 0; --i)
+  for (n = sprite_lines_count[line]; n != 0; )
     {
-      sprite_info info;
+      i = sprite_lines[line][--n];
+      if (i > masking_sprite_index)
+	continue;
+      sprite_info& info = sprite_list[i];
 
-      get_sprite_info(info, sprite_order[i]);
       // Only do it if it's on the right priority.
       if (info.prio == front)
 	{
@@ -1103,23 +1108,23 @@ void md_vdp::draw_sprites(int line, bool front)
 	      if (!front) {
 		// x flipped?
 		if (which & 0x800) {
-		  where = dest + (xend * (int)Bpp);
+		  where = dest + xend;
 		  for(tx = xend; tx >= x; tx -= 8)
 		    {
 		      if(tx > -8 && tx < 320)
 			draw_tile(which, ty, where);
 		      which += ysize;
-		      where -= Bpp_times8;
+		      where -= 8;
 		    }
 	        }
 		else {
-		  where = dest + (x * (int)Bpp);
+		  where = dest + x;
 		  for(tx = x; tx <= xend; tx += 8)
 		    {
 		      if(tx > -8 && tx < 320)
 			draw_tile(which, ty, where);
 		      which += ysize;
-		      where += Bpp_times8;
+		      where += 8;
 		    }
 		}
 	      }
@@ -1128,80 +1133,112 @@ void md_vdp::draw_sprites(int line, bool front)
 	      // list) but with this bit unset. Those have already been drawn
 	      // during the previous pass.
 	      else {
-		union {
-		  uint32_t t4[8];
-		  uint24_t t3[8];
-		  uint16_t t2[8];
-		  uint8_t t1[8];
-		} tile;
+		uint16_t tile[8];
 
 		// x flipped?
 		if (which & 0x800) {
-		  where = dest + (xend * (int)Bpp);
+		  where = dest + xend;
 		  for (tx = xend; (tx >= x); tx -= 8) {
 		    if ((tx > -8) && (tx < 320)) {
 		      int xx;
 		      int xo;
 
-		      memcpy(tile.t1, where, Bpp_times8);
-		      draw_tile(which, ty, tile.t1);
+		      memcpy(tile, where, sizeof(tile));
+		      draw_tile(which, ty, tile);
 		      for (xx = tx, xo = 0; (xo != 8); ++xo, ++xx)
 			if (sprite_mask[(line + 0x80)][(xx + 0x80)] >= i)
-			  memcpy(&dest[(xx * (int)Bpp)],
-				 &tile.t1[(xo * (int)Bpp)],
-				 (int)Bpp);
+			  dest[xx] = tile[xo];
 		    }
 		    which += ysize;
-		    where -= Bpp_times8;
+		    where -= 8;
 		  }
 	        }
 		else {
-		  where = dest + (x * (int)Bpp);
+		  where = dest + x;
 		  for (tx = x; (tx <= xend); tx += 8) {
 		    if ((tx > -8) && (tx < 320)) {
 		      int xx;
 		      int xo;
 
-		      memcpy(tile.t1, where, Bpp_times8);
-		      draw_tile(which, ty, tile.t1);
+		      memcpy(tile, where, sizeof(tile));
+		      draw_tile(which, ty, tile);
 		      for (xx = tx, xo = 0; (xo != 8); ++xo, ++xx)
 			if (sprite_mask[(line + 0x80)][(xx + 0x80)] >= i)
-			  memcpy(&dest[(xx * (int)Bpp)],
-				 &tile.t1[(xo * (int)Bpp)],
-				 (int)Bpp);
+			  dest[xx] = tile[xo];
 		    }
 		    which += ysize;
-		    where += Bpp_times8;
+		    where += 8;
 		  }
 		}
 	      }
-#ifdef WITH_DEBUG_VDP
-	      if (dgen_vdp_sprites_boxing) {
-		uint32_t color[2] = {
-		  (uint32_t)dgen_vdp_sprites_boxing_bg,
-		  (uint32_t)dgen_vdp_sprites_boxing_fg
-		};
-		int ph;
-		int fx;
-
-		if ((ph = 0, (y == line)) ||
-		    (ph = 1, ((y + info.h - 1) == line)))
-		  for (fx = (ant[front] ^ ph); (fx < info.w); fx += 2)
-		    draw_pixel(this->bmap, (info.x + fx),
-			       line, color[info.prio]);
-		else
-		  draw_pixel(this->bmap,
-			     (((line & 1) == ant[front]) ?
-			      (info.x + info.w - 1) : info.x),
-			     line, color[info.prio]);
-	      }
-#endif
 	    }
 	}
       dots = 0;
     }
 }
 
+#ifdef WITH_DEBUG_VDP
+// Draw boxes around the sprites drawn on this line by draw_sprites(). This
+// is done directly in the output, after draw_line().
+void md_vdp::draw_sprites_boxing(int line)
+{
+  static int ant[2];
+  static unsigned long ant_last[2];
+  unsigned long ant_cur;
+  uint32_t color[2] = {
+    (uint32_t)dgen_vdp_sprites_boxing_bg,
+    (uint32_t)dgen_vdp_sprites_boxing_fg
+  };
+  int x, y, xend, yoff, i, masking_sprite_index;
+  int dots;
+  unsigned int n;
+  unsigned int front;
+
+  if (line == 0) {
+    ant_cur = pd_usecs();
+    for (front = 0; (front != 2); ++front)
+      if ((ant_cur - ant_last[front]) > 100000) {
+	ant_last[front] = ant_cur;
+	ant[front] ^= 1;
+      }
+  }
+  masking_sprite_index = masking_sprite_index_cache;
+  dots = dots_cache;
+  if (dots > 0)
+    dots = 0;
+  // Same order and conditions as draw_sprites().
+  for (n = sprite_lines_count[line]; n != 0; )
+    {
+      i = sprite_lines[line][--n];
+      if (i > masking_sprite_index)
+	continue;
+      sprite_info& info = sprite_list[i];
+      int ph;
+      int fx;
+
+      front = info.prio;
+      y = info.y;
+      x = info.x;
+      yoff = (line - y);
+      xend = ((info.w - 8) + x + dots);
+      dots = 0;
+      if (!(xend > -8 && x < 320 && yoff >= 0 &&
+	    yoff <= ((((info.h - 8) >> 3) << 3) + 7)))
+	continue;
+      if ((ph = 0, (y == line)) ||
+	  (ph = 1, ((y + info.h - 1) == line)))
+	for (fx = (ant[front] ^ ph); (fx < info.w); fx += 2)
+	  draw_pixel(this->bmap, (info.x + fx),
+		     line, color[info.prio]);
+      else
+	draw_pixel(this->bmap,
+		   (((line & 1) == ant[front]) ?
+		    (info.x + info.w - 1) : info.x),
+		   line, color[info.prio]);
+    }
+}
+#endif
+
 // The body for the next few functions is in an extraneous header file.
 // Phil, I hope I left enough in this file for GLOBAL to hack it right. ;)
 // Thanks to John Stiles for this trick :)
@@ -1272,13 +1309,53 @@ static uint32_t lerp_rgba32(const uint32_t a, const uint32_t b, const float frac
 	return c0 | (c1 << 8) | (c2 << 16);
 }
 
+/*
+ * Go through VRAM areas marked as changed in dirt[0x00-0x1f] to decode
+ * their tiles again, then hand these changes over to
+ * sprite_mask_generate().
+ */
+void md_vdp::tile_cache_update()
+{
+	unsigned int i;
+	unsigned int j;
+
+	for (i = 0; (i != 0x20); ++i) {
+		uint8_t bits = dirt[i];
+
+		if (bits == 0)
+			continue;
+		dirt[i] = 0;
+		sprite_mask_dirt[i] |= bits;
+		for (j = 0; (j != 8); ++j) {
+			unsigned int addr;
+			unsigned int end;
+
+			if (!(bits & (1 << j)))
+				continue;
+			// 256 bytes per bit, 4 bytes per tile line.
+			addr = (((i << 3) + j) << 8);
+			for (end = (addr + 0x100); (addr != end); addr += 4) {
+				tile_decode(tile_cache[(addr >> 2)][0],
+					    (vram + addr), false);
+				tile_decode(tile_cache[(addr >> 2)][1],
+					    (vram + addr), true);
+			}
+		}
+	}
+}
+
 // The main interface function, to generate a scanline
 void md_vdp::draw_scanline(struct bmap *bits, int line)
 {
   unsigned *ptr, i;
+  uint8_t *out;
   // Set the destination in the bmap
   bmap = bits;
-  dest = bits->data + (bits->pitch * (line + 8) + 16);
+  out = bits->data + (bits->pitch * (line + 8) + 16);
+  dest = (line_buf + 8);
+  // Decode tiles that changed in VRAM
+  if (dirt[0x34] & 1)
+    tile_cache_update();
   // If bytes per pixel hasn't yet been set, do it
   if ((Bpp == 0) || (Bpp != BITS_TO_BYTES(bits->bpp)))
     {
@@ -1286,10 +1363,7 @@ void md_vdp::draw_scanline(struct bmap *bits, int line)
       else if(bits->bpp <= 16) Bpp = 2;
       else if(bits->bpp <= 24) Bpp = 3;
       else		       Bpp = 4;
-      Bpp_times8 = Bpp << 3; // used for tile blitting
-#ifdef WITH_X86_TILES
-      asm_tiles_init(vram, reg, highpal); // pass these values to the asm tiles
-#endif
+      Bpp_times8 = Bpp << 3;
     }
 
   // If the palette's been changed, update it
@@ -1342,6 +1416,7 @@ void md_vdp::draw_scanline(struct bmap *bits, int line)
 	  // Let the hardware palette sort it out :P
 	  for(i = 0; i < 64; ++i) *ptr++ = i;
 	}
+      memcpy(line_lut, highpal, sizeof(highpal));
       // Clean up the dirt
       dirt[0x34] &= ~2;
       pal_dirty = 1;
@@ -1367,12 +1442,20 @@ void md_vdp::draw_scanline(struct bmap *bits, int line)
 	  dirt[0x30] &= ~0x20; dirt[0x34] &= ~1;
 	  // Generate overlap mask for sprites with high priority bit
 	  sprite_mask_generate();
+	  // Sprites must be sorted by line again
+	  sprite_lines_mode = -1;
 	}
+      // Sort sprites by line, also when the display mode has changed
+      if (sprite_lines_mode != (reg[12] & 3))
+	sprite_lines_generate();
       // Calculate sprite masking and overflow.
       sprite_masking_overflow(line);
+      // Shadow/highlight is only rendered in 32bpp.
+      line_sh = ((reg[12] & 8) && (Bpp == 4));
       // Draw, from the bottom up
       // Low priority
 	  drawing_high = false;
+	  line_shadow = (line_sh ? (LINE_SHADOW << LINE_OPS_SHIFT) : 0);
 	  drawing_layer = 0;
       vdp_hide_if(dgen_vdp_hide_plane_b, draw_plane_back1(line));
 	  drawing_layer = 1;
@@ -1383,6 +1466,7 @@ void md_vdp::draw_scanline(struct bmap *bits, int line)
 	  vdp_hide_if(dgen_vdp_hide_sprites, draw_sprites(line, 0));
       // High priority
 	  drawing_high = true;
+	  line_shadow = 0;
 	  drawing_layer = 0;
 	  vdp_hide_if(dgen_vdp_hide_plane_b, draw_plane_front1(line));
 	  drawing_layer = 1;
@@ -1391,10 +1475,16 @@ void md_vdp::draw_scanline(struct bmap *bits, int line)
 	  vdp_hide_if(dgen_vdp_hide_plane_w, draw_window(line, 1));
 	  drawing_layer = 3;
 	  vdp_hide_if(dgen_vdp_hide_sprites, draw_sprites(line, 1));
+      // Convert the result to the output format
+      draw_line(out);
+#ifdef WITH_DEBUG_VDP
+      if (dgen_vdp_sprites_boxing)
+	draw_sprites_boxing(line);
+#endif
     } else {
       // The display is off, paint it black
       // Do it a dword at a time
-      unsigned *destl = (unsigned*)dest;
+      unsigned *destl = (unsigned*)out;
       for(i = 0; i < (80 * Bpp); ++i) destl[i] = 0;
     }
     drawing_high = false;
@@ -1403,7 +1493,7 @@ void md_vdp::draw_scanline(struct bmap *bits, int line)
   // If we're in narrow (256) mode, cut off the messy edges
   if(!(reg[12] & 1))
   {
-      unsigned *destl = (unsigned*)dest;
+      unsigned *destl = (unsigned*)out;
       for(i = 0; i < Bpp_times8; ++i)
         destl[i] = destl[i + (72 * Bpp)] = 0;
 
@@ -1411,7 +1501,7 @@ void md_vdp::draw_scanline(struct bmap *bits, int line)
 	  {
 		  //possible todo - could offer a more accurate step function, haven't read on what the signal is actually doing in this mode
 		  //could also make very speedy with a lut
-		  static uint32_t sTempLine[256];
+		  uint32_t sTempLine[256];
 		  memcpy(sTempLine, destl + 32, sizeof(sTempLine));
 		  const float step = 1.0f / 320.0f;
 		  float currentStep = 0.0f;
@@ -108,18 +108,24 @@ RCCTL(dgen_slot_next, PDK_F8, 0, 0);
 RCCTL(dgen_slot_prev, PDK_F7, 0, 0);
 RCCTL(dgen_save, PDK_F2, 0, 0);
 RCCTL(dgen_load, PDK_F3, 0, 0);
+RCCTL(dgen_rewind, 'r', 0, 0);
 
 RCVAR(dgen_autoload, 0);
 RCVAR(dgen_autosave, 0);
 RCVAR(dgen_autoconf, 1);
 RCVAR(dgen_frameskip, 1);
 RCVAR(dgen_show_carthead, 0);
+RCVAR(dgen_rewind_size, 32); // MiB, 0 disables rewinding
+RCVAR(dgen_rewind_interval, 2);
+RCVAR(dgen_runahead, 0);
 RCSTR(dgen_rom_path, "roms"); /* synchronize with romload.c */
 
 RCVAR(dgen_sound, 1);
 RCVAR(dgen_soundrate, 44100);
 RCVAR(dgen_soundsegs, 8);
 RCVAR(dgen_soundsamples, 0);
+RCVAR(dgen_sound_drc, 1);
+RCVAR(dgen_sound_master, 0);
 RCVAR(dgen_volume, 100);
 RCVAR(dgen_mjazz, 0);
 
@@ -129,6 +135,7 @@ RCVAR(dgen_region, 0);
 RCSTR(dgen_region_order, "JUEX");
 
 RCVAR(dgen_raw_screenshots, 0);
+RCVAR(dgen_png_screenshots, 1);
 RCVAR(dgen_craptv, 0);
 RCVAR(dgen_scaling, 0);
 RCVAR(dgen_nice, 0);
@@ -172,6 +179,7 @@ RCVAR(dgen_h32_stretch, 0);
 #define YM_CHIPIMPL_DEFAULT 0
 #define YM_CHIPIMPL_NUKEDOPN2 1
 RCVAR(dgen_ym_chipimpl, YM_CHIPIMPL_DEFAULT);
+RCVAR(dgen_ym_thread, 1);
 RCVAR(dgen_window_width, 0);
 RCVAR(dgen_window_height, 0);
 
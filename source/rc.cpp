@@ -732,6 +732,12 @@ struct rc_field rc_fields[RC_FIELDS_SIZE] = {
 	{ "key_load", rc_keysym, &dgen_load[RCBK] },
 	{ "joy_load", rc_joypad, &dgen_load[RCBJ] },
 	{ "mou_load", rc_mouse, &dgen_load[RCBM] },
+	{ "key_rewind", rc_keysym, &dgen_rewind[RCBK] },
+	{ "joy_rewind", rc_joypad, &dgen_rewind[RCBJ] },
+	{ "mou_rewind", rc_mouse, &dgen_rewind[RCBM] },
+	{ "int_rewind_size", rc_number, &dgen_rewind_size },
+	{ "int_rewind_interval", rc_number, &dgen_rewind_interval },
+	{ "int_runahead", rc_number, &dgen_runahead },
 	{ "key_z80_toggle", rc_keysym, &dgen_z80_toggle[RCBK] },
 	{ "joy_z80_toggle", rc_joypad, &dgen_z80_toggle[RCBJ] },
 	{ "mou_z80_toggle", rc_mouse, &dgen_z80_toggle[RCBM] },
@@ -764,6 +770,7 @@ struct rc_field rc_fields[RC_FIELDS_SIZE] = {
 	{ "int_h32_stretch", rc_number, &dgen_h32_stretch },
 	{ "int_ym_lowpass_cutoff", rc_number, &dgen_ym_lowpass_cutoff },
 	{ "int_ym_chipimpl", rc_number, &dgen_ym_chipimpl },
+	{ "bool_ym_thread", rc_boolean, &dgen_ym_thread },
 	{ "int_window_width", rc_number, &dgen_window_width },
 	{ "int_window_height", rc_number, &dgen_window_height },
 #ifdef WITH_SEGAVR
@@ -837,6 +844,7 @@ struct rc_field rc_fields[RC_FIELDS_SIZE] = {
 	{ "str_rom_path", rc_rom_path,
 	  (intptr_t *)((void *)&dgen_rom_path) }, // SH
 	{ "bool_raw_screenshots", rc_boolean, &dgen_raw_screenshots },
+	{ "bool_png_screenshots", rc_boolean, &dgen_png_screenshots },
 	{ "ctv_craptv_startup", rc_ctv, &dgen_craptv }, // SH
 	{ "scaling_startup", rc_scaling, &dgen_scaling }, // SH
 	{ "emu_z80_startup", rc_emu_z80, &dgen_emu_z80 }, // SH
@@ -845,6 +853,8 @@ struct rc_field rc_fields[RC_FIELDS_SIZE] = {
 	{ "int_soundrate", rc_soundrate, &dgen_soundrate }, // SH
 	{ "int_soundsegs", rc_number, &dgen_soundsegs }, // SH
 	{ "int_soundsamples", rc_number, &dgen_soundsamples }, // SH
+	{ "bool_sound_drc", rc_boolean, &dgen_sound_drc },
+	{ "bool_sound_master", rc_boolean, &dgen_sound_master },
 	{ "int_volume", rc_number, &dgen_volume },
 	{ "key_volume_inc", rc_keysym, &dgen_volume_inc[RCBK] },
 	{ "joy_volume_inc", rc_joypad, &dgen_volume_inc[RCBJ] },
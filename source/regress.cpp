@@ -0,0 +1,937 @@
+// DGen/SDL regression runner.
+// Runs every ROM of a directory for a number of frames (or through its demo)
+// on parallel md instances, hashes each frame's picture and sound, and
+// compares them with golden hash files written by a previous run.
+// Also checks the incrementally updated sprite overlap mask against a full
+// rebuild over random VDP changes (-S).
+
+#include "platform.h"
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#include <dirent.h>
+#endif
+#include <sys/stat.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define IS_MAIN_CPP
+#include "system.h"
+#include "md.h"
+#include "pd.h"
+#include "rc.h"
+#include "rc-vars.h"
+#include "movie.h"
+
+// Required by the core, normally defined in main.cpp.
+FILE *debug_log = NULL;
+int demo_finished = 0;
+int slot = 0;
+
+// Demo files are looked up next to each ROM, named after it plus this.
+#define REGRESS_DEMO_EXT ".demo"
+// Golden hash files are named after each ROM plus this.
+#define REGRESS_HASH_EXT ".hash"
+// Sprite attribute tables used by the sprite mask check, pattern data
+// is below them.
+#define REGRESS_SAT0 0xa000
+#define REGRESS_SAT1 0xb000
+#define REGRESS_PATTERNS 0x4000
+
+// Regression settings.
+static struct {
+	const char *romdir;
+	const char *golden; // where golden files are, romdir by default
+	unsigned long frames; // frames to run for ROMs without a demo
+	unsigned int jobs; // 0 for one per hardware thread
+	bool update; // write golden files instead of comparing
+	int bpp;
+} regress = {
+	NULL, NULL, 600, 0, false, 32
+};
+
+// Hashes of a single frame.
+struct regress_frame {
+	uint64_t video;
+	uint64_t audio;
+};
+
+// State and results of a single ROM.
+struct regress_rom {
+	std::string name; // file name in romdir
+	enum {
+		PASS, // all frames match
+		FAIL, // some frames differ
+		UPDATED, // golden file written
+		MISSING, // no golden file
+		ERROR
+	} status;
+	std::string error;
+	unsigned long frames;
+	unsigned long golden_frames; // frames in the golden file
+	unsigned long usecs;
+	unsigned long diverged; // first frame that differs
+	unsigned long differ; // number of frames that differ
+	bool video; // video differs in the first divergent frame
+	bool audio; // audio differs in the first divergent frame
+};
+
+// Show help and exit with code 2
+static void help()
+{
+	printf(
+	"DGen/SDL v" VER "\n"
+	"Usage: dgen_regress [options] romdir\n"
+	"       dgen_regress -S STEPS\n\n"
+	"Runs each ROM in romdir and compares per-frame picture and sound\n"
+	"hashes with golden files (romname" REGRESS_HASH_EXT "). When romname"
+	REGRESS_DEMO_EXT "\n"
+	"exists (recorded with dgen -d), it provides the starting state, input\n"
+	"and the number of frames to run.\n\n"
+	"With -S, checks the sprite overlap mask (sprite collisions and\n"
+	"masking) instead, over STEPS random changes to sprites, their pattern\n"
+	"data and display modes.\n\n"
+	"Where options are:\n"
+	"    -v              Print version number and exit.\n"
+	"    -r RCFILE       Read in the file RCFILE after parsing\n"
+	"                    $HOME/.dgen/dgenrc.\n"
+	"    -g DIR          Read and write golden files in DIR instead of\n"
+	"                    romdir.\n"
+	"    -u              Write golden files from this run instead of\n"
+	"                    comparing.\n"
+	"    -f FRAMES       Number of frames to run for ROMs without a demo\n"
+	"                    (default 600).\n"
+	"    -j JOBS         Number of ROMs to run in parallel (default: one\n"
+	"                    per hardware thread).\n"
+	"    -b BPP          Screen depth to hash (8, 15, 16, 24 or 32,\n"
+	"                    default 32).\n"
+	"    -R (J|X|U|E| )  Force emulator region.\n"
+	"    -S STEPS        Check the sprite overlap mask over STEPS random\n"
+	"                    VDP changes.\n"
+	);
+	exit(2);
+}
+
+/**
+ * Hash a buffer (FNV-1a, 64-bit words at a time).
+ * @param data Buffer.
+ * @param size Size in bytes.
+ * @param h Previous hash value, to hash several buffers together.
+ * @return Hash value.
+ */
+static uint64_t regress_hash(const void *data, size_t size,
+			     uint64_t h = 0xcbf29ce484222325ULL)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	uint64_t w;
+
+	for (; (size >= sizeof(w)); size -= sizeof(w), p += sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		h = ((h ^ w) * 0x100000001b3ULL);
+	}
+	for (; (size != 0); --size, ++p)
+		h = ((h ^ *p) * 0x100000001b3ULL);
+	return h;
+}
+
+/**
+ * Settings that make hashes differ, golden files must match them.
+ * @param[out] buf Where to store the description.
+ * @param size Size of buf.
+ */
+static void regress_settings(char *buf, size_t size)
+{
+	snprintf(buf, size,
+		 "bpp=%d rate=%d m68k=%s z80=%s ym2612=%s region=%c",
+		 regress.bpp, (int)dgen_soundrate,
+		 emu_m68k_names[dgen_emu_m68k], emu_z80_names[dgen_emu_z80],
+#ifdef WITH_NUKEDOPN2
+		 ((dgen_ym_chipimpl == YM_CHIPIMPL_NUKEDOPN2) ?
+		  "nukedopn2" : "mame"),
+#else
+		 "mame",
+#endif
+		 (dgen_region ? (char)dgen_region : '-'));
+}
+
+/**
+ * Build the path of a file in a directory.
+ * @param dir Directory.
+ * @param name File name.
+ * @param ext Extension appended to name.
+ * @return Path name.
+ */
+static std::string regress_path(const char *dir, const std::string &name,
+				const char *ext)
+{
+	std::string path(dir);
+
+	if ((!path.empty()) && (strchr(DGEN_DIRSEP, path.back()) == NULL))
+		path += DGEN_DIRSEP[0];
+	path += name;
+	path += ext;
+	return path;
+}
+
+/**
+ * Read a golden file.
+ * @param path File name.
+ * @param[out] frames Hashes found in the file.
+ * @param[out] error Error message.
+ * @return 0 on success, 1 if the file doesn't exist, -1 on error.
+ */
+static int regress_golden_read(const std::string &path,
+			       std::vector<regress_frame> &frames,
+			       std::string &error)
+{
+	FILE *file = fopen(path.c_str(), "r");
+	char settings[128];
+	char line[256];
+	size_t len;
+
+	if (file == NULL) {
+		if (errno == ENOENT)
+			return 1;
+		error = (path + ": " + strerror(errno));
+		return -1;
+	}
+	regress_settings(settings, sizeof(settings));
+	len = strlen(settings);
+	while (fgets(line, sizeof(line), file) != NULL) {
+		unsigned long n;
+		unsigned long long video;
+		unsigned long long audio;
+
+		if (!strncmp(line, "# settings: ", 12)) {
+			if ((strncmp(&line[12], settings, len)) ||
+			    (line[(12 + len)] != '\n')) {
+				error = (path + ": made with different"
+					 " settings, " + &line[12]);
+				error.erase(error.find_last_not_of('\n') + 1);
+				fclose(file);
+				return -1;
+			}
+			continue;
+		}
+		if ((line[0] == '#') || (line[0] == '\n'))
+			continue;
+		if ((sscanf(line, "%lu %llx %llx", &n, &video, &audio) != 3) ||
+		    (n != frames.size())) {
+			error = (path + ": invalid line for frame " +
+				 std::to_string(frames.size()));
+			fclose(file);
+			return -1;
+		}
+		frames.push_back({ video, audio });
+	}
+	fclose(file);
+	return 0;
+}
+
+/**
+ * Write a golden file.
+ * @param path File name.
+ * @param name ROM name, for reference.
+ * @param frames Hashes.
+ * @param[out] error Error message.
+ * @return 0 on success, -1 on error.
+ */
+static int regress_golden_write(const std::string &path,
+				const std::string &name,
+				const std::vector<regress_frame> &frames,
+				std::string &error)
+{
+	FILE *file = fopen(path.c_str(), "w");
+	char settings[128];
+	size_t i;
+
+	if (file == NULL) {
+		error = (path + ": " + strerror(errno));
+		return -1;
+	}
+	regress_settings(settings, sizeof(settings));
+	fprintf(file,
+		"# DGen/SDL v" VER " regression hashes for %s\n"
+		"# settings: %s\n"
+		"# frame video audio\n",
+		name.c_str(), settings);
+	for (i = 0; (i != frames.size()); ++i)
+		fprintf(file, "%lu %016llx %016llx\n", (unsigned long)i,
+			(unsigned long long)frames[i].video,
+			(unsigned long long)frames[i].audio);
+	if (fclose(file)) {
+		error = (path + ": " + strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Run a ROM, hash all frames and compare them with its golden file.
+ * Several of these may run at once, each with its own md instance.
+ * @param rom ROM to run, results are stored there.
+ */
+static void regress_run(regress_rom &rom)
+{
+	std::string path = regress_path(regress.romdir, rom.name, "");
+	std::string golden_path = regress_path(regress.golden, rom.name,
+					       REGRESS_HASH_EXT);
+	std::vector<regress_frame> golden;
+	std::vector<regress_frame> frames;
+	std::vector<uint8_t> screen;
+	std::vector<int16_t> sound;
+	unsigned char palette[256];
+	struct bmap bm;
+	struct sndinfo si;
+	FILE *file;
+	movie demo;
+	md *megad;
+	unsigned long start;
+	unsigned long limit = regress.frames;
+	uint8_t region;
+	int pal;
+	int hz;
+
+	rom.status = regress_rom::ERROR;
+	if (!regress.update) {
+		switch (regress_golden_read(golden_path, golden, rom.error)) {
+		case 0:
+			break;
+		case 1:
+			rom.status = regress_rom::MISSING;
+			rom.error = (golden_path + " not found");
+			return;
+		default:
+			return;
+		}
+	}
+	megad = new md(false, dgen_region);
+	if (!megad->okay()) {
+		rom.error = "Mega Drive initialization failed";
+		delete megad;
+		return;
+	}
+	if (megad->load(path.c_str())) {
+		rom.error = ("unable to load " + path);
+		delete megad;
+		return;
+	}
+	megad->pad[0] = MD_PAD_UNTOUCHED;
+	megad->pad[1] = MD_PAD_UNTOUCHED;
+	megad->reset();
+	// Region settings from ROM header unless forced, like dgen does.
+	region = (dgen_region ? dgen_region : megad->region_guess());
+	md::region_info(region, &pal, &hz, 0, 0, 0);
+	megad->region = region;
+	megad->pal = pal;
+	megad->init_pal();
+	megad->init_sound();
+	// Private screen and sound buffers, the pd ones are shared.
+	memset(&bm, 0, sizeof(bm));
+	bm.w = (320 + 16);
+	bm.h = (240 + 16);
+	bm.bpp = regress.bpp;
+	bm.pitch = (bm.w * ((bm.bpp + 1) / 8));
+	screen.resize(bm.h * bm.pitch);
+	bm.data = screen.data();
+	memset(palette, 0, sizeof(palette));
+	si.len = (dgen_soundrate / hz);
+	sound.resize(si.len * 2);
+	si.lr = sound.data();
+	// Demo length overrides the number of frames.
+	file = fopen(regress_path(regress.romdir, rom.name,
+				  REGRESS_DEMO_EXT).c_str(), "rb");
+	if (file != NULL) {
+		if (demo.play(file, *megad)) {
+			rom.error = ("unable to play " + rom.name +
+				     REGRESS_DEMO_EXT);
+			delete megad;
+			return;
+		}
+		if (demo.remaining() != ULONG_MAX)
+			limit = demo.remaining();
+	}
+	frames.reserve(limit);
+	start = pd_usecs();
+	while (frames.size() != limit) {
+		regress_frame f;
+
+		if ((file != NULL) && (demo.frame(*megad)))
+			break;
+		megad->one_frame(&bm, ((bm.bpp == 8) ? palette : NULL), &si);
+		f.video = regress_hash(bm.data, screen.size());
+		if (bm.bpp == 8)
+			f.video = regress_hash(palette, sizeof(palette),
+					       f.video);
+		f.audio = regress_hash(si.lr, (si.len * 2 * sizeof(si.lr[0])));
+		frames.push_back(f);
+	}
+	rom.usecs = (pd_usecs() - start);
+	if (rom.usecs == 0)
+		rom.usecs = 1;
+	rom.frames = frames.size();
+	demo.close();
+	delete megad;
+	if (regress.update) {
+		if (regress_golden_write(golden_path, rom.name, frames,
+					 rom.error) == 0)
+			rom.status = regress_rom::UPDATED;
+		return;
+	}
+	rom.status = regress_rom::PASS;
+	rom.differ = 0;
+	rom.golden_frames = golden.size();
+	// Frames past the end of the shortest run only make lengths differ.
+	for (size_t i = 0; (i != std::min(frames.size(), golden.size()));
+	     ++i) {
+		bool video = (frames[i].video != golden[i].video);
+		bool audio = (frames[i].audio != golden[i].audio);
+
+		if ((!video) && (!audio))
+			continue;
+		if (rom.differ++ != 0)
+			continue;
+		rom.status = regress_rom::FAIL;
+		rom.diverged = i;
+		rom.video = video;
+		rom.audio = audio;
+	}
+	if (frames.size() != golden.size())
+		rom.status = regress_rom::FAIL;
+}
+
+/**
+ * Print the results of a ROM.
+ * @param rom ROM.
+ */
+static void regress_print(const regress_rom &rom)
+{
+	switch (rom.status) {
+	case regress_rom::PASS:
+		printf("PASS    %s: %lu frames, %.2f fps\n", rom.name.c_str(),
+		       rom.frames,
+		       ((double)rom.frames * 1000000.0 / rom.usecs));
+		break;
+	case regress_rom::FAIL:
+		printf("FAIL    %s: ", rom.name.c_str());
+		if (rom.differ)
+			printf("first divergent frame %lu (%s), %lu frames"
+			       " differ, ", rom.diverged,
+			       ((rom.video && rom.audio) ? "video, audio" :
+				(rom.video ? "video" : "audio")),
+			       rom.differ);
+		if (rom.frames != rom.golden_frames)
+			printf("%lu frames instead of %lu, ", rom.frames,
+			       rom.golden_frames);
+		printf("%.2f fps\n",
+		       ((double)rom.frames * 1000000.0 / rom.usecs));
+		break;
+	case regress_rom::UPDATED:
+		printf("UPDATED %s: %lu frames, %.2f fps\n", rom.name.c_str(),
+		       rom.frames,
+		       ((double)rom.frames * 1000000.0 / rom.usecs));
+		break;
+	case regress_rom::MISSING:
+		printf("MISSING %s: %s\n", rom.name.c_str(), rom.error.c_str());
+		break;
+	case regress_rom::ERROR:
+		printf("ERROR   %s: %s\n", rom.name.c_str(), rom.error.c_str());
+		break;
+	}
+	fflush(stdout);
+}
+
+/**
+ * Random number generator for regress_sprite_mask() (xorshift32).
+ * @param state Generator state, must not be 0.
+ * @return Random number.
+ */
+static uint32_t regress_rand(uint32_t &state)
+{
+	state ^= (state << 13);
+	state ^= (state >> 17);
+	state ^= (state << 5);
+	return state;
+}
+
+/**
+ * Write words to VRAM through the VDP ports, like the 68000 does.
+ * Register 15 (auto-increment) must be 2.
+ * @param vdp VDP.
+ * @param addr VRAM address.
+ * @param data Words to write.
+ * @param len Number of words.
+ */
+static void regress_vram_write(md_vdp &vdp, unsigned int addr,
+			       const uint16_t *data, unsigned int len)
+{
+	vdp.command(0x4000 | (addr & 0x3fff));
+	vdp.command((addr >> 14) & 0x3);
+	while (len--)
+		vdp.writeword(*(data++));
+}
+
+/**
+ * Write a random sprite attribute table entry.
+ * @param vdp VDP.
+ * @param sat Sprite attribute table address.
+ * @param n Sprite number.
+ * @param link Link field, next sprite number.
+ * @param rnd Generator state.
+ */
+static void regress_sprite(md_vdp &vdp, unsigned int sat, unsigned int n,
+			   unsigned int link, uint32_t &rnd)
+{
+	uint16_t entry[4];
+	unsigned int x;
+	unsigned int y;
+
+	// Most sprites are crammed around the same area to overlap, some are
+	// anywhere (including hidden).
+	switch (regress_rand(rnd) & 3) {
+	case 0:
+		x = (regress_rand(rnd) & 0x1ff);
+		y = (regress_rand(rnd) & 0x1ff);
+		break;
+	case 1:
+		x = (0x80 - 32 + (regress_rand(rnd) % (320 + 32)));
+		y = (0x80 - 32 + (regress_rand(rnd) % (224 + 32)));
+		break;
+	default:
+		x = (0x80 + 128 + (regress_rand(rnd) % 64));
+		y = (0x80 + 96 + (regress_rand(rnd) % 64));
+		break;
+	}
+	// Y is twice as precise in interlace mode.
+	if (vdp.reg[12] & 0x02)
+		y <<= 1;
+	entry[0] = (y & 0x3ff);
+	entry[1] = (((regress_rand(rnd) & 0xf) << 8) | (link & 0x7f));
+	// Priority for 1 sprite out of 8, random flips and tiles from the
+	// pattern area. Interlaced tiles are twice as large and also use the
+	// tables and whatever is above them, without going past VRAM.
+	entry[2] = ((((regress_rand(rnd) & 7) == 0) << 15) |
+		    ((regress_rand(rnd) & 3) << 11) |
+		    ((REGRESS_PATTERNS >> 5) + (regress_rand(rnd) % 0x1e0)));
+	entry[3] = (x & 0x1ff);
+	regress_vram_write(vdp, (sat + (n << 3)), entry, 4);
+}
+
+/**
+ * Write random pattern data, mostly transparent.
+ * @param vdp VDP.
+ * @param addr VRAM address.
+ * @param len Number of words.
+ * @param rnd Generator state.
+ */
+static void regress_patterns(md_vdp &vdp, unsigned int addr,
+			     unsigned int len, uint32_t &rnd)
+{
+	std::vector<uint16_t> data(len);
+	unsigned int i;
+	unsigned int j;
+
+	for (i = 0; (i != len); ++i)
+		for (j = 0; (j != 4); ++j)
+			if ((regress_rand(rnd) & 3) == 0)
+				data[i] |= ((regress_rand(rnd) & 0xf) <<
+					    (j * 4));
+	regress_vram_write(vdp, addr, data.data(), len);
+}
+
+/**
+ * Check the sprite overlap mask, incrementally updated by
+ * md_vdp::sprite_mask_generate() while scanlines are drawn, against a
+ * full rebuild (md_vdp::sprite_mask_check()) after each of a number of
+ * random changes to sprite attributes, pattern data and display modes.
+ * @param steps Number of changes.
+ * @return 0 on success, -1 on error.
+ */
+static int regress_sprite_mask(unsigned long steps)
+{
+	static const uint8_t modes[] = { 0x81, 0x00, 0x87, 0x06 };
+	md *megad = new md(false, dgen_region);
+	std::vector<uint8_t> screen;
+	struct bmap bm;
+	unsigned int sat = REGRESS_SAT0;
+	unsigned int count = 80;
+	unsigned long checked = 0;
+	unsigned long failed = 0;
+	unsigned long step;
+	uint32_t rnd = 1;
+	unsigned int i;
+
+	if (!megad->okay()) {
+		fprintf(stderr, "regress: Mega Drive initialization failed\n");
+		delete megad;
+		return -1;
+	}
+	md_vdp &vdp = megad->vdp;
+
+	memset(&bm, 0, sizeof(bm));
+	bm.w = (320 + 16);
+	bm.h = (240 + 16);
+	bm.bpp = 32;
+	bm.pitch = (bm.w * 4);
+	screen.resize(bm.h * bm.pitch);
+	bm.data = screen.data();
+	vdp.write_reg(1, 0x44); // display enabled
+	vdp.write_reg(5, (REGRESS_SAT0 >> 9));
+	vdp.write_reg(12, modes[0]);
+	vdp.write_reg(15, 2);
+	regress_patterns(vdp, REGRESS_PATTERNS,
+			 ((REGRESS_SAT0 - REGRESS_PATTERNS) / 2), rnd);
+	for (i = 0; (i != 80); ++i) {
+		regress_sprite(vdp, REGRESS_SAT0, i, ((i + 1) % 80), rnd);
+		regress_sprite(vdp, REGRESS_SAT1, i, ((i + 1) % 80), rnd);
+	}
+	for (step = 0; (step != steps); ++step) {
+		unsigned int changes = (1 + (regress_rand(rnd) % 4));
+		bool update;
+		bool collision;
+		int ret;
+
+		while (changes--) {
+			uint16_t word;
+			unsigned int n = (regress_rand(rnd) % 80);
+
+			switch (regress_rand(rnd) % 8) {
+			case 0:
+				// New sprite attributes.
+				regress_sprite(vdp, sat, n, ((n + 1) % count),
+					       rnd);
+				break;
+			case 1:
+				// Move a sprite, horizontally or vertically.
+				if (regress_rand(rnd) & 1) {
+					word = ((0x80 + (regress_rand(rnd) %
+							 320)) & 0x1ff);
+					regress_vram_write(vdp,
+							   (sat + (n << 3) + 6),
+							   &word, 1);
+				}
+				else {
+					word = ((0x80 + (regress_rand(rnd) %
+							 224)) & 0x3ff);
+					regress_vram_write(vdp, (sat + (n << 3)),
+							   &word, 1);
+				}
+				break;
+			case 2:
+			case 3:
+				// Pattern data changes, a line or a whole tile.
+				regress_patterns(vdp,
+						 (REGRESS_PATTERNS +
+						  ((regress_rand(rnd) %
+						    (REGRESS_SAT0 -
+						     REGRESS_PATTERNS)) & ~3)),
+						 ((regress_rand(rnd) & 1) ? 2 : 16),
+						 rnd);
+				break;
+			case 4:
+				// Change the number of sprites in the list.
+				count = (1 + (regress_rand(rnd) % 80));
+				for (i = 0; (i != 80); ++i) {
+					word = ((vdp.vram[(sat + (i << 3) + 2)] <<
+						 8) |
+						((i + 1) % count));
+					if (i == (count - 1))
+						word &= 0xff00;
+					regress_vram_write(vdp,
+							   (sat + (i << 3) + 2),
+							   &word, 1);
+				}
+				break;
+			case 5:
+				// Send a sprite elsewhere in the list.
+				word = ((vdp.vram[(sat + (n << 3) + 2)] << 8) |
+					(regress_rand(rnd) % 80));
+				regress_vram_write(vdp, (sat + (n << 3) + 2),
+						   &word, 1);
+				break;
+			case 6:
+				// Display mode (H32/H40, interlace).
+				vdp.write_reg(12, modes[(regress_rand(rnd) %
+							 elemof(modes))]);
+				break;
+			case 7:
+				// Switch sprite attribute tables.
+				sat = ((sat == REGRESS_SAT0) ?
+				       REGRESS_SAT1 : REGRESS_SAT0);
+				vdp.write_reg(5, (sat >> 9));
+				break;
+			}
+		}
+		// The mask is only updated when VRAM or the table address
+		// change, like it always was.
+		update = ((vdp.dirt[0x30] & 0x20) || (vdp.dirt[0x34] & 1));
+		megad->coo5 &= ~0x20;
+		vdp.draw_scanline(&bm, (regress_rand(rnd) % 224));
+		if (!update)
+			continue;
+		ret = vdp.sprite_mask_check(collision);
+		if (ret > 0)
+			continue;
+		++checked;
+		if ((ret == 0) &&
+		    (collision == ((megad->coo5 & 0x20) != 0)))
+			continue;
+		if (failed++ == 0)
+			printf("FAIL    sprite mask: first divergent step %lu"
+			       " (%s)\n", step,
+			       ((ret < 0) ? "mask" : "collision bit"));
+	}
+	delete megad;
+	printf("%lu steps, %lu checked, %lu failed\n", steps, checked,
+	       failed);
+	return (failed ? -1 : 0);
+}
+
+/**
+ * Check whether the selected CPU cores may run in several threads.
+ * Only Musashi and CZ80 keep their state per md instance, unavailable
+ * cores fall back to none (see md::md()).
+ * @return true if they can.
+ */
+static bool regress_parallel()
+{
+	switch (dgen_emu_m68k) {
+#ifdef WITH_STAR
+	case 1:
+		return false;
+#endif
+#ifdef WITH_CYCLONE
+	case 3:
+		return false;
+#endif
+	default:
+		break;
+	}
+	switch (dgen_emu_z80) {
+#ifdef WITH_MZ80
+	case 1:
+		return false;
+#endif
+#ifdef WITH_DRZ80
+	case 3:
+		return false;
+#endif
+#ifdef WITH_GXZ80
+	case 4:
+		return false;
+#endif
+	default:
+		break;
+	}
+	return true;
+}
+
+/**
+ * List ROMs in a directory, skipping demo and golden files.
+ * @param dir Directory.
+ * @param[out] roms ROMs found, sorted by name.
+ * @return 0 on success, -1 on error.
+ */
+static int regress_list(const char *dir, std::vector<regress_rom> &roms)
+{
+#ifdef _MSC_VER
+	(void)dir;
+	(void)roms;
+	fprintf(stderr, "regress: directory listing isn't supported.\n");
+	return -1;
+#else
+	static const char *skip[] = { REGRESS_DEMO_EXT, REGRESS_HASH_EXT };
+	DIR *d = opendir(dir);
+	struct dirent *dent;
+
+	if (d == NULL) {
+		fprintf(stderr, "regress: %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	while ((dent = readdir(d)) != NULL) {
+		std::string name(dent->d_name);
+		struct stat st;
+		size_t i;
+
+		if (name[0] == '.')
+			continue;
+		for (i = 0; (i != elemof(skip)); ++i) {
+			size_t len = strlen(skip[i]);
+
+			if ((name.size() > len) &&
+			    (!name.compare((name.size() - len), len, skip[i])))
+				break;
+		}
+		if ((i != elemof(skip)) ||
+		    (stat(regress_path(dir, name, "").c_str(), &st) == -1) ||
+		    (!S_ISREG(st.st_mode)))
+			continue;
+		roms.push_back(regress_rom());
+		roms.back().name = name;
+	}
+	closedir(d);
+	std::sort(roms.begin(), roms.end(),
+		  [](const regress_rom &a, const regress_rom &b) {
+			  return (a.name < b.name);
+		  });
+	return 0;
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	FILE *file;
+	std::vector<regress_rom> roms;
+	std::vector<std::thread> workers;
+	std::atomic<size_t> next(0);
+	std::mutex print_lock;
+	unsigned int jobs;
+	unsigned long usecs;
+	unsigned long sprite_mask_steps = 0;
+	size_t i;
+	int ret = 0;
+
+	// Parse the RC file, never write anything back.
+	dgen_autoconf = 0;
+	if ((file = dgen_fopen_rc(DGEN_READ)) != NULL) {
+		parse_rc(file, DGEN_RC);
+		fclose(file);
+		file = NULL;
+	}
+	while ((c = getopt(argc, argv, "hvr:g:uf:j:b:R:S:")) != EOF) {
+		switch (c) {
+		case 'v':
+			printf("DGen/SDL version " VER "\n");
+			return 0;
+		case 'r':
+			if ((file = dgen_fopen(NULL, optarg,
+					       (DGEN_READ | DGEN_CURRENT))) ==
+			    NULL) {
+				fprintf(stderr, "rc: %s: %s\n", optarg,
+					strerror(errno));
+				break;
+			}
+			parse_rc(file, optarg);
+			fclose(file);
+			file = NULL;
+			break;
+		case 'g':
+			regress.golden = optarg;
+			break;
+		case 'u':
+			regress.update = true;
+			break;
+		case 'f':
+			regress.frames = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			regress.jobs = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			regress.bpp = atoi(optarg);
+			switch (regress.bpp) {
+			case 8:
+			case 15:
+			case 16:
+			case 24:
+			case 32:
+				break;
+			default:
+				help();
+			}
+			break;
+		case 'R':
+			if ((strlen(optarg) != 1) ||
+			    (strchr("jxue ", (optarg[0] | 0x20)) == NULL)) {
+				fprintf(stderr, "regress: invalid region"
+					" `%s'.\n", optarg);
+				return EXIT_FAILURE;
+			}
+			dgen_region = (optarg[0] & ~(0x20));
+			break;
+		case 'S':
+			sprite_mask_steps = strtoul(optarg, NULL, 0);
+			if (sprite_mask_steps == 0)
+				help();
+			break;
+		default:
+			help();
+		}
+	}
+	if (sprite_mask_steps) {
+		if (optind != argc)
+			help();
+		return (regress_sprite_mask(sprite_mask_steps) ?
+			EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	if ((optind + 1) != argc)
+		help();
+	regress.romdir = argv[optind];
+	if (regress.golden == NULL)
+		regress.golden = regress.romdir;
+	if (regress_list(regress.romdir, roms))
+		return EXIT_FAILURE;
+	if (roms.empty()) {
+		fprintf(stderr, "regress: no ROM found in %s.\n",
+			regress.romdir);
+		return EXIT_FAILURE;
+	}
+	jobs = regress.jobs;
+	if (jobs == 0)
+		jobs = std::thread::hardware_concurrency();
+	if (jobs == 0)
+		jobs = 1;
+	if ((jobs > 1) && (!regress_parallel())) {
+		fprintf(stderr, "regress: %s/%s cores can't run in parallel,"
+			" using a single job.\n",
+			emu_m68k_names[dgen_emu_m68k],
+			emu_z80_names[dgen_emu_z80]);
+		jobs = 1;
+	}
+	if (jobs > roms.size())
+		jobs = roms.size();
+	fprintf(stderr, "regress: %zu ROMs, %u jobs, %s/%s cores.\n",
+		roms.size(), jobs, emu_m68k_names[dgen_emu_m68k],
+		emu_z80_names[dgen_emu_z80]);
+	// Each worker picks the next ROM until none are left.
+	usecs = pd_usecs();
+	for (i = 0; (i != jobs); ++i)
+		workers.emplace_back([&]() {
+			size_t n;
+
+			while ((n = next++) < roms.size()) {
+				regress_run(roms[n]);
+				std::lock_guard<std::mutex> lg(print_lock);
+				regress_print(roms[n]);
+			}
+		});
+	for (i = 0; (i != workers.size()); ++i)
+		workers[i].join();
+	usecs = (pd_usecs() - usecs);
+	{
+		unsigned long count[5] = { 0, 0, 0, 0, 0 };
+
+		for (i = 0; (i != roms.size()); ++i)
+			++count[roms[i].status];
+		printf("%lu passed, %lu failed, %lu updated, %lu missing,"
+		       " %lu errors in %.2f seconds\n",
+		       count[regress_rom::PASS], count[regress_rom::FAIL],
+		       count[regress_rom::UPDATED],
+		       count[regress_rom::MISSING],
+		       count[regress_rom::ERROR], (usecs / 1000000.0));
+		if (count[regress_rom::FAIL] || count[regress_rom::MISSING] ||
+		    count[regress_rom::ERROR])
+			ret = 1;
+	}
+	return ret;
+}
@@ -0,0 +1,248 @@
+// Band-limited sample rate converter, see resample.h.
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include "resample.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// SSE2 is always there on x86-64, filter taps are summed with it directly.
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define RESAMPLE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Kaiser window shape, higher values trade a wider transition band for
+// a better stop band attenuation.
+#define RESAMPLE_KAISER_BETA 6.0
+// Cutoff frequency, relative to the lowest Nyquist frequency.
+#define RESAMPLE_CUTOFF 0.9
+
+// Zeroth order modified Bessel function of the first kind.
+static double bessel_i0(double x)
+{
+	double sum = 1.0;
+	double term = 1.0;
+	unsigned int k;
+
+	for (k = 1; (k != 32); ++k) {
+		term *= ((x / (2.0 * k)) * (x / (2.0 * k)));
+		sum += term;
+		if (term < (sum * 1e-12))
+			break;
+	}
+	return sum;
+}
+
+resampler::resampler(unsigned int channels):
+	channels(channels), ratio(0)
+{
+	assert((channels != 0) && (channels <= max_channels));
+	reset();
+}
+
+void resampler::reset()
+{
+	unsigned int c;
+
+	pos = 0;
+	for (c = 0; (c != max_channels); ++c)
+		memset(buf[c], 0, (sizeof(buf[c][0]) * taps));
+}
+
+/**
+ * Compute filter coefficients for a given output/input ratio.
+ * @param ratio Output samples per input sample (16.16).
+ */
+void resampler::setup(uint32_t ratio)
+{
+	double cutoff = (ratio / 65536.0);
+	unsigned int ph;
+	unsigned int k;
+
+	this->ratio = ratio;
+	if (cutoff > 1.0)
+		cutoff = 1.0;
+	cutoff *= RESAMPLE_CUTOFF;
+	for (ph = 0; (ph <= phases); ++ph) {
+		double frac = ((double)ph / phases);
+		double h[taps];
+		double sum = 0.0;
+		int total = 0;
+		unsigned int center = 0;
+
+		for (k = 0; (k != taps); ++k) {
+			// Distance between this tap and the output sample.
+			double x = ((double)k + 1.0 - (taps / 2) - frac);
+			double w = (x / (taps / 2));
+
+			if ((w <= -1.0) || (w >= 1.0))
+				h[k] = 0.0;
+			else {
+				w = (bessel_i0(RESAMPLE_KAISER_BETA *
+					       sqrt(1.0 - (w * w))) /
+				     bessel_i0(RESAMPLE_KAISER_BETA));
+				x *= (M_PI * cutoff);
+				h[k] = (w * ((x == 0.0) ? 1.0 : (sin(x) / x)));
+			}
+			sum += h[k];
+		}
+		// Normalize for unity gain, rounding errors go to the
+		// largest coefficient.
+		for (k = 0; (k != taps); ++k) {
+			coef[ph][k] = (int16_t)floor(((h[k] / sum) *
+						      (1 << coef_bits)) + 0.5);
+			total += coef[ph][k];
+			if (coef[ph][k] > coef[ph][center])
+				center = k;
+		}
+		coef[ph][center] += ((1 << coef_bits) - total);
+	}
+}
+
+void resampler::process(const int16_t *in, unsigned int in_len,
+			int32_t *out, unsigned int out_len)
+{
+	unsigned int in_done = 0;
+	unsigned int out_done = 0;
+	uint32_t r;
+
+	if (in_len == 0) {
+		memset(out, 0, (sizeof(*out) * channels * out_len));
+		return;
+	}
+	// Recompute the filter when the ratio changes by more than 1/64.
+	r = (uint32_t)(((uint64_t)out_len << 16) / in_len);
+	if ((ratio == 0) ||
+	    (r > (ratio + (ratio >> 6))) || (r < (ratio - (ratio >> 6))))
+		setup(r);
+	// Split large blocks, spreading output samples proportionally.
+	while (in_done != in_len) {
+		unsigned int n = (in_len - in_done);
+		unsigned int o;
+
+		if (n > block)
+			n = block;
+		o = (unsigned int)((((uint64_t)out_len * (in_done + n)) /
+				    in_len) - out_done);
+		run(&in[(in_done * channels)], n,
+		    &out[(out_done * channels)], o);
+		in_done += n;
+		out_done += o;
+	}
+}
+
+void resampler::save(uint8_t *state) const
+{
+	unsigned int c;
+
+	memcpy(state, &pos, sizeof(pos));
+	state += sizeof(pos);
+	memcpy(state, &ratio, sizeof(ratio));
+	state += sizeof(ratio);
+	for (c = 0; (c != max_channels); ++c) {
+		memcpy(state, buf[c], (sizeof(buf[c][0]) * taps));
+		state += (sizeof(buf[c][0]) * taps);
+	}
+}
+
+void resampler::load(const uint8_t *state)
+{
+	uint32_t r;
+	unsigned int c;
+
+	memcpy(&pos, state, sizeof(pos));
+	state += sizeof(pos);
+	memcpy(&r, state, sizeof(r));
+	state += sizeof(r);
+	// Coefficients are only computed again when they differ.
+	if (r != ratio) {
+		if (r == 0)
+			ratio = 0;
+		else
+			setup(r);
+	}
+	for (c = 0; (c != max_channels); ++c) {
+		memcpy(buf[c], state, (sizeof(buf[c][0]) * taps));
+		state += (sizeof(buf[c][0]) * taps);
+	}
+}
+
+/**
+ * Convert a block of at most "block" input samples.
+ */
+void resampler::run(const int16_t *in, unsigned int in_len,
+		    int32_t *out, unsigned int out_len)
+{
+	const int32_t round = (1 << (coef_bits - 1));
+	uint64_t step;
+	unsigned int c;
+	unsigned int i;
+
+	assert(in_len <= block);
+	for (c = 0; (c != channels); ++c)
+		for (i = 0; (i != in_len); ++i)
+			buf[c][(taps + i)] = in[((i * channels) + c)];
+	if (out_len) {
+		// Stepping so that the last output sample falls in this
+		// block and the next one at most out_len units after it.
+		step = (((((uint64_t)in_len << 32) - pos) + (out_len - 1)) /
+			out_len);
+		for (i = 0; (i != out_len); ++i) {
+			unsigned int idx = (unsigned int)(pos >> 32);
+			// Nearest phase, the last one is for the next sample.
+			unsigned int ph = (unsigned int)
+				((((uint32_t)pos) +
+				  (1ULL << (31 - phase_bits))) >>
+				 (32 - phase_bits));
+			const int16_t *h = coef[ph];
+
+			assert(idx < in_len);
+			for (c = 0; (c != channels); ++c) {
+				const int16_t *s = &buf[c][(idx + 1)];
+				int32_t sum;
+#ifdef RESAMPLE_SSE2
+				__m128i acc;
+				unsigned int k;
+
+				acc = _mm_madd_epi16(_mm_loadu_si128
+						     ((const __m128i *)s),
+						     _mm_loadu_si128
+						     ((const __m128i *)h));
+				for (k = 8; (k != taps); k += 8)
+					acc = _mm_add_epi32
+						(acc, _mm_madd_epi16
+						 (_mm_loadu_si128
+						  ((const __m128i *)&s[k]),
+						  _mm_loadu_si128
+						  ((const __m128i *)&h[k])));
+				acc = _mm_add_epi32(acc,
+						    _mm_shuffle_epi32(acc, 0x4e));
+				acc = _mm_add_epi32(acc,
+						    _mm_shuffle_epi32(acc, 0xb1));
+				sum = _mm_cvtsi128_si32(acc);
+#else
+				unsigned int k;
+
+				sum = 0;
+				for (k = 0; (k != taps); ++k)
+					sum += ((int32_t)s[k] * h[k]);
+#endif
+				out[((i * channels) + c)] =
+					((sum + round) >> coef_bits);
+			}
+			pos += step;
+		}
+		pos -= ((uint64_t)in_len << 32);
+	}
+	else
+		pos = 0;
+	// Keep the last input samples for the next block.
+	for (c = 0; (c != channels); ++c)
+		memmove(buf[c], &buf[c][in_len], (sizeof(buf[c][0]) * taps));
+}
@@ -0,0 +1,57 @@
+#ifndef __RESAMPLE_H__
+#define __RESAMPLE_H__
+
+// Band-limited sample rate converter.
+// Fixed-point polyphase FIR (Kaiser windowed sinc). Each call converts one
+// block of input samples into a given number of output samples, the ratio
+// between both may change from one call to the next. Filter state is kept
+// between calls so blocks join without discontinuities. No memory is
+// allocated after construction.
+
+#include <stddef.h>
+#include <stdint.h>
+
+class resampler {
+public:
+	static const unsigned int taps = 32; // filter length, in input samples
+	static const unsigned int phase_bits = 7; // sub-sample resolution
+	static const unsigned int phases = (1 << phase_bits);
+	static const unsigned int coef_bits = 14; // coefficient precision
+	static const unsigned int max_channels = 2;
+	// Input samples converted at once, longer blocks are split.
+	static const unsigned int block = 2048;
+
+	explicit resampler(unsigned int channels = 2);
+	// Forget previous input, as if it had been silent.
+	void reset();
+	// Convert "in_len" samples from "in" into "out_len" samples stored
+	// in "out". Samples are interleaved when there are several channels.
+	// The output is delayed by taps / 2 input samples.
+	void process(const int16_t *in, unsigned int in_len,
+		     int32_t *out, unsigned int out_len);
+	// Filter state (position, ratio and input history) stored by
+	// save() and reloaded by load() as is.
+	static const size_t state_size =
+		(sizeof(uint64_t) + sizeof(uint32_t) +
+		 (sizeof(int16_t) * max_channels * taps));
+	void save(uint8_t *state) const;
+	void load(const uint8_t *state);
+
+private:
+	unsigned int channels;
+	// Position of the next output sample relative to the first input
+	// sample of the next block, in 1/2^32 input sample units.
+	uint64_t pos;
+	// out_len / in_len (16.16) the filter was computed for.
+	uint32_t ratio;
+	// Per-channel input, taps previous samples followed by a block.
+	int16_t buf[max_channels][(taps + block)];
+	// Coefficients for (phases + 1) fractional positions.
+	int16_t coef[(phases + 1)][taps];
+
+	void setup(uint32_t ratio);
+	void run(const int16_t *in, unsigned int in_len,
+		 int32_t *out, unsigned int out_len);
+};
+
+#endif // __RESAMPLE_H__
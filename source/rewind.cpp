@@ -0,0 +1,283 @@
+// Rewind history, see rewind.h.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "md.h"
+#include "pd.h"
+#include "rewind.h"
+
+rewind_ring::rewind_ring(size_t size, unsigned int interval):
+	size(size), interval(interval), countdown(0), used(0), captures(0),
+	usecs(0), last_usecs(0), raw(0), packed(0)
+{
+	if (this->interval == 0)
+		this->interval = 1;
+	// Pages are only committed once written to.
+	ring = (uint8_t *)malloc(size);
+}
+
+rewind_ring::~rewind_ring()
+{
+	free(ring);
+}
+
+void rewind_ring::clear()
+{
+	entries.clear();
+	used = 0;
+	latest.clear();
+	countdown = 0;
+}
+
+/**
+ * Append a LEB128 encoded value.
+ * @param out Output buffer.
+ * @param val Value to store.
+ * @return Number of bytes written.
+ */
+static size_t varint_put(uint8_t *out, size_t val)
+{
+	size_t i = 0;
+
+	while (val >= 0x80) {
+		out[i++] = (val | 0x80);
+		val >>= 7;
+	}
+	out[i++] = val;
+	return i;
+}
+
+/**
+ * Read a LEB128 encoded value.
+ * @param in Input buffer.
+ * @param len Number of bytes left in it.
+ * @param[out] val Decoded value.
+ * @return Number of bytes read, 0 on error.
+ */
+static size_t varint_get(const uint8_t *in, size_t len, size_t& val)
+{
+	size_t i;
+	unsigned int shift = 0;
+
+	val = 0;
+	for (i = 0; (i != len); ++i) {
+		val |= ((size_t)(in[i] & 0x7f) << shift);
+		if (!(in[i] & 0x80))
+			return (i + 1);
+		shift += 7;
+		if (shift >= (sizeof(val) * 8))
+			break;
+	}
+	return 0;
+}
+
+static inline bool word_equal(const uint8_t *a, const uint8_t *b)
+{
+	uint64_t x;
+	uint64_t y;
+
+	memcpy(&x, a, sizeof(x));
+	memcpy(&y, b, sizeof(y));
+	return (x == y);
+}
+
+/**
+ * Encode the difference between two states into the delta buffer.
+ * The result is a list of (skip, count, count bytes) records, where skip
+ * is the number of identical bytes and count the number of following bytes
+ * stored as prev ^ cur. Both lengths are LEB128 encoded.
+ * States are compared 8 bytes at a time, runs of changes therefore always
+ * cover whole words except at the end.
+ * @param prev Previous state.
+ * @param cur Current state.
+ * @param len Size of both states.
+ * @return Size of the encoded delta.
+ */
+size_t rewind_ring::encode(const uint8_t *prev, const uint8_t *cur,
+			   size_t len)
+{
+	uint8_t *out;
+	size_t pos = 0;
+	size_t i = 0;
+
+	// Worst case is alternating changed and identical words.
+	delta.resize(len + (len / 4) + 32);
+	out = delta.data();
+	while (i != len) {
+		size_t skip = i;
+		size_t start;
+		size_t j;
+
+		while (((i + 8) <= len) && (word_equal(&prev[i], &cur[i])))
+			i += 8;
+		while ((i != len) && (prev[i] == cur[i]))
+			++i;
+		if (i == len) {
+			// Nothing changed past this point.
+			if (pos == 0)
+				pos += varint_put(&out[pos], len);
+			break;
+		}
+		skip = (i - skip);
+		start = i;
+		while (((i + 8) <= len) && (!word_equal(&prev[i], &cur[i])))
+			i += 8;
+		if ((i + 8) > len)
+			i = len;
+		pos += varint_put(&out[pos], skip);
+		pos += varint_put(&out[pos], (i - start));
+		for (j = start; (j != i); ++j)
+			out[pos++] = (prev[j] ^ cur[j]);
+	}
+	return pos;
+}
+
+/**
+ * Apply a delta made by encode() to a state.
+ * @param dst State to modify.
+ * @param dst_len Size of state.
+ * @param src Delta.
+ * @param src_len Size of delta.
+ */
+void rewind_ring::apply(uint8_t *dst, size_t dst_len,
+			const uint8_t *src, size_t src_len)
+{
+	size_t pos = 0;
+	size_t i = 0;
+
+	while (pos != src_len) {
+		size_t skip;
+		size_t count;
+		size_t n;
+		size_t j;
+
+		if ((n = varint_get(&src[pos], (src_len - pos), skip)) == 0)
+			return;
+		pos += n;
+		if ((skip > (dst_len - i)) || (pos == src_len))
+			return;
+		i += skip;
+		if ((n = varint_get(&src[pos], (src_len - pos), count)) == 0)
+			return;
+		pos += n;
+		if ((count > (dst_len - i)) || (count > (src_len - pos)))
+			return;
+		for (j = 0; (j != count); ++j)
+			dst[i++] ^= src[pos++];
+	}
+}
+
+/**
+ * Store a delta as the newest entry, dropping the oldest ones to make room.
+ * @param data Delta.
+ * @param len Size of delta.
+ */
+void rewind_ring::push(const uint8_t *data, size_t len)
+{
+	size_t off = 0;
+	struct entry e;
+
+	if (len > size) {
+		// Can't be stored, history is broken.
+		entries.clear();
+		used = 0;
+		return;
+	}
+	if (!entries.empty()) {
+		off = (entries.back().offset + entries.back().len);
+		if ((off + len) > size) {
+			// Wrap around, the leftovers at the end are the
+			// oldest entries.
+			while ((!entries.empty()) &&
+			       (entries.front().offset >= off)) {
+				used -= entries.front().len;
+				entries.pop_front();
+			}
+			off = 0;
+		}
+	}
+	while ((!entries.empty()) &&
+	       (entries.front().offset < (off + len)) &&
+	       ((entries.front().offset + entries.front().len) > off)) {
+		used -= entries.front().len;
+		entries.pop_front();
+	}
+	memcpy(&ring[off], data, len);
+	e.offset = off;
+	e.len = len;
+	entries.push_back(e);
+	used += len;
+}
+
+void rewind_ring::frame(md& megad)
+{
+	unsigned long start;
+	size_t len;
+
+	if (ring == NULL)
+		return;
+	if (countdown > 1) {
+		--countdown;
+		return;
+	}
+	countdown = interval;
+	start = pd_usecs();
+	len = megad.save_state(state.data(), state.size());
+	if (len > state.size()) {
+		state.resize(len);
+		megad.save_state(state.data(), len);
+	}
+	else
+		state.resize(len);
+	if (latest.size() != len) {
+		// First snapshot or different kind of state.
+		entries.clear();
+		used = 0;
+		latest.assign(state.begin(), (state.begin() + len));
+	}
+	else {
+		size_t n = encode(latest.data(), state.data(), len);
+
+		push(delta.data(), n);
+		latest.swap(state);
+		raw += len;
+		packed += n;
+	}
+	last_usecs = (pd_usecs() - start);
+	usecs += last_usecs;
+	++captures;
+}
+
+bool rewind_ring::step(md& megad)
+{
+	bool ret = false;
+
+	if (latest.empty())
+		return false;
+	if (!entries.empty()) {
+		const struct entry& e = entries.back();
+
+		apply(latest.data(), latest.size(), &ring[e.offset], e.len);
+		used -= e.len;
+		entries.pop_back();
+		ret = true;
+	}
+	megad.load_state(latest.data(), latest.size());
+	countdown = interval;
+	return ret;
+}
+
+void rewind_ring::get_stats(struct stats& st) const
+{
+	st.capacity = ((ring != NULL) ? size : 0);
+	st.used = used;
+	st.state_size = latest.size();
+	st.entries = entries.size();
+	st.frames = (entries.size() * interval);
+	st.captures = captures;
+	st.usecs = usecs;
+	st.last_usecs = last_usecs;
+	st.raw = raw;
+	st.packed = packed;
+}
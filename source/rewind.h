@@ -0,0 +1,73 @@
+#ifndef __REWIND_H__
+#define __REWIND_H__
+
+// Rewind history kept in a fixed amount of memory.
+// Every "interval" frames a state is taken with md::save_state(). Only the
+// most recent one is kept whole, older states are stored as the difference
+// (XOR) with their successor, run-length encoded since most of it is zero.
+// Deltas live in a preallocated ring buffer, the oldest ones are dropped
+// to make room for new ones. Stepping back applies the newest delta to the
+// current state and loads the result.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+class md;
+
+class rewind_ring {
+public:
+	// "size" is the ring buffer size in bytes.
+	rewind_ring(size_t size, unsigned int interval);
+	~rewind_ring();
+	bool okay() const { return (ring != NULL); }
+	// Call after each emulated frame, takes a snapshot when due.
+	void frame(md& megad);
+	// Load the previous snapshot and forget the current one. When there
+	// is none left, reload the oldest one and return false.
+	bool step(md& megad);
+	// Forget everything.
+	void clear();
+
+	struct stats {
+		size_t capacity; // ring buffer size
+		size_t used; // bytes used by deltas in the ring buffer
+		size_t state_size; // size of a full state
+		unsigned int entries; // number of deltas
+		unsigned int frames; // frames covered by them
+		unsigned long captures; // snapshots taken so far
+		unsigned long usecs; // time spent taking them
+		unsigned long last_usecs; // time spent on the last one
+		unsigned long raw; // total size of delta'd states
+		unsigned long packed; // total size of the resulting deltas
+	};
+	void get_stats(struct stats& st) const;
+
+private:
+	struct entry {
+		size_t offset; // in ring
+		size_t len;
+	};
+	uint8_t *ring;
+	size_t size;
+	unsigned int interval;
+	unsigned int countdown; // frames left until the next snapshot
+	std::deque<struct entry> entries;
+	size_t used;
+	std::vector<uint8_t> latest; // newest state, empty if none
+	std::vector<uint8_t> state; // scratch buffer for save_state()
+	std::vector<uint8_t> delta; // scratch buffer for encoding
+	unsigned long captures;
+	unsigned long usecs;
+	unsigned long last_usecs;
+	unsigned long raw;
+	unsigned long packed;
+
+	size_t encode(const uint8_t *prev, const uint8_t *cur, size_t len);
+	static void apply(uint8_t *dst, size_t dst_len,
+			  const uint8_t *src, size_t src_len);
+	void push(const uint8_t *data, size_t len);
+};
+
+#endif // __REWIND_H__
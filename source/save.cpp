@@ -4,8 +4,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "md.h"
+#include "rc-vars.h"
+#include "rewind.h"
 #include "system.h"
 
 void md::m68k_state_dump()
@@ -257,222 +260,795 @@ static void *swap16cpy(void *dest, const void *src, size_t n)
 
 	for (i = 0; (i != (n & ~1)); ++i)
 		((uint8_t *)dest)[(i ^ 1)] = ((uint8_t *)src)[i];
-	((uint8_t *)dest)[i] = ((uint8_t *)src)[i];
+	if (n & 1)
+		((uint8_t *)dest)[i] = ((uint8_t *)src)[i];
 	return dest;
 }
 
-int md::import_gst(FILE *hand)
+/*
+  DGen extensions, stored after the GST image by save_state(). They are a
+  list of chunks made of a 4 characters tag, a 32-bit data size and data:
+
+  Tag   Description
+  ----  -----------
+  DGEN  Extensions version and byte order, must come first
+  MD    Console and VDP state missing from the GST image (struct state_md)
+  M68K  Musashi context (m68k_context_state_size() bytes)
+  CZ80  CZ80 registers and status
+  FM0   MAME YM2612 chips (YM2612_state_save()), FM1 and FM2 with MJazz
+  OPN2  Nuked OPN2 chip and its sample accumulator
+  PSG   SN76496 chip
+  RSMP  DAC and Nuked OPN2 resampler histories
+  SRAM  Save RAM contents
+  SGVR  Sega VR headset state
+
+  Chunks are copies of host structures, in host byte order. Extensions
+  are ignored when written by a build with a different byte order or
+  version, and so are chunks whose size doesn't match, which are then
+  restored from the GST image instead. Chunks tagged with less than four
+  characters are padded with spaces.
+*/
+
+#define STATE_EXT_VERSION 1
+#define STATE_EXT_ORDER 0x01020304
+
+// Console state that GST doesn't cover, "MD  " chunk.
+struct state_md {
+	uint8_t vdp_reg[0x20];
+	int32_t vdp_rw_mode;
+	int32_t vdp_rw_addr;
+	int32_t vdp_rw_dma;
+	uint8_t vdp_hint_pending;
+	uint8_t vdp_vint_pending;
+	uint8_t vdp_cmd_pending;
+	uint8_t coo4;
+	uint8_t coo5;
+	uint8_t pad_com[2];
+	uint8_t fm_sel[2];
+	uint8_t fm_tover;
+	uint8_t dac_data;
+	uint8_t dac_enabled;
+	int16_t dac_level;
+	int16_t fm_reg[2][0x100];
+	int32_t fm_ticker[4];
+	int32_t aoo3_toggle;
+	int32_t aoo5_toggle;
+	int32_t aoo3_six;
+	int32_t aoo5_six;
+	int32_t aoo3_six_timeout;
+	int32_t aoo5_six_timeout;
+	uint32_t z80_bank68k;
+	uint8_t z80_st_busreq;
+	uint8_t z80_st_reset;
+	uint8_t z80_st_irq;
+	uint8_t z80_irq_vector;
+	uint8_t save_prot;
+	uint8_t save_active;
+	uint32_t rom_bank_offsets[md::max_rom_banks];
+};
+
+/**
+ * Append a chunk to DGen extensions.
+ * @param ext Extensions buffer, NULL to only compute their size.
+ * @param[in,out] size Current size of extensions.
+ * @param tag Chunk tag.
+ * @param len Chunk data size.
+ * @return Where to store chunk data, NULL if ext is NULL.
+ */
+static uint8_t *state_chunk(uint8_t *ext, size_t &size, const char *tag,
+			    uint32_t len)
+{
+	uint8_t *p = NULL;
+
+	if (ext != NULL) {
+		p = &ext[size];
+		memset(p, ' ', 4);
+		memcpy(p, tag, strlen(tag));
+		memcpy(&p[4], &len, 4);
+		p += 8;
+	}
+	size += (8 + len);
+	return p;
+}
+
+/**
+ * Find a chunk in DGen extensions.
+ * @param ext Extensions.
+ * @param len Extensions size.
+ * @param tag Chunk tag.
+ * @param size Expected chunk data size.
+ * @return Chunk data, NULL if not found or if its size differs.
+ */
+static const uint8_t *state_chunk_find(const uint8_t *ext, size_t len,
+				       const char *tag, uint32_t size)
+{
+	char name[4];
+
+	memset(name, ' ', 4);
+	memcpy(name, tag, strlen(tag));
+	while (len >= 8) {
+		uint32_t n;
+
+		memcpy(&n, &ext[4], 4);
+		if (n > (len - 8))
+			break;
+		if (memcmp(ext, name, 4) == 0)
+			return ((n == size) ? &ext[8] : NULL);
+		ext += (8 + n);
+		len -= (8 + n);
+	}
+	return NULL;
+}
+
+/**
+ * Check whether DGen extensions after a GST image can be loaded.
+ * @param buf State.
+ * @param len State size.
+ * @return Console state chunk, NULL if extensions are unusable.
+ */
+static const uint8_t *state_ext_check(const uint8_t *buf, size_t len)
+{
+	const uint8_t *p;
+	uint32_t tmp[2];
+
+	if (len <= md::gst_size)
+		return NULL;
+	buf += md::gst_size;
+	len -= md::gst_size;
+	p = state_chunk_find(buf, len, "DGEN", sizeof(tmp));
+	if ((p == NULL) || (memcmp(buf, "DGEN", 4) != 0))
+		return NULL;
+	memcpy(tmp, p, sizeof(tmp));
+	if ((tmp[0] != STATE_EXT_VERSION) || (tmp[1] != STATE_EXT_ORDER))
+		return NULL;
+	return state_chunk_find(buf, len, "MD", sizeof(struct state_md));
+}
+
+/**
+ * Write DGen extensions.
+ * @param ext Where to write them, NULL to only compute their size.
+ * @return Extensions size.
+ */
+size_t md::state_ext_save(uint8_t *ext)
 {
-	uint8_t (*buf)[0x22478] =
-		(uint8_t (*)[sizeof(*buf)])malloc(sizeof(*buf));
+	size_t size = 0;
 	uint8_t *p;
-	uint8_t *q;
-	size_t i;
-	uint32_t tmp;
 
-	if ((buf == NULL) ||
-	    (fread((*buf), sizeof(*buf), 1, hand) != 1) ||
-	    /* GST header */
-	    ((memcmp((*buf), "GST\x0\x0\0\xe0\x40", 8) != 0) &&
-	     (memcmp((*buf), "GST\x40\xe0", 5) != 0))) {
-		fprintf(stderr,
-			"%s: error: invalid save file header.\n",
-			__func__);
-		free(buf);
-		return -1;
+	if ((p = state_chunk(ext, size, "DGEN",
+			     (2 * sizeof(uint32_t)))) != NULL) {
+		uint32_t tmp[2] = { STATE_EXT_VERSION, STATE_EXT_ORDER };
+
+		memcpy(p, tmp, sizeof(tmp));
 	}
-	p = &(*buf)[0x50];
-	if (p[2] != 0) {
-		fprintf(stderr,
-			"%s: error: this is not a Genesis/Mega Drive"
-			" save file.\n",
-			__func__);
-		free(buf);
-		return -1;
+	if ((p = state_chunk(ext, size, "MD", sizeof(struct state_md)))) {
+		struct state_md s;
+
+		// Padding must not make identical states differ.
+		memset(&s, 0, sizeof(s));
+		memcpy(s.vdp_reg, vdp.reg, sizeof(s.vdp_reg));
+		s.vdp_rw_mode = vdp.rw_mode;
+		s.vdp_rw_addr = vdp.rw_addr;
+		s.vdp_rw_dma = vdp.rw_dma;
+		s.vdp_hint_pending = vdp.hint_pending;
+		s.vdp_vint_pending = vdp.vint_pending;
+		s.vdp_cmd_pending = vdp.cmd_pending;
+		s.coo4 = coo4;
+		s.coo5 = coo5;
+		memcpy(s.pad_com, pad_com, sizeof(s.pad_com));
+		memcpy(s.fm_sel, fm_sel, sizeof(s.fm_sel));
+		s.fm_tover = fm_tover;
+		s.dac_data = dac_data;
+		s.dac_enabled = dac_enabled;
+		// DAC changes are only pending when sound wasn't generated
+		// for the previous frame, keep the last level.
+		s.dac_level = (dac_len ?
+			       dac_events[(dac_len - 1)].level : dac_level);
+		memcpy(s.fm_reg, fm_reg, sizeof(s.fm_reg));
+		memcpy(s.fm_ticker, fm_ticker, sizeof(s.fm_ticker));
+		s.aoo3_toggle = aoo3_toggle;
+		s.aoo5_toggle = aoo5_toggle;
+		s.aoo3_six = aoo3_six;
+		s.aoo5_six = aoo5_six;
+		s.aoo3_six_timeout = aoo3_six_timeout;
+		s.aoo5_six_timeout = aoo5_six_timeout;
+		s.z80_bank68k = z80_bank68k;
+		s.z80_st_busreq = z80_st_busreq;
+		s.z80_st_reset = z80_st_reset;
+		s.z80_st_irq = z80_st_irq;
+		s.z80_irq_vector = z80_irq_vector;
+		s.save_prot = !!save_prot;
+		s.save_active = !!save_active;
+		memcpy(s.rom_bank_offsets, rom_bank_offsets,
+		       sizeof(s.rom_bank_offsets));
+		memcpy(p, &s, sizeof(s));
+	}
+#ifdef WITH_MUSA
+	if ((cpu_emu == CPU_EMU_MUSA) &&
+	    ((p = state_chunk(ext, size, "M68K",
+			      m68k_context_state_size())) != NULL))
+		memcpy(p, ctx_musa, m68k_context_state_size());
+#endif
+#ifdef WITH_CZ80
+	if ((z80_core == Z80_CORE_CZ80) &&
+	    ((p = state_chunk(ext, size, "CZ80",
+			      offsetof(cz80_struc, BasePC))) != NULL))
+		memcpy(p, &cz80, offsetof(cz80_struc, BasePC));
+#endif
+#ifdef WITH_NUKEDOPN2
+	if (dgen_ym_chipimpl == YM_CHIPIMPL_NUKEDOPN2) {
+		if ((p = state_chunk(ext, size, "OPN2",
+				     (sizeof(opn2) + sizeof(ym3438_accm) +
+				      sizeof(ym3438_sample) +
+				      sizeof(ym3438_sample_prev) +
+				      sizeof(ym3438_cycles)))) != NULL) {
+			memcpy(p, &opn2, sizeof(opn2));
+			p += sizeof(opn2);
+			memcpy(p, ym3438_accm, sizeof(ym3438_accm));
+			p += sizeof(ym3438_accm);
+			memcpy(p, ym3438_sample, sizeof(ym3438_sample));
+			p += sizeof(ym3438_sample);
+			memcpy(p, ym3438_sample_prev,
+			       sizeof(ym3438_sample_prev));
+			p += sizeof(ym3438_sample_prev);
+			memcpy(p, &ym3438_cycles, sizeof(ym3438_cycles));
+		}
+	}
+	else
+#endif
+	if (ok_ym2612) {
+		static const char *const tags[] = { "FM0", "FM1", "FM2" };
+		unsigned int i;
+
+		for (i = 0; (i != (dgen_mjazz ? 3 : 1)); ++i)
+			if ((p = state_chunk(ext, size, tags[i],
+					     YM2612_state_size())) != NULL)
+				YM2612_state_save(ym2612[i], p);
+	}
+	if ((p = state_chunk(ext, size, "PSG", sizeof(sn76496))) != NULL)
+		memcpy(p, &sn76496, sizeof(sn76496));
+#ifdef WITH_NUKEDOPN2
+	if ((p = state_chunk(ext, size, "RSMP",
+			     (resampler::state_size * 2))) != NULL) {
+		dac_resampler.save(p);
+		ym3438_resampler.save(&p[resampler::state_size]);
+	}
+#else
+	if ((p = state_chunk(ext, size, "RSMP",
+			     resampler::state_size)) != NULL)
+		dac_resampler.save(p);
+#endif
+	if ((save_len) &&
+	    ((p = state_chunk(ext, size, "SRAM", save_len)) != NULL))
+		memcpy(p, saveram, save_len);
+#ifdef WITH_SEGAVR
+	if ((p = state_chunk(ext, size, "SGVR",
+			     (sizeof(int32_t) * 5 + sizeof(uint32_t) * 2 +
+			      sizeof(float) * 4))) != NULL) {
+		int32_t i32[5] = {
+			mHmdThRwMask, mHmdRequestBit, mHmdRequestIndex,
+			mHmdVblankCounter, mStereoShotCount
+		};
+		uint32_t u32[2] = { mHmdEncoded, mHmdFlags };
+
+		memcpy(p, i32, sizeof(i32));
+		p += sizeof(i32);
+		memcpy(p, u32, sizeof(u32));
+		p += sizeof(u32);
+		memcpy(p, mHmdAngles, sizeof(mHmdAngles));
+		p += sizeof(mHmdAngles);
+		memcpy(p, mHmdAVel, sizeof(mHmdAVel));
+	}
+#endif
+	return size;
+}
+
+/**
+ * Restore what DGen extensions cover, after the GST image has been loaded
+ * without resetting the console first.
+ * @param buf State, previously validated by state_ext_check().
+ * @param len State size.
+ */
+void md::state_ext_load(const uint8_t *buf, size_t len)
+{
+	const uint8_t *ext = &buf[gst_size];
+	const uint8_t *p;
+	struct state_md s;
+	unsigned int i;
+	uint32_t a;
+
+	len -= gst_size;
+	memcpy(&s, state_chunk_find(ext, len, "MD", sizeof(s)), sizeof(s));
+	memcpy(vdp.reg, s.vdp_reg, sizeof(vdp.reg));
+	vdp.rw_mode = s.vdp_rw_mode;
+	vdp.rw_addr = s.vdp_rw_addr;
+	vdp.rw_dma = s.vdp_rw_dma;
+	vdp.hint_pending = s.vdp_hint_pending;
+	vdp.vint_pending = s.vdp_vint_pending;
+	vdp.cmd_pending = s.vdp_cmd_pending;
+	coo4 = s.coo4;
+	coo5 = s.coo5;
+	memcpy(pad_com, s.pad_com, sizeof(pad_com));
+	memcpy(fm_sel, s.fm_sel, sizeof(fm_sel));
+	fm_tover = s.fm_tover;
+	dac_data = s.dac_data;
+	dac_enabled = s.dac_enabled;
+	dac_level = s.dac_level;
+	dac_len = 0;
+	memcpy(fm_reg, s.fm_reg, sizeof(fm_reg));
+	memcpy(fm_ticker, s.fm_ticker, sizeof(fm_ticker));
+	aoo3_toggle = s.aoo3_toggle;
+	aoo5_toggle = s.aoo5_toggle;
+	aoo3_six = s.aoo3_six;
+	aoo5_six = s.aoo5_six;
+	aoo3_six_timeout = s.aoo3_six_timeout;
+	aoo5_six_timeout = s.aoo5_six_timeout;
+	z80_bank68k = s.z80_bank68k;
+	z80_st_busreq = s.z80_st_busreq;
+	z80_st_reset = s.z80_st_reset;
+	save_prot = s.save_prot;
+	save_active = s.save_active;
+	// Bank switching copies ROM data around, only do it for banks that
+	// differ.
+	for (a = 0xa130f3; (a <= 0xa130ff); a += 2) {
+		i = (1 + ((a - 0xa130f3) >> 1));
+		if (s.rom_bank_offsets[i] != rom_bank_offsets[i])
+			m68k_IO_write(a, (s.rom_bank_offsets[i] >> 19));
+	}
+	// CPU contexts, on top of registers from the GST image.
+#ifdef WITH_MUSA
+	if ((cpu_emu == CPU_EMU_MUSA) &&
+	    ((p = state_chunk_find(ext, len, "M68K",
+				   m68k_context_state_size())) != NULL)) {
+		memcpy(ctx_musa, p, m68k_context_state_size());
+		m68k_state_restore();
+	}
+#endif
+	z80_state.irq_asserted = s.z80_st_irq;
+	z80_state.irq_vector = s.z80_irq_vector;
+	z80_state_restore();
+#ifdef WITH_CZ80
+	if ((z80_core == Z80_CORE_CZ80) &&
+	    ((p = state_chunk_find(ext, len, "CZ80",
+				   offsetof(cz80_struc, BasePC))) != NULL)) {
+		memcpy(&cz80, p, offsetof(cz80_struc, BasePC));
+		Cz80_Set_PC(&cz80, cz80.PC);
+		// z80_state is loaded into cz80 every time it's used.
+		md_set_cz80_sync(false);
+	}
+#endif
+	// Sound chips, reset and restored from registers when missing.
+#ifdef WITH_NUKEDOPN2
+	if (dgen_ym_chipimpl == YM_CHIPIMPL_NUKEDOPN2) {
+		ym3438_thread_sync();
+		if ((p = state_chunk_find(ext, len, "OPN2",
+					  (sizeof(opn2) +
+					   sizeof(ym3438_accm) +
+					   sizeof(ym3438_sample) +
+					   sizeof(ym3438_sample_prev) +
+					   sizeof(ym3438_cycles)))) != NULL) {
+			memcpy(&opn2, p, sizeof(opn2));
+			p += sizeof(opn2);
+			memcpy(ym3438_accm, p, sizeof(ym3438_accm));
+			p += sizeof(ym3438_accm);
+			memcpy(ym3438_sample, p, sizeof(ym3438_sample));
+			p += sizeof(ym3438_sample);
+			memcpy(ym3438_sample_prev, p,
+			       sizeof(ym3438_sample_prev));
+			p += sizeof(ym3438_sample_prev);
+			memcpy(&ym3438_cycles, p, sizeof(ym3438_cycles));
+			ym3438_frame_ptr = 0;
+		}
+		else
+			ym3438_reset();
+	}
+	else
+#endif
+	if (ok_ym2612) {
+		static const char *const tags[] = { "FM0", "FM1", "FM2" };
+
+		for (i = 0; (i != (dgen_mjazz ? 3 : 1)); ++i) {
+			p = state_chunk_find(ext, len, tags[i],
+					     YM2612_state_size());
+			if ((p != NULL) &&
+			    (YM2612_state_load(ym2612[i], p) == 0))
+				continue;
+			YM2612ResetChip(ym2612[i]);
+			if (i == 0)
+				YM2612_restore(ym2612[0],
+					       (uint8_t *)&buf[0x1e4]);
+		}
+	}
+	p = state_chunk_find(ext, len, "PSG", sizeof(sn76496));
+	if ((p != NULL) &&
+	    (memcmp(&p[offsetof(struct SN76496, SampleRate)],
+		    &sn76496.SampleRate, sizeof(sn76496.SampleRate)) == 0) &&
+	    (memcmp(&p[offsetof(struct SN76496, UpdateStep)],
+		    &sn76496.UpdateStep, sizeof(sn76496.UpdateStep)) == 0))
+		memcpy(&sn76496, p, sizeof(sn76496));
+	else
+		SN76496_restore(&sn76496, (uint8_t *)&buf[0x60]);
+#ifdef WITH_NUKEDOPN2
+	if ((p = state_chunk_find(ext, len, "RSMP",
+				  (resampler::state_size * 2))) != NULL) {
+		dac_resampler.load(p);
+		ym3438_resampler.load(&p[resampler::state_size]);
 	}
-	if (p[1] != 9) {
-		fprintf(stderr,
-			"%s: warning: save file was probably not generated by"
-			" DGen/SDL.\n",
-			__func__);
+#else
+	if ((p = state_chunk_find(ext, len, "RSMP",
+				  resampler::state_size)) != NULL)
+		dac_resampler.load(p);
+#endif
+	if ((save_len) &&
+	    ((p = state_chunk_find(ext, len, "SRAM", save_len)) != NULL))
+		memcpy(saveram, p, save_len);
+#ifdef WITH_SEGAVR
+	if ((p = state_chunk_find(ext, len, "SGVR",
+				  (sizeof(int32_t) * 5 +
+				   sizeof(uint32_t) * 2 +
+				   sizeof(float) * 4))) != NULL) {
+		int32_t i32[5];
+		uint32_t u32[2];
+
+		memcpy(i32, p, sizeof(i32));
+		p += sizeof(i32);
+		memcpy(u32, p, sizeof(u32));
+		p += sizeof(u32);
+		memcpy(mHmdAngles, p, sizeof(mHmdAngles));
+		p += sizeof(mHmdAngles);
+		memcpy(mHmdAVel, p, sizeof(mHmdAVel));
+		mHmdThRwMask = i32[0];
+		mHmdRequestBit = i32[1];
+		mHmdRequestIndex = i32[2];
+		mHmdVblankCounter = i32[3];
+		mStereoShotCount = i32[4];
+		mHmdEncoded = u32[0];
+		mHmdFlags = u32[1];
 	}
+#endif
+}
+
+/**
+ * Describe a load_state() return value.
+ * @param ret Value returned by load_state().
+ * @return Message.
+ */
+const char *md::load_state_message(int ret)
+{
+	switch (ret) {
+	case 0:
+		return "success";
+	case STATE_ERR_HEADER:
+		return "invalid save file header";
+	case STATE_ERR_SYSTEM:
+		return "this is not a Genesis/Mega Drive save file";
+	case STATE_WARN_EMULATOR:
+		return "save file was probably not generated by DGen/SDL";
+	case STATE_WARN_VERSION:
+		return "unknown save file version";
+	}
+	return "unknown error";
+}
+
+/**
+ * Load a state saved by save_state() or a plain GST image.
+ * Without DGen extensions, the console is reset first and state not
+ * covered by GST starts over.
+ * Nothing is printed, see load_state_message().
+ * @param buf State.
+ * @param len State size.
+ * @return 0 on success, a negative STATE_ERR_* value on error or a
+ * positive STATE_WARN_* value when the state was loaded anyway.
+ */
+int md::load_state(const uint8_t *buf, size_t len)
+{
+	bool exact = (state_ext_check(buf, len) != NULL);
+	const uint8_t *p;
+	const uint8_t *q;
+	size_t i;
+	uint32_t tmp;
+	int ret = 0;
+	// VDP state before loading, to only mark what changed as dirty.
+	uint8_t reg[0x20];
+	uint8_t cram[0x80];
+	uint8_t vsram[0x50];
+
+	if ((len < gst_size) ||
+	    /* GST header */
+	    ((memcmp(buf, "GST\x0\x0\0\xe0\x40", 8) != 0) &&
+	     (memcmp(buf, "GST\x40\xe0", 5) != 0)))
+		return STATE_ERR_HEADER;
+	p = &buf[0x50];
+	if (p[2] != 0)
+		return STATE_ERR_SYSTEM;
+	if (p[1] != 9)
+		ret = STATE_WARN_EMULATOR;
 	else if (p[0] != 5)
-		fprintf(stderr,
-			"%s: warning: unknown save file version.\n",
-			__func__);
-	/* Reset console first. */
-	reset();
+		ret = STATE_WARN_VERSION;
+	memcpy(reg, vdp.reg, sizeof(reg));
+	memcpy(cram, vdp.cram, sizeof(cram));
+	memcpy(vsram, vdp.vsram, sizeof(vsram));
+	/* Reset console first, extensions restore everything instead. */
+	if (!exact)
+		reset();
 	/* FIXME: VDP stuff */
-	/* PSG registers (8x16-bit, 16 bytes) */
-	SN76496_restore(0, &(*buf)[0x60]);
 	/* M68K registers (19x32-bit, 1x16-bit, 90 bytes (padding: 12)) */
-	p = &(*buf)[0x80];
-	q = &(*buf)[0xa0];
+	p = &buf[0x80];
+	q = &buf[0xa0];
 	for (i = 0; (i != 8); ++i, p += 4, q += 4) {
 		memcpy(&m68k_state.d[i], p, 4);
 		memcpy(&m68k_state.a[i], q, 4);
 	}
-	memcpy(&m68k_state.pc, &(*buf)[0xc8], 4);
-	memcpy(&m68k_state.sr, &(*buf)[0xd0], 2);
+	memcpy(&m68k_state.pc, &buf[0xc8], 4);
+	memcpy(&m68k_state.sr, &buf[0xd0], 2);
 	/*
 	  FIXME?
-	  memcpy(&m68k_state.usp, &(*buf)[0xd2], 4);
-	  memcpy(&m68k_state.ssp, &(*buf)[0xd6], 4);
+	  memcpy(&m68k_state.usp, &buf[0xd2], 4);
+	  memcpy(&m68k_state.ssp, &buf[0xd6], 4);
 	*/
 	m68k_state_restore();
 	/* VDP registers (24x8-bit VDP registers, not sizeof(vdp.reg)) */
-	memcpy(vdp.reg, &(*buf)[0xfa], 0x18);
+	memcpy(vdp.reg, &buf[0xfa], 0x18);
 	memset(&vdp.reg[0x18], 0, (sizeof(vdp.reg) - 0x18));
 	/* CRAM (64x16-bit registers, 128 bytes), swapped */
-	swap16cpy(vdp.cram, &(*buf)[0x112], 0x80);
+	swap16cpy(vdp.cram, &buf[0x112], 0x80);
 	/* VSRAM (40x16-bit words, 80 bytes), swapped */
-	swap16cpy(vdp.vsram, &(*buf)[0x192], 0x50);
-	/* YM2612 registers */
-	p = &(*buf)[0x1e2];
-	fm_sel[0] = p[0];
-	fm_sel[1] = p[1];
-	p = &(*buf)[0x1e4];
-	//todo - support for nuked-opn2
-	YM2612_restore(0, p);
-	fm_reg[0][0x24] = p[0x24];
-	fm_reg[0][0x25] = p[0x25];
-	fm_reg[0][0x26] = p[0x26];
-	fm_reg[0][0x27] = p[0x27];
-	dac_data[0] = p[0x2a];
-	dac_enabled = (p[0x2b] >> 7);
-	memset(fm_ticker, 0, sizeof(fm_ticker));
+	swap16cpy(vdp.vsram, &buf[0x192], 0x50);
+	if (!exact) {
+		/* PSG registers (8x16-bit, 16 bytes) */
+		SN76496_restore(&sn76496, (uint8_t *)&buf[0x60]);
+		/* YM2612 registers */
+		p = &buf[0x1e2];
+		fm_sel[0] = p[0];
+		fm_sel[1] = p[1];
+		p = &buf[0x1e4];
+		//todo - support for nuked-opn2
+		if (ok_ym2612)
+			YM2612_restore(ym2612[0], (uint8_t *)p);
+		fm_reg[0][0x24] = p[0x24];
+		fm_reg[0][0x25] = p[0x25];
+		fm_reg[0][0x26] = p[0x26];
+		fm_reg[0][0x27] = p[0x27];
+		dac_data = p[0x2a];
+		dac_enabled = (p[0x2b] >> 7);
+		// Older saves store 0xff as register 0x2a, start silent.
+		dac_level = 0;
+		dac_len = 0;
+		memset(fm_ticker, 0, sizeof(fm_ticker));
+	}
 	/* Z80 registers (12x16-bit and 4x8-bit, 52 bytes (padding: 24)) */
-	p = &(*buf)[0x404];
-	for (i = 0; (i != 2); ++i, p = &(*buf)[0x424]) {
+	p = &buf[0x404];
+	for (i = 0; (i != 2); ++i, p = &buf[0x424]) {
 		memcpy(&z80_state.alt[i].fa, &p[0x0], 2);
 		memcpy(&z80_state.alt[i].cb, &p[0x4], 2);
 		memcpy(&z80_state.alt[i].ed, &p[0x8], 2);
 		memcpy(&z80_state.alt[i].lh, &p[0xc], 2);
 	}
-	p = &(*buf)[0x414];
+	p = &buf[0x414];
 	memcpy(&z80_state.ix, &p[0x0], 2);
 	memcpy(&z80_state.iy, &p[0x4], 2);
 	memcpy(&z80_state.pc, &p[0x8], 2);
 	memcpy(&z80_state.sp, &p[0xc], 2);
-	p = &(*buf)[0x434];
+	p = &buf[0x434];
 	z80_state.i = p[0];
 	z80_state.r = p[1];
 	z80_state.iff = ((p[2] << 1) | p[2]); /* IFF2 = IFF1 */
 	z80_state.im = ((p[3] == 0) ? 1 : p[3]);
-	z80_state_restore();
-	/* Z80 state (8 bytes) */
-	p = &(*buf)[0x438];
-	z80_st_reset = !p[0]; /* BUS RESET state */
-	if (z80_st_reset) {
-		z80_reset();
-		fm_reset();
+	if (!exact) {
+		z80_state_restore();
+		/* Z80 state (8 bytes) */
+		p = &buf[0x438];
+		z80_st_reset = !p[0]; /* BUS RESET state */
+		if (z80_st_reset) {
+			z80_reset();
+			fm_reset();
+		}
+		z80_st_busreq = (p[1] & 1); /* BUSREQ state */
 	}
-	z80_st_busreq = (p[1] & 1); /* BUSREQ state */
-	memcpy(&tmp, &(*buf)[0x43c], 4);
+	memcpy(&tmp, &buf[0x43c], 4);
 	z80_bank68k = le2h32(tmp);
 	/* Z80 RAM (8192 bytes) */
-	memcpy(z80ram, &(*buf)[0x474], 0x2000);
+	memcpy(z80ram, &buf[0x474], 0x2000);
 	/* RAM (65536 bytes), swapped */
-	swap16cpy(ram, &(*buf)[0x2478], 0x10000);
-	/* VRAM (65536 bytes) */
-	memcpy(vdp.vram, &(*buf)[0x12478], 0x10000);
-	/* Mark everything as changed */
-	memset(vdp.dirt, 0xff, 0x35);
-	free(buf);
-	return 0;
+	swap16cpy(ram, &buf[0x2478], 0x10000);
+	/*
+	  VRAM (65536 bytes), 256 byte blocks at a time like dirt[0x00-0x1f]
+	  so that tiles decoded from unchanged ones are kept.
+	*/
+	for (i = 0; (i != 0x10000); i += 0x100) {
+		if (memcmp(&vdp.vram[i], &buf[(0x12478 + i)], 0x100) == 0)
+			continue;
+		memcpy(&vdp.vram[i], &buf[(0x12478 + i)], 0x100);
+		vdp.dirt[(i >> 11)] |= (1 << ((i >> 8) & 7));
+	}
+	if (exact)
+		state_ext_load(buf, len);
+	/* Mark what changed, like md_vdp::poke_cram() and others do */
+	for (i = 0; (i != sizeof(cram)); ++i)
+		if (vdp.cram[i] != cram[i]) {
+			vdp.dirt[(0x20 + (i >> 3))] |= (1 << (i & 7));
+			vdp.dirt[0x34] |= 2;
+		}
+	if (memcmp(vdp.vsram, vsram, sizeof(vsram)))
+		vdp.dirt[0x34] |= 4;
+	for (i = 0; (i != sizeof(reg)); ++i)
+		if (vdp.reg[i] != reg[i]) {
+			vdp.dirt[(0x30 + (i >> 3))] |= (1 << (i & 7));
+			vdp.dirt[0x34] |= 8;
+		}
+	/* The sprite list isn't saved, always build it again */
+	vdp.dirt[0x34] |= 1;
+	return ret;
 }
 
-int md::export_gst(FILE *hand)
+/**
+ * Save the current state as a GST image followed by DGen extensions.
+ * Nothing is written when the buffer is too small, call this function
+ * with a NULL buffer to get the required size.
+ * @param[out] buf Where to save the state.
+ * @param cap Size of buf.
+ * @return State size.
+ */
+size_t md::save_state(uint8_t *buf, size_t cap)
 {
-	uint8_t (*buf)[0x22478] =
-		(uint8_t (*)[sizeof(*buf)])calloc(1, sizeof(*buf));
+	size_t size = (gst_size + state_ext_save(NULL));
 	uint8_t *p;
 	uint8_t *q;
 	size_t i;
 	uint32_t tmp;
 
-	if (buf == NULL)
-		return -1;
+	if ((buf == NULL) || (size > cap))
+		return size;
+	m68k_state_dump();
+	z80_state_dump();
+#ifdef WITH_NUKEDOPN2
+	ym3438_thread_sync();
+#endif
+	memset(buf, 0, gst_size);
 	/* GST header */
-	memcpy((*buf), "GST\x40\xe0", 5);
+	memcpy(buf, "GST\x40\xe0", 5);
 	/* FIXME: VDP stuff */
 	/* Version */
-	(*buf)[0x50] = 5;
+	buf[0x50] = 5;
 	/* Emulator ID */
-	(*buf)[0x51] = 9;
+	buf[0x51] = 9;
 	/* System ID */
-	(*buf)[0x52] = 0;
+	buf[0x52] = 0;
 	/* PSG registers (8x16-bit, 16 bytes) */
-	SN76496_dump(0, &(*buf)[0x60]);
+	SN76496_dump(&sn76496, &buf[0x60]);
 	/* M68K registers (19x32-bit, 1x16-bit, 90 bytes (padding: 12)) */
-	m68k_state_dump();
-	p = &(*buf)[0x80];
-	q = &(*buf)[0xa0];
+	p = &buf[0x80];
+	q = &buf[0xa0];
 	for (i = 0; (i != 8); ++i, p += 4, q += 4) {
 		memcpy(p, &m68k_state.d[i], 4);
 		memcpy(q, &m68k_state.a[i], 4);
 	}
-	memcpy(&(*buf)[0xc8], &m68k_state.pc, 4);
-	memcpy(&(*buf)[0xd0], &m68k_state.sr, 2);
+	memcpy(&buf[0xc8], &m68k_state.pc, 4);
+	memcpy(&buf[0xd0], &m68k_state.sr, 2);
 	/*
 	  FIXME?
-	  memcpy(&(*buf)[0xd2], &m68k_state.usp, 4);
-	  memcpy(&(*buf)[0xd6], &m68k_state.ssp, 4);
+	  memcpy(&buf[0xd2], &m68k_state.usp, 4);
+	  memcpy(&buf[0xd6], &m68k_state.ssp, 4);
 	*/
 	/* VDP registers (24x8-bit VDP registers, not sizeof(vdp.reg)) */
-	memcpy(&(*buf)[0xfa], vdp.reg, 0x18);
+	memcpy(&buf[0xfa], vdp.reg, 0x18);
 	/* CRAM (64x16-bit registers, 128 bytes), swapped */
-	swap16cpy(&(*buf)[0x112], vdp.cram, 0x80);
+	swap16cpy(&buf[0x112], vdp.cram, 0x80);
 	/* VSRAM (40x16-bit words, 80 bytes), swapped */
-	swap16cpy(&(*buf)[0x192], vdp.vsram, 0x50);
+	swap16cpy(&buf[0x192], vdp.vsram, 0x50);
 	/* YM2612 registers */
-	p = &(*buf)[0x1e2];
+	p = &buf[0x1e2];
 	p[0] = fm_sel[0];
 	p[1] = fm_sel[1];
-	p = &(*buf)[0x1e4];
+	p = &buf[0x1e4];
 	//todo - support for nuked-opn2
-	YM2612_dump(0, p);
+	if (ok_ym2612)
+		YM2612_dump(ym2612[0], p);
 	p[0x24] = fm_reg[0][0x24];
 	p[0x25] = fm_reg[0][0x25];
 	p[0x26] = fm_reg[0][0x26];
 	p[0x27] = fm_reg[0][0x27];
-	p[0x2a] = 0xff;
+	p[0x2a] = dac_data;
 	p[0x2b] = (dac_enabled << 7);
 	/* Z80 registers (12x16-bit and 4x8-bit, 52 bytes (padding: 24)) */
-	z80_state_dump();
-	p = &(*buf)[0x404];
-	for (i = 0; (i != 2); ++i, p = &(*buf)[0x424]) {
+	p = &buf[0x404];
+	for (i = 0; (i != 2); ++i, p = &buf[0x424]) {
 		memcpy(&p[0x0], &z80_state.alt[i].fa, 2);
 		memcpy(&p[0x4], &z80_state.alt[i].cb, 2);
 		memcpy(&p[0x8], &z80_state.alt[i].ed, 2);
 		memcpy(&p[0xc], &z80_state.alt[i].lh, 2);
 	}
-	p = &(*buf)[0x414];
+	p = &buf[0x414];
 	memcpy(&p[0x0], &z80_state.ix, 2);
 	memcpy(&p[0x4], &z80_state.iy, 2);
 	memcpy(&p[0x8], &z80_state.pc, 2);
 	memcpy(&p[0xc], &z80_state.sp, 2);
-	p = &(*buf)[0x434];
+	p = &buf[0x434];
 	p[0] = z80_state.i;
 	p[1] = z80_state.r;
 	p[2] = ((z80_state.iff >> 1) | z80_state.iff);
 	p[3] = z80_state.im;
 	/* Z80 state (8 bytes) */
-	p = &(*buf)[0x438];
+	p = &buf[0x438];
 	p[0] = !z80_st_reset;
 	p[1] = z80_st_busreq;
 	tmp = h2le32(z80_bank68k);
-	memcpy(&(*buf)[0x43c], &tmp, 4);
+	memcpy(&buf[0x43c], &tmp, 4);
 	/* Z80 RAM (8192 bytes) */
-	memcpy(&(*buf)[0x474], z80ram, 0x2000);
+	memcpy(&buf[0x474], z80ram, 0x2000);
 	/* RAM (65536 bytes), swapped */
-	swap16cpy(&(*buf)[0x2478], ram, 0x10000);
+	swap16cpy(&buf[0x2478], ram, 0x10000);
 	/* VRAM (65536 bytes) */
-	memcpy(&(*buf)[0x12478], vdp.vram, 0x10000);
-	/* Output */
-	i = fwrite((*buf), sizeof(*buf), 1, hand);
+	memcpy(&buf[0x12478], vdp.vram, 0x10000);
+	state_ext_save(&buf[gst_size]);
+	return size;
+}
+
+int md::import_gst(FILE *hand)
+{
+	uint8_t *buf = NULL;
+	size_t size = 0;
+	size_t len = 0;
+	int ret;
+
+	/* Read everything, DGen extensions follow the GST image. */
+	do {
+		uint8_t *tmp = (uint8_t *)realloc(buf, (size + gst_size));
+
+		if (tmp == NULL) {
+			free(buf);
+			return -1;
+		}
+		buf = tmp;
+		size += gst_size;
+		len += fread(&buf[len], 1, (size - len), hand);
+	}
+	while (len == size);
+	ret = load_state(buf, len);
 	free(buf);
-	if (i != 1)
+	if (ret != 0)
+		fprintf(stderr, "%s: %s: %s.\n", __func__,
+			((ret < 0) ? "error" : "warning"),
+			load_state_message(ret));
+	return ret;
+}
+
+int md::export_gst(FILE *hand)
+{
+	size_t size = save_state(NULL, 0);
+	uint8_t *buf = (uint8_t *)malloc(size);
+	int ret = -1;
+
+	if (buf == NULL)
 		return -1;
+	if ((save_state(buf, size) == size) &&
+	    (fwrite(buf, size, 1, hand) == 1))
+		ret = 0;
+	free(buf);
+	return ret;
+}
+
+/**
+ * Start recording rewind history, any previous history is discarded.
+ * @param size Memory to use in bytes.
+ * @param interval Number of frames between snapshots.
+ * @return 0 on success, -1 on error.
+ */
+int md::rewind_start(size_t size, unsigned int interval)
+{
+	rewind_stop();
+	rewind = new rewind_ring(size, interval);
+	if (!rewind->okay()) {
+		rewind_stop();
+		return -1;
+	}
 	return 0;
 }
+
+/**
+ * Stop recording rewind history and free it.
+ */
+void md::rewind_stop()
+{
+	delete rewind;
+	rewind = NULL;
+}
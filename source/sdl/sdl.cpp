@@ -25,6 +25,8 @@
 #include <errno.h>
 #include <ctype.h>
 #include <assert.h>
+#include <math.h>
+#include <atomic>
 #include <SDL.h>
 #include <SDL_audio.h>
 
@@ -49,6 +51,8 @@
 #include "prompt.h"
 #include "romload.h"
 #include "splash.h"
+#include "rewind.h"
+#include "shot.h"
 
 #ifdef WITH_HQX
 #define HQX_NO_UINT24
@@ -359,81 +363,94 @@ const char *pd_options =
 
 static void mdscr_splash();
 
-/// Circular buffer and related functions.
+/**
+ * Lock-free ring buffer of stereo samples, written by the emulation thread
+ * and read by the audio callback. Indices are free-running counters, only
+ * the writer updates wr and only the reader updates rd.
+ */
 typedef struct {
-	size_t i; ///< data start index
-	size_t s; ///< data size
-	size_t size; ///< buffer size
-	union {
-		uint8_t *u8;
-		int16_t *i16;
-	} data; ///< storage
-} cbuf_t;
+	std::atomic<size_t> rd; ///< samples read so far
+	std::atomic<size_t> wr; ///< samples written so far
+	size_t size; ///< storage size in samples (power of two)
+	size_t limit; ///< maximum number of buffered samples
+	uint32_t *data; ///< storage, one sample (both channels) per entry
+	std::atomic<unsigned long> underruns; ///< callbacks short of samples
+	std::atomic<unsigned long> overruns; ///< writes that didn't fit
+} sring_t;
 
 /**
- * Write/copy data into a circular buffer.
- * @param[in,out] cbuf Destination buffer.
- * @param[in] src Buffer to copy from.
- * @param size Size of src.
- * @return Number of bytes copied.
+ * Write samples into a ring buffer. Samples that don't fit are dropped.
+ * @param[in,out] sring Destination buffer.
+ * @param[in] src Samples to copy.
+ * @param n Number of samples in src.
+ * @return Number of samples copied.
  */
-size_t cbuf_write(cbuf_t *cbuf, uint8_t *src, size_t size)
+static size_t sring_write(sring_t *sring, const uint32_t *src, size_t n)
 {
-	size_t j;
-	size_t k;
+	size_t wr = sring->wr.load(std::memory_order_relaxed);
+	size_t used = (wr - sring->rd.load(std::memory_order_acquire));
+	size_t mask = (sring->size - 1);
+	size_t i;
 
-	if (size > cbuf->size) {
-		src += (size - cbuf->size);
-		size = cbuf->size;
-	}
-	k = (cbuf->size - cbuf->s);
-	j = ((cbuf->i + cbuf->s) % cbuf->size);
-	if (size > k) {
-		cbuf->i = ((cbuf->i + (size - k)) % cbuf->size);
-		cbuf->s = cbuf->size;
+	if (used >= sring->limit)
+		n = 0;
+	else if (n > (sring->limit - used))
+		n = (sring->limit - used);
+	i = (wr & mask);
+	if ((i + n) > sring->size) {
+		size_t k = (sring->size - i);
+
+		memcpy(&sring->data[i], &src[0], (k * sizeof(*src)));
+		memcpy(&sring->data[0], &src[k], ((n - k) * sizeof(*src)));
 	}
 	else
-		cbuf->s += size;
-	k = (cbuf->size - j);
-	if (k >= size) {
-		memcpy(&cbuf->data.u8[j], src, size);
-	}
-	else {
-		memcpy(&cbuf->data.u8[j], src, k);
-		memcpy(&cbuf->data.u8[0], &src[k], (size - k));
-	}
-	return size;
+		memcpy(&sring->data[i], &src[0], (n * sizeof(*src)));
+	sring->wr.store((wr + n), std::memory_order_release);
+	return n;
 }
 
 /**
- * Read bytes out of a circular buffer.
+ * Read samples out of a ring buffer.
  * @param[out] dst Destination buffer.
- * @param[in,out] cbuf Circular buffer to read from.
- * @param size Maximum number of bytes to copy to dst.
- * @return Number of bytes copied.
+ * @param[in,out] sring Ring buffer to read from.
+ * @param n Maximum number of samples to copy to dst.
+ * @return Number of samples copied.
  */
-size_t cbuf_read(uint8_t *dst, cbuf_t *cbuf, size_t size)
+static size_t sring_read(uint32_t *dst, sring_t *sring, size_t n)
 {
-	if (size > cbuf->s)
-		size = cbuf->s;
-	if ((cbuf->i + size) > cbuf->size) {
-		size_t k = (cbuf->size - cbuf->i);
+	size_t rd = sring->rd.load(std::memory_order_relaxed);
+	size_t used = (sring->wr.load(std::memory_order_acquire) - rd);
+	size_t mask = (sring->size - 1);
+	size_t i;
+
+	if (n > used)
+		n = used;
+	i = (rd & mask);
+	if ((i + n) > sring->size) {
+		size_t k = (sring->size - i);
 
-		memcpy(&dst[0], &cbuf->data.u8[(cbuf->i)], k);
-		memcpy(&dst[k], &cbuf->data.u8[0], (size - k));
+		memcpy(&dst[0], &sring->data[i], (k * sizeof(*dst)));
+		memcpy(&dst[k], &sring->data[0], ((n - k) * sizeof(*dst)));
 	}
 	else
-		memcpy(&dst[0], &cbuf->data.u8[(cbuf->i)], size);
-	cbuf->i = ((cbuf->i + size) % cbuf->size);
-	cbuf->s -= size;
-	return size;
+		memcpy(&dst[0], &sring->data[i], (n * sizeof(*dst)));
+	sring->rd.store((rd + n), std::memory_order_release);
+	return n;
 }
 
+/// Maximum deviation from the nominal sound rate (dynamic rate control).
+#define SOUND_DRC_MAX 0.005
+
 /// Sound
 static struct {
 	unsigned int rate; ///< samples rate
 	unsigned int samples; ///< number of samples required by the callback
-	cbuf_t cbuf; ///< circular buffer
+	sring_t sring; ///< ring buffer
+	double len; ///< nominal number of samples per frame
+	double len_frac; ///< fraction of a sample carried to the next frame
+	unsigned int len_max; ///< sndi.lr size in samples
+	double fill; ///< average sring fill level after writing a frame
+	double ratio; ///< current rate adjustment (1.0 = nominal)
 } sound;
 
 /// Messages
@@ -489,11 +506,16 @@ static int prompt_cmd_config_load(class md&, unsigned int, const char**);
 static int prompt_cmd_config_save(class md&, unsigned int, const char**);
 static char* prompt_cmpl_config_file(class md&, unsigned int, const char**,
 				     unsigned int);
+static int prompt_cmd_sound_stats(class md&, unsigned int, const char**);
+static int prompt_cmd_rewind_stats(class md&, unsigned int, const char**);
 #ifdef WITH_VGMDUMP
 static char* prompt_cmpl_vgmdump(class md&, unsigned int, const char**,
 				 unsigned int);
 static int prompt_cmd_vgmdump(class md&, unsigned int, const char**);
 #endif
+static char* prompt_cmpl_wavdump(class md&, unsigned int, const char**,
+				 unsigned int);
+static int prompt_cmd_wavdump(class md&, unsigned int, const char**);
 
 /**
  * List of commands to auto complete.
@@ -520,9 +542,12 @@ static const struct prompt_command prompt_command[] = {
 	{ "calibrate_js", prompt_cmd_calibrate, NULL }, // deprecated name
 	{ "config_load", prompt_cmd_config_load, prompt_cmpl_config_file },
 	{ "config_save", prompt_cmd_config_save, prompt_cmpl_config_file },
+	{ "sound_stats", prompt_cmd_sound_stats, NULL },
+	{ "rewind_stats", prompt_cmd_rewind_stats, NULL },
 #ifdef WITH_VGMDUMP
 	{ "vgmdump", prompt_cmd_vgmdump, prompt_cmpl_vgmdump },
 #endif
+	{ "wavdump", prompt_cmd_wavdump, prompt_cmpl_wavdump },
 	{ NULL, NULL, NULL }
 };
 
@@ -558,6 +583,9 @@ static const char game_genie_str[] = "Enter Game Genie/Hex code: ";
 bool pd_freeze = false;
 static unsigned int pd_freeze_ref = 0;
 
+/// Set while the rewind control is held.
+bool pd_rewind = false;
+
 static void freeze(bool toggle)
 {
 	if (toggle == true) {
@@ -904,6 +932,63 @@ static int prompt_cmd_reset(class md& md, unsigned int, const char**)
 	return CMD_OK;
 }
 
+static int prompt_cmd_sound_stats(class md&, unsigned int ac,
+				  const char** av)
+{
+	size_t used;
+
+	if (!sound.sring.size) {
+		pd_message("Sound is disabled.");
+		return (CMD_FAIL | CMD_MSG);
+	}
+	if (ac > 1) {
+		if (strcasecmp(av[1], "reset"))
+			return CMD_EINVAL;
+		sound.sring.underruns.store(0);
+		sound.sring.overruns.store(0);
+		pd_message("Sound statistics reset.");
+		return (CMD_OK | CMD_MSG);
+	}
+	used = pd_sound_fill();
+	// Latency includes the callback buffer, played after the ring.
+	pd_message("Sound: %lu underruns, %lu overruns,"
+		   " %u/%u samples buffered, latency %.1fms, rate %+.2f%%",
+		   sound.sring.underruns.load(),
+		   sound.sring.overruns.load(),
+		   (unsigned int)used, (unsigned int)sound.sring.limit,
+		   (((sound.fill + sound.samples) * 1000.0) / sound.rate),
+		   ((sound.ratio - 1.0) * 100.0));
+	return (CMD_OK | CMD_MSG);
+}
+
+static int prompt_cmd_rewind_stats(class md& md, unsigned int ac,
+				   const char** av)
+{
+	struct rewind_ring::stats st;
+
+	if (md.rewind == NULL) {
+		pd_message("Rewinding is disabled.");
+		return (CMD_FAIL | CMD_MSG);
+	}
+	if (ac > 1) {
+		if (strcasecmp(av[1], "clear"))
+			return CMD_EINVAL;
+		md.rewind->clear();
+		pd_message("Rewind history cleared.");
+		return (CMD_OK | CMD_MSG);
+	}
+	md.rewind->get_stats(st);
+	pd_message("Rewind: %.1fs in %.1f/%.1fMiB, %u snapshots of %uKiB"
+		   " (ratio %.1f:1), capture %luus (average %luus)",
+		   ((double)st.frames / dgen_hz),
+		   (st.used / 1048576.0), (st.capacity / 1048576.0),
+		   st.entries, (unsigned int)(st.state_size / 1024),
+		   (st.packed ? ((double)st.raw / st.packed) : 0.0),
+		   st.last_usecs,
+		   (st.captures ? (st.usecs / st.captures) : 0));
+	return (CMD_OK | CMD_MSG);
+}
+
 static int prompt_cmd_unbind(class md&, unsigned int ac, const char** av)
 {
 	unsigned int i;
@@ -1044,6 +1129,91 @@ static int prompt_cmd_vgmdump(class md& md, unsigned int ac, const char** av)
 
 #endif
 
+static char* prompt_cmpl_wavdump(class md& md, unsigned int ac,
+				 const char** av, unsigned int len)
+{
+	const char *prefix;
+	size_t i;
+	unsigned int skip;
+
+	(void)md;
+	assert(ac != 0);
+	if ((ac == 1) || (len == ~0u) || (av[(ac - 1)] == NULL)) {
+		prefix = "";
+		len = 0;
+	}
+	else
+		prefix = av[(ac - 1)];
+	if (prompt.complete == NULL) {
+		// Rebuild cache.
+		prompt.skip = 0;
+		prompt.complete = complete_path(prefix, len, "wav");
+		if (prompt.complete == NULL)
+			return NULL;
+		rehash_prompt_complete_common();
+	}
+retry:
+	skip = prompt.skip;
+	for (i = 0; (prompt.complete[i] != NULL); ++i) {
+		if (skip == 0)
+			break;
+		--skip;
+	}
+	if (prompt.complete[i] == NULL) {
+		if (prompt.skip != 0) {
+			prompt.skip = 0;
+			goto retry;
+		}
+		return NULL;
+	}
+	++prompt.skip;
+	return strdup(prompt.complete[i]);
+}
+
+/**
+ * Prompt "wavdump" command handler.
+ * "wavdump start FILE [YM3438_FILE]" captures the final mix to FILE and
+ * optionally native rate Nuked OPN2 output to YM3438_FILE,
+ * "wavdump stop" finalizes both.
+ */
+static int prompt_cmd_wavdump(class md& md, unsigned int ac, const char** av)
+{
+	char *s;
+
+	if (ac < 2)
+		return CMD_EINVAL;
+	if (!strcasecmp(av[1], "stop")) {
+		if ((md.wav_dump == NULL) && (md.wav_dump_ym3438 == NULL))
+			pd_message("WAV dumping already stopped.");
+		else if (md.wav_dump_stop()) {
+			pd_message("Stopped WAV dumping, some data couldn't"
+				   " be written.");
+			return (CMD_FAIL | CMD_MSG);
+		}
+		else
+			pd_message("Stopped WAV dumping.");
+		return (CMD_OK | CMD_MSG);
+	}
+	if (strcasecmp(av[1], "start"))
+		return CMD_EINVAL;
+	if (ac < 3) {
+		pd_message("WAV file name required.");
+		return (CMD_EINVAL | CMD_MSG);
+	}
+	s = backslashify((const uint8_t *)av[2], strlen(av[2]), 0, NULL);
+	if (s == NULL)
+		return CMD_FAIL;
+	if (md.wav_dump_start(av[2], ((ac > 3) ? av[3] : NULL))) {
+		pd_message("Cannot dump WAV to \"%s\": %s",
+			   s, strerror(errno));
+		free(s);
+		return (CMD_FAIL | CMD_MSG);
+	}
+	pd_message("Started WAV dumping to \"%s\"", s);
+	free(s);
+	return (CMD_OK | CMD_MSG);
+}
+
 struct filter_data {
 	bpp_t buf; ///< Input or output buffer.
 	unsigned int width; ///< Buffer width.
@@ -1492,13 +1662,37 @@ static void filters_empty()
 
 #endif
 
+/// Screenshots are converted and written in the background.
+static shot_writer shots;
+
+/**
+ * Display the outcome of finished screenshots.
+ */
+static void screenshots_report()
+{
+	std::string name;
+	bool ok;
+
+	while (shots.done(name, ok)) {
+		if (ok)
+			pd_message("Screenshot written to %s.", name.c_str());
+		else
+			pd_message("Error while generating screenshot %s.",
+				   name.c_str());
+	}
+}
+
 /**
  * Take a screenshot.
+ * Only a copy of the frame is made here, see shot.h.
  */
-void pd_do_screenshot(md& megad, const char *pNameSuffix, const bool autoIncrementShotNumber)
+void pd_do_screenshot(md& megad, const char *pNameSuffix)
 {
 	static unsigned int n = 0;
 	static char romname_old[sizeof(megad.romname)];
+	enum shot_writer::format fmt = (dgen_png_screenshots ?
+					shot_writer::SHOT_PNG :
+					shot_writer::SHOT_TGA);
 	FILE *fp;
 #ifdef HAVE_FTELLO
 	off_t pos;
@@ -1510,7 +1704,7 @@ void pd_do_screenshot(md& megad, const char *pNameSuffix, const bool autoIncreme
 	unsigned int height;
 	unsigned int pitch;
 	unsigned int bpp = mdscr.bpp;
-	uint8_t (*out)[3]; // 24 bpp
+	int ret;
 	char name[(sizeof(megad.romname) + 32)];
 
 	if (dgen_raw_screenshots) {
@@ -1535,16 +1729,15 @@ void pd_do_screenshot(md& megad, const char *pNameSuffix, const bool autoIncreme
 		pd_message("Screenshots unsupported in %d bpp.", bpp);
 		return;
 	}
-	// Make take a long time, let the main loop know about it.
-	stopped = 1;
 	// If megad.romname is different from last time, reset n.
 	if (memcmp(romname_old, megad.romname, sizeof(romname_old))) {
 		memcpy(romname_old, megad.romname, sizeof(romname_old));
 		n = 0;
 	}
 retry:
-	snprintf(name, sizeof(name), "%s-%s%06u.tga",
-		 ((megad.romname[0] == '\0') ? "unknown" : megad.romname), pNameSuffix, n);
+	snprintf(name, sizeof(name), "%s-%s%06u.%s",
+		 ((megad.romname[0] == '\0') ? "unknown" : megad.romname), pNameSuffix, n,
+		 shot_writer::extension(fmt));
 	fp = dgen_fopen("screenshots", name, DGEN_APPEND);
 	if (fp == NULL) {
 		pd_message("Can't open %s.", name);
@@ -1561,131 +1754,20 @@ retry:
 		n = ((n + 1) % 1000000);
 		goto retry;
 	}
-	if (autoIncrementShotNumber)
-	{
-		n = ((n + 1) % 1000000);
-	}
-	// Allocate line buffer.
-	if ((out = (uint8_t (*)[3])malloc(sizeof(*out) * width)) == NULL)
-		goto error;
-	// Header
-	{
-		uint8_t tmp[(3 + 5)] = {
-			0x00, // length of the image ID field
-			0x00, // whether a color map is included
-			0x02 // image type: uncompressed, true-color image
-			// 5 bytes of color map specification
-		};
-
-		if (!fwrite(tmp, sizeof(tmp), 1, fp))
-			goto error;
-	}
-	{
-		uint16_t tmp[4] = {
-			0, // x-origin
-			0, // y-origin
-			h2le16(width), // width
-			h2le16(height) // height
-		};
-
-		if (!fwrite(tmp, sizeof(tmp), 1, fp))
-			goto error;
-	}
-	{
-		uint8_t tmp[2] = {
-			24, // always output 24 bits per pixel
-			(1 << 5) // top-left origin
-		};
-
-		if (!fwrite(tmp, sizeof(tmp), 1, fp))
-			goto error;
+	// The file stays empty until the worker thread writes it, its name
+	// must not be handed out again.
+	n = ((n + 1) % 1000000);
+	if (screen_lock()) {
+		fclose(fp);
+		ret = -1;
 	}
-	// Data
-	switch (bpp) {
-		unsigned int y;
-		unsigned int x;
-
-	case 15:
-		for (y = 0; (y < height); ++y) {
-			if (screen_lock())
-				goto error;
-			for (x = 0; (x < width); ++x) {
-				uint16_t v = line.u16[x];
-
-				out[x][0] = ((v << 3) & 0xf8);
-				out[x][1] = ((v >> 2) & 0xf8);
-				out[x][2] = ((v >> 7) & 0xf8);
-			}
-			screen_unlock();
-			if (!fwrite(out, (sizeof(*out) * width), 1, fp))
-				goto error;
-			line.u8 += pitch;
-		}
-		break;
-	case 16:
-		for (y = 0; (y < height); ++y) {
-			if (screen_lock())
-				goto error;
-			for (x = 0; (x < width); ++x) {
-				uint16_t v = line.u16[x];
-
-				out[x][0] = ((v << 3) & 0xf8);
-				out[x][1] = ((v >> 3) & 0xfc);
-				out[x][2] = ((v >> 8) & 0xf8);
-			}
-			screen_unlock();
-			if (!fwrite(out, (sizeof(*out) * width), 1, fp))
-				goto error;
-			line.u8 += pitch;
-		}
-		break;
-	case 24:
-		for (y = 0; (y < height); ++y) {
-			if (screen_lock())
-				goto error;
-#ifdef WORDS_BIGENDIAN
-			for (x = 0; (x < width); ++x) {
-				out[x][0] = line.u24[x][2];
-				out[x][1] = line.u24[x][1];
-				out[x][2] = line.u24[x][0];
-			}
-#else
-			memcpy(out, line.u24, (sizeof(*out) * width));
-#endif
-			screen_unlock();
-			if (!fwrite(out, (sizeof(*out) * width), 1, fp))
-				goto error;
-			line.u8 += pitch;
-		}
-		break;
-	case 32:
-		for (y = 0; (y < height); ++y) {
-			if (screen_lock())
-				goto error;
-			for (x = 0; (x < width); ++x) {
-#ifdef WORDS_BIGENDIAN
-				uint32_t rgb = h2le32(line.u32[x]);
-
-				memcpy(&(out[x]), &rgb, 3);
-#else
-				memcpy(&(out[x]), &(line.u32[x]), 3);
-#endif
-			}
-			screen_unlock();
-			if (!fwrite(out, (sizeof(*out) * width), 1, fp))
-				goto error;
-			line.u8 += pitch;
-		}
-		break;
+	else {
+		ret = shots.write(fp, name, fmt, line.u8, pitch, width, height,
+				  bpp);
+		screen_unlock();
 	}
-	pd_message("Screenshot written to %s.", name);
-	free(out);
-	fclose(fp);
-	return;
-error:
-	pd_message("Error while generating screenshot %s.", name);
-	free(out);
-	fclose(fp);
+	if (ret)
+		pd_message("Error while generating screenshot %s.", name);
 }
 
 /**
@@ -4100,13 +4182,35 @@ static void snd_callback(void *, Uint8 *stream, int len)
 	size_t wrote;
 
 	// Slurp off the play buffer
-	wrote = cbuf_read(stream, &sound.cbuf, len);
+	wrote = (sring_read((uint32_t *)stream, &sound.sring, (len >> 2)) << 2);
 	if (wrote == (size_t)len)
 		return;
 	// Not enough data, fill remaining space with silence.
+	sound.sring.underruns.fetch_add(1, std::memory_order_relaxed);
 	memset(&stream[wrote], 0, ((size_t)len - wrote));
 }
 
+/**
+ * Forget sound buffer contents and settings.
+ */
+static void snd_clear()
+{
+	sound.rate = 0;
+	sound.samples = 0;
+	sound.sring.rd.store(0);
+	sound.sring.wr.store(0);
+	sound.sring.size = 0;
+	sound.sring.limit = 0;
+	sound.sring.data = NULL;
+	sound.sring.underruns.store(0);
+	sound.sring.overruns.store(0);
+	sound.len = 0.0;
+	sound.len_frac = 0.0;
+	sound.len_max = 0;
+	sound.fill = 0.0;
+	sound.ratio = 1.0;
+}
+
 /**
  * Initialize the sound.
  * @param freq Sound samples rate.
@@ -4158,23 +4262,38 @@ int pd_sound_init(long &freq, unsigned int &samples)
 
 	// Set things as they really are
 	sound.rate = freq = spec.freq;
-	sndi.len = (spec.freq / video.hz);
+	sound.len = ((double)spec.freq / video.hz);
+	sound.len_frac = 0.0;
+	sound.ratio = 1.0;
+	sndi.len = sound.len;
+	// Leave room for rate adjustments.
+	sound.len_max = (ceil(sound.len * (1.0 + SOUND_DRC_MAX)) + 1);
 	sound.samples = spec.samples;
 	samples += sound.samples;
 
-	// Calculate buffer size (sample size = (channels * (bits / 8))).
-	sound.cbuf.size = (samples * (2 * (16 / 8)));
-	sound.cbuf.i = 0;
-	sound.cbuf.s = 0;
+	// Buffer up to "samples" samples, storage size must be a power of
+	// two (sample size = (channels * (bits / 8))).
+	sound.sring.limit = samples;
+	for (sound.sring.size = 1;
+	     (sound.sring.size < samples);
+	     sound.sring.size <<= 1)
+		;
+	sound.sring.rd.store(0);
+	sound.sring.wr.store(0);
+	sound.sring.underruns.store(0);
+	sound.sring.overruns.store(0);
+	sound.fill = (sound.sring.limit / 2);
 
 	fprintf(stderr, "sound: %uHz, %d samples, buffer: %u bytes\n",
-		sound.rate, spec.samples, (unsigned int)sound.cbuf.size);
+		sound.rate, spec.samples,
+		(unsigned int)(sound.sring.limit * (2 * (16 / 8))));
 
 	// Allocate zero-filled play buffer.
-	sndi.lr = (int16_t *)calloc(2, (sndi.len * sizeof(sndi.lr[0])));
+	sndi.lr = (int16_t *)calloc(2, (sound.len_max * sizeof(sndi.lr[0])));
 
-	sound.cbuf.data.i16 = (int16_t *)calloc(1, sound.cbuf.size);
-	if ((sndi.lr == NULL) || (sound.cbuf.data.i16 == NULL)) {
+	sound.sring.data = (uint32_t *)calloc(sound.sring.size,
+					      sizeof(sound.sring.data[0]));
+	if ((sndi.lr == NULL) || (sound.sring.data == NULL)) {
 		fprintf(stderr, "sdl: couldn't allocate sound buffers.\n");
 		goto snd_error;
 	}
@@ -4191,9 +4310,8 @@ snd_error:
 	free((void *)sndi.lr);
 	sndi.lr = NULL;
 	sndi.len = 0;
-	free((void *)sound.cbuf.data.i16);
-	sound.cbuf.data.i16 = NULL;
-	memset(&sound, 0, sizeof(sound));
+	free((void *)sound.sring.data);
+	snd_clear();
 	return 0;
 }
 
@@ -4202,12 +4320,12 @@ snd_error:
  */
 void pd_sound_deinit()
 {
-	if (sound.cbuf.data.i16 != NULL) {
+	if (sound.sring.data != NULL) {
 		SDL_PauseAudio(1);
 		SDL_CloseAudio();
-		free((void *)sound.cbuf.data.i16);
+		free((void *)sound.sring.data);
 	}
-	memset(&sound, 0, sizeof(sound));
+	snd_clear();
 	free((void*)sndi.lr);
 	sndi.lr = NULL;
 }
@@ -4217,38 +4335,61 @@ void pd_sound_deinit()
  */
 unsigned int pd_sound_rp()
 {
-	unsigned int ret;
-
-	if (!sound.cbuf.size)
+	if (!sound.sring.size)
 		return 0;
-	SDL_LockAudio();
-	ret = sound.cbuf.i;
-	SDL_UnlockAudio();
-	return (ret >> 2);
+	return (sound.sring.rd.load(std::memory_order_acquire) &
+		(sound.sring.size - 1));
 }
 
 unsigned int pd_sound_wp()
 {
-	unsigned int ret;
+	if (!sound.sring.size)
+		return 0;
+	return (sound.sring.wr.load(std::memory_order_acquire) &
+		(sound.sring.size - 1));
+}
 
-	if (!sound.cbuf.size)
+unsigned int pd_sound_fill()
+{
+	if (!sound.sring.size)
 		return 0;
-	SDL_LockAudio();
-	ret = ((sound.cbuf.i + sound.cbuf.s) % sound.cbuf.size);
-	SDL_UnlockAudio();
-	return (ret >> 2);
+	return (sound.sring.wr.load(std::memory_order_acquire) -
+		sound.sring.rd.load(std::memory_order_acquire));
 }
 
 /**
- * Write contents of sndi to sound.cbuf.
+ * Write contents of sndi to sound.sring, then decide how many samples
+ * the next frame should generate.
  */
 void pd_sound_write()
 {
-	if (!sound.cbuf.size)
+	double len;
+
+	if (!sound.sring.size)
 		return;
-	SDL_LockAudio();
-	cbuf_write(&sound.cbuf, (uint8_t *)sndi.lr, (sndi.len * 4));
-	SDL_UnlockAudio();
+	if (sring_write(&sound.sring, (uint32_t *)sndi.lr, sndi.len) !=
+	    sndi.len)
+		sound.sring.overruns.fetch_add(1, std::memory_order_relaxed);
+	sound.fill += ((pd_sound_fill() - sound.fill) / 16.0);
+	// Dynamic rate control: generate slightly more samples when the
+	// buffer is less than half full, fewer when it's more. When sound
+	// is the master clock, frames already follow its consumption.
+	if ((dgen_sound_drc) && (!dgen_sound_master)) {
+		sound.ratio = (1.0 - (SOUND_DRC_MAX *
+				      (((2.0 * sound.fill) /
+					sound.sring.limit) - 1.0)));
+		if (sound.ratio < (1.0 - SOUND_DRC_MAX))
+			sound.ratio = (1.0 - SOUND_DRC_MAX);
+		else if (sound.ratio > (1.0 + SOUND_DRC_MAX))
+			sound.ratio = (1.0 + SOUND_DRC_MAX);
+	}
+	else
+		sound.ratio = 1.0;
+	len = ((sound.len * sound.ratio) + sound.len_frac);
+	sndi.len = len;
+	if (sndi.len > sound.len_max)
+		sndi.len = sound.len_max;
+	sound.len_frac = (len - sndi.len);
 }
 
 /**
@@ -4626,8 +4767,6 @@ static int prompt_rehash_rc_field(const struct rc_field *rc, md& megad)
 		else if (dgen_sound == 0)
 			pd_sound_deinit();
 		else {
-			uint8_t ym2612_buf[512];
-			uint8_t sn76496_buf[16];
 			unsigned int samples;
 			long rate = dgen_soundrate;
 
@@ -4635,11 +4774,8 @@ static int prompt_rehash_rc_field(const struct rc_field *rc, md& megad)
 			samples = (dgen_soundsegs * (rate / video.hz));
 			if (!pd_sound_init(rate, samples))
 				fail = true;
-			YM2612_dump(0, ym2612_buf);
-			SN76496_dump(0, sn76496_buf);
-			megad.init_sound();
-			SN76496_restore(0, sn76496_buf);
-			YM2612_restore(0, ym2612_buf);
+			if (!megad.reinit_sound())
+				fail = true;
 		}
 	}
 	if (init_joystick) {
@@ -5305,6 +5441,7 @@ enum ctl_e {
 	CTL_DGEN_SLOT_PREV,
 	CTL_DGEN_SAVE,
 	CTL_DGEN_LOAD,
+	CTL_DGEN_REWIND,
 	CTL_DGEN_Z80_TOGGLE,
 	CTL_DGEN_CPU_TOGGLE,
 	CTL_DGEN_STOP,
@@ -5709,6 +5846,21 @@ static int ctl_dgen_load(struct ctl&, md& megad)
 	return 1;
 }
 
+static int ctl_dgen_rewind(struct ctl&, md& megad)
+{
+	if (megad.rewind == NULL)
+		pd_message("Rewinding is disabled.");
+	else
+		pd_rewind = true;
+	return 1;
+}
+
+static int ctl_dgen_rewind_release(struct ctl&, md&)
+{
+	pd_rewind = false;
+	return 1;
+}
+
 // Cycle Z80 core.
 static int ctl_dgen_z80_toggle(struct ctl&, md& megad)
 {
@@ -5839,7 +5991,7 @@ static int ctl_dgen_fix_checksum(struct ctl&, md& megad)
 
 static int ctl_dgen_screenshot(struct ctl&, md& megad)
 {
-	pd_do_screenshot(megad, "", false);
+	pd_do_screenshot(megad, "");
 	return 1;
 }
 
@@ -5930,6 +6082,8 @@ static struct ctl control[] = {
 	{ CTL_DGEN_SLOT_PREV, &dgen_slot_prev, ctl_dgen_slot_prev, NULL, DEF },
 	{ CTL_DGEN_SAVE, &dgen_save, ctl_dgen_save, NULL, DEF },
 	{ CTL_DGEN_LOAD, &dgen_load, ctl_dgen_load, NULL, DEF },
+	{ CTL_DGEN_REWIND,
+	  &dgen_rewind, ctl_dgen_rewind, ctl_dgen_rewind_release, DEF },
 	{ CTL_DGEN_Z80_TOGGLE,
 	  &dgen_z80_toggle, ctl_dgen_z80_toggle, NULL, DEF },
 	{ CTL_DGEN_CPU_TOGGLE,
@@ -6500,6 +6654,7 @@ int pd_handle_events(md &megad)
 	intptr_t mouse;
 	unsigned int which;
 
+	screenshots_report();
 #ifdef WITH_DEBUGGER
 	if ((megad.debug_trap) && (megad.debug_enter() < 0))
 		return 0;
@@ -6507,7 +6662,7 @@ int pd_handle_events(md &megad)
 		debug_trap = megad.debug_trap;
 		if (debug_trap)
 			mouse_grab(false);
-		if (sound.cbuf.size)
+		if (sound.sring.size)
 			SDL_PauseAudio(debug_trap == true);
 	}
 #endif
@@ -7124,6 +7279,8 @@ void pd_quit()
 {
 	size_t i;
 
+	// Let pending screenshots complete.
+	shots.wait();
 #ifdef WITH_THREADS
 	screen_update_thread_stop();
 #endif
@@ -97,6 +97,8 @@ void md::segavr_init()
 	mHmdRequestIndex = 0;
 	mHmdVblankCounter = 0;
 	mHmdFlags = 0;
+	mHmdShownFlags = 0;
+	mHmdShownVblankCounter = 0;
 	mHmdAngles[0] = mHmdAngles[1] = mHmdAVel[0] = mHmdAVel[1] = 0.0f;
 	mHmdEncoded = 0;
 	mStereoShotCount = 0;
@@ -153,6 +155,13 @@ void md::segavr_begin_scan()
 	mHmdFlags = transfer_bit<skHmdFlag_ScannedOnLeft, skHmdFlag_VBlankedOnLeft>(mHmdFlags, mHmdFlags);
 }
 
+void md::segavr_end_scan()
+{
+	//remember which eye the frame in the screen buffer is for, run-ahead rolls the state back before it's displayed
+	mHmdShownFlags = mHmdFlags;
+	mHmdShownVblankCounter = mHmdVblankCounter;
+}
+
 bool md::segavr_allow_frameskip()
 {
 #ifdef WITH_OPENVR
@@ -181,10 +190,10 @@ bool md::segavr_steal_frame(bmap *pFrame)
 		return false;
 	}
 
-	const bool isActive = (mHmdFlags & skHmdFlag_IsActive) != 0;
-	const bool scannedOnLeft = (mHmdFlags & skHmdFlag_ScannedOnLeft) != 0;
+	const bool isActive = (mHmdShownFlags & skHmdFlag_IsActive) != 0;
+	const bool scannedOnLeft = (mHmdShownFlags & skHmdFlag_ScannedOnLeft) != 0;
 	bool isLeft = (!dgen_segavr_swapeyeframes) ? scannedOnLeft : !scannedOnLeft;
-	if (dgen_segavr_flipbetweenpolls && (mHmdVblankCounter & 1))
+	if (dgen_segavr_flipbetweenpolls && (mHmdShownVblankCounter & 1))
 	{ //continue alternating in between hmd polls
 		isLeft = !isLeft;
 	}
@@ -200,7 +209,7 @@ bool md::segavr_steal_frame(bmap *pFrame)
 		{
 			const intptr_t preserveSetting = dgen_raw_screenshots;
 			dgen_raw_screenshots = 1;
-			pd_do_screenshot(*this, isLeft ? "eye_left-" : "eye_right-", true);
+			pd_do_screenshot(*this, isLeft ? "eye_left-" : "eye_right-");
 			dgen_raw_screenshots = preserveSetting;
 			if (!--mStereoShotCount)
 			{
@@ -467,6 +476,11 @@ void md::segavr_headsmack()
 	mHmdFlags |= skHmdFlag_SwapEyes;
 }
 
+bool md::segavr_headsmack_pending()
+{
+	return ((mHmdFlags & skHmdFlag_SwapEyes) != 0);
+}
+
 float md::bgr_to_mono(const uint8_t *pBgr)
 {
 #ifdef MONO_AS_LUMA
@@ -0,0 +1,627 @@
+// Screenshot writer, see shot.h.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "system.h"
+#include "shot.h"
+
+// Number of idle jobs (and their frame buffers) to keep around.
+#define SHOT_POOL_SIZE 4
+
+// Deflate window and hash table sizes.
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+
+shot_writer::shot_writer(): stop(false), busy(false)
+{
+}
+
+shot_writer::~shot_writer()
+{
+	if (thread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lg(lock);
+
+			stop = true;
+		}
+		wake.notify_one();
+		thread.join();
+	}
+	for (size_t i = 0; (i != pool.size()); ++i)
+		delete pool[i];
+}
+
+const char *shot_writer::extension(enum format fmt)
+{
+	return ((fmt == SHOT_PNG) ? "png" : "tga");
+}
+
+int shot_writer::write(FILE *file, const char *name, enum format fmt,
+		       const uint8_t *data, unsigned int pitch,
+		       unsigned int width, unsigned int height,
+		       unsigned int bpp)
+{
+	struct job *j = NULL;
+	size_t row;
+	unsigned int y;
+
+	switch (bpp) {
+	case 15:
+	case 16:
+		row = (width * 2);
+		break;
+	case 24:
+		row = (width * 3);
+		break;
+	case 32:
+		row = (width * 4);
+		break;
+	default:
+		fclose(file);
+		errno = EINVAL;
+		return -1;
+	}
+	{
+		std::lock_guard<std::mutex> lg(lock);
+
+		if (!pool.empty()) {
+			j = pool.back();
+			pool.pop_back();
+		}
+		// Started on first use, most sessions never take screenshots.
+		if (!thread.joinable()) {
+			stop = false;
+			thread = std::thread(&shot_writer::main, this);
+		}
+	}
+	if (j == NULL)
+		j = new job;
+	j->file = file;
+	j->name = name;
+	j->fmt = fmt;
+	j->width = width;
+	j->height = height;
+	j->bpp = bpp;
+	j->pixels.resize(row * height);
+	for (y = 0; (y != height); ++y)
+		memcpy(&j->pixels[(row * y)], &data[(pitch * y)], row);
+	{
+		std::lock_guard<std::mutex> lg(lock);
+
+		queue.push_back(j);
+	}
+	wake.notify_one();
+	return 0;
+}
+
+bool shot_writer::done(std::string& name, bool& ok)
+{
+	std::lock_guard<std::mutex> lg(lock);
+
+	if (results.empty())
+		return false;
+	name.swap(results.front().name);
+	ok = results.front().ok;
+	results.pop_front();
+	return true;
+}
+
+void shot_writer::wait()
+{
+	std::unique_lock<std::mutex> ul(lock);
+
+	idle.wait(ul, [this] { return ((queue.empty()) && (!busy)); });
+}
+
+/**
+ * Worker thread, encodes queued frames until destruction.
+ */
+void shot_writer::main()
+{
+	while (true) {
+		struct job *j;
+		struct result r;
+
+		{
+			std::unique_lock<std::mutex> ul(lock);
+
+			wake.wait(ul, [this] {
+				return ((stop) || (!queue.empty()));
+			});
+			if (queue.empty())
+				break;
+			j = queue.front();
+			queue.pop_front();
+			busy = true;
+		}
+		r.ok = encode(*j);
+		if (fclose(j->file))
+			r.ok = false;
+		r.name.swap(j->name);
+		{
+			std::lock_guard<std::mutex> lg(lock);
+
+			results.push_back(r);
+			if (pool.size() < SHOT_POOL_SIZE)
+				pool.push_back(j);
+			else
+				delete j;
+			busy = false;
+		}
+		idle.notify_all();
+	}
+}
+
+/**
+ * Encode a frame in the requested format and write it.
+ * @param j Job.
+ * @return true on success.
+ */
+bool shot_writer::encode(struct job& j)
+{
+	if (j.fmt == SHOT_PNG)
+		return write_png(j);
+	return write_tga(j);
+}
+
+/**
+ * Convert a line of the frame to 24-bit BGR.
+ * @param j Job.
+ * @param y Line number.
+ * @param[out] bgr Output, 3 bytes per pixel.
+ */
+void shot_writer::convert(const struct job& j, unsigned int y,
+			  uint8_t *bgr) const
+{
+	unsigned int x;
+
+	switch (j.bpp) {
+	case 15:
+		for (x = 0; (x != j.width); ++x) {
+			uint16_t v;
+
+			memcpy(&v, &j.pixels[(((j.width * y) + x) * 2)], 2);
+			bgr[0] = ((v << 3) & 0xf8);
+			bgr[1] = ((v >> 2) & 0xf8);
+			bgr[2] = ((v >> 7) & 0xf8);
+			bgr += 3;
+		}
+		break;
+	case 16:
+		for (x = 0; (x != j.width); ++x) {
+			uint16_t v;
+
+			memcpy(&v, &j.pixels[(((j.width * y) + x) * 2)], 2);
+			bgr[0] = ((v << 3) & 0xf8);
+			bgr[1] = ((v >> 3) & 0xfc);
+			bgr[2] = ((v >> 8) & 0xf8);
+			bgr += 3;
+		}
+		break;
+	case 24:
+#ifdef WORDS_BIGENDIAN
+		for (x = 0; (x != j.width); ++x) {
+			const uint8_t *p = &j.pixels[(((j.width * y) + x) * 3)];
+
+			bgr[0] = p[2];
+			bgr[1] = p[1];
+			bgr[2] = p[0];
+			bgr += 3;
+		}
+#else
+		memcpy(bgr, &j.pixels[(j.width * y * 3)], (j.width * 3));
+#endif
+		break;
+	case 32:
+		for (x = 0; (x != j.width); ++x) {
+			uint32_t v;
+
+			memcpy(&v, &j.pixels[(((j.width * y) + x) * 4)], 4);
+			v = h2le32(v);
+			memcpy(bgr, &v, 3);
+			bgr += 3;
+		}
+		break;
+	}
+}
+
+/**
+ * Write an uncompressed, true-color TGA file.
+ * @param j Job.
+ * @return true on success.
+ */
+bool shot_writer::write_tga(struct job& j)
+{
+	static const uint8_t head[(3 + 5)] = {
+		0x00, // length of the image ID field
+		0x00, // whether a color map is included
+		0x02 // image type: uncompressed, true-color image
+		// 5 bytes of color map specification
+	};
+	uint16_t dim[4] = {
+		0, // x-origin
+		0, // y-origin
+		h2le16(j.width), // width
+		h2le16(j.height) // height
+	};
+	uint8_t fmt[2] = {
+		24, // always output 24 bits per pixel
+		(1 << 5) // top-left origin
+	};
+	size_t line = (j.width * 3);
+	size_t pos;
+	unsigned int y;
+
+	out.resize(sizeof(head) + sizeof(dim) + sizeof(fmt) +
+		   (line * j.height));
+	memcpy(&out[0], head, sizeof(head));
+	memcpy(&out[sizeof(head)], dim, sizeof(dim));
+	memcpy(&out[(sizeof(head) + sizeof(dim))], fmt, sizeof(fmt));
+	pos = (sizeof(head) + sizeof(dim) + sizeof(fmt));
+	for (y = 0; (y != j.height); ++y) {
+		convert(j, y, &out[pos]);
+		pos += line;
+	}
+	return (fwrite(out.data(), out.size(), 1, j.file) == 1);
+}
+
+/**
+ * Update a CRC-32 (as used by PNG).
+ * @param crc Current value, 0 to start.
+ * @param data Data.
+ * @param len Size of data.
+ * @return Updated CRC.
+ */
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+	static const struct crc_table {
+		uint32_t v[256];
+
+		crc_table()
+		{
+			for (uint32_t i = 0; (i != 256); ++i) {
+				uint32_t c = i;
+
+				for (unsigned int k = 0; (k != 8); ++k)
+					c = ((c & 1) ?
+					     (0xedb88320 ^ (c >> 1)) :
+					     (c >> 1));
+				v[i] = c;
+			}
+		}
+	} table;
+
+	crc = ~crc;
+	while (len--)
+		crc = (table.v[((crc ^ *(data++)) & 0xff)] ^ (crc >> 8));
+	return ~crc;
+}
+
+/**
+ * Compute an Adler-32 checksum (zlib trailer).
+ * @param data Data.
+ * @param len Size of data.
+ * @return Checksum.
+ */
+static uint32_t adler32(const uint8_t *data, size_t len)
+{
+	uint32_t a = 1;
+	uint32_t b = 0;
+
+	while (len) {
+		// Largest count that can't overflow b before the modulo.
+		size_t n = ((len < 5552) ? len : 5552);
+
+		len -= n;
+		while (n--) {
+			a += *(data++);
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return ((b << 16) | a);
+}
+
+static inline void put_be32(std::vector<uint8_t>& out, uint32_t val)
+{
+	out.push_back(val >> 24);
+	out.push_back(val >> 16);
+	out.push_back(val >> 8);
+	out.push_back(val);
+}
+
+/// LSB first bit writer for deflate streams.
+struct deflate_bits {
+	std::vector<uint8_t>& out;
+	uint32_t acc;
+	unsigned int n;
+
+	deflate_bits(std::vector<uint8_t>& out): out(out), acc(0), n(0) {}
+
+	inline void put(uint32_t val, unsigned int len)
+	{
+		acc |= (val << n);
+		n += len;
+		while (n >= 8) {
+			out.push_back(acc);
+			acc >>= 8;
+			n -= 8;
+		}
+	}
+
+	void flush()
+	{
+		if (n)
+			out.push_back(acc);
+		acc = 0;
+		n = 0;
+	}
+};
+
+/// Fixed Huffman codes of RFC 1951, bit-reversed for deflate_bits.
+static const struct deflate_fixed {
+	uint16_t lit_code[288];
+	uint8_t lit_len[288];
+	uint8_t len_sym[(DEFLATE_MAX_MATCH + 1)]; // length to index below
+	uint16_t len_base[29];
+	uint8_t len_extra[29];
+	uint8_t dist_code[30];
+
+	static uint32_t reverse(uint32_t code, unsigned int len)
+	{
+		uint32_t r = 0;
+
+		while (len--) {
+			r = ((r << 1) | (code & 1));
+			code >>= 1;
+		}
+		return r;
+	}
+
+	deflate_fixed()
+	{
+		unsigned int i;
+		unsigned int base = 3;
+
+		for (i = 0; (i != 288); ++i) {
+			if (i < 144) {
+				lit_code[i] = (0x30 + i);
+				lit_len[i] = 8;
+			}
+			else if (i < 256) {
+				lit_code[i] = (0x190 + (i - 144));
+				lit_len[i] = 9;
+			}
+			else if (i < 280) {
+				lit_code[i] = (i - 256);
+				lit_len[i] = 7;
+			}
+			else {
+				lit_code[i] = (0xc0 + (i - 280));
+				lit_len[i] = 8;
+			}
+			lit_code[i] = reverse(lit_code[i], lit_len[i]);
+		}
+		for (i = 0; (i != 28); ++i) {
+			unsigned int l;
+
+			len_extra[i] = ((i < 8) ? 0 : ((i / 4) - 1));
+			len_base[i] = base;
+			for (l = 0; (l != (1u << len_extra[i])); ++l)
+				len_sym[(base + l)] = i;
+			base += (1 << len_extra[i]);
+		}
+		// 258 has its own code.
+		len_base[28] = DEFLATE_MAX_MATCH;
+		len_extra[28] = 0;
+		len_sym[DEFLATE_MAX_MATCH] = 28;
+		for (i = 0; (i != 30); ++i)
+			dist_code[i] = reverse(i, 5);
+	}
+} deflate_codes;
+
+/**
+ * Compress data as a single deflate block with fixed Huffman codes.
+ * Matches are found with a single hash table probe (no chains), which is
+ * fast and good enough for emulated graphics.
+ * @param in Data.
+ * @param len Size of data.
+ * @param[out] out Where to append the deflate stream.
+ */
+static void deflate_fast(const uint8_t *in, size_t len,
+			 std::vector<uint8_t>& out)
+{
+	const struct deflate_fixed& c = deflate_codes;
+	std::vector<int32_t> head((1 << DEFLATE_HASH_BITS), -1);
+	deflate_bits bits(out);
+	size_t i = 0;
+
+	auto hash = [in](size_t pos) {
+		uint32_t v = ((in[pos] << 16) | (in[(pos + 1)] << 8) |
+			      in[(pos + 2)]);
+
+		return ((v * 2654435761u) >> (32 - DEFLATE_HASH_BITS));
+	};
+	auto literal = [&bits, &c](unsigned int sym) {
+		bits.put(c.lit_code[sym], c.lit_len[sym]);
+	};
+
+	out.reserve(out.size() + (len / 4) + 64);
+	bits.put(1, 1); // BFINAL
+	bits.put(1, 2); // BTYPE, fixed Huffman codes
+	while ((i + DEFLATE_MIN_MATCH) <= len) {
+		uint32_t h = hash(i);
+		int32_t cand = head[h];
+		size_t max;
+		size_t m;
+		size_t k;
+
+		head[h] = i;
+		if ((cand < 0) || ((i - cand) > DEFLATE_WINDOW)) {
+			literal(in[i++]);
+			continue;
+		}
+		max = (len - i);
+		if (max > DEFLATE_MAX_MATCH)
+			max = DEFLATE_MAX_MATCH;
+		for (m = 0; ((m != max) && (in[(cand + m)] == in[(i + m)]));
+		     ++m)
+			;
+		if (m < DEFLATE_MIN_MATCH) {
+			literal(in[i++]);
+			continue;
+		}
+		// Length.
+		{
+			unsigned int s = c.len_sym[m];
+
+			literal(257 + s);
+			if (c.len_extra[s])
+				bits.put((m - c.len_base[s]), c.len_extra[s]);
+		}
+		// Distance.
+		{
+			uint32_t d = ((i - cand) - 1);
+			unsigned int b = 0;
+			unsigned int s;
+
+			if (d < 4)
+				bits.put(c.dist_code[d], 5);
+			else {
+				while ((d >> (b + 1)) != 0)
+					++b;
+				s = ((b * 2) + ((d >> (b - 1)) & 1));
+				bits.put(c.dist_code[s], 5);
+				bits.put((d & ((1u << (b - 1)) - 1)), (b - 1));
+			}
+		}
+		for (k = 1; ((k != m) && ((i + k + DEFLATE_MIN_MATCH) <= len));
+		     ++k)
+			head[hash(i + k)] = (i + k);
+		i += m;
+	}
+	while (i != len)
+		literal(in[i++]);
+	literal(256); // end of block
+	bits.flush();
+}
+
+/**
+ * Append a PNG chunk.
+ * @param out Output.
+ * @param type Chunk type.
+ * @param data Chunk data.
+ * @param len Size of data.
+ */
+static void png_chunk(std::vector<uint8_t>& out, const char *type,
+		      const uint8_t *data, size_t len)
+{
+	size_t start;
+
+	put_be32(out, len);
+	start = out.size();
+	out.insert(out.end(), type, (type + 4));
+	out.insert(out.end(), data, (data + len));
+	put_be32(out, crc32_update(0, &out[start], (len + 4)));
+}
+
+/**
+ * Write a 24-bit RGB PNG file.
+ * Each line uses whichever of the None, Sub and Up filters yields the
+ * smallest sum of absolute differences.
+ * @param j Job.
+ * @return true on success.
+ */
+bool shot_writer::write_png(struct job& j)
+{
+	static const uint8_t sig[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+	};
+	size_t line = (j.width * 3);
+	uint8_t ihdr[13];
+	size_t start;
+	unsigned int y;
+
+	// Filtered image, each line preceded by its filter type.
+	raw.resize((line + 1) * j.height);
+	rgb.resize(line * 2);
+	for (y = 0; (y != j.height); ++y) {
+		uint8_t *cur = &rgb[((y & 1) * line)];
+		const uint8_t *prev = &rgb[((~y & 1) * line)];
+		uint8_t *dst = &raw[((line + 1) * y)];
+		unsigned long sum[3] = { 0, 0, 0 };
+		size_t x;
+
+		convert(j, y, cur);
+		for (x = 0; (x != line); x += 3) {
+			uint8_t b = cur[x];
+
+			cur[x] = cur[(x + 2)];
+			cur[(x + 2)] = b;
+		}
+		for (x = 0; (x != line); ++x) {
+			uint8_t left = ((x < 3) ? 0 : cur[(x - 3)]);
+			uint8_t up = ((y == 0) ? 0 : prev[x]);
+
+			sum[0] += abs((int8_t)cur[x]);
+			sum[1] += abs((int8_t)(cur[x] - left));
+			sum[2] += abs((int8_t)(cur[x] - up));
+		}
+		if ((sum[0] <= sum[1]) && (sum[0] <= sum[2])) {
+			dst[0] = 0;
+			memcpy(&dst[1], cur, line);
+		}
+		else if (sum[1] <= sum[2]) {
+			dst[0] = 1;
+			for (x = 0; (x != line); ++x)
+				dst[(1 + x)] = (cur[x] -
+						((x < 3) ? 0 : cur[(x - 3)]));
+		}
+		else {
+			dst[0] = 2;
+			for (x = 0; (x != line); ++x)
+				dst[(1 + x)] = (cur[x] - prev[x]);
+		}
+	}
+	out.clear();
+	out.insert(out.end(), sig, (sig + sizeof(sig)));
+	ihdr[0] = (j.width >> 24);
+	ihdr[1] = (j.width >> 16);
+	ihdr[2] = (j.width >> 8);
+	ihdr[3] = j.width;
+	ihdr[4] = (j.height >> 24);
+	ihdr[5] = (j.height >> 16);
+	ihdr[6] = (j.height >> 8);
+	ihdr[7] = j.height;
+	ihdr[8] = 8; // bit depth
+	ihdr[9] = 2; // color type: RGB
+	ihdr[10] = 0; // compression method: deflate
+	ihdr[11] = 0; // filter method
+	ihdr[12] = 0; // no interlace
+	png_chunk(out, "IHDR", ihdr, sizeof(ihdr));
+	// IDAT is compressed in place, its length and CRC come afterwards.
+	start = out.size();
+	put_be32(out, 0);
+	out.insert(out.end(), { 'I', 'D', 'A', 'T' });
+	out.push_back(0x78); // zlib header: deflate, 32K window
+	out.push_back(0x01); // fastest compression level
+	deflate_fast(raw.data(), raw.size(), out);
+	put_be32(out, adler32(raw.data(), raw.size()));
+	{
+		uint32_t len = (out.size() - start - 8);
+
+		out[start] = (len >> 24);
+		out[(start + 1)] = (len >> 16);
+		out[(start + 2)] = (len >> 8);
+		out[(start + 3)] = len;
+		put_be32(out, crc32_update(0, &out[(start + 4)], (len + 4)));
+	}
+	png_chunk(out, "IEND", NULL, 0);
+	return (fwrite(out.data(), out.size(), 1, j.file) == 1);
+}
@@ -0,0 +1,81 @@
+#ifndef __SHOT_H__
+#define __SHOT_H__
+
+// Screenshot writer.
+// write() only copies the frame into a buffer taken from a pool, conversion
+// and encoding to TGA or PNG are done by a separate thread so the emulation
+// doesn't stall. PNG files are compressed with a built-in deflate encoder
+// tuned for speed (fixed Huffman codes, single probe LZ77), similar to the
+// fastest zlib level.
+// Outcomes are queued and must be retrieved with done() by the caller's
+// thread, which may display them.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class shot_writer {
+public:
+	enum format {
+		SHOT_TGA,
+		SHOT_PNG
+	};
+
+	shot_writer();
+	~shot_writer();
+	// File name extension for a format, without the dot.
+	static const char *extension(enum format fmt);
+	// Copy a 15, 16, 24 or 32 bpp frame and queue it for writing to
+	// file, which is closed once done, even on error. "name" is only
+	// used by done(). Returns 0 on success, -1 on error.
+	int write(FILE *file, const char *name, enum format fmt,
+		  const uint8_t *data, unsigned int pitch, unsigned int width,
+		  unsigned int height, unsigned int bpp);
+	// Retrieve the outcome of a finished screenshot, returns false when
+	// there are none.
+	bool done(std::string& name, bool& ok);
+	// Wait until all queued screenshots are written.
+	void wait();
+
+private:
+	struct job {
+		FILE *file;
+		std::string name;
+		enum format fmt;
+		unsigned int width;
+		unsigned int height;
+		unsigned int bpp;
+		std::vector<uint8_t> pixels; // copy of the frame, packed
+	};
+	struct result {
+		std::string name;
+		bool ok;
+	};
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable wake; // jobs queued or stop
+	std::condition_variable idle; // queue drained
+	std::deque<struct job *> queue;
+	std::vector<struct job *> pool; // idle jobs and their buffers
+	std::deque<struct result> results;
+	bool stop;
+	bool busy; // worker is encoding a job
+	// Worker buffers.
+	std::vector<uint8_t> rgb;
+	std::vector<uint8_t> raw;
+	std::vector<uint8_t> out;
+
+	void main();
+	bool encode(struct job& j);
+	void convert(const struct job& j, unsigned int y, uint8_t *bgr) const;
+	bool write_tga(struct job& j);
+	bool write_png(struct job& j);
+};
+
+#endif // __SHOT_H__
@@ -42,28 +42,8 @@
 #define NG_PRESET 0x0f35
 
 
-struct SN76496
+void SN76496_dump(struct SN76496 *R, uint8_t buf[16])
 {
-    int Channel;
-    int SampleRate;
-    unsigned int UpdateStep;
-    int VolTable[16];   /* volume table         */
-    int Register[8];    /* registers */
-    int LastRegister;   /* last register written */
-    int Volume[4];      /* volume of voice 0-2 and noise */
-    unsigned int RNG;       /* noise generator      */
-    int NoiseFB;        /* noise feedback mask */
-    unsigned int Period[4];
-    int Count[4];
-    int Output[4];
-};
-
-
-static struct SN76496 sn[MAX_76496];
-
-void SN76496_dump(int chip, uint8_t buf[16])
-{
-	struct SN76496 *R = &sn[chip];
 	uint16_t tmp;
 	unsigned int i;
 
@@ -73,9 +53,8 @@ void SN76496_dump(int chip, uint8_t buf[16])
 	}
 }
 
-void SN76496_restore(int chip, uint8_t buf[16])
+void SN76496_restore(struct SN76496 *R, uint8_t buf[16])
 {
-	struct SN76496 *R = &sn[chip];
 	uint16_t tmp;
 	unsigned int i;
 
@@ -85,11 +64,8 @@ void SN76496_restore(int chip, uint8_t buf[16])
 	}
 }
 
-void SN76496Write(int chip,int data)
+void SN76496Write(struct SN76496 *R,int data)
 {
-    struct SN76496 *R = &sn[chip];
-
-
     /* update the output buffer before changing the registers */
     ///// commented out by starshine
     //stream_update(R->Channel,0);
@@ -161,38 +137,138 @@ void SN76496Write(int chip,int data)
 }
 
 
-void SN76496_0_w(int offset, int data) { (void)offset; SN76496Write(0, data); }
-void SN76496_1_w(int offset, int data) { (void)offset; SN76496Write(1, data); }
-void SN76496_2_w(int offset, int data) { (void)offset; SN76496Write(2, data); }
-void SN76496_3_w(int offset, int data) { (void)offset; SN76496Write(3, data); }
-
+/* Mix the weighted time each voice spent high into an output sample. */
+static int32_t SN76496Output(unsigned int out)
+{
+    if (out > MAX_OUTPUT * STEP) out = MAX_OUTPUT * STEP;
 
+    return ((AUDIO_CONV(out / STEP) * 3) >> 3); /* Dave: a bit quieter */
+}
 
-void SN76496Update_8_2(int chip,void *buffer,int length)
+/* Compute a single sample during which at least one voice changes. */
+static int32_t SN76496Step(struct SN76496 *R)
 {
-#define DATATYPE unsigned char
-#define DATACONV(A) AUDIO_CONV((A) / (STEP * 256))
-#include "sn76496u.c"
-#undef DATATYPE
-#undef DATACONV
+    int vol[4];
+    int left;
+    int i;
+
+    /* vol[] keeps track of how long each square wave stays */
+    /* in the 1 position during the sample period. */
+    vol[0] = vol[1] = vol[2] = vol[3] = 0;
+
+    for (i = 0;i < 3;i++)
+    {
+        if (R->Output[i]) vol[i] += R->Count[i];
+        R->Count[i] -= STEP;
+        /* Period[i] is the half period of the square wave. Here, in each */
+        /* loop I add Period[i] twice, so that at the end of the loop the */
+        /* square wave is in the same status (0 or 1) it was at the start. */
+        /* vol[i] is also incremented by Period[i], since the wave has been 1 */
+        /* exactly half of the time, regardless of the initial position. */
+        /* If we exit the loop in the middle, Output[i] has to be inverted */
+        /* and vol[i] incremented only if the exit status of the square */
+        /* wave is 1. */
+        while (R->Count[i] <= 0)
+        {
+            R->Count[i] += R->Period[i];
+            if (R->Count[i] > 0)
+            {
+                R->Output[i] ^= 1;
+                if (R->Output[i]) vol[i] += R->Period[i];
+                break;
+            }
+            R->Count[i] += R->Period[i];
+            vol[i] += R->Period[i];
+        }
+        if (R->Output[i]) vol[i] -= R->Count[i];
+    }
+
+    left = STEP;
+    do
+    {
+        int nextevent;
+
+
+        if (R->Count[3] < left) nextevent = R->Count[3];
+        else nextevent = left;
+
+        if (R->Output[3]) vol[3] += R->Count[3];
+        R->Count[3] -= nextevent;
+        if (R->Count[3] <= 0)
+        {
+            if (R->RNG & 1) R->RNG ^= R->NoiseFB;
+            R->RNG >>= 1;
+            R->Output[3] = R->RNG & 1;
+            R->Count[3] += R->Period[3];
+            if (R->Output[3]) vol[3] += R->Period[3];
+        }
+        if (R->Output[3]) vol[3] -= R->Count[3];
+
+        left -= nextevent;
+    } while (left > 0);
+
+    return SN76496Output((unsigned int)vol[0] * R->Volume[0] +
+                         (unsigned int)vol[1] * R->Volume[1] +
+                         (unsigned int)vol[2] * R->Volume[2] +
+                         (unsigned int)vol[3] * R->Volume[3]);
 }
 
-void SN76496Update_16_2(int chip,void *buffer,int length)
+/*
+ * Render "length" mono samples into "buffer". Voices only change state a
+ * few times per period, samples in between are constant and filled in bulk,
+ * the others are computed one at a time.
+ */
+void SN76496Update(struct SN76496 *R,int32_t *buffer,int length)
 {
-#define DATATYPE unsigned short
-#define DATACONV(A) ((A) / STEP)
-#include "sn76496u.c"
-#undef DATATYPE
-#undef DATACONV
-}
+    int i;
 
 
+    /* If the volume is 0, increase the counter */
+    for (i = 0;i < 4;i++)
+    {
+        if (R->Volume[i] == 0)
+        {
+            /* note that I do count += length, NOT count = length + 1. You might think */
+            /* it's the same since the volume is 0, but doing the latter could cause */
+            /* interferencies when the program is rapidly modulating the volume. */
+            if (R->Count[i] <= length*STEP) R->Count[i] += length*STEP;
+        }
+    }
 
-void SN76496_set_clock(int chip,int clock)
-{
-    struct SN76496 *R = &sn[chip];
+    while (length > 0)
+    {
+        int run = length;
 
+        /* Number of samples until the next voice change. A voice */
+        /* changes during a sample when its counter doesn't outlast it. */
+        for (i = 0;i < 4;i++)
+        {
+            int n = (R->Count[i] > 0) ? ((R->Count[i] - 1) / STEP) : 0;
+
+            if (n < run) run = n;
+        }
+        if (run)
+        {
+            int32_t out = SN76496Output((unsigned int)STEP *
+                                        ((R->Output[0] ? R->Volume[0] : 0) +
+                                         (R->Output[1] ? R->Volume[1] : 0) +
+                                         (R->Output[2] ? R->Volume[2] : 0) +
+                                         (R->Output[3] ? R->Volume[3] : 0)));
+
+            for (i = 0;i < 4;i++) R->Count[i] -= run * STEP;
+            length -= run;
+            while (run--) *(buffer++) = out;
+            continue;
+        }
+        *(buffer++) = SN76496Step(R);
+        length--;
+    }
+}
 
+
+
+void SN76496_set_clock(struct SN76496 *R,int clock)
+{
     /* the base clock for the tone generators is the chip clock divided by 16; */
     /* for the noise generator, it is clock / 256. */
     /* Here we calculate the number of steps which happen during one sample */
@@ -204,9 +280,8 @@ void SN76496_set_clock(int chip,int clock)
 
 
 
-static void SN76496_set_volume(int chip,int volume,int gain)
+static void SN76496_set_volume(struct SN76496 *R,int volume,int gain)
 {
-    struct SN76496 *R = &sn[chip];
     int i;
     double out;
 
@@ -235,10 +310,9 @@ static void SN76496_set_volume(int chip,int volume,int gain)
 
 
 
-int SN76496_init(int chip,int clock,int sample_rate,int sample_bits)
+int SN76496_init(struct SN76496 *R,int clock,int sample_rate,int sample_bits)
 {
     int i;
-    struct SN76496 *R = &sn[chip];
     /* char name[40]; */
 
     (void)sample_bits;
@@ -252,8 +326,8 @@ int SN76496_init(int chip,int clock,int sample_rate,int sample_bits)
         return 1;
 
     R->SampleRate = sample_rate;
-    SN76496_set_clock(chip,clock);
-    SN76496_set_volume(chip,255,0);
+    SN76496_set_clock(R,clock);
+    SN76496_set_volume(R,255,0);
 
     for (i = 0;i < 4;i++) R->Volume[i] = 0;
 
@@ -274,22 +348,3 @@ int SN76496_init(int chip,int clock,int sample_rate,int sample_bits)
 
     return 0;
 }
-
-
-
-int SN76496_sh_start()
-{
-    ///// total commenting out by starshine
-    //int chip;
-    //const struct SN76496interface *intf = msound->sound_interface;
-
-
-    //for (chip = 0;chip < intf->num;chip++)
-    //{
-    //    if (SN76496_init(msound,chip,intf->baseclock,Machine->sample_rate,Machine->sample_bits) != 0)
-    //        return 1;
-
-    //    SN76496_set_volume(chip,intf->volume[chip] & 0xff,(intf->volume[chip] >> 8) & 0xff);
-    //}
-    return 0;
-}
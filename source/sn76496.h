@@ -13,27 +13,29 @@
 
 SN76496_H_BEGIN_
 
-#define MAX_76496 4
-
-struct SN76496interface
+/* State of one chip, owned by the caller. */
+struct SN76496
 {
-    int num;    /* total number of 76496 in the machine */
-    int baseclock;
-    int volume[MAX_76496];
+    int Channel;
+    int SampleRate;
+    unsigned int UpdateStep;
+    int VolTable[16];   /* volume table         */
+    int Register[8];    /* registers */
+    int LastRegister;   /* last register written */
+    int Volume[4];      /* volume of voice 0-2 and noise */
+    unsigned int RNG;       /* noise generator      */
+    int NoiseFB;        /* noise feedback mask */
+    unsigned int Period[4];
+    int Count[4];
+    int Output[4];
 };
 
-int SN76496_sh_start();
-void SN76496_0_w(int offset,int data);
-void SN76496_1_w(int offset,int data);
-void SN76496_2_w(int offset,int data);
-void SN76496_3_w(int offset,int data);
-void SN76496_dump(int chip, uint8_t buf[16]);
-void SN76496_restore(int chip, uint8_t buf[16]);
-void SN76496_set_clock(int chip,int _clock);
-int SN76496_init(int chip, int clock, int sample_rate, int sample_bits);
-void SN76496Write(int chip, int data);
-void SN76496Update_8_2(int chip,void *buffer, int length);
-void SN76496Update_16_2(int chip,void *buffer, int length);
+void SN76496_dump(struct SN76496 *R, uint8_t buf[16]);
+void SN76496_restore(struct SN76496 *R, uint8_t buf[16]);
+void SN76496_set_clock(struct SN76496 *R,int _clock);
+int SN76496_init(struct SN76496 *R, int clock, int sample_rate, int sample_bits);
+void SN76496Write(struct SN76496 *R, int data);
+void SN76496Update(struct SN76496 *R,int32_t *buffer, int length);
 
 SN76496_H_END_
 
@@ -29,14 +29,26 @@ void md_vdp::reset()
 	memset(reg, 0, 0x20);
 	memset(dirt, 0xff, 0x35); // mark everything as changed
 	memset(highpal, 0, sizeof(highpal));
+	pal_dirty = 1;
+	memset(line_buf, 0, sizeof(line_buf));
+	memset(line_lut, 0, sizeof(line_lut));
+	line_shadow = 0;
+	line_sh = false;
 	memset(sprite_order, 0, sizeof(sprite_order));
 	memset(sprite_mask, 0xff, sizeof(sprite_mask));
+	memset(sprite_mask_top, 0, sizeof(sprite_mask_top));
+	memset(sprite_mask_cache, 0, sizeof(sprite_mask_cache));
+	memset(sprite_mask_dirt, 0, sizeof(sprite_mask_dirt));
+	sprite_mask_collision = false;
+	memset(sprite_lines_count, 0, sizeof(sprite_lines_count));
+	sprite_list_end = 0;
+	sprite_lines_mode = -1;
 	sprite_base = NULL;
 	sprite_count = 0;
 	masking_sprite_index_cache = -1;
 	dots_cache = 0;
 	sprite_overflow_line = INT_MIN;
-	dest = NULL;
+	dest = (line_buf + 8);
 	bmap = NULL;
 }
 
@@ -91,6 +103,64 @@ unsigned char md_vdp::dma_mem_read(int addr)
   return belongs.misc_readbyte(addr);
 }
 
+/**
+ * DMA words from 68K memory to VRAM, bypassing dma_mem_read() and
+ * putword() when the source can be read directly (ROM, RAM). Stops at the
+ * first word that must be read through dma_mem_read().
+ *
+ * @param addr Address where to read from (even).
+ * @param len Number of words to copy.
+ * @return Number of words copied.
+ */
+int md_vdp::dma_vram_copy(int addr, int len)
+{
+  int done = 0;
+
+  while (done != len)
+    {
+      unsigned int swab;
+      const uint8_t *page = belongs.misc_readpage(addr, swab);
+      unsigned int src = (addr & 0xffff);
+      unsigned int dst = (rw_addr & 0xffff);
+      unsigned int n;
+      unsigned int i;
+      uint8_t buf[0x100];
+
+      if (page == NULL)
+	break;
+      if ((reg[15] != 2) || (dst & 1))
+	{
+	  // Unusual increment or odd address, one word at a time.
+	  putword((page[(src ^ swab)] << 8) | page[((src + 1) ^ swab)]);
+	  addr += 2;
+	  ++done;
+	  continue;
+	}
+      // Stop at the end of the source page or of the 256 byte VRAM block
+      // (the unit of dirt[0x00-0x1f]), whichever comes first.
+      n = ((0x10000 - src) >> 1);
+      if (n > ((0x100 - (dst & 0xff)) >> 1))
+	n = ((0x100 - (dst & 0xff)) >> 1);
+      if (n > (unsigned int)(len - done))
+	n = (len - done);
+      for (i = 0; (i != n); ++i)
+	{
+	  buf[(i << 1)] = page[((src + (i << 1)) ^ swab)];
+	  buf[((i << 1) + 1)] = page[((src + (i << 1) + 1) ^ swab)];
+	}
+      if (memcmp(&vram[dst], buf, (n << 1)))
+	{
+	  memcpy(&vram[dst], buf, (n << 1));
+	  dirt[(dst >> 11)] |= (1 << ((dst >> 8) & 7));
+	  dirt[0x34] |= 1;
+	}
+      rw_addr += (n << 1);
+      addr += (n << 1);
+      done += n;
+    }
+  return done;
+}
+
 /**
  * Set value in VRAM.
  * Must go through these calls to update the dirty flags.
@@ -324,7 +394,13 @@ int md_vdp::command(uint16_t cmd)
     switch (mode)
     {
       case 0: case 1:
-        for (i=0;i<len;i++)
+        // Directly readable sources first, for VRAM
+        if (rw_mode == 0x04)
+        {
+          i = dma_vram_copy(s, len);
+          s += (i << 1);
+        }
+        for (;i<len;i++)
         {
           unsigned short val;
           val= dma_mem_read(s++); val<<=8;
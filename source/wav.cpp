@@ -0,0 +1,157 @@
+// Streaming WAV file writer, see wav.h.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "system.h"
+#include "wav.h"
+
+// Size of the RIFF, "fmt " and "data" chunk headers.
+#define WAV_HEADER_SIZE 44
+
+wav_writer::wav_writer():
+	file(NULL), freq(0), channels(0), stop(false), data_size(0),
+	error(false)
+{
+}
+
+wav_writer::~wav_writer()
+{
+	close();
+}
+
+/**
+ * Build the file header.
+ * @param size Size of sample data in bytes.
+ * @param[out] buf Header.
+ */
+void wav_writer::header(uint64_t size, uint8_t buf[WAV_HEADER_SIZE]) const
+{
+	uint32_t data = (uint32_t)size;
+	uint32_t tmp;
+	uint16_t tmp16;
+
+	// Chunk sizes are 32-bit, larger files are truncated.
+	if (size > (0xffffffffu - (WAV_HEADER_SIZE - 8)))
+		data = (0xffffffffu - (WAV_HEADER_SIZE - 8));
+	memcpy(&buf[0], "RIFF", 4);
+	tmp = h2le32(data + (WAV_HEADER_SIZE - 8));
+	memcpy(&buf[4], &tmp, 4);
+	memcpy(&buf[8], "WAVEfmt ", 8);
+	tmp = h2le32(16);
+	memcpy(&buf[16], &tmp, 4);
+	tmp16 = h2le16(1); // linear PCM
+	memcpy(&buf[20], &tmp16, 2);
+	tmp16 = h2le16(channels);
+	memcpy(&buf[22], &tmp16, 2);
+	tmp = h2le32(freq);
+	memcpy(&buf[24], &tmp, 4);
+	tmp = h2le32(freq * channels * 2); // bytes per second
+	memcpy(&buf[28], &tmp, 4);
+	tmp16 = h2le16(channels * 2); // block alignment
+	memcpy(&buf[32], &tmp16, 2);
+	tmp16 = h2le16(16); // bits per sample
+	memcpy(&buf[34], &tmp16, 2);
+	memcpy(&buf[36], "data", 4);
+	tmp = h2le32(data);
+	memcpy(&buf[40], &tmp, 4);
+}
+
+int wav_writer::open(FILE *file, unsigned int rate, unsigned int channels)
+{
+	uint8_t buf[WAV_HEADER_SIZE];
+
+	close();
+	if ((file == NULL) || (rate == 0) || (channels == 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+	this->freq = rate;
+	this->channels = channels;
+	// Sizes are unknown yet, a reader that stops at EOF may still
+	// use the file if it isn't closed properly.
+	header(0xffffffff, buf);
+	if (fwrite(buf, sizeof(buf), 1, file) != 1)
+		return -1;
+	this->file = file;
+	stop = false;
+	data_size = 0;
+	error = false;
+	thread = std::thread(&wav_writer::main, this);
+	return 0;
+}
+
+void wav_writer::write(const int16_t *samples, unsigned int len)
+{
+	if ((file == NULL) || (len == 0))
+		return;
+	{
+		std::lock_guard<std::mutex> lg(lock);
+
+		queue.insert(queue.end(), samples,
+			     (samples + (len * channels)));
+	}
+	wake.notify_one();
+}
+
+/**
+ * Writer thread, moves queued samples to the file until close().
+ */
+void wav_writer::main()
+{
+	std::vector<int16_t> buf;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> ul(lock);
+
+			wake.wait(ul, [this] {
+				return ((stop) || (!queue.empty()));
+			});
+			if (queue.empty())
+				break;
+			// Keep both buffers allocated, write() then rarely
+			// has to grow its own.
+			buf.swap(queue);
+		}
+#ifdef WORDS_BIGENDIAN
+		for (size_t i = 0; (i != buf.size()); ++i)
+			buf[i] = h2le16(buf[i]);
+#endif
+		if ((!error) &&
+		    (fwrite(buf.data(), (buf.size() * sizeof(buf[0])), 1,
+			    file) != 1))
+			error = true;
+		data_size += (buf.size() * sizeof(buf[0]));
+		buf.clear();
+	}
+}
+
+int wav_writer::close()
+{
+	uint8_t buf[WAV_HEADER_SIZE];
+	int ret = 0;
+
+	if (file == NULL)
+		return 0;
+	{
+		std::lock_guard<std::mutex> lg(lock);
+
+		stop = true;
+	}
+	wake.notify_one();
+	thread.join();
+	if (error)
+		ret = -1;
+	// Complete the header, not possible with pipes.
+	header(data_size, buf);
+	if ((fseek(file, 0, SEEK_SET) == 0) &&
+	    (fwrite(buf, sizeof(buf), 1, file) != 1))
+		ret = -1;
+	if (fclose(file))
+		ret = -1;
+	file = NULL;
+	queue.clear();
+	return ret;
+}
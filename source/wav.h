@@ -0,0 +1,50 @@
+#ifndef __WAV_H__
+#define __WAV_H__
+
+// Streaming WAV (16-bit PCM) file writer.
+// Samples passed to write() are only copied to memory, a background thread
+// does the actual file I/O so that capturing doesn't stall the caller.
+// The RIFF header is completed by close() when the file is seekable.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class wav_writer {
+public:
+	wav_writer();
+	~wav_writer();
+	// Start writing to "file", which is closed by close(). Samples are
+	// interleaved when there are several channels.
+	// Returns 0 on success, -1 on error (errno is set).
+	int open(FILE *file, unsigned int rate, unsigned int channels);
+	// Queue "len" samples (per channel) for writing.
+	void write(const int16_t *samples, unsigned int len);
+	// Write remaining samples, complete the header and close the file.
+	// Returns 0 on success, -1 if anything couldn't be written.
+	int close();
+	bool is_open() const { return (file != NULL); }
+	unsigned int rate() const { return freq; }
+
+private:
+	FILE *file;
+	unsigned int freq;
+	unsigned int channels;
+	// Samples waiting for the writer thread, protected by lock.
+	std::vector<int16_t> queue;
+	bool stop;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::thread thread;
+	// Owned by the writer thread until it ends.
+	uint64_t data_size; // bytes written after the header
+	bool error;
+
+	void main();
+	void header(uint64_t size, uint8_t buf[44]) const;
+};
+
+#endif // __WAV_H__